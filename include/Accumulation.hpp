@@ -0,0 +1,85 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_ACCUMULATION_H_
+#define _INCLUDE_PATHTRACER_ACCUMULATION_H_
+
+#include "Common.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Filtered sums of the samples of every pixel, their weights and the number
+ * of samples taken in every pixel, row by row. Together with the seed of the
+ * sampler, this is all the state needed to continue a progressive render, so
+ * it can be saved as a checkpoint and loaded back.
+ *
+ * Sums are fixed point, so adding the same samples in any order, from any
+ * thread or split in any passes, gives the same bits.
+*/
+struct Accumulation {
+    /** Values per pixel in values: red, green, blue and weight */
+    static const unsigned CHANNELS = 4;
+
+    unsigned width = 0;
+    unsigned height = 0;
+    uint64_t seed = 0;
+    /** Reconstruction filter the sums were made with */
+    uint32_t filter = 0;
+    /**
+     * Hash of the scene and the render settings the samples were taken
+     * with, set by the renderer, so that a checkpoint is only resumed by
+     * the render it belongs to
+    */
+    uint64_t configuration = 0;
+    std::vector<int64_t> values;
+    std::vector<uint32_t> counts;
+
+    /** Start an empty buffer */
+    void reset(unsigned width, unsigned height, uint64_t seed, uint32_t filter);
+
+    /** Fewest samples of any pixel */
+    uint32_t minCount();
+    /** Weighted mean of the samples of pixel p, black without weight */
+    Color mean(unsigned p);
+
+    /** Fixed point of a contribution to values */
+    static inline int64_t toFixed(Real x) {
+        // Also sends NaN to 0
+        x = (x > -FIXED_LIMIT)? x : -FIXED_LIMIT;
+        x = (x < FIXED_LIMIT)? x : FIXED_LIMIT;
+        return static_cast<int64_t>(x * FIXED_ONE);
+    }
+
+    /**
+     * Write a checkpoint. The file is replaced atomically, so that an
+     * interrupted write leaves the previous checkpoint. Returns false on error.
+    */
+    bool save(const char* filename);
+    /** Read a checkpoint. Returns false if it is missing or invalid */
+    bool load(const char* filename);
+
+private:
+    /** 32 fractional bits leave room for 2^31 of accumulated radiance */
+    static constexpr double FIXED_ONE = 4294967296.0;
+    /** Largest magnitude of a single contribution */
+    static constexpr Real FIXED_LIMIT = 1e6;
+};
+
+#endif // _INCLUDE_PATHTRACER_ACCUMULATION_H_
@@ -0,0 +1,83 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_ANIMATION_H_
+#define _INCLUDE_PATHTRACER_ANIMATION_H_
+
+#include "Common.hpp"
+#include "Camera.hpp"
+#include "Objects.hpp"
+
+#include <map>
+#include <vector>
+
+/**
+ * Keyframed tracks for the camera and the translation of scene objects.
+ * Values between keyframes are interpolated linearly and held before the
+ * first keyframe and after the last one.
+ *
+ * Tracks are loaded from a text file with one keyframe per line:
+ *
+ *     camera FRAME px py pz fx fy fz     eye position and facing direction
+ *     translate OBJECT FRAME dx dy dz    offset of scene object OBJECT
+ *
+ * Lines starting with '#' are comments.
+*/
+class Animation {
+public:
+    Animation();
+    virtual ~Animation();
+
+    /** Load the keyframes of a file. Returns false on error */
+    bool load(const char* filename);
+
+    void addCameraKey(Real frame, Vec3D position, Vec3D facing);
+    void addTranslationKey(unsigned object, Real frame, Vec3D offset);
+
+    /** Number of frames: up to the last keyframe, included */
+    unsigned getFrameCount();
+    bool hasCameraTrack();
+
+    /**
+     * Pose the camera and move the objects to a frame. The scene revision
+     * is incremented if any object moved.
+    */
+    void apply(unsigned frame, struct Scene& scene, Camera& camera);
+
+private:
+    struct CameraKey {
+        Real frame;
+        Vec3D position;
+        Vec3D facing;
+    };
+
+    struct TranslationKey {
+        Real frame;
+        Vec3D offset;
+    };
+
+    std::vector<CameraKey> mCameraKeys;
+    /** Keys of every animated object, by index in the scene */
+    std::map<unsigned, std::vector<TranslationKey>> mTranslationKeys;
+    /** Offset already applied to every animated object */
+    std::map<unsigned, Vec3D> mApplied;
+
+    Vec3D translationAt(std::vector<TranslationKey>& keys, Real frame);
+};
+
+#endif // _INCLUDE_PATHTRACER_ANIMATION_H_
@@ -0,0 +1,92 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef _INCLUDE_PATHTRACER_ARENA_H_
+#define _INCLUDE_PATHTRACER_ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Monotonic allocator: objects are placed one after the other in large
+ * blocks, in the order they are created, and are never freed one by one.
+ * Releasing the arena frees a handful of blocks, however many objects it
+ * holds.
+ *
+ * Destructors are skipped for types that do not own memory: trivially
+ * destructible types, and types that declare OWNS_MEMORY as false. Objects
+ * of other types are destroyed on release, in reverse order of creation.
+*/
+class Arena {
+public:
+    Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    virtual ~Arena();
+
+    /** Uninitialized memory that lives until the arena is released */
+    void* allocate(size_t size, size_t alignment);
+
+    /** Construct an object in the arena */
+    template<typename T, typename... Args>
+    T* create(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!SkipsDestructor<T>::value) {
+            mFinalizers.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+        }
+        return object;
+    }
+
+    /** Destroy the objects that own memory and free every block */
+    void release();
+
+    /** Bytes handed out */
+    size_t getSizeBytes() const { return mUsed; }
+    /** Bytes of the blocks, handed out or not */
+    size_t getReservedBytes() const { return mReserved; }
+
+private:
+    template<typename T, typename = void>
+    struct SkipsDestructor : std::is_trivially_destructible<T> { };
+    template<typename T>
+    struct SkipsDestructor<T, std::void_t<decltype(T::OWNS_MEMORY)>>
+        : std::integral_constant<bool, !T::OWNS_MEMORY> { };
+
+    struct Finalizer {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    static constexpr size_t FIRST_BLOCK_SIZE = 64 * 1024;
+    static constexpr size_t MAX_BLOCK_SIZE = 16 * 1024 * 1024;
+
+    std::vector<void*> mBlocks;
+    std::vector<Finalizer> mFinalizers;
+    /** Free range of the current block */
+    char* mNext = nullptr;
+    char* mEnd = nullptr;
+    size_t mNextBlockSize = FIRST_BLOCK_SIZE;
+    size_t mUsed = 0;
+    size_t mReserved = 0;
+};
+
+#endif // _INCLUDE_PATHTRACER_ARENA_H_
@@ -24,6 +24,37 @@
 #include "Light.hpp"
 #include "Vector3D.hpp"
 #include "Surface.hpp"
+#include "ToneMapper.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * Camera rays of a tile in structure of arrays layout, one per pixel row by
+ * row, for the renderers to consume as a stream. All of them leave the eye.
+*/
+struct RayBuffer {
+    /** Seed of the random sequences of the samples */
+    uint64_t seed = 0;
+    /** Jitter the rays inside their stratum, or aim them at its centre */
+    bool jittered = true;
+
+    Vec3D origin;
+    /** Points of the image the rays go through, in pixels */
+    std::vector<Real> x, y;
+    /** Components of the unit directions */
+    std::vector<Real> dx, dy, dz;
+    /** Random sequence of every sample, after drawing its jitter */
+    std::vector<uint64_t> random;
+
+    size_t size() const { return x.size(); }
+    void resize(size_t count);
+
+    Vec3D direction(size_t k) const { return Vec3D(dx[k], dy[k], dz[k]); }
+    Ray ray(size_t k) const { return Ray::withUnitDirection(origin, direction(k)); }
+};
 
 /**
  * A camera object. The Field Of Vision parameter is always entered in degrees.
@@ -34,23 +65,85 @@ class Camera {
         Camera(unsigned width, unsigned height, float fov, Vec3D pos, Vec3D facing);
         virtual ~Camera();
 
+        /** Linear radiance of the pixels */
         Surface& getSurface();
+        /** 8-bit image of the surface, updated by updateDisplay() */
+        DisplayImage& getDisplay();
+        ToneMapper& getToneMapper();
+        /** Auxiliary first-hit buffers, or nullptr if they are disabled */
+        AOVBuffers* getAOVs();
 
-        /** Get a Ray from the eye to pixel [i, j] */
+        /** Get a Ray from the eye to the centre of pixel [i, j] */
         Ray getRayToPixel(unsigned i, unsigned j);
+        /** Get a Ray from the eye to a point of the image, in pixels */
+        Ray getRayToPoint(Real x, Real y);
+        /**
+         * Fill rays with sample sampleIndex of every pixel of a tile. The
+         * samples of a pixel cycle through its strata, and each one draws its
+         * jitter from its own random sequence.
+        */
+        void generateRays(unsigned left, unsigned up, unsigned right, unsigned down,
+                          unsigned sampleIndex, RayBuffer& rays);
 
         unsigned int getWidth();
         unsigned int getHeight();
         float getFov();
         float getFovInRad();
         float getAspectRatio();
+        Vec3D getPosition();
+        /** Unit vector in the facing direction */
+        Vec3D getFacing();
 
+        /** Move the camera eye and point it in a direction */
+        void setView(Vec3D pos, Vec3D facing);
         void setResolution(unsigned width, unsigned height);
+        /** Encode the display image with the sRGB transfer function */
         void setGammaCorrectionEnabled(bool enabled);
+        void setAOVsEnabled(bool enabled);
 
         void onRenderFinished();
+        /** Tone map the surface into the display image, e.g. for a preview */
+        void updateDisplay();
+
+        /** Pixels are split in STRATA_SIDE x STRATA_SIDE strata */
+        static constexpr unsigned STRATA_SIDE = 2;
+        static constexpr unsigned STRATA = STRATA_SIDE * STRATA_SIDE;
+
+        /** Offset inside a pixel of a point u in [0, 1) of stratum s along one axis */
+        static inline Real strataOffset(unsigned s, Real u) {
+            return ((s % STRATA_SIDE) + u) / STRATA_SIDE;
+        }
+
+        /**
+         * Stratum of sample n of pixel p. Every run of STRATA samples takes
+         * each stratum once, in an order drawn for the pixel and the run, so
+         * that renders of fewer samples are not biased to the first strata.
+        */
+        static inline unsigned stratumOf(unsigned p, unsigned n) {
+            uint32_t h = p ^ scramble(n / STRATA);
+            h = scramble(h);
+            unsigned order[STRATA];
+            for (unsigned int s = 0; s < STRATA; s++) {
+                order[s] = s;
+            }
+            for (unsigned int s = STRATA - 1; s > 0; s--) {
+                std::swap(order[s], order[h % (s + 1)]);
+                h /= s + 1;
+            }
+            return order[n % STRATA];
+        }
 
     private:
+        /** Integer hash with every input bit reaching every output bit */
+        static inline uint32_t scramble(uint32_t x) {
+            x ^= x >> 16;
+            x *= 0x7feb352du;
+            x ^= x >> 15;
+            x *= 0x846ca68bu;
+            x ^= x >> 16;
+            return x;
+        }
+
         /** Screen width in pixels */
         unsigned width;
         /** Screen height in pixels */
@@ -61,6 +154,11 @@ class Camera {
         float aspectRatio;
         /** Projected image aka. surface */
         Surface surface;
+        /** Tone mapped surface */
+        DisplayImage display;
+        ToneMapper toneMapper;
+        /** Albedo, normal and depth of the first hits */
+        std::unique_ptr<AOVBuffers> aovs;
 
         /** Position of the camera <i>eye</i> */
         Vec3D position;
@@ -72,10 +170,16 @@ class Camera {
         /** <br><b>w</b> is the <b>z</b> axis, or the facing. */
         Vec3D w;
 
-        /** Get a vector from the eye to pixel [i, j] */
-        Vec3D getVectorToPixel(unsigned i, unsigned j);
+        /** Direction to the point (0, 0) of the image, not unit */
+        Vec3D corner;
+        /** Change of the direction from one pixel to the next along x and y */
+        Vec3D stepX;
+        Vec3D stepY;
 
-        bool gammaCorrectionEnabled;
+        /** Recalculate the steps after the view or the resolution change */
+        void updateSteps();
+        /** Get a vector from the eye to a point of the image, in pixels */
+        Vec3D getVectorToPoint(Real x, Real y);
 };
 
 #endif // _INCLUDE_PATHTRACER_CAMERA_H_
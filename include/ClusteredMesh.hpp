@@ -0,0 +1,105 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef _INCLUDE_PATHTRACER_CLUSTERED_MESH_H_
+#define _INCLUDE_PATHTRACER_CLUSTERED_MESH_H_
+
+#include "Arena.hpp"
+#include "Common.hpp"
+#include "GeometryCache.hpp"
+#include "Mesh.hpp"
+#include "Objects.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * A triangle mesh kept on disk, for meshes larger than memory.
+ *
+ * The hierarchy of a TriangleMesh is cut into clusters of subtrees, stored
+ * one after the other in a file with their own nodes, vertices and indices.
+ * The top of the hierarchy, down to the clusters, stays in memory; the
+ * clusters a ray reaches are paged in through a GeometryCache. On threads
+ * that defer misses, clusters that are not resident are skipped and the
+ * thread is marked, so the caller must discard what it traced and retry.
+ *
+ * File layout, in the byte order of the host, aligned to 64 bytes:
+ *   header: "PTCL", version, cluster and top node counts, triangle count,
+ *           offsets of the top nodes and of the cluster table
+ *   clusters: a ClusterHeader, nodes, positions and indices each
+ *   top nodes: TriangleMesh nodes whose leaves hold one cluster
+ *   cluster table: offset and size in the file, area and triangle count
+*/
+class ClusteredMesh : public IObject3D {
+public:
+    /** Record of a cluster in the file */
+    struct ClusterRecord {
+        uint64_t offset;
+        uint64_t size;
+        float area;
+        uint32_t triangleCount;
+    };
+
+    /** The top of the hierarchy and the clusters of file of cache, which must outlive the mesh */
+    ClusteredMesh(struct Material material, GeometryCache& cache, unsigned file,
+                  std::vector<TriangleMesh::Node>&& top, std::vector<ClusterRecord>& clusters);
+    virtual ~ClusteredMesh();
+
+    virtual Real intersect(Ray& ray);
+    virtual Vec3D getHitNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v);
+    virtual Vec3D getSurfaceNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v);
+
+    virtual struct Enclosure getEnclosure();
+    virtual Real getArea();
+    virtual Vec3D samplePoint(Real u1, Real u2);
+    virtual void translate(Vec3D& offset_v);
+    /** Only the resident top; clusters are accounted by the cache */
+    virtual size_t getStorageBytes();
+
+    static constexpr bool OWNS_MEMORY = true;
+
+    uint32_t getClusterCount() { return mAreaCdf.size(); }
+    uint64_t getTriangleCount() { return mTriangleCount; }
+
+private:
+    GeometryCache& mCache;
+    unsigned mFile;
+    std::vector<TriangleMesh::Node> mTop;
+    /** Cumulative areas of the clusters */
+    std::vector<float> mAreaCdf;
+    uint64_t mTriangleCount = 0;
+    /** Translation of the mesh since it was written. Clusters are not moved */
+    float mOffset[3] = {0, 0, 0};
+};
+
+/**
+ * Open a cluster file and serve its clusters from cache. The mesh is
+ * created in arena. Returns nullptr if the file cannot be read or is invalid.
+*/
+ClusteredMesh* loadClusteredMesh(const char* filename, struct Material material,
+                                 GeometryCache& cache, Arena& arena);
+
+/**
+ * Write the hierarchy of a mesh as a cluster file: every cluster is the
+ * largest subtree with at most clusterTriangles triangles. Returns false on
+ * error.
+*/
+bool writeClusteredMesh(const char* filename, TriangleMesh& mesh, unsigned clusterTriangles);
+
+#endif // _INCLUDE_PATHTRACER_CLUSTERED_MESH_H_
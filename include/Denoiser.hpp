@@ -0,0 +1,78 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_DENOISER_H_
+#define _INCLUDE_PATHTRACER_DENOISER_H_
+
+#include "Common.hpp"
+#include "Surface.hpp"
+
+#include <vector>
+
+/**
+ * Edge-avoiding à-trous wavelet denoiser (Dammertz et al. 2010).
+ * The noisy colour is demodulated by the first-hit albedo and filtered with
+ * a 5x5 B3-spline kernel of growing step, weighted by the colour, normal
+ * and depth differences between pixels so that edges are kept sharp.
+ *
+ * Pixels are processed as planar float channels, row by row, so that the
+ * inner loops run over contiguous memory.
+*/
+class Denoiser {
+public:
+    Denoiser(unsigned iterations = DEFAULT_ITERATIONS);
+    virtual ~Denoiser();
+
+    /** Number of à-trous passes. The filter footprint is 4*2^iterations pixels */
+    void setIterations(unsigned iterations);
+
+    /**
+     * Sensitivity of the edge-stopping functions. Lower values keep more
+     * detail. The colour sigma is halved after every pass.
+    */
+    void setSigmas(Real color, Real normal, Real depth);
+
+    /** Filter the surface in place, guided by the first-hit AOVs */
+    void denoise(Surface& surface, AOVBuffers& aovs);
+
+private:
+    static constexpr unsigned DEFAULT_ITERATIONS = 5;
+
+    unsigned mIterations;
+    Real mSigmaColor = 0.6;
+    Real mSigmaNormal = 0.1;
+    Real mSigmaDepth = 0.05;
+
+    /** Planar channels of the image being filtered */
+    struct Planes {
+        std::vector<float> r, g, b;
+        void resize(unsigned size);
+    };
+
+    unsigned mWidth = 0;
+    unsigned mHeight = 0;
+    Planes mIn, mOut;
+    Planes mAlbedo, mNormal;
+    std::vector<float> mDepth;
+
+    void load(Surface& surface, AOVBuffers& aovs);
+    void store(Surface& surface);
+    void filterPass(unsigned step, Real sigmaColor);
+};
+
+#endif // _INCLUDE_PATHTRACER_DENOISER_H_
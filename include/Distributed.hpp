@@ -0,0 +1,122 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_DISTRIBUTED_H_
+#define _INCLUDE_PATHTRACER_DISTRIBUTED_H_
+
+#include "Common.hpp"
+#include "Camera.hpp"
+#include "Objects.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * Distributed rendering: a coordinator splits the frame into tiles and
+ * worker processes render them with a PathTracer.
+ *
+ * Workers connect to the coordinator, which sends them the scene, the camera
+ * and the render settings and then one tile at a time. Each worker keeps up
+ * to two tiles in flight. A worker whose connection drops gives its tiles
+ * back to the queue, so that other workers render them.
+ *
+ * Addresses are "unix:PATH" for a Unix domain socket, "HOST:PORT" or just
+ * "PORT" (on localhost) for TCP. Messages use the byte order of the host.
+*/
+
+/** PathTracer settings sent to the workers */
+struct RenderSettings {
+    uint32_t spp;
+    uint32_t depth;
+    uint8_t firstHitCache;
+    uint8_t guiding;
+    uint8_t radianceCache;
+    uint8_t lightSampling;
+    /** FilterType of the pixels */
+    uint8_t filter;
+    /** Seed of the sampler */
+    uint64_t seed;
+};
+
+class RenderCoordinator {
+public:
+    RenderCoordinator(const char* address);
+    virtual ~RenderCoordinator();
+
+    /** Size of the tiles sent to the workers */
+    void setTileSize(unsigned width, unsigned height);
+
+    /** Start accepting workers. Returns false on error */
+    bool listen();
+
+    /**
+     * Start worker processes on this machine, running a program that is
+     * given "--worker ADDRESS --threads THREADS".
+    */
+    bool spawnLocalWorkers(unsigned count, const char* program, unsigned threads);
+
+    /**
+     * Render a frame through the workers into the surface of the camera.
+     * Workers may join at any time. Returns false if the frame could not be
+     * sent or no worker connected.
+    */
+    bool render(struct Scene& scene, Camera& camera, struct RenderSettings& settings);
+
+private:
+    static constexpr unsigned DEFAULT_TILE_SIZE = 128;
+    static constexpr unsigned TILES_IN_FLIGHT = 2;
+
+    struct Tile {
+        unsigned left, up, right, down;
+    };
+
+    struct Connection {
+        int fd;
+        /** Tiles sent and not returned yet */
+        std::deque<unsigned> tiles;
+        unsigned tilesDone = 0;
+    };
+
+    const char* mAddress;
+    int mListenFd = -1;
+    unsigned mTileWidth = DEFAULT_TILE_SIZE;
+    unsigned mTileHeight = DEFAULT_TILE_SIZE;
+    std::vector<Connection> mConnections;
+    std::vector<pid_t> mChildren;
+
+    void acceptWorker(std::vector<uint8_t>& setup);
+    void dropWorker(unsigned index, std::deque<unsigned>& pending);
+};
+
+class RenderWorker {
+public:
+    RenderWorker(const char* address, unsigned threads = 0);
+    virtual ~RenderWorker();
+
+    /** Render the tiles of the coordinator until it disconnects. Returns 0 on success */
+    int run();
+
+private:
+    const char* mAddress;
+    unsigned mThreads;
+};
+
+#endif // _INCLUDE_PATHTRACER_DISTRIBUTED_H_
@@ -0,0 +1,79 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_ENVIRONMENT_H_
+#define _INCLUDE_PATHTRACER_ENVIRONMENT_H_
+
+#include "Common.hpp"
+
+#include <vector>
+
+/**
+ * Light arriving from infinitely far away, either a constant colour or a
+ * latitude-longitude float image with +y up.
+ *
+ * Directions are importance sampled by the luminance of the image with a
+ * marginal CDF over the rows and a conditional CDF for each row, weighted by
+ * the solid angle of the pixels.
+*/
+class Environment {
+public:
+    /** A constant environment */
+    Environment(Color color = Color());
+    virtual ~Environment();
+
+    /** Load a lat-long map from a PFM file. Returns false on error */
+    bool loadPFM(const char* filename);
+    /** Use a lat-long map of width*height RGB pixels, top row first */
+    void setImage(unsigned width, unsigned height, std::vector<Color>& pixels);
+
+    unsigned getWidth();
+    unsigned getHeight();
+    /** Pixels of the lat-long map, top row first */
+    std::vector<Color>& getPixels();
+
+    /** Whether the environment emits no light at all */
+    bool isBlack();
+
+    /** Radiance arriving from a direction */
+    Color radiance(Vec3D& direction);
+    /** Sample a direction from two uniform numbers. Returns the solid angle pdf */
+    Vec3D sample(Real u1, Real u2, Real& pdf);
+    /** Solid angle pdf of sampling a direction */
+    Real pdf(Vec3D& direction);
+
+    /** Bytes of the map and its sampling distribution */
+    size_t getSizeBytes();
+
+private:
+    unsigned mWidth;
+    unsigned mHeight;
+    std::vector<Color> mPixels;
+
+    /** Marginal CDF over rows, mHeight+1 values */
+    std::vector<Real> mRowCdf;
+    /** Conditional CDF of each row, mWidth+1 values per row */
+    std::vector<Real> mColumnCdf;
+    /** Integral of the sampling density over the image */
+    Real mTotal;
+
+    void buildDistribution();
+    void directionToPixel(Vec3D& direction, unsigned& column, unsigned& row, Real& sinTheta);
+};
+
+#endif // _INCLUDE_PATHTRACER_ENVIRONMENT_H_
@@ -0,0 +1,115 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_FILM_H_
+#define _INCLUDE_PATHTRACER_FILM_H_
+
+#include "Common.hpp"
+#include "Accumulation.hpp"
+#include "Surface.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/** Pixel reconstruction filters */
+enum FilterType {
+    /** Every sample counts for the pixel it falls in, with the same weight */
+    FILTER_BOX,
+    /** Truncated Gaussian of radius 1.5 pixels */
+    FILTER_GAUSSIAN,
+    /** Mitchell-Netravali with B = C = 1/3, radius 2 pixels */
+    FILTER_MITCHELL
+};
+
+/** A separable reconstruction filter */
+class Filter {
+public:
+    Filter(FilterType type = FILTER_BOX);
+
+    FilterType getType();
+    /** Distance from a pixel centre beyond which samples have no weight */
+    Real getRadius();
+    /** Whole pixels a sample can reach beyond the one it falls in */
+    unsigned getPadding();
+    /** Weight along one axis of a sample at offset d from a pixel centre */
+    Real evaluate(Real d);
+
+private:
+    FilterType mType;
+    Real mRadius;
+};
+
+/**
+ * Samples of a block, and of the filter padding around it, filtered into a
+ * buffer private to one thread. Nothing is shared until the tile is merged.
+*/
+class FilmTile {
+public:
+    /** Add a sample taken at (x, y) in pixels, e.g. (0.5, 0.5) is the centre of pixel (0, 0) */
+    void add(Real x, Real y, Color& radiance);
+
+private:
+    friend class Film;
+
+    Filter* mFilter = nullptr;
+    /** Pixels covered, padding included and clipped to the image */
+    unsigned mLeft = 0, mUp = 0, mRight = 0, mDown = 0;
+    /** Fixed point sums like Accumulation::values, row by row */
+    std::vector<int64_t> mValues;
+
+    void splat(unsigned i, unsigned j, Real weight, Color& radiance);
+};
+
+/**
+ * The film collects the samples of a render through a reconstruction filter.
+ * Every worker splats into its own tile, which is then merged into the
+ * accumulation with atomic integer additions: there are no locks, tiles
+ * that overlap in their padding can be merged at the same time, and the
+ * order of the merges does not change the result.
+*/
+class Film {
+public:
+    Film();
+
+    void setFilter(FilterType type);
+    Filter& getFilter();
+    Accumulation& getAccumulation();
+
+    /** Start an empty film */
+    void reset(unsigned width, unsigned height, uint64_t seed);
+    /** Number of workers that will use tiles at the same time */
+    void setWorkerCount(unsigned count);
+
+    /** Clear the tile of a worker and place it over a block */
+    FilmTile& beginTile(unsigned worker, unsigned left, unsigned up, unsigned right, unsigned down);
+    /** Add a tile to the accumulation. Safe to call from several threads */
+    void merge(FilmTile& tile);
+    /** Write the filtered value of the pixels of a block into surface */
+    void resolve(Surface& surface, unsigned left, unsigned up, unsigned right, unsigned down);
+
+    /** Bytes of the accumulation and the tiles of the workers */
+    size_t getSizeBytes();
+
+private:
+    Filter mFilter;
+    Accumulation mAccumulation;
+    std::vector<std::unique_ptr<FilmTile>> mTiles;
+};
+
+#endif // _INCLUDE_PATHTRACER_FILM_H_
@@ -0,0 +1,218 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef _INCLUDE_PATHTRACER_GEOMETRY_CACHE_H_
+#define _INCLUDE_PATHTRACER_GEOMETRY_CACHE_H_
+
+#include "Mesh.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Header of a cluster in a file, followed by its nodes, positions and
+ * indices, laid out like the arrays of a TriangleMesh
+*/
+struct ClusterHeader {
+    uint32_t nodeCount;
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t reserved;
+};
+
+/** Place of a cluster in its file */
+struct ClusterExtent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/** A cluster in memory: its bytes and a mesh borrowing them */
+struct GeometryCluster {
+    std::unique_ptr<uint8_t[]> data;
+    size_t size = 0;
+    std::unique_ptr<TriangleMesh> mesh;
+};
+
+/**
+ * Fixed-size cache of the clusters of out-of-core meshes, evicted
+ * approximately least recently used first.
+ *
+ * Clusters are read by an I/O thread: requests are queued, and every batch
+ * is read in file order. A miss also prefetches the clusters that follow in
+ * the file, which are near in space. On threads that defer, a miss returns
+ * at once and the request is left to the I/O thread, so that the caller can
+ * put the work aside and come back once the batch is in; elsewhere the
+ * cluster is read before returning.
+ *
+ * Hits take no lock: every cluster of a file has a slot with the resident
+ * copy and the tick of its last use, which stands in for an LRU list. Only
+ * misses lock the cache. Evicted clusters are freed once no thread is in a
+ * ReadSection that began before the eviction.
+ *
+ * Files are added and evicted while no thread reads from the cache.
+*/
+class GeometryCache {
+public:
+    GeometryCache(size_t budgetBytes = DEFAULT_BUDGET);
+    virtual ~GeometryCache();
+
+    /**
+     * While a thread is in a section, the clusters it acquired from the
+     * cache are not freed. Sections can nest and must be short, e.g. one
+     * traversal, since evicted clusters wait for them.
+    */
+    class ReadSection {
+    public:
+        ReadSection(GeometryCache& cache);
+        ~ReadSection();
+
+    private:
+        GeometryCache& mCache;
+    };
+
+    /** Bytes of clusters kept in memory */
+    void setBudget(size_t bytes);
+    size_t getBudget();
+    /** Bytes of the resident clusters */
+    size_t getSizeBytes();
+    /** Whether any file is served, so that misses are possible */
+    bool hasFiles();
+
+    /**
+     * Serve the clusters of an open file, which then belongs to the cache.
+     * Returns the index of the file.
+    */
+    unsigned addFile(int fd, std::vector<ClusterExtent>&& extents);
+    /** Drop the resident clusters of a file */
+    void evictFile(unsigned file);
+
+    /**
+     * A cluster of a file, valid until the ReadSection of the calling thread
+     * ends. If it is not resident, it is read before returning, or on a
+     * deferring thread requested, the thread marked and nullptr returned.
+    */
+    GeometryCluster* acquire(unsigned file, uint32_t cluster);
+
+    /** Return once the requested clusters are read */
+    void waitForLoads();
+
+    /**
+     * Whether misses of the calling thread are deferred. Threads do not
+     * defer by default. Clears the mark of the thread.
+    */
+    static void setDeferring(bool deferring);
+    static bool isDeferring();
+    /** Whether a miss was deferred on the calling thread since the last call */
+    static bool takeDeferred();
+
+    /** Zero the statistics */
+    void resetStatistics();
+    /** Log hit rate, deferred misses, prefetches and bytes read */
+    void report();
+
+private:
+    static constexpr size_t DEFAULT_BUDGET = 256 * 1024 * 1024;
+    /** Clusters after a missed one that are requested with it */
+    static constexpr unsigned PREFETCH_COUNT = 2;
+    /** Reader slots. Threads beyond them share slots, which stays correct */
+    static constexpr unsigned READER_SLOTS = 256;
+
+    /** A cluster of a file: its resident copy, or nullptr, and its last use */
+    struct Slot {
+        std::atomic<GeometryCluster*> cluster{nullptr};
+        std::atomic<uint32_t> lastUse{0};
+    };
+
+    struct File {
+        int fd;
+        std::vector<ClusterExtent> extents;
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    /**
+     * Sections of the threads using a slot: their count in the high 16 bits
+     * and the epoch at which the oldest one began in the low 48. Lookups are
+     * counted here too, so that hits only write the line of their thread.
+    */
+    struct alignas(64) Reader {
+        std::atomic<uint64_t> state{0};
+        std::atomic<uint64_t> lookups{0};
+        std::atomic<uint64_t> hits{0};
+    };
+
+    /** A cluster evicted at an epoch, freed when no older section is left */
+    struct Retired {
+        uint64_t epoch;
+        GeometryCluster* cluster;
+    };
+
+    std::mutex mLock;
+    std::vector<File> mFiles;
+    /** Keys of the resident clusters, in no order */
+    std::vector<uint64_t> mResidentKeys;
+    std::vector<Retired> mRetired;
+    size_t mBudget;
+    size_t mResident = 0;
+    /** Advanced on every insertion; the last use of the clusters */
+    std::atomic<uint32_t> mTick;
+    std::atomic<uint64_t> mEpoch;
+    std::unique_ptr<Reader[]> mReaders;
+
+    std::thread mThread;
+    std::condition_variable mRequested;
+    std::condition_variable mLoaded;
+    std::deque<uint64_t> mQueue;
+    /** Keys queued or being read */
+    std::unordered_set<uint64_t> mPending;
+    bool mExit = false;
+
+    std::atomic<uint64_t> mDeferred;
+    std::atomic<uint64_t> mBlockingLoads;
+    std::atomic<uint64_t> mPrefetches;
+    std::atomic<uint64_t> mLoads;
+    std::atomic<uint64_t> mBytesRead;
+    std::atomic<uint64_t> mEvictions;
+
+    /** Reader slot of the calling thread */
+    Reader& reader();
+    void ioLoop();
+    /** Read a cluster, nullptr on error */
+    std::unique_ptr<GeometryCluster> read(int fd, const ClusterExtent& extent);
+    /**
+     * Make a cluster resident, evicting others over the budget, and return
+     * the resident one. Locked
+    */
+    GeometryCluster* insert(uint64_t key, std::unique_ptr<GeometryCluster>& cluster);
+    /** Take a resident cluster out of its slot and retire it. Locked */
+    void evict(unsigned index);
+    /** Free the retired clusters no section can still use. Locked */
+    void reclaim();
+    /** Queue a cluster that is neither resident nor pending. Locked */
+    bool request(uint64_t key);
+    Slot& slot(uint64_t key);
+};
+
+#endif // _INCLUDE_PATHTRACER_GEOMETRY_CACHE_H_
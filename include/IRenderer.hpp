@@ -42,9 +42,31 @@ public:
         camera.onRenderFinished();
     }
 
+    /**
+     * Render several views of a scene, e.g. a stereo pair or the faces of a
+     * cube map, and notify every camera when finished. Each camera gets its
+     * own surface.
+    */
+    void renderScene(struct Scene& scene, const std::vector<Camera*>& cameras) {
+        renderViews(scene, cameras);
+        for (Camera* camera : cameras) {
+            camera->onRenderFinished();
+        }
+    }
+
 protected:
     /** Internal function to render a scene */
     virtual void render(struct Scene& scene, Camera& camera) = 0;
+
+    /**
+     * Internal function to render several views. Renderers that can share
+     * the work of the views override it, the others render one at a time.
+    */
+    virtual void renderViews(struct Scene& scene, const std::vector<Camera*>& cameras) {
+        for (Camera* camera : cameras) {
+            render(scene, *camera);
+        }
+    }
 };
 
 #endif // _INCLUDE_PATHTRACER_RENDERER_H_
@@ -0,0 +1,81 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_IMAGEWRITER_H_
+#define _INCLUDE_PATHTRACER_IMAGEWRITER_H_
+
+#include "Surface.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Writes images on a background thread. A copy of the surface is queued,
+ * so the caller can render the next frame into it while the previous one is
+ * encoded and written.
+*/
+class ImageWriter {
+public:
+    /** Start the writer. write() blocks while maxPending images are queued */
+    ImageWriter(unsigned maxPending = 2);
+    /** Write the queued images and stop */
+    virtual ~ImageWriter();
+
+    /** Queue a copy of surface to be written to filename */
+    void write(Surface& surface, const std::string& filename, ImageFormat format);
+    /** Queue a copy of a display image, written as PPM */
+    void write(DisplayImage& display, const std::string& filename, ImageFormat format);
+    /** Wait until every queued image is written */
+    void flush();
+
+    unsigned getImagesWritten();
+    unsigned getFailures();
+    /** Time the writer thread spent encoding and writing */
+    double getWriteSeconds();
+
+private:
+    /** Either a surface or a display image */
+    struct Job {
+        std::unique_ptr<Surface> surface;
+        std::unique_ptr<DisplayImage> display;
+        std::string filename;
+        ImageFormat format;
+    };
+
+    const unsigned mMaxPending;
+    std::thread mThread;
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    std::deque<Job> mJobs;
+    /** Jobs queued or being written */
+    unsigned mPending = 0;
+    bool mExit = false;
+
+    unsigned mWritten = 0;
+    unsigned mFailures = 0;
+    double mWriteSeconds = 0;
+
+    void push(Job job);
+    void writerLoop();
+};
+
+#endif // _INCLUDE_PATHTRACER_IMAGEWRITER_H_
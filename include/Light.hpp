@@ -31,7 +31,8 @@ class Ray {
          * If any of the vectors are not unit they will be normalised.
          */
         Ray(Vec3D origin_v, Vec3D direction_v);
-        virtual ~Ray();
+        /** A ray whose direction is known to be unit, which is kept as is */
+        static Ray withUnitDirection(Vec3D origin_v, Vec3D direction_v);
 
         /**
          * Get a point in the trajectory of the ray. The parameter
@@ -46,6 +47,9 @@ class Ray {
         Vec3D getDirection();
 
     private:
+        struct Unit { };
+        Ray(Vec3D origin_v, Vec3D direction_v, Unit);
+
         /** Origin vector */
         Vec3D mOrigin_v;
         /** Propagation direction of the Ray */
@@ -0,0 +1,94 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_LIGHTBVH_H_
+#define _INCLUDE_PATHTRACER_LIGHTBVH_H_
+
+#include "Common.hpp"
+#include "Objects.hpp"
+
+#include <unordered_set>
+#include <vector>
+
+/**
+ * A bounding volume hierarchy over the emissive objects of a scene, used to
+ * pick a light for a shading point with probability proportional to an
+ * estimate of its contribution (Estevez & Kulla 2018).
+ *
+ * Every node bounds the position, the orientation (as a NormalCone) and the
+ * power of the lights under it. Emitters in this renderer are two-sided, so
+ * the cones bound lines rather than directions.
+ *
+ * Only objects with a finite area can be sampled. Unbounded emitters such as
+ * planes are left out and keep being found by the paths that hit them.
+*/
+class LightBVH {
+public:
+    LightBVH();
+    virtual ~LightBVH();
+
+    /** Build the hierarchy over the bounded emissive objects of a list */
+    void build(std::vector<IObject3D*>& objects);
+
+    /** Number of lights in the hierarchy */
+    unsigned size();
+    bool empty();
+
+    /** Whether an object is one of the lights of the hierarchy */
+    bool contains(IObject3D* object);
+
+    /**
+     * Traverse the hierarchy from the root choosing one child at every node
+     * with probability proportional to its importance for the shading point.
+     * Returns the selected light and the probability of selecting it, or
+     * nullptr if no light can contribute.
+    */
+    IObject3D* sample(Vec3D& point, Vec3D& normal, Real u, Real& pmf);
+
+    /** Bytes of the nodes and the light tables */
+    size_t getSizeBytes();
+
+private:
+    struct Node {
+        struct Enclosure bounds;
+        struct NormalCone cone;
+        Real power;
+        /** Index of the second child. The first child follows the node */
+        unsigned secondChild;
+        /** Index of the light for leaves, -1 for interior nodes */
+        int light;
+    };
+
+    /** Light attributes gathered before building */
+    struct LightInfo {
+        IObject3D* object;
+        struct Enclosure bounds;
+        struct NormalCone cone;
+        Vec3D centroid;
+        Real power;
+    };
+
+    std::vector<Node> mNodes;
+    std::vector<IObject3D*> mLights;
+    std::unordered_set<IObject3D*> mLightSet;
+
+    unsigned buildRecursive(std::vector<LightInfo>& lights, unsigned begin, unsigned end);
+    Real importance(const Node& node, Vec3D& point, Vec3D& normal);
+};
+
+#endif // _INCLUDE_PATHTRACER_LIGHTBVH_H_
@@ -0,0 +1,140 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_MESH_H_
+#define _INCLUDE_PATHTRACER_MESH_H_
+
+#include "Common.hpp"
+#include "Objects.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * An indexed triangle mesh: one array of vertex positions and three vertex
+ * indices per triangle. The mesh is a single object of the scene with a
+ * bounding volume hierarchy of its own over its triangles, so that millions
+ * of triangles cost one intersection call.
+ *
+ * Triangles face the same way as Triangle objects with the same vertices.
+ *
+ * The arrays are owned by the mesh, or borrowed from a mapped scene cache
+ * together with a hierarchy built before.
+*/
+class TriangleMesh : public IObject3D {
+public:
+    /**
+     * 32 byte node. Interior nodes have count 0, their first child follows
+     * them and offset is the second one. Leaves hold count triangles from
+     * offset on.
+    */
+    struct Node {
+        float lo[3];
+        uint32_t offset;
+        float hi[3];
+        uint32_t count;
+    };
+
+    /**
+     * Take x, y, z of every vertex and the vertex indices of every triangle.
+     * The triangles are reordered while the hierarchy is built.
+    */
+    TriangleMesh(struct Material material, std::vector<float>&& positions, std::vector<uint32_t>&& indices);
+    /**
+     * Borrow the arrays of a mesh and its hierarchy, as returned by the
+     * getters of a built mesh. They must outlive the mesh, and positions and
+     * nodes are written if the mesh is translated.
+    */
+    TriangleMesh(struct Material material, float* positions, uint32_t vertexCount,
+                 uint32_t* indices, uint32_t triangleCount, Node* nodes, uint32_t nodeCount);
+    virtual ~TriangleMesh();
+
+    virtual Real intersect(Ray& ray);
+    virtual Vec3D getHitNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v);
+    virtual Vec3D getSurfaceNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v);
+
+    virtual struct Enclosure getEnclosure();
+    virtual Real getArea();
+    virtual Vec3D samplePoint(Real u1, Real u2);
+    virtual void translate(Vec3D& offset_v);
+    virtual size_t getStorageBytes();
+
+    /** The arrays and the area distribution are vectors when owned */
+    static constexpr bool OWNS_MEMORY = true;
+
+    uint32_t getVertexCount() { return mVertexCount; }
+    uint32_t getTriangleCount() { return mTriangleCount; }
+    uint32_t getNodeCount() { return mNodeCount; }
+    /** x, y, z of every vertex */
+    const float* getPositions() { return mPositions; }
+    /** Three vertex indices per triangle, in the order of the leaves */
+    const uint32_t* getIndices() { return mIndices; }
+    const Node* getNodes() { return mNodes; }
+
+    /** Closest triangle along the ray before tMax, or -1. tMax becomes its distance */
+    int64_t intersectTriangles(Ray& ray, Real& tMax);
+    /** Unnormalized normal of a triangle, facing like Triangle objects */
+    Vec3D triangleNormal(uint32_t triangle);
+
+    /**
+     * Distance at which a ray enters a node, or infinity if it misses it.
+     * inverse holds 1 over the components of the direction.
+    */
+    static inline float enterNode(const float* lo, const float* hi, const float* origin,
+                                  const float* inverse, float tMax)
+    {
+        float tNear = 0, tFar = tMax;
+        for (unsigned int k = 0; k < 3; k++) {
+            const float t0 = (lo[k] - origin[k]) * inverse[k];
+            const float t1 = (hi[k] - origin[k]) * inverse[k];
+            tNear = std::max(tNear, std::min(t0, t1));
+            tFar = std::min(tFar, std::max(t0, t1));
+        }
+        return (tNear <= tFar)? tNear : INFINITY;
+    }
+
+private:
+    /** Arrays of the mesh when it owns them */
+    std::vector<float> mPositionStorage;
+    std::vector<uint32_t> mIndexStorage;
+    std::vector<Node> mNodeStorage;
+
+    float* mPositions;
+    uint32_t mVertexCount;
+    uint32_t* mIndices;
+    uint32_t mTriangleCount;
+    Node* mNodes;
+    uint32_t mNodeCount;
+
+    /** Cumulative areas of the triangles, built the first time it is needed */
+    std::vector<float> mAreaCdf;
+    std::once_flag mAreaOnce;
+
+    /** Bounds and centroids of the triangles while building */
+    struct BuildInput;
+
+    void build();
+    /** Build the subtree over the triangles order[begin, end), returns its root */
+    uint32_t buildNode(BuildInput& input, std::vector<uint32_t>& order, uint32_t begin, uint32_t end);
+    void buildAreas();
+};
+
+#endif // _INCLUDE_PATHTRACER_MESH_H_
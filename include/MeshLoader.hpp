@@ -0,0 +1,40 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_MESH_LOADER_H_
+#define _INCLUDE_PATHTRACER_MESH_LOADER_H_
+
+#include "Arena.hpp"
+#include "Mesh.hpp"
+
+/**
+ * Load a Wavefront OBJ or binary little endian PLY file, chosen by the
+ * extension, into an indexed mesh.
+ *
+ * The file is mapped in memory and parsed in parallel: OBJ files in chunks
+ * split at line ends, whose vertex counts are added up afterwards to resolve
+ * relative indices, and PLY files by copying the vertex and face records
+ * straight into the arrays of the mesh. Polygons are split into fans of
+ * triangles; normals, texture coordinates and materials are ignored.
+ *
+ * The mesh is created in arena. Returns nullptr if the file cannot be read
+ * or is invalid.
+*/
+TriangleMesh* loadMesh(const char* filename, struct Material material, Arena& arena);
+
+#endif // _INCLUDE_PATHTRACER_MESH_LOADER_H_
@@ -19,6 +19,7 @@
 #ifndef _INCLUDE_PATHTRACER_OBJECTS_H_
 #define _INCLUDE_PATHTRACER_OBJECTS_H_
 
+#include "Arena.hpp"
 #include "Common.hpp"
 #include "Light.hpp"
 #include "Vector3D.hpp"
@@ -47,6 +48,13 @@ struct Enclosure {
     Real z_min, z_max;
 };
 
+/** Bounds of the directions of the normals of a surface */
+struct NormalCone {
+    Vec3D axis;
+    /** Half-angle of the cone around the axis, in radians */
+    Real theta;
+};
+
 /**
  * 3D Object base
  */
@@ -72,18 +80,76 @@ class IObject3D {
 
         virtual struct Enclosure getEnclosure() = 0;
 
+        /** Returns the area of the surface. Unbounded objects return infinity
+         * and cannot be sampled.
+        */
+        virtual Real getArea();
+
+        /** Returns a point uniformly distributed over the surface given two
+         * uniform random numbers in [0, 1)
+        */
+        virtual Vec3D samplePoint(Real u1, Real u2);
+
+        /** Returns the cone that bounds the surface normals. By default all
+         * directions.
+        */
+        virtual struct NormalCone getNormalCone();
+
+        /** Move the object by an offset */
+        virtual void translate(Vec3D& offset_v) = 0;
+
+        /** Bytes held outside of the object itself, e.g. mesh arrays */
+        virtual size_t getStorageBytes();
+
         struct Material& material();
         Color& color();
 
+        /**
+         * Primitives hold no memory of their own, so an arena can drop them
+         * without running their destructors. Classes that do must say so.
+        */
+        static constexpr bool OWNS_MEMORY = false;
+
     protected:
         struct Material mMaterial;
 };
 
-/** A container of objects and light sources */
-/// \todo Delete objects
+class Environment;
+class GeometryCache;
+
+/**
+ * A container of objects and light sources. The scene owns its objects: they
+ * are created in its arena, next to each other in the order they are added,
+ * and are all freed at once when the scene is cleared or destroyed.
+*/
 struct Scene {
     std::vector<IObject3D*> objects;
+    Arena arena;
+    /** Radiance of rays that leave the scene, when there is no environment */
     Color backgroundColor;
+    /** Optional environment map lighting the scene. Not owned by the scene */
+    Environment* environment = nullptr;
+    /** Pages the clusters of the out-of-core meshes. Not owned by the scene */
+    GeometryCache* geometryCache = nullptr;
+    /**
+     * Incremented whenever objects or the environment change, so that
+     * renderers can keep what they build from the scene between frames
+    */
+    unsigned revision = 0;
+
+    /** Create an object in the arena and add it to the scene */
+    template<typename T, typename... Args>
+    T* add(Args&&... args) {
+        T* object = arena.create<T>(std::forward<Args>(args)...);
+        objects.push_back(object);
+        return object;
+    }
+
+    /** Remove and free every object */
+    void clear();
+
+    /** Bytes of the objects and of the storage they hold */
+    size_t getSizeBytes();
 };
 
 /// \todo Define a Cube object
@@ -100,6 +166,10 @@ class Plane : public IObject3D {
         virtual Vec3D getSurfaceNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v);
 
         virtual struct Enclosure getEnclosure();
+        virtual void translate(Vec3D& offset_v);
+
+        Vec3D position() { return mPosition_v; }
+        Vec3D normal() { return mNormal_v; }
 
     private:
         Vec3D mPosition_v;
@@ -120,6 +190,14 @@ class Triangle : public IObject3D {
         virtual Vec3D getSurfaceNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v);
 
         virtual struct Enclosure getEnclosure();
+        virtual Real getArea();
+        virtual Vec3D samplePoint(Real u1, Real u2);
+        virtual struct NormalCone getNormalCone();
+        virtual void translate(Vec3D& offset_v);
+
+        Vec3D a() { return mA_v; }
+        Vec3D b() { return mB_v; }
+        Vec3D c() { return mC_v; }
 
     private:
         Vec3D mA_v, mB_v, mC_v;
@@ -138,6 +216,9 @@ class Sphere : public IObject3D {
 
         /// \todo Return the cubic enclosure of the sphere
         virtual struct Enclosure getEnclosure();
+        virtual Real getArea();
+        virtual Vec3D samplePoint(Real u1, Real u2);
+        virtual void translate(Vec3D& offset_v);
 
         Vec3D center() { return mCenter_v; }
         Real radius() { return mRadius; }
@@ -170,6 +251,9 @@ public:
     virtual std::vector<IObject3D*>& children();
 
     virtual struct Enclosure getEnclosure();
+    virtual void translate(Vec3D& offset_v);
+
+    static constexpr bool OWNS_MEMORY = true;
 
 protected:
     /** \todo Define a Cube object to use as a container boundary.
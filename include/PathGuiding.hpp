@@ -0,0 +1,153 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_PATHGUIDING_H_
+#define _INCLUDE_PATHTRACER_PATHGUIDING_H_
+
+#include "Common.hpp"
+#include "Objects.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/* Path guiding
+ * A spatial-directional tree in the style of "Practical Path Guiding for
+ * Efficient Light-Transport Simulation" (Müller et al. 2017). A binary tree
+ * subdivides space and every spatial leaf holds a quadtree over the sphere
+ * of directions that learns the distribution of incident radiance.
+ *
+ * Every leaf keeps two quadtrees: one that is sampled during a pass and is
+ * never modified, and one that records the radiance of the current pass.
+ * Recording only uses atomic additions, so any number of rendering threads
+ * can record at the same time without locks. refine() is called between
+ * passes, when no thread is rendering.
+*/
+
+/**
+ * A quadtree over the unit square, mapped to the sphere with the cylindrical
+ * (equal-area) mapping (cos(theta), phi).
+*/
+class DTree {
+public:
+    DTree();
+    DTree(const DTree& other);
+    DTree& operator=(const DTree& other);
+
+    /** Add radiance arriving from a direction. Lock-free */
+    void record(Vec3D& direction, Real radiance);
+
+    /** Sample a direction proportionally to the recorded radiance */
+    Vec3D sample(Real& pdf);
+    /** Solid angle density of sampling a direction */
+    Real pdf(Vec3D& direction);
+
+    /** Total recorded radiance */
+    Real total();
+    /** Number of recorded samples */
+    uint32_t sampleCount();
+
+    /**
+     * Build the structure for the next pass: nodes holding more than a
+     * fraction of the recorded radiance are subdivided, the rest are merged.
+     * The result has no recorded radiance.
+    */
+    DTree refined(Real threshold, unsigned maxDepth);
+
+    size_t getSizeBytes();
+
+private:
+    struct Node {
+        Node();
+        Node(const Node& other);
+        Node& operator=(const Node& other);
+
+        /** Radiance recorded in each quadrant */
+        std::atomic<float> sum[4];
+        /** Index of the node of each quadrant. 0 for leaf quadrants */
+        uint32_t child[4];
+    };
+
+    std::vector<Node> mNodes;
+    std::atomic<uint32_t> mSampleCount;
+
+    void refineNode(DTree& result, unsigned node, int source, Real sourceSum,
+                    Real total, Real threshold, unsigned depth, unsigned maxDepth);
+};
+
+/** Spatial binary tree of DTrees */
+class SDTree {
+public:
+    SDTree();
+
+    /** Start learning from scratch inside the given bounds */
+    void reset(const struct Enclosure& bounds);
+
+    /** Whether the sampling distributions have been trained */
+    bool ready();
+
+    /** Sample a direction for a point. Returns the solid angle pdf */
+    Real sample(Vec3D& point, Vec3D& direction);
+    /** Solid angle pdf of sampling a direction at a point */
+    Real pdf(Vec3D& point, Vec3D& direction);
+    /** Record radiance arriving at a point from a direction. Lock-free */
+    void record(Vec3D& point, Vec3D& direction, Real radiance);
+
+    /**
+     * End a pass of spp samples per pixel: subdivide the spatial leaves that
+     * received many samples, make the recorded distributions the sampling
+     * ones and prepare new empty ones.
+    */
+    void refine(unsigned spp);
+
+    unsigned spatialLeafCount();
+    /** Bytes of the spatial tree and of all the directional trees */
+    size_t getSizeBytes();
+
+private:
+    struct SNode {
+        /** Index of the children. 0 for leaves */
+        uint32_t child[2];
+        /** Split axis: 0 = x, 1 = y, 2 = z */
+        int axis;
+        /** Index of the leaf data */
+        uint32_t leaf;
+    };
+
+    struct Leaf {
+        DTree sampling;
+        DTree building;
+    };
+
+    struct Enclosure mBounds;
+    std::vector<SNode> mNodes;
+    std::vector<Leaf> mLeaves;
+    bool mReady = false;
+
+    /** A spatial leaf splits after c*sqrt(spp) samples in a pass */
+    static constexpr Real SPATIAL_THRESHOLD = 4000;
+    /** A quadrant subdivides if it holds more than this fraction of the energy */
+    static constexpr Real DIRECTIONAL_THRESHOLD = 0.01;
+    static constexpr unsigned MAX_DIRECTIONAL_DEPTH = 16;
+    static constexpr unsigned MAX_SPATIAL_DEPTH = 24;
+
+    Leaf& lookup(Vec3D& point);
+    void splitNode(unsigned node, unsigned threshold, unsigned depth);
+};
+
+#endif // _INCLUDE_PATHTRACER_PATHGUIDING_H_
@@ -22,31 +22,27 @@
 #include "IRenderer.hpp"
 
 #include "Common.hpp"
+#include "Film.hpp"
+#include "GeometryCache.hpp"
+#include "SharedFramebuffer.hpp"
 #include "Surface.hpp"
 #include "Objects.hpp"
 #include "Light.hpp"
 #include "Camera.hpp"
+#include "Denoiser.hpp"
+#include "Environment.hpp"
+#include "LightBVH.hpp"
+#include "PathGuiding.hpp"
+#include "RadianceCache.hpp"
+#include "ResultNotifier.hpp"
 #include "Surface.hpp"
+#include "TileScheduler.hpp"
+#include "Topology.hpp"
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
-/**
- * IResultsListener is an interface to be notified of rendering results,
- * either partial or complete. Thus, listeners can act upon notification of
- * a rendering result.
-*/
-class IResultsListener {
-public:
-    virtual ~IResultsListener() = default;
-
-    /** The renderer has finished rendering a part of the scene*/
-    virtual void onPartialResult(struct Scene& scene, Camera& camera) = 0;
-
-    /** The renderer has finished rendering the scene */
-    virtual void onRenderFinished(struct Scene& scene, Camera& camera) = 0;
-};
-
 class PathTracer : public IRenderer {
 public:
     PathTracer(unsigned spp, unsigned depth);
@@ -54,32 +50,281 @@ public:
 
     /** Register a results listener */
     void addCallback(IResultsListener* callback);
+    /** Shortest time between two partial results, 0.05 s by default */
+    void setNotificationInterval(double seconds);
 
     /** Set the block size of the renderer */
     void setBlockSize(unsigned int width, unsigned int height);
 
+    /**
+     * Render only the pixels in [left, right) x [up, down) of the camera
+     * surface. The other pixels are cleared. A null rectangle renders the
+     * whole surface, which is the default.
+    */
+    void setRegion(unsigned left, unsigned up, unsigned right, unsigned down);
+
+    /**
+     * Start a frame rendered region by region with renderRegion: clear the
+     * camera surface and reset the film and the learning of path guiding and
+     * the radiance cache. The replicas, the film and what is learned are kept
+     * for all the regions of the frame, and the camera is not finished.
+    */
+    void beginFrame(struct Scene& scene, Camera& camera);
+    /**
+     * Render only the blocks covering [left, right) x [up, down) of the frame
+     * started by beginFrame, in one pass, and resolve them into the camera
+     * surface. Path guiding learns over the regions of the frame.
+    */
+    void renderRegion(struct Scene& scene, unsigned left, unsigned up, unsigned right, unsigned down);
+
+    /**
+     * Seed of the sampler. Every sample of every pixel draws from its own
+     * sequence, so renders with the same seed are identical whatever the
+     * threads and passes, unless path guiding or the radiance cache are on.
+    */
+    void setSeed(uint64_t seed);
+
+    /**
+     * Publish every finished block in a shared memory framebuffer of the
+     * size of the frames, or nullptr to stop publishing.
+    */
+    void setSharedFramebuffer(SharedFramebuffer* framebuffer);
+
+    /** Reconstruction filter of the pixels, box by default */
+    void setFilter(FilterType type);
+
+    /**
+     * Save the accumulated samples to a file every intervalSeconds and at
+     * the end, and continue from it if it holds samples of the same frame
+     * size and seed. Pass nullptr to disable checkpoints.
+    */
+    void setCheckpoint(const char* filename, double intervalSeconds);
+
+    /** Number of worker threads rendering blocks. 0 uses one per hardware thread */
+    void setThreadCount(unsigned threads);
+
+    /**
+     * Render NUMA-aware on a topology: workers are pinned to its nodes and
+     * the light hierarchy and the environment read at every bounce are
+     * replicated on each node. The objects, meshes and their hierarchies
+     * are shared by the replicas, not replicated, and the pixels are not
+     * placed, as blocks move between nodes when stolen and their rows are
+     * smaller than a page. Pass nullptr to disable.
+    */
+    void setNumaTopology(Topology* topology);
+
+    /**
+     * Resolve the primary hit of every pixel once per block and start all
+     * the samples of the pixel from it instead of tracing the camera ray
+     * spp times.
+    */
+    void setFirstHitCacheEnabled(bool enabled);
+
+    /**
+     * Set a denoiser to filter the result before it is reported as finished.
+     * The camera AOVs are enabled when rendering with a denoiser.
+     * Pass nullptr to disable denoising.
+    */
+    void setDenoiser(Denoiser* denoiser);
+
+    /**
+     * Sample the bounded emitters of the scene through a light hierarchy at
+     * every bounce (next event estimation), and the environment combined
+     * with the bounce direction by multiple importance sampling.
+     * Enabled by default.
+    */
+    void setLightSamplingEnabled(bool enabled);
+
+    /**
+     * Learn the distribution of incident light while rendering and use it to
+     * sample diffuse bounces, mixed with cosine sampling. Samples are taken in
+     * passes of growing size and the distribution is refined after each one.
+    */
+    void setPathGuidingEnabled(bool enabled);
+
+    /**
+     * Set a radiance cache to terminate long paths into. The cache is
+     * filled by the first bounces of the paths and samples are taken in
+     * passes, so later passes use what earlier ones recorded.
+     * Pass nullptr to trace every path to the maximum depth.
+    */
+    void setRadianceCache(RadianceCache* cache);
+
 private:
     unsigned mMaxDepth;
     unsigned mSPP;
-    std::vector<IResultsListener*> mPartialResultListeners;
+    bool mFirstHitCacheEnabled = false;
+    Denoiser* mDenoiser = nullptr;
+    std::vector<IResultsListener*> mListeners;
+    /** Delivers the partial results without stopping the render threads */
+    ResultNotifier mNotifier;
+
+    /** Persistent workers that render the blocks of the frame */
+    TileScheduler mScheduler;
+
+    Topology* mTopology = nullptr;
+
+    /** Reconstruction filter of the films */
+    FilterType mFilter = FILTER_BOX;
+    SharedFramebuffer* mSharedFramebuffer = nullptr;
+    uint64_t mSeed = 0;
+    const char* mCheckpointFile = nullptr;
+    double mCheckpointInterval = 0;
+
+    /**
+     * Read-only data used at every bounce, with one copy per NUMA node. The
+     * objects are shared: only the list of pointers to them is copied.
+    */
+    struct SceneReplica {
+        std::vector<IObject3D*> objects;
+        /** Bounded emitters of the scene, sampled explicitly at every bounce */
+        LightBVH lightBVH;
+        /** Light of the rays leaving the scene */
+        Environment environment;
+    };
+    std::vector<std::unique_ptr<SceneReplica>> mReplicas;
+    /** Scene and revision the replicas were built from */
+    const struct Scene* mReplicaScene = nullptr;
+    unsigned mReplicaRevision = 0;
+    bool mLightSamplingEnabled = true;
+    bool mEnvironmentSamplingEnabled = false;
+
+    /** Learnt incident radiance for path guiding */
+    SDTree mGuiding;
+    bool mPathGuidingEnabled = false;
+
+    RadianceCache* mRadianceCache = nullptr;
+
+    /** A surface hit: position, normal facing the ray and material */
+    struct HitRecord {
+        bool valid;
+        IObject3D* object;
+        Real distance;
+        Vec3D point;
+        Vec3D normal;
+        struct Material material;
+    };
+
+    struct Block {
+        unsigned int left, up, right, down;
+    };
+
+    /** A camera of the current render with the filtered samples of its pixels */
+    struct View {
+        Camera* camera = nullptr;
+        Film film;
+        std::vector<Block> blocks;
+        /** Partial results go to the listeners, which follow a single view */
+        bool preview = false;
+        /** Framebuffer the blocks are published to, or nullptr */
+        SharedFramebuffer* shared = nullptr;
+    };
+    /** Views of the last render, kept to reuse their films */
+    std::vector<std::unique_ptr<View>> mViews;
+    /** Samples taken by renderRegion since path guiding was last refined */
+    uint64_t mRegionSamples = 0;
+    /** Samples per pixel of the frame that renderRegion learns before refining */
+    unsigned mRegionLearningPass = 2;
+
+    /** A block of one of the views, as handed to the scheduler */
+    struct ViewBlock {
+        View* view;
+        Block block;
+    };
 
     virtual void render(struct Scene& scene, Camera& camera);
-    Color traceRay(unsigned depth, Ray& ray, struct Scene& scene);
+    /**
+     * Render the views through one scheduler over the same replicas. Only
+     * the first view is published to, and finished for, the listeners and
+     * the shared framebuffer, and checkpoints are only kept for a single
+     * view. Path guiding and the radiance cache learn from all the views
+     * together over the union of their bounds, so with either of them the
+     * views differ from renders of one view at a time.
+    */
+    virtual void renderViews(struct Scene& scene, const std::vector<Camera*>& cameras);
+    /**
+     * Build the replicas of the scene, each one on its node. They are kept
+     * while the scene and its revision stay the same.
+    */
+    void buildReplicas(struct Scene& scene);
+    /** Replica of the node running the calling thread */
+    SceneReplica& replica();
+    /** Add the blocks of a region of a view, grown by the reach of the filter */
+    void addBlocks(View& view, Block region, std::vector<ViewBlock>& blocks);
+    /** Reset path guiding and the radiance cache to the bounds seen by the cameras */
+    void resetLearning(struct Scene& scene, const std::vector<Camera*>& cameras);
+    /** The shared framebuffer, if it has the size of surface */
+    SharedFramebuffer* sharedFramebufferFor(Surface& surface);
+    /**
+     * Take samples until every pixel of the blocks has target of them, and
+     * fill the AOVs of the cameras if asked. Returns the mean variance of the
+     * luminance of the new samples.
+    */
+    double renderPass(struct Scene& scene, std::vector<ViewBlock>& blocks, unsigned target,
+                      bool withAOVs);
+    /**
+     * Take the samples of one block of a view and merge them, adding the
+     * variance of its pixels to workerVariance. Returns false, with nothing
+     * merged or learned, if rays reached geometry that is not resident on a
+     * deferring thread.
+    */
+    bool renderBlock(struct Scene& scene, View& view, const Block& block, unsigned target,
+                     bool withAOVs, unsigned worker, double& workerVariance);
+    /** Bounds of the region of the scene that paths can reach */
+    struct Enclosure estimateSceneBounds(struct Scene& scene, Camera& camera);
+
+    /**
+     * Radiance arriving along a ray. bsdfPdf is the solid angle pdf with
+     * which the ray direction was sampled, or 0 for camera rays.
+    */
+    Color traceRay(unsigned depth, Ray& ray, struct Scene& scene, Real bsdfPdf);
+
+    /** Find the closest hit of a ray. Returns false if nothing was hit */
+    bool resolveHit(Ray& ray, struct Scene& scene, HitRecord& hit);
+    /** Radiance leaving a resolved hit towards the ray that produced it */
+    Color shadeHit(unsigned depth, HitRecord& hit, struct Scene& scene);
+    /** Direct light from one emitter of the light hierarchy */
+    Color sampleDirectLight(HitRecord& hit, struct Scene& scene);
+    /** Direct light from the environment, weighted against bounce sampling */
+    Color sampleEnvironment(HitRecord& hit, struct Scene& scene);
+    /** Solid angle pdf of shadeHit sampling a bounce direction */
+    Real bouncePdf(HitRecord& hit, Vec3D& direction);
+
+    /**
+     * Teach the guiding distribution and the radiance cache. Deferring
+     * threads keep the records until their block is merged, since a block
+     * that is taken again would otherwise be learned twice, and partly from
+     * samples that missed geometry.
+    */
+    void recordGuiding(Vec3D& point, Vec3D& direction, Real radiance);
+    void recordCache(Vec3D& point, Vec3D& normal, Color& radiance);
+    void validateCache(Color& cached, Color& traced);
+    /** Apply or drop the records kept by the calling thread */
+    void commitLearning(bool apply);
+
+    /**
+     * Hash of what the samples of a view depend on besides its size, seed
+     * and filter: the scene, the camera and the render settings
+    */
+    uint64_t configurationHash(struct Scene& scene, Camera& camera);
 
-    void notifyPartialResult(struct Scene& scene, Camera& camera);
     void notifyRenderFinished(struct Scene& scene, Camera& camera);
+    /** Log the bytes used by every part of the render of the first viewCount views */
+    void reportMemory(struct Scene& scene, unsigned viewCount);
+
+    /** Rounds in which blocks can be put aside for out-of-core geometry */
+    static constexpr unsigned int MAX_DEFERRED_ROUNDS = 3;
 
     static constexpr unsigned int DEFAULT_BLOCK_WIDTH = 64;
     static constexpr unsigned int DEFAULT_BLOCK_HEIGHT = 64;
     unsigned int mBlockWidth = DEFAULT_BLOCK_WIDTH;
     unsigned int mBlockHeight = DEFAULT_BLOCK_HEIGHT;
 
-    struct Block {
-        unsigned int left, up, right, down;
-    };
+    /** Rendered rectangle, or null for the whole surface */
+    Block mRegion = {0, 0, 0, 0};
 
-    void calculateBlocks(std::vector<Block>& blocks, unsigned int width, unsigned int height);
-    void reorderBlocks(std::vector<Block>& blocks, unsigned int width, unsigned int height);
+    void calculateBlocks(std::vector<Block>& blocks, const Block& region);
+    void reorderBlocks(std::vector<Block>& blocks, const Block& region);
 };
 
 #endif // _INCLUDE_PATHTRACER_PATHTRACER_H_
@@ -0,0 +1,106 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_RADIANCECACHE_H_
+#define _INCLUDE_PATHTRACER_RADIANCECACHE_H_
+
+#include "Common.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/**
+ * A world-space radiance cache stored in a hash table of grid cells.
+ * Path vertices record the radiance they send back along the path, and
+ * long paths can stop at a vertex and use the mean of its cell instead of
+ * tracing more bounces. That trades a small bias for less work.
+ *
+ * Cells are keyed by their position and the dominant axis of the normal.
+ * The table uses open addressing, and both inserts and updates are lock-free.
+*/
+class RadianceCache {
+public:
+    RadianceCache(unsigned capacityLog2 = DEFAULT_CAPACITY_LOG2);
+    virtual ~RadianceCache();
+
+    /** Edge of the grid cells. 0 (default) picks 1/64 of the scene size */
+    void setCellSize(Real size);
+    /** Paths are never terminated before this number of bounces */
+    void setMinBounces(unsigned bounces);
+    /** Cells are used once they have at least this number of samples */
+    void setMinSamples(unsigned samples);
+    /**
+     * A path terminates into the cache when the segment that reaches a
+     * vertex is longer than this number of cells.
+    */
+    void setFootprintScale(Real scale);
+
+    Real getCellSize();
+    unsigned getMinBounces();
+    Real getFootprintScale();
+
+    /** Empty the cache. The cell size is resolved with the scene size */
+    void clear(Real sceneSize);
+
+    /** Add the radiance leaving a point */
+    void record(Vec3D& point, Vec3D& normal, Color& radiance);
+    /** Mean radiance leaving the cell of a point, if it has enough samples */
+    bool lookup(Vec3D& point, Vec3D& normal, Color& radiance);
+
+    /** Account a terminated path that was also traced to estimate the bias */
+    void validate(Color& cached, Color& traced);
+
+    /** Log hit rate, occupancy and the bias and variance estimates */
+    void report();
+
+    /** Bytes of the table of cells */
+    size_t getSizeBytes();
+
+private:
+    static constexpr unsigned DEFAULT_CAPACITY_LOG2 = 18;
+    static constexpr unsigned MAX_PROBES = 16;
+
+    struct Entry {
+        std::atomic<uint64_t> key;
+        std::atomic<float> r, g, b;
+        std::atomic<uint32_t> count;
+    };
+
+    unsigned mCapacityLog2;
+    std::unique_ptr<Entry[]> mEntries;
+
+    Real mCellSize = 0;
+    Real mResolvedCellSize = 1;
+    unsigned mMinBounces = 3;
+    unsigned mMinSamples = 8;
+    Real mFootprintScale = 2;
+
+    std::atomic<uint64_t> mLookups;
+    std::atomic<uint64_t> mHits;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mValidations;
+    std::atomic<double> mBiasSum;
+    std::atomic<double> mTracedSum;
+    std::atomic<double> mDifferenceSquares;
+
+    uint64_t cellKey(Vec3D& point, Vec3D& normal);
+    Entry* find(uint64_t key, bool insert);
+};
+
+#endif // _INCLUDE_PATHTRACER_RADIANCECACHE_H_
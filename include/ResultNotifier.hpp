@@ -0,0 +1,115 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_RESULTNOTIFIER_H_
+#define _INCLUDE_PATHTRACER_RESULTNOTIFIER_H_
+
+#include "Surface.hpp"
+#include "ToneMapper.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Scene;
+class Camera;
+
+/** A rectangle of pixels, from left to right-1 and up to down-1 */
+struct ResultRect {
+    unsigned left, up, right, down;
+};
+
+/**
+ * IResultsListener is an interface to be notified of rendering results,
+ * either partial or complete. Thus, listeners can act upon notification of
+ * a rendering result.
+*/
+class IResultsListener {
+public:
+    virtual ~IResultsListener() = default;
+
+    /**
+     * Part of the image has been rendered. Called from the notification
+     * thread with a snapshot of the whole image, linear and tone mapped for
+     * display, that stays unchanged during the call, and the rectangles that
+     * changed since the last call.
+    */
+    virtual void onPartialResult(const Surface& snapshot, const DisplayImage& display,
+                                 const std::vector<ResultRect>& dirty) = 0;
+
+    /** The renderer has finished rendering the scene */
+    virtual void onRenderFinished(struct Scene& scene, Camera& camera) = 0;
+};
+
+/**
+ * Delivers partial results to the listeners from a thread of its own.
+ *
+ * Rendering threads copy their finished rectangles into a back buffer and
+ * return at once. The notification thread copies the changed rectangles into
+ * the front buffer, which only it writes, tone maps their rows into the
+ * front display image and hands both to the listeners at most once per
+ * interval. A slow listener delays the next
+ * notification, whose changes add up in the meantime, but never the render.
+*/
+class ResultNotifier {
+public:
+    ResultNotifier();
+    virtual ~ResultNotifier();
+
+    void addListener(IResultsListener* listener);
+    bool hasListeners();
+    /** Shortest time between two notifications */
+    void setInterval(double seconds);
+
+    /** Start a frame of width x height pixels, displayed through toneMapper */
+    void begin(unsigned width, unsigned height, ToneMapper* toneMapper);
+    /** Queue a finished rectangle of surface. Safe from several threads */
+    void publish(Surface& surface, const ResultRect& rect);
+    /** Deliver what is queued, ignoring the interval, and wait for it */
+    void flush();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<IResultsListener*> mListeners;
+    Clock::duration mInterval;
+
+    std::thread mThread;
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    bool mExit = false;
+    bool mFlush = false;
+
+    /** Written by the rendering threads under the lock */
+    Surface mBack;
+    std::vector<ResultRect> mDirty;
+    uint64_t mPublished = 0;
+    /** Only touched by the notification thread, or while it is idle */
+    Surface mFront;
+    DisplayImage mDisplay;
+    ToneMapper* mToneMapper = nullptr;
+    uint64_t mDelivered = 0;
+    unsigned mNotifications = 0;
+
+    void notifierLoop();
+};
+
+#endif // _INCLUDE_PATHTRACER_RESULTNOTIFIER_H_
@@ -0,0 +1,79 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_SCENE_CACHE_H_
+#define _INCLUDE_PATHTRACER_SCENE_CACHE_H_
+
+#include "Objects.hpp"
+#include "SceneParser.hpp"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Binary cache of parsed scenes, named after a hash of the contents of the
+ * scene file. Everything needed before the first ray is stored flattened,
+ * with offsets instead of pointers: primitives, materials, and the vertex,
+ * index and hierarchy arrays of the meshes. Loading maps the file and points
+ * the meshes into the mapping, so pages are only read when rays reach them.
+ *
+ * Layout, in the byte order of the host, arrays aligned to 64 bytes:
+ *   header: "PTSC", version, scene hash, file size, background color,
+ *           counts and offsets of the tables
+ *   dependencies: size, modification time and path of every mesh file
+ *   materials: color and emission
+ *   objects: type, material, parameters or offsets of the mesh arrays
+ *   mesh arrays: positions, indices and hierarchy nodes
+ *
+ * A cache is stale when the version, the hash or any mesh file changed.
+ * Caches are trusted local files: the arrays are not validated on load.
+*/
+class SceneCache {
+public:
+    SceneCache();
+    virtual ~SceneCache();
+
+    /**
+     * Add the objects of a scene file to scene through the cache in
+     * directory: map the cache of the file if it is up to date, or parse
+     * the file and write its cache.
+    */
+    ParserError loadScene(const char* filename, const char* directory, struct Scene& scene);
+
+    /**
+     * Map a cache and add its objects to scene. The meshes point into the
+     * mapping, so the cache must outlive the use of the scene.
+     * Returns false if the cache is missing, stale or invalid.
+    */
+    bool load(const char* cacheFile, uint64_t hash, struct Scene& scene);
+
+    /** Write the cache of a scene read from a file with the given hash and mesh files */
+    static bool save(const char* cacheFile, uint64_t hash, struct Scene& scene,
+                     const std::vector<std::string>& files);
+
+    /** Hash of the contents of a file */
+    static bool hashFile(const char* filename, uint64_t& hash);
+
+private:
+    /** Address and size of the mapped caches */
+    std::vector<std::pair<void*, size_t>> mMappings;
+};
+
+#endif // _INCLUDE_PATHTRACER_SCENE_CACHE_H_
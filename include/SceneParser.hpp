@@ -21,14 +21,39 @@
 
 #include "Objects.hpp"
 
+#include <string>
+#include <vector>
+
 enum ParserError : int {
     PARSER_OK = 0,
     PARSER_ERROR_NO_FILE,
     PARSER_ERROR_INVALID_FORMAT,
-    /// \todo Remove when finished
-    PARSER_ERROR_UNFINISHED,
 };
 
-ParserError parseSceneFromXml(const char* filename, struct Scene& scene);
+/**
+ * Add the objects of an XML scene file to scene. The file is read as a
+ * stream and every object is added as soon as its element is read, so memory
+ * does not grow with the size of the file:
+ *
+ *     <scene background="000000">
+ *       <plane position="0 0 0" normal="0 1 0" color="bfbfbf"/>
+ *       <sphere center="0 60 -170" radius="30" color="b4b400" emission="0 0 0"/>
+ *       <triangle a="0 0 0" b="1 0 0" c="0 1 0" color="0.5 0.5 0.5"/>
+ *       <mesh file="bunny.ply" color="b4b4b4"/>
+ *     </scene>
+ *
+ * Mesh files are OBJ or PLY, or out-of-core cluster files (.ptcl) that are
+ * paged through the geometry cache of the scene. They are found from the
+ * directory of the scene file unless their path is absolute.
+ *
+ * Colors are hexadecimal RGB or three reals, which can exceed 1 for
+ * emission. On error, the objects read from the file are removed again.
+ * If files is given, the paths of the mesh files read are added to it.
+*/
+ParserError parseSceneFromXml(const char* filename, struct Scene& scene,
+                              std::vector<std::string>* files = nullptr);
+
+/** Add the built-in scene: a closed room with three spheres and a lit ceiling */
+void buildScene(struct Scene& scene);
 
 #endif // _INCLUDE_PATHTRACER_SCENE_PARSER_H_
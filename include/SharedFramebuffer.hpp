@@ -0,0 +1,118 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_SHAREDFRAMEBUFFER_H_
+#define _INCLUDE_PATHTRACER_SHAREDFRAMEBUFFER_H_
+
+#include "Surface.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Header at the start of a shared framebuffer segment. Offsets are in bytes
+ * from the start of the segment. Pixels are linear float RGB, row by row.
+*/
+struct SharedFramebufferHeader {
+    /** "PTFB" */
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    /** Pixels are grouped in tiles of tileSize x tileSize, cropped on the edges */
+    uint32_t tileSize;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint32_t reserved;
+    /** One bit per tile, set when the tile changed and cleared by the reader */
+    uint64_t dirtyOffset;
+    /** Two uint32 per tile: writers and version, see SharedFramebuffer::readTile */
+    uint64_t tileStateOffset;
+    uint64_t pixelOffset;
+    uint64_t size;
+    /** Incremented every time tiles are published */
+    std::atomic<uint64_t> sequence;
+    /** Incremented at the start of every frame */
+    std::atomic<uint32_t> frame;
+    /** 1 once the current frame is final */
+    std::atomic<uint32_t> complete;
+};
+
+/**
+ * A framebuffer published in a POSIX shared memory segment, so that external
+ * viewers can map it and follow a render while it progresses. The renderer
+ * copies every finished block into the segment and marks its tiles dirty;
+ * readers find the changed tiles in the bitmap and read the pixels in place.
+ *
+ * Writers of a tile bump its writer count while they copy and its version
+ * afterwards, so readers can detect and retry torn tiles without ever making
+ * the renderer wait.
+*/
+class SharedFramebuffer {
+public:
+    /** Create the segment name, e.g. "/pathtracer". Returns nullptr on error */
+    static std::unique_ptr<SharedFramebuffer> create(const char* name,
+        unsigned width, unsigned height, unsigned tileSize = 32);
+    /** Map the segment of a renderer. Returns nullptr if it does not exist */
+    static std::unique_ptr<SharedFramebuffer> open(const char* name);
+    /** Unmap, and remove the segment if this process created it */
+    virtual ~SharedFramebuffer();
+
+    SharedFramebufferHeader& getHeader();
+    /** Pixels of the segment, without copying */
+    const Color* getPixels();
+
+    /** Start a new frame */
+    void beginFrame();
+    /**
+     * Copy a rectangle of a surface of the size of the framebuffer into the
+     * segment. Safe from several threads.
+    */
+    void publish(Surface& surface, unsigned left, unsigned up, unsigned right, unsigned down);
+    /** Mark the frame as final */
+    void endFrame();
+
+    /** Indices of the tiles changed since the last call, clearing their bits */
+    void takeDirtyTiles(std::vector<unsigned>& tiles);
+    /** Mark a tile changed, e.g. to read it again after a torn read */
+    void markDirty(unsigned tile);
+    /**
+     * Copy a tile into out, row by row, retrying while it is being written.
+     * Returns false if it was still torn after a number of attempts.
+    */
+    bool readTile(unsigned tile, std::vector<Color>& out);
+
+private:
+    std::string mName;
+    bool mOwner;
+    void* mMemory;
+    size_t mSize;
+    SharedFramebufferHeader* mHeader;
+    std::atomic<uint64_t>* mDirty;
+    /** Writers and version of every tile */
+    std::atomic<uint32_t>* mTileState;
+    Color* mPixels;
+
+    SharedFramebuffer(const char* name, bool owner, void* memory, size_t size);
+};
+
+#endif // _INCLUDE_PATHTRACER_SHAREDFRAMEBUFFER_H_
@@ -22,26 +22,125 @@
 #include "Light.hpp"
 #include "Utils.hpp"
 
-/* A container for a render result */
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** File formats a Surface can be written in */
+enum ImageFormat {
+    /** Text PPM (P3), 8 bits per channel */
+    IMAGE_PPM_ASCII,
+    /** Binary PPM (P6), 8 bits per channel */
+    IMAGE_PPM,
+    /** Portable float map, linear 32-bit float RGB */
+    IMAGE_PFM,
+    /** Tiles of 16-bit float RGB, see Surface::toTiledHalf */
+    IMAGE_HALF_TILES
+};
+
+/**
+ * A container for a render result. Pixels are stored row by row in a single
+ * buffer aligned to a cache line, so rows of a tile are contiguous and whole
+ * image passes stream through memory.
+*/
 class Surface {
     public:
         Surface(unsigned width, unsigned height);
+        Surface(const Surface& other);
+        Surface(Surface&& other);
         virtual ~Surface();
 
-        unsigned getWidth();
-        unsigned getHeight();
+        Surface& operator=(const Surface& other);
+        Surface& operator=(Surface&& other);
 
-        Color* operator[](unsigned i);
-        void toPPM(const char* filename);
+        unsigned getWidth() const;
+        unsigned getHeight() const;
+
+        /** Pixel at column i of row j */
+        inline Color& at(unsigned i, unsigned j) {
+            return color[j*width + i];
+        }
+        inline const Color& at(unsigned i, unsigned j) const {
+            return color[j*width + i];
+        }
+        /** First pixel of row j */
+        inline Color* row(unsigned j) {
+            return color + j*width;
+        }
+        inline const Color* row(unsigned j) const {
+            return color + j*width;
+        }
+        /** All the pixels, row by row, without copying */
+        inline Color* data() {
+            return color;
+        }
+        /** Size of data() in bytes */
+        size_t getSizeBytes();
+
+        /** Write in any format. Returns false on error */
+        bool save(const char* filename, ImageFormat format);
+        /** Text PPM, kept for viewers that only read P3 */
+        bool toPPM(const char* filename);
+        /** Binary PPM */
+        bool toBinaryPPM(const char* filename);
+        /** Float map, which keeps the values above 1 */
+        bool toPFM(const char* filename);
+        /**
+         * Half-float tiles. After the header "PTHT", version, width, height
+         * and tile size (uint32), tiles follow row by row. Each tile holds its
+         * pixels row by row as three halfs, and tiles on the right and bottom
+         * edges are cropped to the image. Numbers are in host byte order.
+        */
+        bool toTiledHalf(const char* filename, unsigned tileSize = 64);
 
-        void applyGammaCorrection(Real gamma);
         void clear();
 
     private:
         unsigned width;
         unsigned height;
 
-        Color** color;
+        Color* color;
+
+        void allocate();
+        void release();
+};
+
+/** Auxiliary first-hit buffers (AOVs) written alongside the colour surface */
+struct AOVBuffers {
+    AOVBuffers(unsigned width, unsigned height);
+
+    /** Colour of the material at the first hit */
+    Surface albedo;
+    /** Unit normal at the first hit, facing the camera */
+    Surface normal;
+    /** Distance from the eye to the first hit, in every channel */
+    Surface depth;
+};
+
+/** An 8-bit RGB image ready for display, row by row */
+class DisplayImage {
+    public:
+        DisplayImage(unsigned width = 0, unsigned height = 0);
+
+        void resize(unsigned width, unsigned height);
+        unsigned getWidth();
+        unsigned getHeight();
+
+        /** Red, green and blue of the pixels of row j */
+        inline uint8_t* row(unsigned j) {
+            return &pixels[3 * static_cast<size_t>(j) * width];
+        }
+        inline uint8_t* data() {
+            return pixels.data();
+        }
+
+        /** Write as text or binary PPM. Returns false on error */
+        bool save(const char* filename, ImageFormat format);
+
+    private:
+        unsigned width = 0;
+        unsigned height = 0;
+        std::vector<uint8_t> pixels;
 };
 
 #endif // _INCLUDE_PATHTRACER_SURFACE_H_
@@ -0,0 +1,115 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_TILESCHEDULER_H_
+#define _INCLUDE_PATHTRACER_TILESCHEDULER_H_
+
+#include "Topology.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A persistent pool of worker threads that run a batch of tiles.
+ *
+ * The tiles of a batch are dealt round-robin into one deque per worker, in
+ * the order they are given. Workers take their own tiles from the front and,
+ * once their deque is empty, steal from the back of the others. The threads
+ * live as long as the scheduler, so consecutive batches do not pay for
+ * creating them.
+*/
+class TileScheduler {
+public:
+    /** Task run for each tile, with the index of the worker running it */
+    typedef std::function<void(unsigned tile, unsigned worker)> Task;
+
+    /** Start a pool of threads. 0 uses one thread per hardware thread */
+    TileScheduler(unsigned threads = 0);
+    virtual ~TileScheduler();
+
+    /** Replace the pool with a new number of threads */
+    void setThreadCount(unsigned threads);
+    unsigned getThreadCount();
+
+    /**
+     * Pin the workers to the CPUs of a topology, or nullptr to let them run
+     * anywhere. With a topology, 0 threads uses one per CPU of the topology.
+    */
+    void setTopology(Topology* topology);
+    /** Number of nodes of the topology, 1 without one */
+    unsigned getNodeCount();
+    unsigned getWorkerNode(unsigned worker);
+    /** Node of the worker that is dealt a tile of a batch */
+    unsigned getTileNode(unsigned tile);
+    /** Index of the worker running the calling thread, -1 outside workers */
+    static int currentWorker();
+
+    /** Run task for tiles 0..count-1 and return when all of them are done */
+    void run(unsigned count, const Task& task);
+    /** Run task once on a worker of every node, e.g. to first-touch memory */
+    void runOnEachNode(const std::function<void(unsigned node)>& task);
+
+    /** Zero the utilization statistics */
+    void resetStatistics();
+    /** Log tiles, steals and busy time of every worker since the last reset */
+    void report();
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::mutex lock;
+        std::deque<unsigned> tiles;
+        unsigned node = 0;
+        int cpu = -1;
+
+        // Statistics, only written by the worker
+        uint64_t tilesRun = 0;
+        uint64_t tilesStolen = 0;
+        double busySeconds = 0;
+    };
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    unsigned mRequestedThreads = 0;
+    Topology* mTopology = nullptr;
+    unsigned mNodeCount = 1;
+
+    std::mutex mLock;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+    const Task* mTask = nullptr;
+    uint64_t mBatch = 0;
+    unsigned mActive = 0;
+    bool mExit = false;
+    bool mStealingEnabled = true;
+    double mWallSeconds = 0;
+
+    void start(unsigned threads);
+    void stop();
+    /** Run the batches that follow seenBatch until the scheduler stops */
+    void workerLoop(unsigned index, uint64_t seenBatch);
+    bool nextTile(unsigned index, unsigned& tile);
+    bool steal(unsigned index, unsigned victim, unsigned& tile);
+};
+
+#endif // _INCLUDE_PATHTRACER_TILESCHEDULER_H_
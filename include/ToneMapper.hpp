@@ -0,0 +1,74 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_TONEMAPPER_H_
+#define _INCLUDE_PATHTRACER_TONEMAPPER_H_
+
+#include "Common.hpp"
+#include "Surface.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/** Curves that compress linear radiance into [0, 1] */
+enum ToneCurve {
+    /** Values above 1 are clipped */
+    TONE_CLAMP,
+    /** x / (1 + x) */
+    TONE_REINHARD,
+    /** Narkowicz's fit of the ACES filmic curve */
+    TONE_ACES
+};
+
+/**
+ * Turns the linear surface into an 8-bit display image: exposure, a tone
+ * curve and the sRGB transfer function. The curves are rational polynomials
+ * evaluated over whole rows of channels, and the transfer function and the
+ * quantization are a table lookup, so the surface is left untouched and
+ * mapping it is cheap enough for previews: the result notifier maps the
+ * rows of every partial result for its listeners.
+*/
+class ToneMapper {
+public:
+    ToneMapper();
+
+    /** Exposure in stops: every stop doubles the radiance */
+    void setExposure(Real stops);
+    void setCurve(ToneCurve curve);
+    /** Encode with the sRGB transfer function, or store linear values */
+    void setSRGBEnabled(bool enabled);
+
+    /** Map the whole surface, resizing the display image to it */
+    void map(Surface& surface, DisplayImage& display);
+    /**
+     * Map rows up..down-1, e.g. the blocks of a partial result. A display
+     * image of another size is resized to the surface first.
+    */
+    void map(Surface& surface, DisplayImage& display, unsigned up, unsigned down);
+
+private:
+    Real mExposure = 1;
+    ToneCurve mCurve = TONE_CLAMP;
+    bool mSRGBEnabled = true;
+    /** Display value of LUT_SIZE evenly spaced values in [0, 1] */
+    std::vector<uint8_t> mLut;
+
+    void buildLut();
+};
+
+#endif // _INCLUDE_PATHTRACER_TONEMAPPER_H_
@@ -0,0 +1,66 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _INCLUDE_PATHTRACER_TOPOLOGY_H_
+#define _INCLUDE_PATHTRACER_TOPOLOGY_H_
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * The NUMA nodes of the machine and the CPUs of each one.
+ *
+ * A topology can also be simulated by splitting the CPUs of the machine into
+ * a number of nodes, so that NUMA code paths run on single-node machines.
+ * Simulated nodes are backed by the real nodes in turn for memory placement.
+*/
+class Topology {
+public:
+    /** Read the nodes from sysfs. Machines without NUMA have one node */
+    static Topology detect();
+    /** Split the CPUs available to the process into a number of nodes */
+    static Topology simulate(unsigned nodes);
+
+    unsigned getNodeCount();
+    /** CPUs of a node, never empty */
+    const std::vector<unsigned>& getCpus(unsigned node);
+    /** sysfs id of the real NUMA node that holds the memory of a node */
+    unsigned getMemoryNode(unsigned node);
+    bool isSimulated();
+
+    /** Pin the calling thread to a CPU. Returns false on error */
+    static bool pinThread(unsigned cpu);
+
+private:
+    Topology();
+
+    std::vector<std::vector<unsigned>> mCpus;
+    /** sysfs id of the real node behind each node */
+    std::vector<unsigned> mMemoryNodes;
+    bool mSimulated = false;
+
+    /** CPUs in the affinity mask of the process */
+    static std::vector<unsigned> availableCpus();
+    /**
+     * sysfs ids of the online nodes, which need not be contiguous. Empty if
+     * there is no NUMA information
+    */
+    static std::vector<unsigned> realNodes();
+};
+
+#endif // _INCLUDE_PATHTRACER_TOPOLOGY_H_
@@ -23,7 +23,9 @@
 #include "Vector3D.hpp"
 #include "Objects.hpp"
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <vector>
 
 /** Calculate discriminant b^2 - 4ac */
@@ -41,14 +43,43 @@ Real intersectPlane(Vec3D l0, Vec3D l, Vec3D p0, Vec3D n);
 
 Vec3D sampleHemisphere(Vec3D& normal);
 
+/** Uniform random number in [0, 1) from the sequence of the calling thread */
+Real uniformRandom();
+/**
+ * Restart the random sequence of the calling thread. The same stream and
+ * seed always produce the same numbers, whatever thread draws them.
+*/
+void seedRandom(uint64_t stream, uint64_t seed);
+/** Current point of the random sequence of the calling thread */
+uint64_t getRandomState();
+/** Continue a random sequence from a point given by getRandomState() */
+void setRandomState(uint64_t state);
+
 IObject3D* intersectObjects(Ray& ray, std::vector<IObject3D*>& objects, Real& t);
 
+/**
+ * 64 bit hash of size bytes, to tell contents apart (not cryptographic).
+ * Hashing more data with the previous hash as seed chains them.
+*/
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed);
+
+/** Lock-free addition to an atomic floating point value */
+template <typename T>
+inline void atomicAdd(std::atomic<T>& target, T value) {
+    T current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) { }
+}
+
 template <typename T>
 inline T infinity() {
     return std::numeric_limits<T>::infinity();
 }
 
+Real luminance(Color& c);
+
 uint8_t toColorInt(Real component);
+/** Write the decimal digits of an 8-bit value to out, and return how many */
+unsigned formatColorInt(char* out, uint8_t value);
 uint32_t colorGetARGB(Color& v);
 Real colorClamp(Real x);
 
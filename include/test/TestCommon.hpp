@@ -19,8 +19,16 @@
 #ifndef _INCLUDE_PATHTRACER_TEST_COMMON_H_
 #define _INCLUDE_PATHTRACER_TEST_COMMON_H_
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <string>
+
+#include <unistd.h>
+
 #include "Common.hpp"
+#include "Surface.hpp"
 #include "Vector3D.hpp"
 
 void printVector(Vec3D& v) {
@@ -35,4 +43,83 @@ void printVector(std::string pfx, Vec3D& v) {
     printVector(v);
 }
 
+/*
+ * Helpers of the regression tests. Every test is a program of its own that
+ * runs its checks, reports the failed ones and exits with an error if any
+ * failed, so that "make test" stops at the first failing program.
+*/
+
+static unsigned sFailures = 0;
+
+/** Report a failed condition and go on with the test */
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            sFailures++; \
+        } \
+    } while (0)
+
+/** A directory of its own for the files of a test, removed at the end */
+class TestDirectory {
+public:
+    TestDirectory() {
+        char path[] = "/tmp/pathtracer-test-XXXXXX";
+        if (mkdtemp(path) != nullptr) {
+            mPath = path;
+        }
+    }
+
+    ~TestDirectory() {
+        if (!mPath.empty()) {
+            const std::string command = "rm -rf '" + mPath + "'";
+            if (system(command.c_str()) != 0) {
+                fprintf(stderr, "Could not remove %s\n", mPath.c_str());
+            }
+        }
+    }
+
+    /** Path of a file in the directory */
+    std::string path(const char* name) {
+        return mPath + "/" + name;
+    }
+
+    /** Write a file in the directory and return its path */
+    std::string write(const char* name, const std::string& contents) {
+        const std::string filename = path(name);
+        FILE* f = fopen(filename.c_str(), "wb");
+        if (f != nullptr) {
+            fwrite(contents.data(), 1, contents.size(), f);
+            fclose(f);
+        }
+        return filename;
+    }
+
+private:
+    std::string mPath;
+};
+
+/** Whether two surfaces hold the same bits */
+static inline bool sameSurface(Surface& a, Surface& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+        return false;
+    }
+    for (unsigned int j = 0; j < a.getHeight(); j++) {
+        if (memcmp(a.row(j), b.row(j), a.getWidth() * sizeof(Color))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Report the result of a test program and return its exit status */
+static inline int finish(const char* name) {
+    if (sFailures > 0) {
+        fprintf(stderr, "%s: %u checks failed\n", name, sFailures);
+    } else {
+        printf("%s: passed\n", name);
+    }
+    return (sFailures > 0)? 1 : 0;
+}
+
 #endif // _INCLUDE_PATHTRACER_TEST_COMMON_H_
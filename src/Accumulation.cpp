@@ -0,0 +1,173 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Accumulation.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "Accumulation";
+
+/*
+ * Checkpoint layout, in the byte order of the host:
+ *   "PTCK", version, width, height, filter (uint32), seed, configuration (uint64)
+ *   number of runs (uint32), then (length, count) runs of sample counts
+ *   width*height fixed point red, green, blue and weight (int64)
+*/
+static const char MAGIC[4] = {'P', 'T', 'C', 'K'};
+static const uint32_t VERSION = 3;
+
+/** Largest side accepted when loading, to reject corrupted headers */
+static const uint32_t MAX_SIZE = 1u << 16;
+
+void Accumulation::reset(unsigned w, unsigned h, uint64_t s, uint32_t f) {
+    width = w;
+    height = h;
+    seed = s;
+    filter = f;
+    configuration = 0;
+    values.assign(CHANNELS * w * h, 0);
+    counts.assign(w * h, 0);
+}
+
+uint32_t Accumulation::minCount() {
+    if (counts.empty()) {
+        return 0;
+    }
+    return *std::min_element(counts.begin(), counts.end());
+}
+
+Color Accumulation::mean(unsigned p) {
+    const int64_t* v = &values[CHANNELS * p];
+    const int64_t weight = __atomic_load_n(&v[3], __ATOMIC_RELAXED);
+    if (weight <= 0) {
+        return Color();
+    }
+    const double scale = 1.0 / weight;
+    return Color(__atomic_load_n(&v[0], __ATOMIC_RELAXED) * scale,
+                 __atomic_load_n(&v[1], __ATOMIC_RELAXED) * scale,
+                 __atomic_load_n(&v[2], __ATOMIC_RELAXED) * scale);
+}
+
+bool Accumulation::save(const char* filename) {
+    const std::string temporary = std::string(filename) + ".tmp";
+    FILE* f = fopen(temporary.c_str(), "wb");
+    if (f == nullptr) {
+        Debug::Log::e(TAG, "Could not write checkpoint %s", temporary.c_str());
+        return false;
+    }
+
+    // Sample counts are mostly equal, so they are stored as runs
+    std::vector<uint32_t> runs;
+    for (unsigned int p = 0; p < counts.size(); ) {
+        unsigned int end = p + 1;
+        while (end < counts.size() && counts[end] == counts[p]) {
+            end++;
+        }
+        runs.push_back(end - p);
+        runs.push_back(counts[p]);
+        p = end;
+    }
+
+    const uint32_t header[4] = {VERSION, width, height, filter};
+    const uint32_t runCount = runs.size() / 2;
+    bool ok = fwrite(MAGIC, sizeof(MAGIC), 1, f) == 1 &&
+        fwrite(header, sizeof(header), 1, f) == 1 &&
+        fwrite(&seed, sizeof(seed), 1, f) == 1 &&
+        fwrite(&configuration, sizeof(configuration), 1, f) == 1 &&
+        fwrite(&runCount, sizeof(runCount), 1, f) == 1 &&
+        fwrite(runs.data(), sizeof(uint32_t), runs.size(), f) == runs.size() &&
+        fwrite(values.data(), sizeof(int64_t), values.size(), f) == values.size();
+    ok = (fflush(f) == 0) && ok;
+    ok = (fsync(fileno(f)) == 0) && ok;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(temporary.c_str(), filename) != 0) {
+        Debug::Log::e(TAG, "Could not write checkpoint %s", filename);
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Accumulation::load(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+
+    char magic[4];
+    uint32_t header[4];
+    uint64_t fileSeed;
+    uint64_t fileConfiguration;
+    uint32_t runCount;
+    uint64_t pixels = 0;
+    struct stat info;
+    if (fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, MAGIC, sizeof(MAGIC)) &&
+        fread(header, sizeof(header), 1, f) == 1) {
+        // 65536 x 65536 does not fit in 32 bits. Runs and values take 8 bytes
+        // each, so a file too short for them is rejected before allocating
+        pixels = static_cast<uint64_t>(header[1]) * header[2];
+    }
+    if (pixels == 0 || header[0] != VERSION || header[1] > MAX_SIZE || header[2] > MAX_SIZE ||
+        pixels > UINT32_MAX ||
+        fread(&fileSeed, sizeof(fileSeed), 1, f) != 1 ||
+        fread(&fileConfiguration, sizeof(fileConfiguration), 1, f) != 1 ||
+        fread(&runCount, sizeof(runCount), 1, f) != 1 || runCount > pixels ||
+        fstat(fileno(f), &info) != 0 ||
+        static_cast<uint64_t>(info.st_size) < (runCount + CHANNELS * pixels) * sizeof(int64_t)) {
+        Debug::Log::e(TAG, "%s is not a valid checkpoint", filename);
+        fclose(f);
+        return false;
+    }
+
+    std::vector<uint32_t> runs(2 * static_cast<size_t>(runCount));
+    std::vector<uint32_t> fileCounts;
+    std::vector<int64_t> fileValues(CHANNELS * pixels);
+    bool ok = fread(runs.data(), sizeof(uint32_t), runs.size(), f) == runs.size();
+    for (unsigned int r = 0; ok && r < runCount; r++) {
+        ok = runs[2*r] <= pixels - fileCounts.size();
+        if (ok) {
+            fileCounts.insert(fileCounts.end(), runs[2*r], runs[2*r + 1]);
+        }
+    }
+    ok = ok && fileCounts.size() == pixels &&
+        fread(fileValues.data(), sizeof(int64_t), fileValues.size(), f) == fileValues.size();
+    fclose(f);
+
+    if (!ok) {
+        Debug::Log::e(TAG, "Checkpoint %s is truncated", filename);
+        return false;
+    }
+
+    width = header[1];
+    height = header[2];
+    filter = header[3];
+    seed = fileSeed;
+    configuration = fileConfiguration;
+    counts.swap(fileCounts);
+    values.swap(fileValues);
+    return true;
+}
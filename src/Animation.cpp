@@ -0,0 +1,159 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Animation.hpp"
+
+#include "Common.hpp"
+#include "Camera.hpp"
+#include "Objects.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "debug.hpp"
+
+static const char* TAG = "Animation";
+
+/** Linear interpolation between a and b */
+static Vec3D lerp(Vec3D a, Vec3D b, Real t) {
+    return (1 - t)*a + t*b;
+}
+
+Animation::Animation() { }
+
+Animation::~Animation() { }
+
+bool Animation::load(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == nullptr) {
+        Debug::Log::e(TAG, "Could not open %s", filename);
+        return false;
+    }
+
+    char line[256];
+    unsigned lineNumber = 0;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        lineNumber++;
+        char keyword[16];
+        if (sscanf(line, "%15s", keyword) != 1 || keyword[0] == '#') {
+            continue;
+        }
+
+        float frame, x, y, z, fx, fy, fz;
+        unsigned object;
+        if (!strcmp(keyword, "camera") &&
+            sscanf(line, "%*s %f %f %f %f %f %f %f", &frame, &x, &y, &z, &fx, &fy, &fz) == 7) {
+            addCameraKey(frame, Vec3D(x, y, z), Vec3D(fx, fy, fz));
+        } else if (!strcmp(keyword, "translate") &&
+            sscanf(line, "%*s %u %f %f %f %f", &object, &frame, &x, &y, &z) == 5) {
+            addTranslationKey(object, frame, Vec3D(x, y, z));
+        } else {
+            Debug::Log::e(TAG, "%s:%d: invalid keyframe", filename, lineNumber);
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+    Debug::Log::i(TAG, "Loaded %zu camera keys and %zu object tracks, %d frames",
+        mCameraKeys.size(), mTranslationKeys.size(), getFrameCount());
+    return true;
+}
+
+void Animation::addCameraKey(Real frame, Vec3D position, Vec3D facing) {
+    CameraKey key = {frame, position, facing};
+    auto it = std::upper_bound(mCameraKeys.begin(), mCameraKeys.end(), key,
+        [](const CameraKey& lhs, const CameraKey& rhs) { return lhs.frame < rhs.frame; });
+    mCameraKeys.insert(it, key);
+}
+
+void Animation::addTranslationKey(unsigned object, Real frame, Vec3D offset) {
+    std::vector<TranslationKey>& keys = mTranslationKeys[object];
+    TranslationKey key = {frame, offset};
+    auto it = std::upper_bound(keys.begin(), keys.end(), key,
+        [](const TranslationKey& lhs, const TranslationKey& rhs) { return lhs.frame < rhs.frame; });
+    keys.insert(it, key);
+}
+
+unsigned Animation::getFrameCount() {
+    Real last = 0;
+    if (!mCameraKeys.empty()) {
+        last = mCameraKeys.back().frame;
+    }
+    for (auto& track : mTranslationKeys) {
+        last = std::max(last, track.second.back().frame);
+    }
+    return static_cast<unsigned>(floor(last)) + 1;
+}
+
+bool Animation::hasCameraTrack() {
+    return !mCameraKeys.empty();
+}
+
+Vec3D Animation::translationAt(std::vector<TranslationKey>& keys, Real frame) {
+    if (frame <= keys.front().frame) {
+        return keys.front().offset;
+    }
+    if (frame >= keys.back().frame) {
+        return keys.back().offset;
+    }
+
+    unsigned k = 1;
+    while (keys[k].frame < frame) {
+        k++;
+    }
+    const Real t = (frame - keys[k-1].frame) / (keys[k].frame - keys[k-1].frame);
+    return lerp(keys[k-1].offset, keys[k].offset, t);
+}
+
+void Animation::apply(unsigned frame, struct Scene& scene, Camera& camera) {
+    if (!mCameraKeys.empty()) {
+        const CameraKey* a = &mCameraKeys.front();
+        const CameraKey* b = a;
+        for (const CameraKey& key : mCameraKeys) {
+            if (key.frame <= frame) {
+                a = b = &key;
+            } else {
+                b = &key;
+                break;
+            }
+        }
+        const Real t = (b->frame > a->frame)? (frame - a->frame) / (b->frame - a->frame) : 0;
+        camera.setView(lerp(a->position, b->position, t), lerp(a->facing, b->facing, t));
+    }
+
+    bool moved = false;
+    for (auto& track : mTranslationKeys) {
+        if (track.first >= scene.objects.size()) {
+            continue;
+        }
+        Vec3D offset = translationAt(track.second, frame);
+        Vec3D delta = offset - mApplied[track.first];
+        if (delta.x != 0 || delta.y != 0 || delta.z != 0) {
+            scene.objects[track.first]->translate(delta);
+            mApplied[track.first] = offset;
+            moved = true;
+        }
+    }
+
+    if (moved) {
+        scene.revision++;
+    }
+}
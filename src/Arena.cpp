@@ -0,0 +1,77 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#include "Arena.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+/** Alignment of the blocks, enough for any object of the scene */
+static const size_t BLOCK_ALIGNMENT = 64;
+
+Arena::Arena() { }
+
+Arena::~Arena() {
+    release();
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    uintptr_t address = (reinterpret_cast<uintptr_t>(mNext) + alignment - 1) & ~(alignment - 1);
+    if (mNext == nullptr || address + size > reinterpret_cast<uintptr_t>(mEnd)) {
+        // Requests larger than a block get one of their own, so that the
+        // current block keeps its free space
+        const size_t needed = size + alignment;
+        const size_t blockSize = (needed > mNextBlockSize / 4)?
+            (needed + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT : mNextBlockSize;
+        char* block = static_cast<char*>(aligned_alloc(BLOCK_ALIGNMENT, blockSize));
+        if (block == nullptr) {
+            throw std::bad_alloc();
+        }
+        mBlocks.push_back(block);
+        mReserved += blockSize;
+
+        address = (reinterpret_cast<uintptr_t>(block) + alignment - 1) & ~(alignment - 1);
+        if (blockSize == mNextBlockSize) {
+            mNext = block;
+            mEnd = block + blockSize;
+            mNextBlockSize = std::min(2 * mNextBlockSize, MAX_BLOCK_SIZE);
+        } else {
+            mUsed += size;
+            return reinterpret_cast<void*>(address);
+        }
+    }
+    mNext = reinterpret_cast<char*>(address + size);
+    mUsed += size;
+    return reinterpret_cast<void*>(address);
+}
+
+void Arena::release() {
+    for (auto it = mFinalizers.rbegin(); it != mFinalizers.rend(); ++it) {
+        it->destroy(it->object);
+    }
+    mFinalizers.clear();
+    for (void* block : mBlocks) {
+        free(block);
+    }
+    mBlocks.clear();
+    mNext = mEnd = nullptr;
+    mNextBlockSize = FIRST_BLOCK_SIZE;
+    mUsed = mReserved = 0;
+}
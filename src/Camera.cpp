@@ -21,26 +21,27 @@
 
 #include "debug.hpp"
 #include "Light.hpp"
+#include "Utils.hpp"
 #include "Vector3D.hpp"
 
 #include <cmath>
 
 static const char* TAG = "Camera";
 
-static const Real CAMERA_GAMMA = 1/2.2;
-
 Camera::Camera(unsigned width, unsigned height, float fov) :
         width(width),
         height(height),
         fov(degToRad(fov)),
         aspectRatio(1.0 * width / height),
         surface(width, height),
-        gammaCorrectionEnabled(false)
+        display(width, height)
 {
+    toneMapper.setSRGBEnabled(false);
     position = Vec3D();
     u = Vec3D(1, 0, 0);     // Right
     v = Vec3D(0, 1, 0);     // Up
     w = Vec3D(0, 0, -1);    // Facing
+    updateSteps();
 }
 
 Camera::Camera(unsigned width, unsigned height, float fov, Vec3D pos, Vec3D facing) :
@@ -49,13 +50,15 @@ Camera::Camera(unsigned width, unsigned height, float fov, Vec3D pos, Vec3D faci
         fov(degToRad(fov)),
         aspectRatio(1.0 * width / height),
         surface(width, height),
+        display(width, height),
         position(pos),
-        w(facing.normalize()),
-        gammaCorrectionEnabled(false)
+        w(facing.normalize())
 {
+    toneMapper.setSRGBEnabled(false);
     v = Vec3D(0, 1, 0); // Up (to the sky)
     u = v.cross(w);     // Right
     v = w.cross(u);     // Recalculate Up to be orthogonal to the facing direction
+    updateSteps();
 }
 
 Camera::~Camera() {
@@ -82,35 +85,141 @@ float Camera::getAspectRatio() {
     return aspectRatio;
 }
 
+Vec3D Camera::getPosition() {
+    return position;
+}
+
+Vec3D Camera::getFacing() {
+    return w;
+}
+
+void Camera::setView(Vec3D pos, Vec3D facing) {
+    position = pos;
+    w = facing.normalize();
+    v = Vec3D(0, 1, 0);
+    u = v.cross(w);
+    v = w.cross(u);
+    updateSteps();
+}
+
 void Camera::setResolution(unsigned w, unsigned h) {
+    width = w;
+    height = h;
+    aspectRatio = 1.0 * w / h;
     surface = Surface(w, h);
+    display.resize(w, h);
+    if (aovs != nullptr) {
+        aovs = std::make_unique<AOVBuffers>(w, h);
+    }
+    updateSteps();
 }
 
 void Camera::setGammaCorrectionEnabled(bool enabled) {
-    gammaCorrectionEnabled = enabled;
+    toneMapper.setSRGBEnabled(enabled);
+}
+
+void Camera::setAOVsEnabled(bool enabled) {
+    if (!enabled) {
+        aovs.reset();
+    } else if (aovs == nullptr) {
+        aovs = std::make_unique<AOVBuffers>(surface.getWidth(), surface.getHeight());
+    }
 }
 
 void Camera::onRenderFinished() {
     Debug::Log::i(TAG, "onRenderFinished()");
-    if (gammaCorrectionEnabled) {
-        Debug::Log::i(TAG, "Apply gamma correction g=%.2f", CAMERA_GAMMA);
-        surface.applyGammaCorrection(CAMERA_GAMMA);
-    }
+    updateDisplay();
+}
+
+void Camera::updateDisplay() {
+    toneMapper.map(surface, display);
 }
 
 Surface& Camera::getSurface() {
     return surface;
 }
 
-Vec3D Camera::getVectorToPixel(unsigned i, unsigned j) {
-    Real right = (1 - 2 * (i + 0.5) / width) * tan(fov/2);
-    Real up = (1 - 2*(j + 0.5) / height) * tan(fov/2)/aspectRatio;
-    Vec3D vector = w + right*u + up*v;
-    return (vector).normalize();
+DisplayImage& Camera::getDisplay() {
+    return display;
+}
+
+ToneMapper& Camera::getToneMapper() {
+    return toneMapper;
+}
+
+AOVBuffers* Camera::getAOVs() {
+    return aovs.get();
+}
+
+void Camera::updateSteps() {
+    const double halfWidth = tan(fov/2.0);
+    const double halfHeight = halfWidth / aspectRatio;
+    corner = w + static_cast<Real>(halfWidth)*u + static_cast<Real>(halfHeight)*v;
+    stepX = static_cast<Real>(-2 * halfWidth / width) * u;
+    stepY = static_cast<Real>(-2 * halfHeight / height) * v;
+}
+
+Vec3D Camera::getVectorToPoint(Real x, Real y) {
+    Vec3D vector = corner + x*stepX + y*stepY;
+    return vector.normalize();
 }
 
 Ray Camera::getRayToPixel(unsigned i, unsigned j) {
-    Vec3D dir = getVectorToPixel(i, j);
-    Ray ray(position, dir);
-    return ray;
+    return getRayToPoint(i + 0.5f, j + 0.5f);
+}
+
+Ray Camera::getRayToPoint(Real x, Real y) {
+    return Ray::withUnitDirection(position, getVectorToPoint(x, y));
+}
+
+void RayBuffer::resize(size_t count) {
+    x.resize(count);
+    y.resize(count);
+    dx.resize(count);
+    dy.resize(count);
+    dz.resize(count);
+    random.resize(count);
+}
+
+void Camera::generateRays(unsigned left, unsigned up, unsigned right, unsigned down,
+                          unsigned sampleIndex, RayBuffer& rays)
+{
+    const unsigned tileWidth = right - left;
+    const unsigned count = tileWidth * (down - up);
+    rays.resize(count);
+    rays.origin = position;
+
+    // The random sequences are drawn one after another, so the points are
+    // placed first and the directions then follow in vector lanes
+    for (unsigned int k = 0; k < count; k++) {
+        const unsigned i = left + k % tileWidth;
+        const unsigned j = up + k / tileWidth;
+        const unsigned stratum = stratumOf(j*width + i, sampleIndex);
+        seedRandom((static_cast<uint64_t>(j*width + i) << 32) | sampleIndex, rays.seed);
+        if (rays.jittered) {
+            rays.x[k] = i + strataOffset(stratum, uniformRandom());
+            rays.y[k] = j + strataOffset(stratum / STRATA_SIDE, uniformRandom());
+        } else {
+            rays.x[k] = i + strataOffset(stratum, 0.5f);
+            rays.y[k] = j + strataOffset(stratum / STRATA_SIDE, 0.5f);
+        }
+        rays.random[k] = getRandomState();
+    }
+
+    const Real* x = rays.x.data();
+    const Real* y = rays.y.data();
+    Real* dx = rays.dx.data();
+    Real* dy = rays.dy.data();
+    Real* dz = rays.dz.data();
+    const Vec3D c = corner, sx = stepX, sy = stepY;
+    #pragma omp simd
+    for (unsigned int k = 0; k < count; k++) {
+        const Real vx = c.x + x[k]*sx.x + y[k]*sy.x;
+        const Real vy = c.y + x[k]*sx.y + y[k]*sy.y;
+        const Real vz = c.z + x[k]*sx.z + y[k]*sy.z;
+        const Real inverse = 1 / std::sqrt(vx*vx + vy*vy + vz*vz);
+        dx[k] = vx * inverse;
+        dy[k] = vy * inverse;
+        dz[k] = vz * inverse;
+    }
 }
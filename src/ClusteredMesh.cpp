@@ -0,0 +1,444 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#include "ClusteredMesh.hpp"
+
+#include "Light.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "ClusteredMesh";
+
+static const char MAGIC[4] = {'P', 'T', 'C', 'L'};
+static const uint32_t VERSION = 1;
+/** Alignment of the clusters in the file */
+static const uint64_t ALIGNMENT = 64;
+static const unsigned STACK_SIZE = 64;
+
+struct ClusterFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t clusterCount;
+    uint32_t topNodeCount;
+    uint64_t triangleCount;
+    uint64_t topNodes;
+    uint64_t clusters;
+};
+
+/** Normal at the last hit or sampled point of the calling thread */
+static thread_local struct {
+    const ClusteredMesh* mesh = nullptr;
+    Vec3D normal;
+} lastHit;
+
+static inline uint64_t align(uint64_t offset) {
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+ClusteredMesh::ClusteredMesh(struct Material material, GeometryCache& cache, unsigned file,
+                             std::vector<TriangleMesh::Node>&& top, std::vector<ClusterRecord>& clusters)
+:   IObject3D(material),
+    mCache(cache),
+    mFile(file),
+    mTop(std::move(top))
+{
+    float area = 0;
+    for (const ClusterRecord& cluster : clusters) {
+        area += cluster.area;
+        mAreaCdf.push_back(area);
+        mTriangleCount += cluster.triangleCount;
+    }
+}
+
+ClusteredMesh::~ClusteredMesh() {
+    if (lastHit.mesh == this) {
+        lastHit.mesh = nullptr;
+    }
+    mCache.evictFile(mFile);
+}
+
+Real ClusteredMesh::intersect(Ray& ray) {
+    Vec3D origin_v = ray.getOrigin();
+    Vec3D direction_v = ray.getDirection();
+    const float origin[3] = {origin_v.x, origin_v.y, origin_v.z};
+    const float direction[3] = {direction_v.x, direction_v.y, direction_v.z};
+    float inverse[3];
+    for (unsigned int k = 0; k < 3; k++) {
+        inverse[k] = (direction[k] != 0)? 1 / direction[k] : std::copysign(1e30f, direction[k]);
+    }
+    // Clusters are in the space the mesh was written in
+    Ray local = Ray::withUnitDirection(
+        Vec3D(origin[0] - mOffset[0], origin[1] - mOffset[1], origin[2] - mOffset[2]), direction_v);
+
+    GeometryCache::ReadSection section(mCache);
+    Real tMax = infinity<Real>();
+    GeometryCluster* hitCluster = nullptr;
+    int64_t hitTriangle = -1;
+    uint32_t stack[STACK_SIZE];
+    unsigned size = 0;
+    uint32_t current = 0;
+    if (mTop.empty() ||
+        TriangleMesh::enterNode(mTop[0].lo, mTop[0].hi, origin, inverse, tMax) == INFINITY) {
+        return -infinity<Real>();
+    }
+
+    while (true) {
+        const TriangleMesh::Node& node = mTop[current];
+        if (node.count == 0) {
+            uint32_t near = current + 1, far = node.offset;
+            float tNear = TriangleMesh::enterNode(mTop[near].lo, mTop[near].hi, origin, inverse, tMax);
+            float tFar = TriangleMesh::enterNode(mTop[far].lo, mTop[far].hi, origin, inverse, tMax);
+            if (tFar < tNear) {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            if (tNear != INFINITY) {
+                if (tFar != INFINITY && size < STACK_SIZE) {
+                    stack[size++] = far;
+                }
+                current = near;
+                continue;
+            }
+        } else {
+            // A cluster that is not resident is skipped on deferring threads
+            GeometryCluster* cluster = mCache.acquire(mFile, node.offset);
+            if (cluster != nullptr) {
+                const int64_t triangle = cluster->mesh->intersectTriangles(local, tMax);
+                if (triangle >= 0) {
+                    hitCluster = cluster;
+                    hitTriangle = triangle;
+                }
+            }
+        }
+
+        if (size == 0) {
+            break;
+        }
+        current = stack[--size];
+    }
+
+    if (hitTriangle < 0) {
+        return -infinity<Real>();
+    }
+    // The cluster may be freed once the section ends, so the normal is kept now
+    lastHit.mesh = this;
+    lastHit.normal = hitCluster->mesh->triangleNormal(hitTriangle).normalize();
+    return tMax;
+}
+
+Vec3D ClusteredMesh::getSurfaceNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v) {
+    if (lastHit.mesh != this) {
+        struct Enclosure e = getEnclosure();
+        const Real back = 1e-4f * std::max({e.x_max - e.x_min, e.y_max - e.y_min, e.z_max - e.z_min, 1.0f});
+        Ray ray(hitPoint_v - back*hitDirection_v, hitDirection_v);
+        if (intersect(ray) < 0) {
+            return hitDirection_v.negative();
+        }
+    }
+    return lastHit.normal;
+}
+
+Vec3D ClusteredMesh::getHitNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v) {
+    Vec3D normal_v = getSurfaceNormal(hitPoint_v, hitDirection_v);
+    if (hitDirection_v.dot(normal_v) < 0) {
+        return normal_v;
+    } else {
+        return normal_v.negative();
+    }
+}
+
+struct Enclosure ClusteredMesh::getEnclosure() {
+    if (mTop.empty()) {
+        return Enclosure {0, 0, 0, 0, 0, 0};
+    }
+    const TriangleMesh::Node& root = mTop[0];
+    return Enclosure {root.lo[0], root.hi[0], root.lo[1], root.hi[1], root.lo[2], root.hi[2]};
+}
+
+Real ClusteredMesh::getArea() {
+    return mAreaCdf.empty()? 0 : mAreaCdf.back();
+}
+
+Vec3D ClusteredMesh::samplePoint(Real u1, Real u2) {
+    if (mAreaCdf.empty()) {
+        return Vec3D();
+    }
+
+    // Pick a cluster by area with u1 and reuse what is left of it
+    const float target = u1 * mAreaCdf.back();
+    const uint32_t c = std::min<size_t>(std::upper_bound(mAreaCdf.begin(), mAreaCdf.end(), target) - mAreaCdf.begin(),
+        mAreaCdf.size() - 1);
+    const float first = (c > 0)? mAreaCdf[c - 1] : 0;
+    const float area = mAreaCdf[c] - first;
+    u1 = (area > 0)? std::min((target - first) / area, 1.0f) : 0;
+
+    GeometryCache::ReadSection section(mCache);
+    GeometryCluster* cluster = mCache.acquire(mFile, c);
+    if (cluster == nullptr) {
+        // Deferred: the sample is discarded with the work of the thread
+        return Vec3D();
+    }
+    Vec3D point = cluster->mesh->samplePoint(u1, u2);
+    Vec3D direction;
+    lastHit.mesh = this;
+    lastHit.normal = cluster->mesh->getSurfaceNormal(point, direction);
+    return point + Vec3D(mOffset[0], mOffset[1], mOffset[2]);
+}
+
+void ClusteredMesh::translate(Vec3D& offset_v) {
+    const float offset[3] = {offset_v.x, offset_v.y, offset_v.z};
+    for (unsigned int k = 0; k < 3; k++) {
+        mOffset[k] += offset[k];
+    }
+    for (TriangleMesh::Node& node : mTop) {
+        for (unsigned int k = 0; k < 3; k++) {
+            node.lo[k] += offset[k];
+            node.hi[k] += offset[k];
+        }
+    }
+}
+
+size_t ClusteredMesh::getStorageBytes() {
+    return mTop.capacity() * sizeof(TriangleMesh::Node) + mAreaCdf.capacity() * sizeof(float);
+}
+
+/** Read exactly size bytes at offset */
+static bool readAt(int fd, void* data, uint64_t size, uint64_t offset) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t n = pread(fd, p, size, offset);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+ClusteredMesh* loadClusteredMesh(const char* filename, struct Material material,
+                                 GeometryCache& cache, Arena& arena)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        Debug::Log::e(TAG, "Could not open %s", filename);
+        return nullptr;
+    }
+
+    struct stat info;
+    ClusterFileHeader header;
+    bool valid = fstat(fd, &info) == 0 && readAt(fd, &header, sizeof(header), 0) &&
+        !memcmp(header.magic, MAGIC, sizeof(MAGIC)) && header.version == VERSION &&
+        header.topNodeCount > 0 && header.clusterCount > 0;
+    const uint64_t fileSize = valid? info.st_size : 0;
+    auto inside = [fileSize](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset <= fileSize && count <= (fileSize - offset) / size;
+    };
+    valid = valid && inside(header.topNodes, header.topNodeCount, sizeof(TriangleMesh::Node)) &&
+        inside(header.clusters, header.clusterCount, sizeof(ClusteredMesh::ClusterRecord));
+
+    std::vector<TriangleMesh::Node> top;
+    std::vector<ClusteredMesh::ClusterRecord> clusters;
+    if (valid) {
+        top.resize(header.topNodeCount);
+        clusters.resize(header.clusterCount);
+        valid = readAt(fd, top.data(), top.size() * sizeof(TriangleMesh::Node), header.topNodes) &&
+            readAt(fd, clusters.data(), clusters.size() * sizeof(ClusteredMesh::ClusterRecord), header.clusters);
+    }
+    for (uint32_t n = 0; valid && n < top.size(); n++) {
+        valid = (top[n].count == 0)? top[n].offset > n && top[n].offset < top.size() && n + 1 < top.size() :
+            top[n].offset < clusters.size();
+    }
+    std::vector<ClusterExtent> extents;
+    for (const ClusteredMesh::ClusterRecord& cluster : clusters) {
+        valid = valid && cluster.size >= sizeof(ClusterHeader) && inside(cluster.offset, cluster.size, 1);
+        extents.push_back(ClusterExtent {cluster.offset, cluster.size});
+    }
+    if (!valid) {
+        Debug::Log::e(TAG, "%s is not a valid cluster file", filename);
+        close(fd);
+        return nullptr;
+    }
+
+    const unsigned file = cache.addFile(fd, std::move(extents));
+    ClusteredMesh* mesh = arena.create<ClusteredMesh>(material, cache, file, std::move(top), clusters);
+    Debug::Log::i(TAG, "Opened %s: %llu triangles in %d clusters, %.1f MB on disk",
+        filename, static_cast<unsigned long long>(mesh->getTriangleCount()), mesh->getClusterCount(),
+        fileSize / (1024.0 * 1024.0));
+    return mesh;
+}
+
+namespace {
+
+/** Writes the clusters of a mesh while the top of its hierarchy is copied */
+struct ClusterWriter {
+    TriangleMesh& mesh;
+    const TriangleMesh::Node* nodes;
+    unsigned clusterTriangles;
+    FILE* f;
+    uint64_t offset;
+    /** Triangles and nodes of the subtree of every node */
+    std::vector<uint32_t> triangles;
+    std::vector<uint32_t> subtreeNodes;
+    /** Local index of every vertex in the cluster being written, and its cluster */
+    std::vector<uint32_t> local;
+    std::vector<uint32_t> localCluster;
+
+    std::vector<TriangleMesh::Node> top;
+    std::vector<ClusteredMesh::ClusterRecord> clusters;
+    bool ok = true;
+
+    /** Copy the node and its subtree down to the clusters, returns its index in top */
+    uint32_t copyNode(uint32_t n) {
+        const uint32_t index = top.size();
+        top.push_back(nodes[n]);
+        if (nodes[n].count > 0 || triangles[n] <= clusterTriangles) {
+            top[index].offset = clusters.size();
+            top[index].count = 1;
+            writeCluster(n);
+        } else {
+            copyNode(n + 1);
+            top[index].offset = copyNode(nodes[n].offset);
+        }
+        return index;
+    }
+
+    /** Nodes are depth first, so a subtree has contiguous nodes and triangles */
+    void writeCluster(uint32_t root) {
+        uint32_t leftmost = root;
+        while (nodes[leftmost].count == 0) {
+            leftmost++;
+        }
+        const uint32_t firstTriangle = nodes[leftmost].offset;
+        const uint32_t triangleCount = triangles[root];
+        const uint32_t nodeCount = subtreeNodes[root];
+        const uint32_t cluster = clusters.size();
+
+        std::vector<TriangleMesh::Node> clusterNodes(nodes + root, nodes + root + nodeCount);
+        for (TriangleMesh::Node& node : clusterNodes) {
+            node.offset -= (node.count == 0)? root : firstTriangle;
+        }
+        std::vector<float> positions;
+        std::vector<uint32_t> indices(3 * triangleCount);
+        const uint32_t* meshIndices = mesh.getIndices() + 3 * static_cast<size_t>(firstTriangle);
+        const float* meshPositions = mesh.getPositions();
+        float area = 0;
+        for (uint32_t i = 0; i < 3 * triangleCount; i++) {
+            const uint32_t v = meshIndices[i];
+            if (localCluster[v] != cluster) {
+                localCluster[v] = cluster;
+                local[v] = positions.size() / 3;
+                positions.insert(positions.end(), meshPositions + 3 * static_cast<size_t>(v),
+                    meshPositions + 3 * static_cast<size_t>(v) + 3);
+            }
+            indices[i] = local[v];
+        }
+        for (uint32_t t = firstTriangle; t < firstTriangle + triangleCount; t++) {
+            area += 0.5f * mesh.triangleNormal(t).dist();
+        }
+
+        ClusterHeader header = {nodeCount, static_cast<uint32_t>(positions.size() / 3), triangleCount, 0};
+        const uint64_t size = sizeof(header) + clusterNodes.size() * sizeof(TriangleMesh::Node) +
+            positions.size() * sizeof(float) + indices.size() * sizeof(uint32_t);
+        ok = ok && fseek(f, offset, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(clusterNodes.data(), sizeof(TriangleMesh::Node), clusterNodes.size(), f) == clusterNodes.size() &&
+            fwrite(positions.data(), sizeof(float), positions.size(), f) == positions.size() &&
+            fwrite(indices.data(), sizeof(uint32_t), indices.size(), f) == indices.size();
+        clusters.push_back(ClusteredMesh::ClusterRecord {offset, size, area, triangleCount});
+        offset = align(offset + size);
+    }
+};
+
+}
+
+bool writeClusteredMesh(const char* filename, TriangleMesh& mesh, unsigned clusterTriangles) {
+    const uint32_t nodeCount = mesh.getNodeCount();
+    if (nodeCount == 0) {
+        Debug::Log::e(TAG, "Not writing %s: the mesh is empty", filename);
+        return false;
+    }
+    const std::string temporary = std::string(filename) + ".tmp";
+    FILE* f = fopen(temporary.c_str(), "wb");
+    if (f == nullptr) {
+        Debug::Log::e(TAG, "Could not write %s", temporary.c_str());
+        return false;
+    }
+
+    ClusterWriter writer {mesh, mesh.getNodes(), clusterTriangles, f};
+    const TriangleMesh::Node* nodes = writer.nodes;
+    // Children follow their parents, so subtrees are summed backwards
+    writer.triangles.resize(nodeCount);
+    writer.subtreeNodes.resize(nodeCount);
+    for (uint32_t n = nodeCount; n-- > 0; ) {
+        if (nodes[n].count > 0) {
+            writer.triangles[n] = nodes[n].count;
+            writer.subtreeNodes[n] = 1;
+        } else {
+            writer.triangles[n] = writer.triangles[n + 1] + writer.triangles[nodes[n].offset];
+            writer.subtreeNodes[n] = 1 + writer.subtreeNodes[n + 1] + writer.subtreeNodes[nodes[n].offset];
+        }
+    }
+    writer.local.resize(mesh.getVertexCount());
+    writer.localCluster.assign(mesh.getVertexCount(), UINT32_MAX);
+
+    // The tables follow the clusters, whose number is only known at the end
+    writer.offset = align(sizeof(ClusterFileHeader));
+    writer.copyNode(0);
+    const uint64_t topOffset = writer.offset;
+    const uint64_t tableOffset = align(topOffset + writer.top.size() * sizeof(TriangleMesh::Node));
+
+    ClusterFileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.clusterCount = writer.clusters.size();
+    header.topNodeCount = writer.top.size();
+    header.triangleCount = mesh.getTriangleCount();
+    header.topNodes = topOffset;
+    header.clusters = tableOffset;
+    bool ok = writer.ok && fseek(f, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fseek(f, topOffset, SEEK_SET) == 0 &&
+        fwrite(writer.top.data(), sizeof(TriangleMesh::Node), writer.top.size(), f) == writer.top.size() &&
+        fseek(f, tableOffset, SEEK_SET) == 0 &&
+        fwrite(writer.clusters.data(), sizeof(ClusteredMesh::ClusterRecord), writer.clusters.size(), f) ==
+            writer.clusters.size();
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(temporary.c_str(), filename) != 0) {
+        Debug::Log::e(TAG, "Could not write %s", filename);
+        unlink(temporary.c_str());
+        return false;
+    }
+    Debug::Log::i(TAG, "Wrote %s: %d triangles in %zu clusters of up to %d, %zu top nodes",
+        filename, mesh.getTriangleCount(), writer.clusters.size(), clusterTriangles, writer.top.size());
+    return true;
+}
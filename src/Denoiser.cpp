@@ -0,0 +1,196 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Denoiser.hpp"
+
+#include "Common.hpp"
+#include "Surface.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "debug.hpp"
+
+static const char* TAG = "Denoiser";
+
+/** B3-spline kernel of the à-trous transform */
+static const float KERNEL[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+
+/** Albedo below this value is not divided out of the colour */
+static const float MIN_ALBEDO = 0.01f;
+/** Depth below this value is a miss */
+static const float MIN_DEPTH = 1e-6f;
+
+void Denoiser::Planes::resize(unsigned size) {
+    r.resize(size);
+    g.resize(size);
+    b.resize(size);
+}
+
+Denoiser::Denoiser(unsigned iterations) : mIterations(iterations) { }
+
+Denoiser::~Denoiser() { }
+
+void Denoiser::setIterations(unsigned iterations) {
+    mIterations = iterations;
+}
+
+void Denoiser::setSigmas(Real color, Real normal, Real depth) {
+    mSigmaColor = color;
+    mSigmaNormal = normal;
+    mSigmaDepth = depth;
+}
+
+void Denoiser::denoise(Surface& surface, AOVBuffers& aovs) {
+    auto start = std::chrono::steady_clock::now();
+
+    load(surface, aovs);
+    Real sigmaColor = mSigmaColor;
+    for (unsigned int it = 0; it < mIterations; it++) {
+        filterPass(1u << it, sigmaColor);
+        std::swap(mIn, mOut);
+        sigmaColor *= 0.5f;
+    }
+    store(surface);
+
+    auto end = std::chrono::steady_clock::now();
+    Debug::Log::i(TAG, "Denoised %dx%d in %.1f ms (%d passes)", mWidth, mHeight,
+        std::chrono::duration<double, std::milli>(end - start).count(), mIterations);
+}
+
+void Denoiser::load(Surface& surface, AOVBuffers& aovs) {
+    mWidth = surface.getWidth();
+    mHeight = surface.getHeight();
+    const unsigned size = mWidth * mHeight;
+    mIn.resize(size);
+    mOut.resize(size);
+    mAlbedo.resize(size);
+    mNormal.resize(size);
+    mDepth.resize(size);
+
+    #pragma omp parallel for schedule(static)
+    for (unsigned int j = 0; j < mHeight; j++) {
+        for (unsigned int i = 0; i < mWidth; i++) {
+            const unsigned k = j*mWidth + i;
+            const Color& c = surface.at(i, j);
+            const Color& a = aovs.albedo.at(i, j);
+            const Color& n = aovs.normal.at(i, j);
+
+            // Filter irradiance rather than radiance so that albedo detail survives
+            mAlbedo.r[k] = (a.x > MIN_ALBEDO)? a.x : 1.0f;
+            mAlbedo.g[k] = (a.y > MIN_ALBEDO)? a.y : 1.0f;
+            mAlbedo.b[k] = (a.z > MIN_ALBEDO)? a.z : 1.0f;
+            mIn.r[k] = c.x / mAlbedo.r[k];
+            mIn.g[k] = c.y / mAlbedo.g[k];
+            mIn.b[k] = c.z / mAlbedo.b[k];
+
+            mNormal.r[k] = n.x;
+            mNormal.g[k] = n.y;
+            mNormal.b[k] = n.z;
+            mDepth[k] = aovs.depth.at(i, j).x;
+        }
+    }
+}
+
+void Denoiser::store(Surface& surface) {
+    #pragma omp parallel for schedule(static)
+    for (unsigned int j = 0; j < mHeight; j++) {
+        for (unsigned int i = 0; i < mWidth; i++) {
+            const unsigned k = j*mWidth + i;
+            surface.at(i, j).set(
+                mIn.r[k] * mAlbedo.r[k],
+                mIn.g[k] * mAlbedo.g[k],
+                mIn.b[k] * mAlbedo.b[k]);
+        }
+    }
+}
+
+void Denoiser::filterPass(unsigned step, Real sigmaColor) {
+    const int width = mWidth;
+    const int height = mHeight;
+    const float invColor = 1.0f / (sigmaColor*sigmaColor);
+    const float invNormal = 1.0f / (mSigmaNormal*mSigmaNormal);
+    const float invDepth = 1.0f / (mSigmaDepth*mSigmaDepth);
+
+    const float* inR = mIn.r.data();
+    const float* inG = mIn.g.data();
+    const float* inB = mIn.b.data();
+    const float* nX = mNormal.r.data();
+    const float* nY = mNormal.g.data();
+    const float* nZ = mNormal.b.data();
+    const float* depth = mDepth.data();
+
+    #pragma omp parallel
+    {
+        // Row accumulators
+        std::vector<float> sumR(width), sumG(width), sumB(width), sumW(width);
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; y++) {
+            std::fill(sumR.begin(), sumR.end(), 0.0f);
+            std::fill(sumG.begin(), sumG.end(), 0.0f);
+            std::fill(sumB.begin(), sumB.end(), 0.0f);
+            std::fill(sumW.begin(), sumW.end(), 0.0f);
+
+            const int row = y*width;
+            for (int ky = -2; ky <= 2; ky++) {
+                const int qy = std::min(std::max(y + ky*int(step), 0), height - 1);
+                const int qrow = qy*width;
+
+                for (int kx = -2; kx <= 2; kx++) {
+                    const float h = KERNEL[ky + 2] * KERNEL[kx + 2];
+                    const int dx = kx*int(step);
+
+                    #pragma omp simd
+                    for (int x = 0; x < width; x++) {
+                        const int p = row + x;
+                        const int q = qrow + std::min(std::max(x + dx, 0), width - 1);
+
+                        const float dr = inR[p] - inR[q];
+                        const float dg = inG[p] - inG[q];
+                        const float db = inB[p] - inB[q];
+                        const float dc = dr*dr + dg*dg + db*db;
+
+                        const float nx = nX[p] - nX[q];
+                        const float ny = nY[p] - nY[q];
+                        const float nz = nZ[p] - nZ[q];
+                        const float dn = nx*nx + ny*ny + nz*nz;
+
+                        const float dd = (depth[p] - depth[q]) / std::max(depth[p], MIN_DEPTH);
+
+                        const float w = h * std::exp(-(dc*invColor + dn*invNormal + dd*dd*invDepth));
+                        sumR[x] += w * inR[q];
+                        sumG[x] += w * inG[q];
+                        sumB[x] += w * inB[q];
+                        sumW[x] += w;
+                    }
+                }
+            }
+
+            // The centre tap always has weight KERNEL[2]^2, so sumW is never 0
+            for (int x = 0; x < width; x++) {
+                const float invW = 1.0f / sumW[x];
+                mOut.r[row + x] = sumR[x] * invW;
+                mOut.g[row + x] = sumG[x] * invW;
+                mOut.b[row + x] = sumB[x] * invW;
+            }
+        }
+    }
+}
@@ -0,0 +1,704 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Distributed.hpp"
+
+#include "Common.hpp"
+#include "Camera.hpp"
+#include "Environment.hpp"
+#include "Mesh.hpp"
+#include "Objects.hpp"
+#include "PathTracer.hpp"
+#include "RadianceCache.hpp"
+#include "Surface.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "Distributed";
+
+enum MessageType : uint32_t {
+    MESSAGE_SETUP = 1,
+    MESSAGE_TILE = 2,
+    MESSAGE_RESULT = 3,
+};
+
+enum ObjectType : uint8_t {
+    OBJECT_PLANE = 1,
+    OBJECT_TRIANGLE = 2,
+    OBJECT_SPHERE = 3,
+    OBJECT_MESH = 4,
+};
+
+/** Largest message accepted, to reject corrupted headers */
+static const uint32_t MAX_MESSAGE_SIZE = 1u << 30;
+
+/** Time the coordinator waits for a worker when there is none */
+static const double WORKER_TIMEOUT_SECONDS = 30;
+
+/** Time a worker keeps trying to reach the coordinator */
+static const double CONNECT_TIMEOUT_SECONDS = 10;
+
+
+/* Messages */
+class MessageWriter {
+public:
+    std::vector<uint8_t> data;
+
+    template<typename T> void put(const T& value) {
+        append(&value, sizeof(T));
+    }
+
+    void putVector(const Vec3D& v) {
+        put(v.x);
+        put(v.y);
+        put(v.z);
+    }
+
+    template<typename T> void putArray(const T* values, uint32_t count) {
+        put<uint32_t>(count);
+        append(values, count * sizeof(T));
+    }
+
+private:
+    // Copied rather than inserted, which GCC 12 warns about when optimising
+    void append(const void* bytes, size_t size) {
+        if (size > 0) {
+            const size_t offset = data.size();
+            data.resize(offset + size);
+            memcpy(data.data() + offset, bytes, size);
+        }
+    }
+};
+
+class MessageReader {
+public:
+    MessageReader(const std::vector<uint8_t>& data) : mData(data) { }
+
+    /** Whether every read so far was inside the message */
+    bool ok() { return mOk; }
+
+    template<typename T> T get() {
+        T value = T();
+        if (mOffset + sizeof(T) > mData.size()) {
+            mOk = false;
+            return value;
+        }
+        memcpy(&value, &mData[mOffset], sizeof(T));
+        mOffset += sizeof(T);
+        return value;
+    }
+
+    Vec3D getVector() {
+        const Real x = get<Real>();
+        const Real y = get<Real>();
+        const Real z = get<Real>();
+        return Vec3D(x, y, z);
+    }
+
+    template<typename T> std::vector<T> getArray() {
+        const uint32_t count = get<uint32_t>();
+        if (!mOk || count > (mData.size() - mOffset) / sizeof(T)) {
+            mOk = false;
+            return std::vector<T>();
+        }
+        std::vector<T> values(count);
+        memcpy(values.data(), &mData[mOffset], count * sizeof(T));
+        mOffset += count * sizeof(T);
+        return values;
+    }
+
+private:
+    const std::vector<uint8_t>& mData;
+    size_t mOffset = 0;
+    bool mOk = true;
+};
+
+static bool writeAll(int fd, const void* buffer, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    while (size > 0) {
+        const ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* buffer, size_t size) {
+    uint8_t* bytes = static_cast<uint8_t*>(buffer);
+    while (size > 0) {
+        const ssize_t n = recv(fd, bytes, size, 0);
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, uint32_t type, const std::vector<uint8_t>& payload) {
+    const uint32_t header[2] = {type, static_cast<uint32_t>(payload.size())};
+    return writeAll(fd, header, sizeof(header)) && writeAll(fd, payload.data(), payload.size());
+}
+
+static bool receiveMessage(int fd, uint32_t& type, std::vector<uint8_t>& payload) {
+    uint32_t header[2];
+    if (!readAll(fd, header, sizeof(header)) || header[1] > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    type = header[0];
+    payload.resize(header[1]);
+    return readAll(fd, payload.data(), payload.size());
+}
+
+
+/* Scene and camera */
+static bool writeScene(MessageWriter& m, struct Scene& scene) {
+    m.putVector(scene.backgroundColor);
+
+    m.put<uint8_t>(scene.environment != nullptr);
+    if (scene.environment != nullptr) {
+        m.put<uint32_t>(scene.environment->getWidth());
+        m.put<uint32_t>(scene.environment->getHeight());
+        for (Color& pixel : scene.environment->getPixels()) {
+            m.putVector(pixel);
+        }
+    }
+
+    m.put<uint32_t>(scene.objects.size());
+    for (IObject3D* object : scene.objects) {
+        if (Plane* plane = dynamic_cast<Plane*>(object)) {
+            m.put<uint8_t>(OBJECT_PLANE);
+            m.putVector(plane->position());
+            m.putVector(plane->normal());
+        } else if (Triangle* triangle = dynamic_cast<Triangle*>(object)) {
+            m.put<uint8_t>(OBJECT_TRIANGLE);
+            m.putVector(triangle->a());
+            m.putVector(triangle->b());
+            m.putVector(triangle->c());
+        } else if (Sphere* sphere = dynamic_cast<Sphere*>(object)) {
+            m.put<uint8_t>(OBJECT_SPHERE);
+            m.putVector(sphere->center());
+            m.put<Real>(sphere->radius());
+        } else if (TriangleMesh* mesh = dynamic_cast<TriangleMesh*>(object)) {
+            m.put<uint8_t>(OBJECT_MESH);
+            m.putArray(mesh->getPositions(), 3 * mesh->getVertexCount());
+            m.putArray(mesh->getIndices(), 3 * mesh->getTriangleCount());
+        } else {
+            Debug::Log::e(TAG, "The scene has an object that cannot be sent to workers");
+            return false;
+        }
+        m.putVector(object->material().color);
+        m.putVector(object->material().emission);
+    }
+    return true;
+}
+
+static bool readScene(MessageReader& r, struct Scene& scene, Environment& environment) {
+    scene.clear();
+    scene.backgroundColor = r.getVector();
+
+    scene.environment = nullptr;
+    if (r.get<uint8_t>()) {
+        const uint32_t width = r.get<uint32_t>();
+        const uint32_t height = r.get<uint32_t>();
+        if (!r.ok() || width == 0 || height == 0 || width > (1u << 16) || height > (1u << 16)) {
+            return false;
+        }
+        std::vector<Color> pixels(width * height);
+        for (Color& pixel : pixels) {
+            pixel = r.getVector();
+        }
+        environment.setImage(width, height, pixels);
+        scene.environment = &environment;
+    }
+
+    const uint32_t count = r.get<uint32_t>();
+    for (unsigned int o = 0; o < count && r.ok(); o++) {
+        const uint8_t type = r.get<uint8_t>();
+        IObject3D* object;
+        if (type == OBJECT_PLANE) {
+            Vec3D position = r.getVector();
+            Vec3D normal = r.getVector();
+            object = scene.add<Plane>(Material(), position, normal);
+        } else if (type == OBJECT_TRIANGLE) {
+            Vec3D a = r.getVector();
+            Vec3D b = r.getVector();
+            Vec3D c = r.getVector();
+            object = scene.add<Triangle>(Material(), a, b, c);
+        } else if (type == OBJECT_SPHERE) {
+            Vec3D center = r.getVector();
+            const Real radius = r.get<Real>();
+            object = scene.add<Sphere>(Material(), center, radius);
+        } else if (type == OBJECT_MESH) {
+            std::vector<float> positions = r.getArray<float>();
+            std::vector<uint32_t> indices = r.getArray<uint32_t>();
+            const uint32_t vertices = positions.size() / 3;
+            for (uint32_t index : indices) {
+                if (index >= vertices) {
+                    return false;
+                }
+            }
+            object = scene.add<TriangleMesh>(Material(), std::move(positions), std::move(indices));
+        } else {
+            return false;
+        }
+        object->material().color = r.getVector();
+        object->material().emission = r.getVector();
+    }
+    return r.ok();
+}
+
+static void writeCamera(MessageWriter& m, Camera& camera) {
+    m.put<uint32_t>(camera.getWidth());
+    m.put<uint32_t>(camera.getHeight());
+    m.put<float>(camera.getFov());
+    m.putVector(camera.getPosition());
+    m.putVector(camera.getFacing());
+}
+
+static Camera* readCamera(MessageReader& r) {
+    const uint32_t width = r.get<uint32_t>();
+    const uint32_t height = r.get<uint32_t>();
+    const float fov = r.get<float>();
+    Vec3D position = r.getVector();
+    Vec3D facing = r.getVector();
+    if (!r.ok() || width == 0 || height == 0 || width > (1u << 16) || height > (1u << 16)) {
+        return nullptr;
+    }
+    return new Camera(width, height, fov, position, facing);
+}
+
+
+/* Sockets */
+/** Open a listening socket (server) or connect to one. Returns -1 on error */
+static int openSocket(const char* address, bool server) {
+    if (!strncmp(address, "unix:", 5)) {
+        const char* path = address + 5;
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (server) {
+            unlink(path);
+            if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0 &&
+                ::listen(fd, SOMAXCONN) == 0) {
+                return fd;
+            }
+        } else if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        return -1;
+    }
+
+    // HOST:PORT or PORT
+    std::string host, port = address;
+    const char* colon = strrchr(address, ':');
+    if (colon != nullptr) {
+        host.assign(address, colon - address);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server? AI_PASSIVE : 0;
+
+    struct addrinfo* result;
+    const char* node = host.empty()? (server? nullptr : "localhost") : host.c_str();
+    if (getaddrinfo(node, port.c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = result; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        const int one = 1;
+        bool ok;
+        if (server) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0;
+        } else {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+
+/* RenderCoordinator */
+RenderCoordinator::RenderCoordinator(const char* address) : mAddress(address) { }
+
+RenderCoordinator::~RenderCoordinator() {
+    // Workers exit when the coordinator disconnects
+    for (Connection& connection : mConnections) {
+        close(connection.fd);
+    }
+    if (mListenFd >= 0) {
+        close(mListenFd);
+        if (!strncmp(mAddress, "unix:", 5)) {
+            unlink(mAddress + 5);
+        }
+    }
+    for (pid_t child : mChildren) {
+        waitpid(child, nullptr, 0);
+    }
+}
+
+void RenderCoordinator::setTileSize(unsigned width, unsigned height) {
+    mTileWidth = width;
+    mTileHeight = height;
+}
+
+bool RenderCoordinator::listen() {
+    mListenFd = openSocket(mAddress, true);
+    if (mListenFd < 0) {
+        Debug::Log::e(TAG, "Could not listen on %s", mAddress);
+        return false;
+    }
+    Debug::Log::i(TAG, "Coordinator listening on %s", mAddress);
+    return true;
+}
+
+bool RenderCoordinator::spawnLocalWorkers(unsigned count, const char* program, unsigned threads) {
+    const std::string threadArg = std::to_string(threads);
+    for (unsigned int w = 0; w < count; w++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            Debug::Log::e(TAG, "Could not start worker %d", w);
+            return false;
+        }
+        if (pid == 0) {
+            if (mListenFd >= 0) {
+                close(mListenFd);
+            }
+            execl(program, program, "--worker", mAddress, "--threads", threadArg.c_str(),
+                static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        mChildren.push_back(pid);
+    }
+    return true;
+}
+
+void RenderCoordinator::acceptWorker(std::vector<uint8_t>& setup) {
+    const int fd = accept(mListenFd, nullptr, nullptr);
+    if (fd < 0) {
+        return;
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!sendMessage(fd, MESSAGE_SETUP, setup)) {
+        close(fd);
+        return;
+    }
+    mConnections.push_back(Connection {fd, {}, 0});
+    Debug::Log::i(TAG, "Worker connected (%zu workers)", mConnections.size());
+}
+
+void RenderCoordinator::dropWorker(unsigned index, std::deque<unsigned>& pending) {
+    Connection& connection = mConnections[index];
+    Debug::Log::w(TAG, "Worker disconnected, reassigning %zu tiles", connection.tiles.size());
+
+    // Its tiles go first, so that the frame does not wait for them at the end
+    for (auto it = connection.tiles.rbegin(); it != connection.tiles.rend(); ++it) {
+        pending.push_front(*it);
+    }
+    close(connection.fd);
+    mConnections.erase(mConnections.begin() + index);
+}
+
+bool RenderCoordinator::render(struct Scene& scene, Camera& camera, struct RenderSettings& settings) {
+    auto start = std::chrono::steady_clock::now();
+
+    MessageWriter setup;
+    setup.put(settings.spp);
+    setup.put(settings.depth);
+    setup.put(settings.firstHitCache);
+    setup.put(settings.guiding);
+    setup.put(settings.radianceCache);
+    setup.put(settings.lightSampling);
+    setup.put(settings.filter);
+    setup.put(settings.seed);
+    writeCamera(setup, camera);
+    if (!writeScene(setup, scene)) {
+        return false;
+    }
+
+    Surface& surface = camera.getSurface();
+    const unsigned width = surface.getWidth();
+    const unsigned height = surface.getHeight();
+    surface.clear();
+
+    std::vector<Tile> tiles;
+    for (unsigned int j = 0; j < height; j += mTileHeight) {
+        for (unsigned int i = 0; i < width; i += mTileWidth) {
+            tiles.push_back(Tile {i, j, std::min(i + mTileWidth, width), std::min(j + mTileHeight, height)});
+        }
+    }
+    std::deque<unsigned> pending;
+    for (unsigned int t = 0; t < tiles.size(); t++) {
+        pending.push_back(t);
+    }
+    std::vector<bool> done(tiles.size(), false);
+    unsigned remaining = tiles.size();
+
+    // Workers kept from a previous frame get the new one
+    for (int c = mConnections.size() - 1; c >= 0; c--) {
+        mConnections[c].tilesDone = 0;
+        if (!sendMessage(mConnections[c].fd, MESSAGE_SETUP, setup.data)) {
+            dropWorker(c, pending);
+        }
+    }
+
+    auto lastWorker = std::chrono::steady_clock::now();
+    std::vector<uint8_t> payload;
+    while (remaining > 0) {
+        // Keep every worker busy
+        for (int c = mConnections.size() - 1; c >= 0; c--) {
+            Connection& connection = mConnections[c];
+            bool failed = false;
+            while (connection.tiles.size() < TILES_IN_FLIGHT && !pending.empty() && !failed) {
+                const unsigned t = pending.front();
+                pending.pop_front();
+                connection.tiles.push_back(t);
+
+                MessageWriter message;
+                message.put<uint32_t>(t);
+                message.put<uint32_t>(tiles[t].left);
+                message.put<uint32_t>(tiles[t].up);
+                message.put<uint32_t>(tiles[t].right);
+                message.put<uint32_t>(tiles[t].down);
+                failed = !sendMessage(connection.fd, MESSAGE_TILE, message.data);
+            }
+            if (failed) {
+                dropWorker(c, pending);
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (!mConnections.empty()) {
+            lastWorker = now;
+        } else if (std::chrono::duration<double>(now - lastWorker).count() > WORKER_TIMEOUT_SECONDS) {
+            Debug::Log::e(TAG, "No worker available, %d tiles were not rendered", remaining);
+            return false;
+        }
+
+        std::vector<struct pollfd> fds;
+        fds.push_back(pollfd {mListenFd, POLLIN, 0});
+        for (Connection& connection : mConnections) {
+            fds.push_back(pollfd {connection.fd, POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), 1000) <= 0) {
+            continue;
+        }
+
+        // Backwards, so that dropping a worker does not move the others
+        for (int c = mConnections.size() - 1; c >= 0; c--) {
+            if (!(fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            uint32_t type;
+            if (!receiveMessage(mConnections[c].fd, type, payload) || type != MESSAGE_RESULT) {
+                dropWorker(c, pending);
+                continue;
+            }
+
+            MessageReader r(payload);
+            const uint32_t t = r.get<uint32_t>();
+            Connection& connection = mConnections[c];
+            auto it = std::find(connection.tiles.begin(), connection.tiles.end(), t);
+            if (!r.ok() || it == connection.tiles.end()) {
+                dropWorker(c, pending);
+                continue;
+            }
+            connection.tiles.erase(it);
+
+            const Tile& tile = tiles[t];
+            for (unsigned int j = tile.up; j < tile.down; j++) {
+                for (unsigned int i = tile.left; i < tile.right; i++) {
+                    surface.at(i, j) = r.getVector();
+                }
+            }
+            if (!r.ok()) {
+                dropWorker(c, pending);
+                continue;
+            }
+
+            if (!done[t]) {
+                done[t] = true;
+                remaining--;
+                connection.tilesDone++;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            acceptWorker(setup.data);
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    Debug::Log::i(TAG, "Rendered %zu tiles with %zu workers in %.2f s",
+        tiles.size(), mConnections.size(), seconds);
+    for (unsigned int c = 0; c < mConnections.size(); c++) {
+        Debug::Log::i(TAG, "Worker %d: %d tiles", c, mConnections[c].tilesDone);
+    }
+    return true;
+}
+
+
+/* RenderWorker */
+RenderWorker::RenderWorker(const char* address, unsigned threads)
+:   mAddress(address), mThreads(threads)
+{ }
+
+RenderWorker::~RenderWorker() { }
+
+int RenderWorker::run() {
+    // The coordinator may still be starting
+    int fd = -1;
+    auto start = std::chrono::steady_clock::now();
+    while ((fd = openSocket(mAddress, false)) < 0) {
+        const auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - start).count() > CONNECT_TIMEOUT_SECONDS) {
+            Debug::Log::e(TAG, "Could not connect to %s", mAddress);
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    struct Scene scene;
+    Environment environment;
+    std::unique_ptr<Camera> camera;
+    std::unique_ptr<PathTracer> renderer;
+    RadianceCache cache;
+
+    int status = 0;
+    std::vector<uint8_t> payload;
+    uint32_t type;
+    while (status == 0 && receiveMessage(fd, type, payload)) {
+        MessageReader r(payload);
+
+        if (type == MESSAGE_SETUP) {
+            struct RenderSettings settings;
+            settings.spp = r.get<uint32_t>();
+            settings.depth = r.get<uint32_t>();
+            settings.firstHitCache = r.get<uint8_t>();
+            settings.guiding = r.get<uint8_t>();
+            settings.radianceCache = r.get<uint8_t>();
+            settings.lightSampling = r.get<uint8_t>();
+            settings.filter = r.get<uint8_t>();
+            settings.seed = r.get<uint64_t>();
+            camera.reset(readCamera(r));
+            if (camera == nullptr || !readScene(r, scene, environment)) {
+                Debug::Log::e(TAG, "Invalid frame from the coordinator");
+                status = -1;
+                break;
+            }
+
+            renderer.reset(new PathTracer(settings.spp, settings.depth));
+            renderer->setThreadCount(mThreads);
+            renderer->setFirstHitCacheEnabled(settings.firstHitCache);
+            renderer->setPathGuidingEnabled(settings.guiding);
+            renderer->setLightSamplingEnabled(settings.lightSampling);
+            renderer->setFilter(static_cast<FilterType>(std::min<unsigned>(settings.filter, FILTER_MITCHELL)));
+            renderer->setRadianceCache(settings.radianceCache? &cache : nullptr);
+            renderer->setSeed(settings.seed);
+            // The tiles of the frame share its film, replicas and learning
+            renderer->beginFrame(scene, *camera);
+            Debug::Log::i(TAG, "Worker received a %dx%d frame with %zu objects",
+                camera->getWidth(), camera->getHeight(), scene.objects.size());
+
+        } else if (type == MESSAGE_TILE && renderer != nullptr) {
+            const uint32_t t = r.get<uint32_t>();
+            const uint32_t left = r.get<uint32_t>();
+            const uint32_t up = r.get<uint32_t>();
+            const uint32_t right = std::min(r.get<uint32_t>(), camera->getWidth());
+            const uint32_t down = std::min(r.get<uint32_t>(), camera->getHeight());
+            if (!r.ok() || left > right || up > down) {
+                Debug::Log::e(TAG, "Invalid tile from the coordinator");
+                status = -1;
+                break;
+            }
+
+            renderer->renderRegion(scene, left, up, right, down);
+
+            Surface& surface = camera->getSurface();
+            MessageWriter result;
+            result.put<uint32_t>(t);
+            for (unsigned int j = up; j < down; j++) {
+                for (unsigned int i = left; i < right; i++) {
+                    result.putVector(surface.at(i, j));
+                }
+            }
+            if (!sendMessage(fd, MESSAGE_RESULT, result.data)) {
+                status = -1;
+            }
+
+        } else {
+            Debug::Log::e(TAG, "Unexpected message %d from the coordinator", type);
+            status = -1;
+        }
+    }
+
+    close(fd);
+    return status;
+}
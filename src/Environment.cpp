@@ -0,0 +1,212 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Environment.hpp"
+
+#include "Common.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "debug.hpp"
+
+static const char* TAG = "Environment";
+
+Environment::Environment(Color color) : mWidth(1), mHeight(1), mPixels(1, color) {
+    buildDistribution();
+}
+
+Environment::~Environment() { }
+
+bool Environment::loadPFM(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (f == nullptr) {
+        Debug::Log::e(TAG, "Could not open %s", filename);
+        return false;
+    }
+
+    char type[3] = {0};
+    unsigned width, height;
+    float scale;
+    if (fscanf(f, "%2s %u %u %f", type, &width, &height, &scale) != 4 ||
+        (strcmp(type, "PF") && strcmp(type, "Pf")) || width == 0 || height == 0) {
+        Debug::Log::e(TAG, "%s is not a PFM file", filename);
+        fclose(f);
+        return false;
+    }
+    fgetc(f);   // Single whitespace before the data
+
+    const unsigned channels = strcmp(type, "PF")? 1 : 3;
+    std::vector<float> data(width * height * channels);
+    if (fread(data.data(), sizeof(float), data.size(), f) != data.size()) {
+        Debug::Log::e(TAG, "%s is truncated", filename);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    // A positive scale means big-endian data
+    if (scale > 0) {
+        for (float& value : data) {
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            bits = __builtin_bswap32(bits);
+            memcpy(&value, &bits, sizeof(bits));
+        }
+    }
+
+    // PFM rows go from bottom to top
+    std::vector<Color> pixels(width * height);
+    for (unsigned int row = 0; row < height; row++) {
+        const float* src = &data[(height - 1 - row) * width * channels];
+        for (unsigned int col = 0; col < width; col++) {
+            const float* p = &src[col * channels];
+            pixels[row*width + col] = (channels == 3)?
+                Color(p[0], p[1], p[2]) : Color(p[0], p[0], p[0]);
+        }
+    }
+
+    setImage(width, height, pixels);
+    Debug::Log::i(TAG, "Loaded %dx%d environment from %s", width, height, filename);
+    return true;
+}
+
+void Environment::setImage(unsigned width, unsigned height, std::vector<Color>& pixels) {
+    mWidth = width;
+    mHeight = height;
+    mPixels = pixels;
+    buildDistribution();
+}
+
+unsigned Environment::getWidth() {
+    return mWidth;
+}
+
+unsigned Environment::getHeight() {
+    return mHeight;
+}
+
+std::vector<Color>& Environment::getPixels() {
+    return mPixels;
+}
+
+void Environment::buildDistribution() {
+    mRowCdf.assign(mHeight + 1, 0);
+    mColumnCdf.assign(mHeight * (mWidth + 1), 0);
+
+    for (unsigned int row = 0; row < mHeight; row++) {
+        // Rows near the poles cover less solid angle
+        const Real sinTheta = sin(M_PI * (row + 0.5) / mHeight);
+        Real* cdf = &mColumnCdf[row * (mWidth + 1)];
+        for (unsigned int col = 0; col < mWidth; col++) {
+            const Real weight = std::max<Real>(0, luminance(mPixels[row*mWidth + col])) * sinTheta;
+            cdf[col + 1] = cdf[col] + weight;
+        }
+
+        const Real rowTotal = cdf[mWidth];
+        mRowCdf[row + 1] = mRowCdf[row] + rowTotal;
+        for (unsigned int col = 1; col <= mWidth; col++) {
+            cdf[col] = (rowTotal > 0)? cdf[col] / rowTotal : static_cast<Real>(col) / mWidth;
+        }
+    }
+
+    mTotal = mRowCdf[mHeight];
+    for (unsigned int row = 1; row <= mHeight; row++) {
+        mRowCdf[row] = (mTotal > 0)? mRowCdf[row] / mTotal : static_cast<Real>(row) / mHeight;
+    }
+}
+
+bool Environment::isBlack() {
+    return !(mTotal > 0);
+}
+
+void Environment::directionToPixel(Vec3D& direction, unsigned& column, unsigned& row, Real& sinTheta) {
+    Vec3D d = direction.normalize();
+    const Real cosTheta = std::min<Real>(1, std::max<Real>(-1, d.y));
+    Real phi = atan2(d.z, d.x);
+    if (phi < 0) {
+        phi += 2*M_PI;
+    }
+
+    sinTheta = sqrt(std::max<Real>(0, 1 - cosTheta*cosTheta));
+    column = std::min<unsigned>(phi / (2*M_PI) * mWidth, mWidth - 1);
+    row = std::min<unsigned>(acos(cosTheta) / M_PI * mHeight, mHeight - 1);
+}
+
+Color Environment::radiance(Vec3D& direction) {
+    unsigned column, row;
+    Real sinTheta;
+    directionToPixel(direction, column, row, sinTheta);
+    return mPixels[row*mWidth + column];
+}
+
+/** Find the bin of a CDF containing u and remap u to [0, 1) inside it */
+static unsigned sampleCdf(const Real* cdf, unsigned size, Real& u) {
+    const Real* it = std::upper_bound(cdf, cdf + size + 1, u);
+    unsigned bin = std::min<unsigned>(std::max<int>(it - cdf - 1, 0), size - 1);
+    // Skip empty bins that upper_bound can land on
+    while (bin + 1 < size && cdf[bin + 1] <= cdf[bin]) {
+        bin++;
+    }
+    const Real width = cdf[bin + 1] - cdf[bin];
+    u = (width > 0)? std::min<Real>((u - cdf[bin]) / width, 1 - 1e-6) : 0.5;
+    return bin;
+}
+
+Vec3D Environment::sample(Real u1, Real u2, Real& pdf) {
+    const unsigned row = sampleCdf(mRowCdf.data(), mHeight, u1);
+    const unsigned column = sampleCdf(&mColumnCdf[row * (mWidth + 1)], mWidth, u2);
+
+    const Real theta = M_PI * (row + u1) / mHeight;
+    const Real phi = 2*M_PI * (column + u2) / mWidth;
+    Vec3D direction(sin(theta)*cos(phi), cos(theta), sin(theta)*sin(phi));
+
+    pdf = this->pdf(direction);
+    return direction;
+}
+
+Real Environment::pdf(Vec3D& direction) {
+    if (isBlack()) {
+        return 0;
+    }
+
+    unsigned column, row;
+    Real sinTheta;
+    directionToPixel(direction, column, row, sinTheta);
+    if (sinTheta <= 0) {
+        return 0;
+    }
+
+    const Real* cdf = &mColumnCdf[row * (mWidth + 1)];
+    const Real rowProbability = mRowCdf[row + 1] - mRowCdf[row];
+    const Real columnProbability = cdf[column + 1] - cdf[column];
+
+    // Density over the unit square, then over the sphere
+    const Real squarePdf = rowProbability * columnProbability * mWidth * mHeight;
+    return squarePdf / (2*M_PI*M_PI * sinTheta);
+}
+
+size_t Environment::getSizeBytes() {
+    return mPixels.capacity() * sizeof(Color) +
+        (mRowCdf.capacity() + mColumnCdf.capacity()) * sizeof(Real);
+}
@@ -0,0 +1,185 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Film.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+/** Falloff of the Gaussian filter */
+static const Real GAUSSIAN_ALPHA = 2;
+/** B and C parameters of the Mitchell-Netravali filter */
+static const Real MITCHELL_B = 1.0/3;
+static const Real MITCHELL_C = 1.0/3;
+
+Filter::Filter(FilterType type) : mType(type) {
+    switch (type) {
+    case FILTER_BOX:
+        mRadius = 0.5;
+        break;
+    case FILTER_GAUSSIAN:
+        mRadius = 1.5;
+        break;
+    case FILTER_MITCHELL:
+        mRadius = 2;
+        break;
+    }
+}
+
+FilterType Filter::getType() {
+    return mType;
+}
+
+Real Filter::getRadius() {
+    return mRadius;
+}
+
+unsigned Filter::getPadding() {
+    return static_cast<unsigned>(ceil(mRadius - 0.5f));
+}
+
+Real Filter::evaluate(Real d) {
+    const Real x = fabs(d);
+    if (x >= mRadius) {
+        return 0;
+    }
+
+    switch (mType) {
+    case FILTER_BOX:
+        return 1;
+    case FILTER_GAUSSIAN:
+        return exp(-GAUSSIAN_ALPHA * x*x) - exp(-GAUSSIAN_ALPHA * mRadius*mRadius);
+    case FILTER_MITCHELL: {
+        const Real B = MITCHELL_B;
+        const Real C = MITCHELL_C;
+        if (x < 1) {
+            return ((12 - 9*B - 6*C) * x*x*x + (-18 + 12*B + 6*C) * x*x + (6 - 2*B)) / 6;
+        }
+        return ((-B - 6*C) * x*x*x + (6*B + 30*C) * x*x + (-12*B - 48*C) * x + (8*B + 24*C)) / 6;
+    }
+    }
+    return 0;
+}
+
+void FilmTile::add(Real x, Real y, Color& radiance) {
+    if (mFilter->getType() == FILTER_BOX) {
+        // The pixel the sample falls in, also for samples on its edges
+        const unsigned i = std::min(static_cast<unsigned>(x), mRight - 1);
+        const unsigned j = std::min(static_cast<unsigned>(y), mDown - 1);
+        splat(i, j, 1, radiance);
+        return;
+    }
+
+    // Pixels whose centre is within the radius
+    const Real radius = mFilter->getRadius();
+    const int i0 = std::max<int>(mLeft, ceil(x - 0.5f - radius));
+    const int i1 = std::min<int>(mRight - 1, floor(x - 0.5f + radius));
+    const int j0 = std::max<int>(mUp, ceil(y - 0.5f - radius));
+    const int j1 = std::min<int>(mDown - 1, floor(y - 0.5f + radius));
+
+    Real weightsX[8];
+    for (int i = i0; i <= i1; i++) {
+        weightsX[i - i0] = mFilter->evaluate(i + 0.5f - x);
+    }
+    for (int j = j0; j <= j1; j++) {
+        const Real weightY = mFilter->evaluate(j + 0.5f - y);
+        for (int i = i0; i <= i1; i++) {
+            splat(i, j, weightsX[i - i0] * weightY, radiance);
+        }
+    }
+}
+
+void FilmTile::splat(unsigned i, unsigned j, Real weight, Color& radiance) {
+    if (weight == 0) {
+        return;
+    }
+    int64_t* v = &mValues[Accumulation::CHANNELS * ((j - mUp)*(mRight - mLeft) + (i - mLeft))];
+    v[0] += Accumulation::toFixed(weight * radiance.x);
+    v[1] += Accumulation::toFixed(weight * radiance.y);
+    v[2] += Accumulation::toFixed(weight * radiance.z);
+    v[3] += Accumulation::toFixed(weight);
+}
+
+Film::Film() { }
+
+void Film::setFilter(FilterType type) {
+    mFilter = Filter(type);
+}
+
+Filter& Film::getFilter() {
+    return mFilter;
+}
+
+Accumulation& Film::getAccumulation() {
+    return mAccumulation;
+}
+
+void Film::reset(unsigned width, unsigned height, uint64_t seed) {
+    mAccumulation.reset(width, height, seed, mFilter.getType());
+}
+
+void Film::setWorkerCount(unsigned count) {
+    while (mTiles.size() < count) {
+        mTiles.push_back(std::make_unique<FilmTile>());
+    }
+}
+
+FilmTile& Film::beginTile(unsigned worker, unsigned left, unsigned up, unsigned right, unsigned down) {
+    FilmTile& tile = *mTiles[worker];
+    const unsigned padding = mFilter.getPadding();
+    tile.mFilter = &mFilter;
+    tile.mLeft = (left > padding)? left - padding : 0;
+    tile.mUp = (up > padding)? up - padding : 0;
+    tile.mRight = std::min(right + padding, mAccumulation.width);
+    tile.mDown = std::min(down + padding, mAccumulation.height);
+    tile.mValues.assign(Accumulation::CHANNELS *
+        (tile.mRight - tile.mLeft) * (tile.mDown - tile.mUp), 0);
+    return tile;
+}
+
+void Film::merge(FilmTile& tile) {
+    const unsigned tileWidth = tile.mRight - tile.mLeft;
+    for (unsigned int j = tile.mUp; j < tile.mDown; j++) {
+        const int64_t* in = &tile.mValues[Accumulation::CHANNELS * (j - tile.mUp) * tileWidth];
+        int64_t* out = &mAccumulation.values[Accumulation::CHANNELS *
+            (j * mAccumulation.width + tile.mLeft)];
+        for (unsigned int k = 0; k < Accumulation::CHANNELS * tileWidth; k++) {
+            if (in[k] != 0) {
+                __atomic_fetch_add(&out[k], in[k], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+void Film::resolve(Surface& surface, unsigned left, unsigned up, unsigned right, unsigned down) {
+    for (unsigned int j = up; j < down; j++) {
+        Color* row = surface.row(j);
+        for (unsigned int i = left; i < right; i++) {
+            row[i] = mAccumulation.mean(j * mAccumulation.width + i);
+        }
+    }
+}
+
+size_t Film::getSizeBytes() {
+    size_t bytes = mAccumulation.values.capacity() * sizeof(int64_t) +
+        mAccumulation.counts.capacity() * sizeof(uint32_t);
+    for (std::unique_ptr<FilmTile>& tile : mTiles) {
+        bytes += sizeof(FilmTile) + tile->mValues.capacity() * sizeof(int64_t);
+    }
+    return bytes;
+}
@@ -0,0 +1,408 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#include "GeometryCache.hpp"
+
+#include <algorithm>
+#include <utility>
+
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "GeometryCache";
+
+/** Whether the calling thread defers misses, and whether it has since the last check */
+static thread_local bool sDeferring = false;
+static thread_local bool sDeferred = false;
+
+/** Reader slot of the calling thread, assigned on its first section */
+static std::atomic<unsigned> sNextReader(0);
+static thread_local unsigned sReaderIndex = sNextReader.fetch_add(1, std::memory_order_relaxed);
+
+/** Layout of Reader::state */
+static const unsigned SECTION_SHIFT = 48;
+static const uint64_t EPOCH_MASK = (1ull << SECTION_SHIFT) - 1;
+
+static inline uint64_t clusterKey(unsigned file, uint32_t cluster) {
+    return (static_cast<uint64_t>(file) << 32) | cluster;
+}
+
+GeometryCache::ReadSection::ReadSection(GeometryCache& cache)
+:   mCache(cache)
+{
+    // The first section of a slot publishes the epoch, which later ones
+    // share: it is older than theirs, so their clusters are kept too
+    Reader& reader = mCache.reader();
+    uint64_t state = reader.state.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        const uint64_t sections = state >> SECTION_SHIFT;
+        const uint64_t epoch = (sections == 0)? mCache.mEpoch.load() : (state & EPOCH_MASK);
+        next = ((sections + 1) << SECTION_SHIFT) | epoch;
+    } while (!reader.state.compare_exchange_weak(state, next));
+}
+
+GeometryCache::ReadSection::~ReadSection() {
+    mCache.reader().state.fetch_sub(1ull << SECTION_SHIFT, std::memory_order_release);
+}
+
+GeometryCache::GeometryCache(size_t budgetBytes)
+:   mBudget(budgetBytes),
+    mTick(0),
+    mEpoch(1),
+    mReaders(new Reader[READER_SLOTS])
+{
+    resetStatistics();
+    mThread = std::thread(&GeometryCache::ioLoop, this);
+}
+
+GeometryCache::~GeometryCache() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    mRequested.notify_all();
+    mThread.join();
+    for (uint64_t key : mResidentKeys) {
+        delete slot(key).cluster.load();
+    }
+    for (Retired& retired : mRetired) {
+        delete retired.cluster;
+    }
+    for (File& file : mFiles) {
+        close(file.fd);
+    }
+}
+
+void GeometryCache::setBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mBudget = bytes;
+}
+
+size_t GeometryCache::getBudget() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mBudget;
+}
+
+size_t GeometryCache::getSizeBytes() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mResident;
+}
+
+bool GeometryCache::hasFiles() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return !mFiles.empty();
+}
+
+unsigned GeometryCache::addFile(int fd, std::vector<ClusterExtent>&& extents) {
+    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_ptr<Slot[]> slots(new Slot[extents.size()]);
+    mFiles.push_back(File {fd, std::move(extents), std::move(slots)});
+    return mFiles.size() - 1;
+}
+
+void GeometryCache::evictFile(unsigned file) {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (unsigned int i = mResidentKeys.size(); i-- > 0; ) {
+        if ((mResidentKeys[i] >> 32) == file) {
+            evict(i);
+        }
+    }
+    // Clusters being read are left to the I/O thread and evicted in time
+    for (auto it = mQueue.begin(); it != mQueue.end(); ) {
+        if ((*it >> 32) == file) {
+            mPending.erase(*it);
+            it = mQueue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    reclaim();
+    mLoaded.notify_all();
+}
+
+GeometryCluster* GeometryCache::acquire(unsigned file, uint32_t cluster) {
+    const uint64_t key = clusterKey(file, cluster);
+    Reader& r = reader();
+    r.lookups.fetch_add(1, std::memory_order_relaxed);
+
+    Slot& s = mFiles[file].slots[cluster];
+    GeometryCluster* resident = s.cluster.load();
+    if (resident != nullptr) {
+        // Written only when it changes, so hot clusters stay shared in the caches
+        const uint32_t tick = mTick.load(std::memory_order_relaxed);
+        if (s.lastUse.load(std::memory_order_relaxed) != tick) {
+            s.lastUse.store(tick, std::memory_order_relaxed);
+        }
+        r.hits.fetch_add(1, std::memory_order_relaxed);
+        return resident;
+    }
+
+    std::unique_lock<std::mutex> lock(mLock);
+    resident = s.cluster.load();
+    if (resident != nullptr) {
+        // Inserted since the lookup
+        return resident;
+    }
+
+    const File& f = mFiles[file];
+    for (uint32_t c = cluster + 1; c <= cluster + PREFETCH_COUNT && c < f.extents.size(); c++) {
+        if (request(clusterKey(file, c))) {
+            mPrefetches.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (sDeferring) {
+        request(key);
+        mRequested.notify_one();
+        sDeferred = true;
+        mDeferred.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    mRequested.notify_one();
+
+    // Read it here rather than wait behind the queue
+    const int fd = f.fd;
+    const ClusterExtent extent = f.extents[cluster];
+    lock.unlock();
+    std::unique_ptr<GeometryCluster> loaded = read(fd, extent);
+    lock.lock();
+    mBlockingLoads.fetch_add(1, std::memory_order_relaxed);
+    if (loaded == nullptr) {
+        return nullptr;
+    }
+    return insert(key, loaded);
+}
+
+void GeometryCache::waitForLoads() {
+    std::unique_lock<std::mutex> lock(mLock);
+    mLoaded.wait(lock, [this]() { return mPending.empty(); });
+    reclaim();
+}
+
+void GeometryCache::setDeferring(bool deferring) {
+    sDeferring = deferring;
+    sDeferred = false;
+}
+
+bool GeometryCache::isDeferring() {
+    return sDeferring;
+}
+
+bool GeometryCache::takeDeferred() {
+    const bool deferred = sDeferred;
+    sDeferred = false;
+    return deferred;
+}
+
+void GeometryCache::resetStatistics() {
+    for (unsigned int r = 0; r < READER_SLOTS; r++) {
+        mReaders[r].lookups = 0;
+        mReaders[r].hits = 0;
+    }
+    mDeferred = 0;
+    mBlockingLoads = 0;
+    mPrefetches = 0;
+    mLoads = 0;
+    mBytesRead = 0;
+    mEvictions = 0;
+}
+
+void GeometryCache::report() {
+    uint64_t lookups = 0, hits = 0;
+    for (unsigned int r = 0; r < READER_SLOTS; r++) {
+        lookups += mReaders[r].lookups.load(std::memory_order_relaxed);
+        hits += mReaders[r].hits.load(std::memory_order_relaxed);
+    }
+    const double MB = 1024.0 * 1024.0;
+    Debug::Log::i(TAG, "%llu lookups, hit rate %.2f%%, %llu deferred misses, %llu blocking loads",
+        static_cast<unsigned long long>(lookups),
+        (lookups > 0)? 100.0 * hits / lookups : 0.0,
+        static_cast<unsigned long long>(mDeferred.load()),
+        static_cast<unsigned long long>(mBlockingLoads.load()));
+    Debug::Log::i(TAG, "%llu clusters read (%llu prefetched), %.1f MB read, %llu evictions, "
+        "%.1f of %.1f MB resident",
+        static_cast<unsigned long long>(mLoads.load()), static_cast<unsigned long long>(mPrefetches.load()),
+        mBytesRead.load() / MB, static_cast<unsigned long long>(mEvictions.load()),
+        getSizeBytes() / MB, getBudget() / MB);
+}
+
+GeometryCache::Reader& GeometryCache::reader() {
+    return mReaders[sReaderIndex % READER_SLOTS];
+}
+
+GeometryCache::Slot& GeometryCache::slot(uint64_t key) {
+    return mFiles[key >> 32].slots[key & 0xFFFFFFFFu];
+}
+
+void GeometryCache::ioLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mRequested.wait(lock, [this]() { return mExit || !mQueue.empty(); });
+        if (mExit) {
+            break;
+        }
+
+        // Read the whole batch in file order
+        struct Request {
+            uint64_t key;
+            int fd;
+            ClusterExtent extent;
+        };
+        std::vector<Request> batch;
+        for (uint64_t key : mQueue) {
+            const File& file = mFiles[key >> 32];
+            batch.push_back(Request {key, file.fd, file.extents[key & 0xFFFFFFFFu]});
+        }
+        mQueue.clear();
+        std::sort(batch.begin(), batch.end(), [](const Request& lhs, const Request& rhs) {
+            return (lhs.fd != rhs.fd)? lhs.fd < rhs.fd : lhs.extent.offset < rhs.extent.offset;
+        });
+
+        for (const Request& request : batch) {
+            lock.unlock();
+            std::unique_ptr<GeometryCluster> loaded = read(request.fd, request.extent);
+            lock.lock();
+            if (loaded != nullptr && mPending.count(request.key) > 0) {
+                insert(request.key, loaded);
+            }
+            mPending.erase(request.key);
+        }
+        mLoaded.notify_all();
+    }
+}
+
+std::unique_ptr<GeometryCluster> GeometryCache::read(int fd, const ClusterExtent& extent) {
+    std::unique_ptr<GeometryCluster> cluster(new GeometryCluster());
+    cluster->size = extent.size;
+    cluster->data.reset(new uint8_t[extent.size]);
+    size_t done = 0;
+    while (done < extent.size) {
+        const ssize_t n = pread(fd, cluster->data.get() + done, extent.size - done, extent.offset + done);
+        if (n <= 0) {
+            Debug::Log::e(TAG, "Could not read a cluster at offset %llu",
+                static_cast<unsigned long long>(extent.offset));
+            return nullptr;
+        }
+        done += n;
+    }
+    mLoads.fetch_add(1, std::memory_order_relaxed);
+    mBytesRead.fetch_add(extent.size, std::memory_order_relaxed);
+
+    ClusterHeader header;
+    std::copy_n(cluster->data.get(), sizeof(header), reinterpret_cast<uint8_t*>(&header));
+    const uint64_t needed = sizeof(ClusterHeader) +
+        static_cast<uint64_t>(header.nodeCount) * sizeof(TriangleMesh::Node) +
+        static_cast<uint64_t>(header.vertexCount) * 3 * sizeof(float) +
+        static_cast<uint64_t>(header.triangleCount) * 3 * sizeof(uint32_t);
+    if (extent.size < sizeof(ClusterHeader) || needed > extent.size || header.nodeCount == 0) {
+        Debug::Log::e(TAG, "Invalid cluster at offset %llu", static_cast<unsigned long long>(extent.offset));
+        return nullptr;
+    }
+
+    uint8_t* p = cluster->data.get() + sizeof(ClusterHeader);
+    TriangleMesh::Node* nodes = reinterpret_cast<TriangleMesh::Node*>(p);
+    p += header.nodeCount * sizeof(TriangleMesh::Node);
+    float* positions = reinterpret_cast<float*>(p);
+    p += header.vertexCount * 3 * sizeof(float);
+    uint32_t* indices = reinterpret_cast<uint32_t*>(p);
+    for (uint32_t i = 0; i < 3 * header.triangleCount; i++) {
+        if (indices[i] >= header.vertexCount) {
+            Debug::Log::e(TAG, "Invalid cluster at offset %llu", static_cast<unsigned long long>(extent.offset));
+            return nullptr;
+        }
+    }
+    cluster->mesh.reset(new TriangleMesh(Material(), positions, header.vertexCount,
+        indices, header.triangleCount, nodes, header.nodeCount));
+    return cluster;
+}
+
+GeometryCluster* GeometryCache::insert(uint64_t key, std::unique_ptr<GeometryCluster>& cluster) {
+    Slot& s = slot(key);
+    GeometryCluster* resident = s.cluster.load();
+    if (resident != nullptr) {
+        // Another thread read it first
+        return resident;
+    }
+
+    // The oldest last use goes first. Ticks wrap, so ages are compared
+    const uint32_t tick = mTick.fetch_add(1, std::memory_order_relaxed) + 1;
+    while (mResident + cluster->size > mBudget && !mResidentKeys.empty()) {
+        unsigned oldest = 0;
+        uint32_t oldestAge = 0;
+        for (unsigned int i = 0; i < mResidentKeys.size(); i++) {
+            const uint32_t age = tick - slot(mResidentKeys[i]).lastUse.load(std::memory_order_relaxed);
+            if (age > oldestAge) {
+                oldest = i;
+                oldestAge = age;
+            }
+        }
+        evict(oldest);
+    }
+
+    resident = cluster.release();
+    s.lastUse.store(tick, std::memory_order_relaxed);
+    s.cluster.store(resident);
+    mResidentKeys.push_back(key);
+    mResident += resident->size;
+    reclaim();
+    return resident;
+}
+
+void GeometryCache::evict(unsigned index) {
+    const uint64_t key = mResidentKeys[index];
+    GeometryCluster* cluster = slot(key).cluster.exchange(nullptr);
+    mResidentKeys[index] = mResidentKeys.back();
+    mResidentKeys.pop_back();
+    mResident -= cluster->size;
+    mEvictions.fetch_add(1, std::memory_order_relaxed);
+
+    // Sections that begin after the epoch advances cannot find it any more
+    mRetired.push_back(Retired {mEpoch.fetch_add(1), cluster});
+}
+
+void GeometryCache::reclaim() {
+    if (mRetired.empty()) {
+        return;
+    }
+    uint64_t oldest = mEpoch.load();
+    for (unsigned int r = 0; r < READER_SLOTS; r++) {
+        const uint64_t state = mReaders[r].state.load();
+        if ((state >> SECTION_SHIFT) > 0) {
+            oldest = std::min(oldest, state & EPOCH_MASK);
+        }
+    }
+
+    auto end = std::remove_if(mRetired.begin(), mRetired.end(), [oldest](Retired& retired) {
+        if (retired.epoch < oldest) {
+            delete retired.cluster;
+            return true;
+        }
+        return false;
+    });
+    mRetired.erase(end, mRetired.end());
+}
+
+bool GeometryCache::request(uint64_t key) {
+    if (slot(key).cluster.load() != nullptr || !mPending.insert(key).second) {
+        return false;
+    }
+    mQueue.push_back(key);
+    return true;
+}
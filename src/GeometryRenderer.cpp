@@ -46,7 +46,7 @@ void GeometryRenderer::render(struct Scene& scene, Camera& camera) {
     for (unsigned int j = 0; j < height; j++) {
         for (unsigned int i = 0; i < width; i++) {
             Ray ray = camera.getRayToPixel(i, j);
-            surface[i][j] = traceRay(ray, scene);
+            surface.at(i, j) = traceRay(ray, scene);
         }
     }
 }
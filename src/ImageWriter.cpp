@@ -0,0 +1,111 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "ImageWriter.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include "debug.hpp"
+
+static const char* TAG = "ImageWriter";
+
+ImageWriter::ImageWriter(unsigned maxPending)
+:   mMaxPending(std::max(maxPending, 1u))
+{
+    mThread = std::thread(&ImageWriter::writerLoop, this);
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    mChanged.notify_all();
+    mThread.join();
+}
+
+void ImageWriter::write(Surface& surface, const std::string& filename, ImageFormat format) {
+    // Copy outside of the lock, the writer may be busy with the queue
+    push({std::make_unique<Surface>(surface), nullptr, filename, format});
+}
+
+void ImageWriter::write(DisplayImage& display, const std::string& filename, ImageFormat format) {
+    push({nullptr, std::make_unique<DisplayImage>(display), filename, format});
+}
+
+void ImageWriter::push(Job job) {
+    std::unique_lock<std::mutex> lock(mLock);
+    mChanged.wait(lock, [this]() { return mPending < mMaxPending; });
+    mJobs.push_back(std::move(job));
+    mPending++;
+    lock.unlock();
+    mChanged.notify_all();
+}
+
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mLock);
+    mChanged.wait(lock, [this]() { return mPending == 0; });
+}
+
+unsigned ImageWriter::getImagesWritten() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mWritten;
+}
+
+unsigned ImageWriter::getFailures() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mFailures;
+}
+
+double ImageWriter::getWriteSeconds() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mWriteSeconds;
+}
+
+void ImageWriter::writerLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mChanged.wait(lock, [this]() { return mExit || !mJobs.empty(); });
+        if (mJobs.empty()) {
+            // Only exit once the queue is drained
+            return;
+        }
+
+        Job job = std::move(mJobs.front());
+        mJobs.pop_front();
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        const bool ok = (job.surface != nullptr)?
+            job.surface->save(job.filename.c_str(), job.format) :
+            job.display->save(job.filename.c_str(), job.format);
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        Debug::Log::d(TAG, "Wrote %s in %.3f s", job.filename.c_str(), seconds);
+        job.surface.reset();
+        job.display.reset();
+
+        lock.lock();
+        mWritten++;
+        mFailures += ok? 0 : 1;
+        mWriteSeconds += seconds;
+        mPending--;
+        mChanged.notify_all();
+    }
+}
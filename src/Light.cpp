@@ -27,7 +27,13 @@ Ray::Ray(Vec3D origin_m, Vec3D dir_v) :
     mOrigin_v(origin_m),
     mDirection_v(dir_v.normalize()) { }
 
-Ray::~Ray() {}
+Ray::Ray(Vec3D origin_v, Vec3D direction_v, Unit) :
+    mOrigin_v(origin_v),
+    mDirection_v(direction_v) { }
+
+Ray Ray::withUnitDirection(Vec3D origin_v, Vec3D direction_v) {
+    return Ray(origin_v, direction_v, Unit());
+}
 
 Vec3D Ray::getOrigin() {
     return mOrigin_v;
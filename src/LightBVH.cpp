@@ -0,0 +1,260 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "LightBVH.hpp"
+
+#include "Common.hpp"
+#include "Objects.hpp"
+#include "Utils.hpp"
+#include "Vector3D.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "debug.hpp"
+
+static const char* TAG = "LightBVH";
+
+static Vec3D enclosureCenter(const struct Enclosure& e) {
+    return Vec3D((e.x_min + e.x_max)/2, (e.y_min + e.y_max)/2, (e.z_min + e.z_max)/2);
+}
+
+static struct Enclosure mergeEnclosures(const struct Enclosure& a, const struct Enclosure& b) {
+    return Enclosure {
+        std::min(a.x_min, b.x_min), std::max(a.x_max, b.x_max),
+        std::min(a.y_min, b.y_min), std::max(a.y_max, b.y_max),
+        std::min(a.z_min, b.z_min), std::max(a.z_max, b.z_max),
+    };
+}
+
+/** Smallest cone of lines containing two cones of lines */
+static struct NormalCone mergeCones(struct NormalCone a, struct NormalCone b) {
+    if (b.theta > a.theta) {
+        std::swap(a, b);
+    }
+
+    // Two-sided cones: use the orientation of b closest to a
+    if (a.axis.dot(b.axis) < 0) {
+        b.axis = b.axis.negative();
+    }
+
+    const Real cosD = std::min<Real>(1, a.axis.dot(b.axis));
+    const Real thetaD = acos(cosD);
+    if (std::min<Real>(thetaD + b.theta, M_PI) <= a.theta) {
+        return a;
+    }
+
+    const Real theta = (a.theta + thetaD + b.theta) / 2;
+    if (theta >= M_PI/2) {
+        // Lines in every direction
+        return NormalCone {a.axis, static_cast<Real>(M_PI)};
+    }
+
+    // Rotate a's axis towards b's by the growth of the cone
+    const Real thetaR = theta - a.theta;
+    Vec3D perp = b.axis - cosD*a.axis;
+    if (perp.dist() == 0) {
+        return NormalCone {a.axis, theta};
+    }
+    Vec3D axis = static_cast<Real>(cos(thetaR))*a.axis +
+        static_cast<Real>(sin(thetaR))*perp.normalize();
+    return NormalCone {axis.normalize(), theta};
+}
+
+LightBVH::LightBVH() { }
+
+LightBVH::~LightBVH() { }
+
+unsigned LightBVH::size() {
+    return mLights.size();
+}
+
+bool LightBVH::empty() {
+    return mLights.empty();
+}
+
+bool LightBVH::contains(IObject3D* object) {
+    return mLightSet.count(object) > 0;
+}
+
+void LightBVH::build(std::vector<IObject3D*>& objects) {
+    auto start = std::chrono::steady_clock::now();
+
+    mNodes.clear();
+    mLights.clear();
+    mLightSet.clear();
+
+    std::vector<LightInfo> lights;
+    for (IObject3D* object : objects) {
+        Real power = luminance(object->material().emission);
+        Real area = object->getArea();
+        if (power <= 0 || area == infinity<Real>()) {
+            continue;
+        }
+
+        LightInfo info;
+        info.object = object;
+        info.bounds = object->getEnclosure();
+        info.cone = object->getNormalCone();
+        info.centroid = enclosureCenter(info.bounds);
+        info.power = power * area;
+        lights.push_back(info);
+    }
+
+    if (!lights.empty()) {
+        mNodes.reserve(2*lights.size() - 1);
+        mLights.reserve(lights.size());
+        buildRecursive(lights, 0, lights.size());
+        mLightSet.insert(mLights.begin(), mLights.end());
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    Debug::Log::i(TAG, "Built hierarchy of %zu lights (%zu nodes) in %.2f ms",
+        mLights.size(), mNodes.size(),
+        std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+unsigned LightBVH::buildRecursive(std::vector<LightInfo>& lights, unsigned begin, unsigned end) {
+    const unsigned index = mNodes.size();
+    mNodes.push_back(Node());
+
+    Node node;
+    node.bounds = lights[begin].bounds;
+    node.cone = lights[begin].cone;
+    node.power = lights[begin].power;
+    struct Enclosure centroids = Enclosure {
+        lights[begin].centroid.x, lights[begin].centroid.x,
+        lights[begin].centroid.y, lights[begin].centroid.y,
+        lights[begin].centroid.z, lights[begin].centroid.z,
+    };
+    for (unsigned int l = begin + 1; l < end; l++) {
+        node.bounds = mergeEnclosures(node.bounds, lights[l].bounds);
+        node.cone = mergeCones(node.cone, lights[l].cone);
+        node.power += lights[l].power;
+
+        Vec3D& c = lights[l].centroid;
+        centroids = mergeEnclosures(centroids, Enclosure {c.x, c.x, c.y, c.y, c.z, c.z});
+    }
+
+    if (end - begin == 1) {
+        node.light = mLights.size();
+        node.secondChild = 0;
+        mLights.push_back(lights[begin].object);
+        mNodes[index] = node;
+        return index;
+    }
+
+    // Median split along the largest extent of the centroids
+    const Real dx = centroids.x_max - centroids.x_min;
+    const Real dy = centroids.y_max - centroids.y_min;
+    const Real dz = centroids.z_max - centroids.z_min;
+    const int axis = (dx >= dy && dx >= dz)? 0 : (dy >= dz)? 1 : 2;
+    const unsigned mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+        [axis](const LightInfo& lhs, const LightInfo& rhs) -> bool {
+            switch (axis) {
+                case 0: return lhs.centroid.x < rhs.centroid.x;
+                case 1: return lhs.centroid.y < rhs.centroid.y;
+                default: return lhs.centroid.z < rhs.centroid.z;
+            }
+        }
+    );
+
+    buildRecursive(lights, begin, mid);
+    node.secondChild = buildRecursive(lights, mid, end);
+    node.light = -1;
+    mNodes[index] = node;
+    return index;
+}
+
+Real LightBVH::importance(const Node& node, Vec3D& point, Vec3D& normal) {
+    const struct Enclosure& e = node.bounds;
+    Vec3D toPoint = point - enclosureCenter(e);
+    Vec3D diagonal(e.x_max - e.x_min, e.y_max - e.y_min, e.z_max - e.z_min);
+    const Real r2 = diagonal.dot(diagonal) / 4;
+    const Real d2 = toPoint.dot(toPoint);
+
+    if (d2 <= r2) {
+        // Inside the bounding sphere no direction can be ruled out
+        return node.power / std::max<Real>(r2, 1e-6);
+    }
+
+    const Real d = sqrt(d2);
+    Vec3D dir = (1/d) * toPoint;
+    const Real thetaU = asin(std::min<Real>(1, sqrt(r2) / d));
+
+    // Emitter side. Cones are two-sided
+    Vec3D axis = node.cone.axis;
+    const Real cosE = std::min<Real>(1, fabs(axis.dot(dir)));
+    const Real thetaE = std::max<Real>(0, acos(cosE) - node.cone.theta - thetaU);
+    if (thetaE >= M_PI/2) {
+        return 0;
+    }
+
+    // Receiver side
+    const Real cosR = std::max<Real>(-1, std::min<Real>(1, -normal.dot(dir)));
+    const Real thetaR = std::max<Real>(0, acos(cosR) - thetaU);
+    if (thetaR >= M_PI/2) {
+        return 0;
+    }
+
+    return node.power * cos(thetaE) * cos(thetaR) / d2;
+}
+
+IObject3D* LightBVH::sample(Vec3D& point, Vec3D& normal, Real u, Real& pmf) {
+    pmf = 0;
+    if (mNodes.empty()) {
+        return nullptr;
+    }
+
+    Vec3D n = normal.normalize();
+    Real p = 1;
+    unsigned index = 0;
+    while (mNodes[index].light < 0) {
+        const unsigned first = index + 1;
+        const unsigned second = mNodes[index].secondChild;
+        const Real iFirst = importance(mNodes[first], point, n);
+        const Real iSecond = importance(mNodes[second], point, n);
+        const Real total = iFirst + iSecond;
+        if (total <= 0) {
+            return nullptr;
+        }
+
+        const Real pFirst = iFirst / total;
+        if (u < pFirst) {
+            u = std::min<Real>(u / pFirst, 1 - 1e-6);
+            p *= pFirst;
+            index = first;
+        } else {
+            u = std::min<Real>((u - pFirst) / (1 - pFirst), 1 - 1e-6);
+            p *= 1 - pFirst;
+            index = second;
+        }
+    }
+
+    pmf = p;
+    return mLights[mNodes[index].light];
+}
+
+size_t LightBVH::getSizeBytes() {
+    // Nodes of the hash set: the pointer, the next pointer and the hash
+    return mNodes.capacity() * sizeof(Node) + mLights.capacity() * sizeof(IObject3D*) +
+        mLightSet.bucket_count() * sizeof(void*) + mLightSet.size() * 3 * sizeof(void*);
+}
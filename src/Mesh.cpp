@@ -0,0 +1,438 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Mesh.hpp"
+
+#include "Light.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "debug.hpp"
+
+static const char* TAG = "TriangleMesh";
+
+/** Triangles of a leaf when splitting does not pay off, and at most */
+static const unsigned MIN_LEAF_TRIANGLES = 2;
+static const unsigned MAX_LEAF_TRIANGLES = 16;
+/** Bins of the surface area heuristic along the split axis */
+static const unsigned SAH_BINS = 16;
+/** Cost of visiting a node relative to intersecting a triangle */
+static const float TRAVERSAL_COST = 1.0f;
+static const unsigned STACK_SIZE = 64;
+
+/**
+ * Triangle of the last hit or sampled point of the calling thread. The
+ * normal queries that follow an intersection refer to the same triangle.
+*/
+static thread_local struct {
+    const TriangleMesh* mesh = nullptr;
+    uint32_t triangle = 0;
+} lastHit;
+
+namespace {
+
+struct Bounds {
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    void grow(const float* p) {
+        for (unsigned int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], p[k]);
+            hi[k] = std::max(hi[k], p[k]);
+        }
+    }
+
+    void grow(const Bounds& b) {
+        for (unsigned int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], b.lo[k]);
+            hi[k] = std::max(hi[k], b.hi[k]);
+        }
+    }
+
+    float area() const {
+        const float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return (dx < 0)? 0 : 2*(dx*dy + dy*dz + dz*dx);
+    }
+};
+
+}
+
+/** Bounds and centroid of every triangle, indexed by triangle */
+struct TriangleMesh::BuildInput {
+    std::vector<Bounds> bounds;
+    std::vector<float> centroids;
+};
+
+TriangleMesh::TriangleMesh(struct Material material, std::vector<float>&& positions, std::vector<uint32_t>&& indices)
+:   IObject3D(material),
+    mPositionStorage(std::move(positions)),
+    mIndexStorage(std::move(indices))
+{
+    mIndexStorage.resize(mIndexStorage.size() - mIndexStorage.size() % 3);
+    mPositions = mPositionStorage.data();
+    mVertexCount = mPositionStorage.size() / 3;
+    mIndices = mIndexStorage.data();
+    mTriangleCount = mIndexStorage.size() / 3;
+    build();
+    mNodes = mNodeStorage.data();
+    mNodeCount = mNodeStorage.size();
+}
+
+TriangleMesh::TriangleMesh(struct Material material, float* positions, uint32_t vertexCount,
+                           uint32_t* indices, uint32_t triangleCount, Node* nodes, uint32_t nodeCount)
+:   IObject3D(material),
+    mPositions(positions), mVertexCount(vertexCount),
+    mIndices(indices), mTriangleCount(triangleCount),
+    mNodes(nodes), mNodeCount(nodeCount)
+{ }
+
+TriangleMesh::~TriangleMesh() {
+    if (lastHit.mesh == this) {
+        lastHit.mesh = nullptr;
+    }
+}
+
+void TriangleMesh::build() {
+    auto start = std::chrono::steady_clock::now();
+
+    const uint32_t triangles = mTriangleCount;
+    mNodeStorage.clear();
+    if (triangles == 0) {
+        return;
+    }
+
+    BuildInput input;
+    input.bounds.resize(triangles);
+    input.centroids.resize(3 * triangles);
+    #pragma omp parallel for schedule(static)
+    for (uint32_t t = 0; t < triangles; t++) {
+        Bounds& b = input.bounds[t];
+        for (unsigned int v = 0; v < 3; v++) {
+            b.grow(&mPositions[3 * mIndices[3*t + v]]);
+        }
+        for (unsigned int k = 0; k < 3; k++) {
+            input.centroids[3*t + k] = 0.5f * (b.lo[k] + b.hi[k]);
+        }
+    }
+
+    std::vector<uint32_t> order(triangles);
+    for (uint32_t t = 0; t < triangles; t++) {
+        order[t] = t;
+    }
+
+    mNodeStorage.reserve(2 * triangles / MIN_LEAF_TRIANGLES + 1);
+    buildNode(input, order, 0, triangles);
+    mNodeStorage.shrink_to_fit();
+
+    // Store the triangles in the order of the leaves
+    std::vector<uint32_t> indices(mIndexStorage.size());
+    #pragma omp parallel for schedule(static)
+    for (uint32_t t = 0; t < triangles; t++) {
+        std::copy_n(&mIndexStorage[3 * order[t]], 3, &indices[3*t]);
+    }
+    mIndexStorage.swap(indices);
+    mIndices = mIndexStorage.data();
+
+    auto end = std::chrono::steady_clock::now();
+    Debug::Log::i(TAG, "Built hierarchy of %d triangles: %zu nodes in %.2f s", triangles, mNodeStorage.size(),
+        std::chrono::duration<double>(end - start).count());
+}
+
+uint32_t TriangleMesh::buildNode(BuildInput& input, std::vector<uint32_t>& order, uint32_t begin, uint32_t end) {
+    Bounds bounds, centroids;
+    for (uint32_t i = begin; i < end; i++) {
+        bounds.grow(input.bounds[order[i]]);
+        centroids.grow(&input.centroids[3 * order[i]]);
+    }
+
+    const uint32_t index = mNodeStorage.size();
+    mNodeStorage.emplace_back();
+    Node node;
+    std::copy_n(bounds.lo, 3, node.lo);
+    std::copy_n(bounds.hi, 3, node.hi);
+    node.offset = begin;
+    node.count = end - begin;
+
+    unsigned axis = 0;
+    for (unsigned int k = 1; k < 3; k++) {
+        if (centroids.hi[k] - centroids.lo[k] > centroids.hi[axis] - centroids.lo[axis]) {
+            axis = k;
+        }
+    }
+    const float extent = centroids.hi[axis] - centroids.lo[axis];
+    const uint32_t count = end - begin;
+
+    uint32_t middle = begin;
+    if (count > MIN_LEAF_TRIANGLES && extent > 0) {
+        // Binned surface area heuristic
+        Bounds binBounds[SAH_BINS];
+        uint32_t binCounts[SAH_BINS] = {0};
+        const float scale = SAH_BINS / extent;
+        auto binOf = [&](uint32_t t) {
+            const unsigned bin = (input.centroids[3*t + axis] - centroids.lo[axis]) * scale;
+            return std::min(bin, SAH_BINS - 1);
+        };
+        for (uint32_t i = begin; i < end; i++) {
+            const unsigned bin = binOf(order[i]);
+            binBounds[bin].grow(input.bounds[order[i]]);
+            binCounts[bin]++;
+        }
+
+        float rightCosts[SAH_BINS];
+        Bounds right;
+        uint32_t rightCount = 0;
+        for (unsigned int b = SAH_BINS - 1; b > 0; b--) {
+            right.grow(binBounds[b]);
+            rightCount += binCounts[b];
+            rightCosts[b] = right.area() * rightCount;
+        }
+
+        Bounds left;
+        uint32_t leftCount = 0;
+        float bestCost = INFINITY;
+        unsigned bestSplit = 0;
+        for (unsigned int b = 1; b < SAH_BINS; b++) {
+            left.grow(binBounds[b - 1]);
+            leftCount += binCounts[b - 1];
+            const float cost = left.area() * leftCount + rightCosts[b];
+            if (leftCount > 0 && leftCount < count && cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        const float leafCost = bounds.area() * count;
+        bestCost = TRAVERSAL_COST * bounds.area() + bestCost;
+        if (bestSplit > 0 && (bestCost < leafCost || count > MAX_LEAF_TRIANGLES)) {
+            middle = std::partition(order.begin() + begin, order.begin() + end,
+                [&](uint32_t t) { return binOf(t) < bestSplit; }) - order.begin();
+        }
+    }
+    if (middle == begin && count > MAX_LEAF_TRIANGLES) {
+        // Centroids in one point: split in halves
+        middle = begin + count/2;
+    }
+
+    if (middle > begin && middle < end) {
+        node.count = 0;
+        buildNode(input, order, begin, middle);
+        node.offset = buildNode(input, order, middle, end);
+    }
+    mNodeStorage[index] = node;
+    return index;
+}
+
+void TriangleMesh::buildAreas() {
+    const uint32_t triangles = mTriangleCount;
+    mAreaCdf.resize(triangles);
+    double sum = 0;
+    for (uint32_t t = 0; t < triangles; t++) {
+        sum += 0.5 * triangleNormal(t).dist();
+        mAreaCdf[t] = sum;
+    }
+}
+
+Vec3D TriangleMesh::triangleNormal(uint32_t triangle) {
+    const float* a = &mPositions[3 * mIndices[3*triangle]];
+    const float* b = &mPositions[3 * mIndices[3*triangle + 1]];
+    const float* c = &mPositions[3 * mIndices[3*triangle + 2]];
+    Vec3D AC_v(c[0] - a[0], c[1] - a[1], c[2] - a[2]);
+    Vec3D AB_v(b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+    return AC_v.cross(AB_v);
+}
+
+int64_t TriangleMesh::intersectTriangles(Ray& ray, Real& tMax) {
+    if (mNodeCount == 0) {
+        return -1;
+    }
+
+    Vec3D origin_v = ray.getOrigin();
+    Vec3D direction_v = ray.getDirection();
+    const float origin[3] = {origin_v.x, origin_v.y, origin_v.z};
+    const float direction[3] = {direction_v.x, direction_v.y, direction_v.z};
+    float inverse[3];
+    for (unsigned int k = 0; k < 3; k++) {
+        // Avoid 0 * infinity in the slab test of flat nodes
+        inverse[k] = (direction[k] != 0)? 1 / direction[k] : std::copysign(1e30f, direction[k]);
+    }
+
+    int64_t hit = -1;
+    uint32_t stack[STACK_SIZE];
+    unsigned size = 0;
+    uint32_t current = 0;
+    if (enterNode(mNodes[0].lo, mNodes[0].hi, origin, inverse, tMax) == INFINITY) {
+        return -1;
+    }
+
+    while (true) {
+        const Node& node = mNodes[current];
+        if (node.count == 0) {
+            // Visit the nearest child first
+            uint32_t near = current + 1, far = node.offset;
+            float tNear = enterNode(mNodes[near].lo, mNodes[near].hi, origin, inverse, tMax);
+            float tFar = enterNode(mNodes[far].lo, mNodes[far].hi, origin, inverse, tMax);
+            if (tFar < tNear) {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            if (tNear != INFINITY) {
+                if (tFar != INFINITY && size < STACK_SIZE) {
+                    stack[size++] = far;
+                }
+                current = near;
+                continue;
+            }
+        } else {
+            // Möller-Trumbore
+            for (uint32_t t = node.offset; t < node.offset + node.count; t++) {
+                const float* a = &mPositions[3 * mIndices[3*t]];
+                const float* b = &mPositions[3 * mIndices[3*t + 1]];
+                const float* c = &mPositions[3 * mIndices[3*t + 2]];
+                const float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+                const float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+                const float p[3] = {direction[1]*e2[2] - direction[2]*e2[1],
+                                    direction[2]*e2[0] - direction[0]*e2[2],
+                                    direction[0]*e2[1] - direction[1]*e2[0]};
+                const float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+                if (det == 0) {
+                    continue;
+                }
+                const float invDet = 1 / det;
+                const float s[3] = {origin[0] - a[0], origin[1] - a[1], origin[2] - a[2]};
+                const float u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * invDet;
+                if (u < 0 || u > 1) {
+                    continue;
+                }
+                const float q[3] = {s[1]*e1[2] - s[2]*e1[1],
+                                    s[2]*e1[0] - s[0]*e1[2],
+                                    s[0]*e1[1] - s[1]*e1[0]};
+                const float v = (direction[0]*q[0] + direction[1]*q[1] + direction[2]*q[2]) * invDet;
+                if (v < 0 || u + v > 1) {
+                    continue;
+                }
+                const float distance = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * invDet;
+                if (distance > 0 && distance < tMax) {
+                    tMax = distance;
+                    hit = t;
+                }
+            }
+        }
+
+        if (size == 0) {
+            break;
+        }
+        current = stack[--size];
+    }
+    return hit;
+}
+
+Real TriangleMesh::intersect(Ray& ray) {
+    Real t = infinity<Real>();
+    const int64_t triangle = intersectTriangles(ray, t);
+    if (triangle < 0) {
+        return -infinity<Real>();
+    }
+    lastHit.mesh = this;
+    lastHit.triangle = triangle;
+    return t;
+}
+
+Vec3D TriangleMesh::getSurfaceNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v) {
+    if (lastHit.mesh != this) {
+        // Another object was intersected since: find the triangle again
+        // from just before the point
+        struct Enclosure e = getEnclosure();
+        const Real back = 1e-4f * std::max({e.x_max - e.x_min, e.y_max - e.y_min, e.z_max - e.z_min, 1.0f});
+        Ray ray(hitPoint_v - back*hitDirection_v, hitDirection_v);
+        if (intersect(ray) < 0) {
+            return hitDirection_v.negative();
+        }
+    }
+    return triangleNormal(lastHit.triangle).normalize();
+}
+
+Vec3D TriangleMesh::getHitNormal(Vec3D& hitPoint_v, Vec3D& hitDirection_v) {
+    Vec3D normal_v = getSurfaceNormal(hitPoint_v, hitDirection_v);
+    if (hitDirection_v.dot(normal_v) < 0) {
+        return normal_v;
+    } else {
+        return normal_v.negative();
+    }
+}
+
+struct Enclosure TriangleMesh::getEnclosure() {
+    if (mNodeCount == 0) {
+        return Enclosure {0, 0, 0, 0, 0, 0};
+    }
+    const Node& root = mNodes[0];
+    return Enclosure {root.lo[0], root.hi[0], root.lo[1], root.hi[1], root.lo[2], root.hi[2]};
+}
+
+Real TriangleMesh::getArea() {
+    std::call_once(mAreaOnce, &TriangleMesh::buildAreas, this);
+    return mAreaCdf.empty()? 0 : mAreaCdf.back();
+}
+
+Vec3D TriangleMesh::samplePoint(Real u1, Real u2) {
+    std::call_once(mAreaOnce, &TriangleMesh::buildAreas, this);
+    if (mAreaCdf.empty()) {
+        return Vec3D();
+    }
+
+    // Pick a triangle by area with u1 and reuse what is left of it
+    const float target = u1 * mAreaCdf.back();
+    const uint32_t t = std::min<size_t>(std::upper_bound(mAreaCdf.begin(), mAreaCdf.end(), target) - mAreaCdf.begin(),
+        mAreaCdf.size() - 1);
+    const float first = (t > 0)? mAreaCdf[t - 1] : 0;
+    const float area = mAreaCdf[t] - first;
+    u1 = (area > 0)? std::min((target - first) / area, 1.0f) : 0;
+    lastHit.mesh = this;
+    lastHit.triangle = t;
+
+    const float* a = &mPositions[3 * mIndices[3*t]];
+    const float* b = &mPositions[3 * mIndices[3*t + 1]];
+    const float* c = &mPositions[3 * mIndices[3*t + 2]];
+    Real su1 = sqrt(u1);
+    Real b0 = 1 - su1;
+    Real b1 = u2 * su1;
+    Real b2 = 1 - b0 - b1;
+    return Vec3D(b0*a[0] + b1*b[0] + b2*c[0], b0*a[1] + b1*b[1] + b2*c[1], b0*a[2] + b1*b[2] + b2*c[2]);
+}
+
+void TriangleMesh::translate(Vec3D& offset_v) {
+    const float offset[3] = {offset_v.x, offset_v.y, offset_v.z};
+    for (size_t i = 0; i < 3 * static_cast<size_t>(mVertexCount); i++) {
+        mPositions[i] += offset[i % 3];
+    }
+    for (uint32_t n = 0; n < mNodeCount; n++) {
+        for (unsigned int k = 0; k < 3; k++) {
+            mNodes[n].lo[k] += offset[k];
+            mNodes[n].hi[k] += offset[k];
+        }
+    }
+}
+
+size_t TriangleMesh::getStorageBytes() {
+    // Borrowed arrays are counted too: they are mapped while the mesh lives
+    return 3 * sizeof(float) * static_cast<size_t>(mVertexCount) +
+        3 * sizeof(uint32_t) * static_cast<size_t>(mTriangleCount) +
+        sizeof(Node) * static_cast<size_t>(mNodeCount) + sizeof(float) * mAreaCdf.size();
+}
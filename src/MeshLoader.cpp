@@ -0,0 +1,698 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "MeshLoader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "MeshLoader";
+
+/** Bytes of OBJ text parsed by one task */
+static const size_t OBJ_CHUNK_SIZE = 4 << 20;
+/** Values copied by one task from PLY records */
+static const size_t PLY_COPY_BLOCK = 1 << 20;
+
+/** A read-only mapping of a whole file */
+class MappedFile {
+public:
+    const char* data = nullptr;
+    size_t size = 0;
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    bool open(const char* filename) {
+        const int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        // Chunks are read in parallel, so read ahead the whole file
+        madvise(mapping, info.st_size, MADV_WILLNEED);
+        data = static_cast<const char*>(mapping);
+        size = info.st_size;
+        return true;
+    }
+};
+
+
+/* OBJ */
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline void skipBlanks(const char*& p, const char* end) {
+    while (p < end && isBlank(*p)) {
+        p++;
+    }
+}
+
+/**
+ * Parse a decimal real at p, which is moved past it. Unlike strtof it stops
+ * at end, as the mapping is not terminated, and ignores the locale.
+*/
+static inline bool parseReal(const char*& p, const char* end, float& value) {
+    const char* s = p;
+    const bool negative = (s < end && *s == '-');
+    if (s < end && (*s == '-' || *s == '+')) {
+        s++;
+    }
+
+    // 18 significant digits are plenty for a float, the rest scale it
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; s < end && isDigit(*s); s++, digits = true) {
+        if (mantissa < 100000000000000000ull) {
+            mantissa = 10*mantissa + (*s - '0');
+        } else {
+            exponent++;
+        }
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && isDigit(*s); s++, digits = true) {
+            if (mantissa < 100000000000000000ull) {
+                mantissa = 10*mantissa + (*s - '0');
+                exponent--;
+            }
+        }
+    }
+    if (!digits) {
+        return false;
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        const bool negativeExponent = (e < end && *e == '-');
+        if (e < end && (*e == '-' || *e == '+')) {
+            e++;
+        }
+        int value = 0;
+        for (; e < end && isDigit(*e); e++) {
+            value = std::min(10*value + (*e - '0'), 1000);
+        }
+        exponent += negativeExponent? -value : value;
+        s = e;
+    }
+
+    double result = mantissa;
+    if (exponent < 0) {
+        result = (exponent >= -22)? result / POWERS_OF_TEN[-exponent] : result * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = (exponent <= 22)? result * POWERS_OF_TEN[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = negative? -result : result;
+    p = s;
+    return true;
+}
+
+/** Parse an integer at p, which is moved past it */
+static inline bool parseInteger(const char*& p, const char* end, int64_t& value) {
+    const char* s = p;
+    const bool negative = (s < end && *s == '-');
+    if (s < end && (*s == '-' || *s == '+')) {
+        s++;
+    }
+    if (s == end || !isDigit(*s)) {
+        return false;
+    }
+    int64_t result = 0;
+    for (; s < end && isDigit(*s); s++) {
+        result = std::min<int64_t>(10*result + (*s - '0'), INT64_C(1) << 40);
+    }
+    value = negative? -result : result;
+    p = s;
+    return true;
+}
+
+/** Vertices and triangles of a chunk of an OBJ file */
+struct ObjChunk {
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    /**
+     * Places in indices of relative vertex references, which count from the
+     * start of the chunk until the vertex offset of the chunk is known
+    */
+    std::vector<uint32_t> relative;
+    /** Offset in the file of the first invalid line, if any */
+    const char* error = nullptr;
+};
+
+/** Parse the lines in [begin, end) */
+static void parseObjChunk(const char* begin, const char* end, ObjChunk& chunk) {
+    // Vertex references of the face being read and whether they are relative
+    std::vector<std::pair<uint32_t, bool>> face;
+
+    const char* p = begin;
+    while (p < end) {
+        const char* line = p;
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == nullptr) {
+            eol = end;
+        }
+
+        skipBlanks(p, eol);
+        if (eol - p > 1 && p[0] == 'v' && isBlank(p[1])) {
+            float x, y, z;
+            p++;
+            skipBlanks(p, eol);
+            if (!parseReal(p, eol, x) || (skipBlanks(p, eol), !parseReal(p, eol, y)) ||
+                (skipBlanks(p, eol), !parseReal(p, eol, z))) {
+                chunk.error = line;
+                return;
+            }
+            chunk.positions.push_back(x);
+            chunk.positions.push_back(y);
+            chunk.positions.push_back(z);
+        } else if (eol - p > 1 && p[0] == 'f' && isBlank(p[1])) {
+            face.clear();
+            p++;
+            const int64_t vertices = chunk.positions.size() / 3;
+            while (skipBlanks(p, eol), p < eol) {
+                // v, v/vt, v//vn or v/vt/vn: only v matters
+                int64_t index;
+                if (!parseInteger(p, eol, index) || index == 0 || index > UINT32_MAX) {
+                    chunk.error = line;
+                    return;
+                }
+                while (p < eol && !isBlank(*p)) {
+                    p++;
+                }
+                if (index > 0) {
+                    face.emplace_back(index - 1, false);
+                } else {
+                    // Wraps around if it points before the chunk, which
+                    // the offset of the chunk undoes
+                    face.emplace_back(static_cast<uint32_t>(vertices + index), true);
+                }
+            }
+            if (face.size() < 3) {
+                chunk.error = line;
+                return;
+            }
+            for (unsigned int k = 1; k + 1 < face.size(); k++) {
+                for (unsigned int v : {0u, k, k + 1}) {
+                    if (face[v].second) {
+                        chunk.relative.push_back(chunk.indices.size());
+                    }
+                    chunk.indices.push_back(face[v].first);
+                }
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+static bool loadObj(const char* filename, MappedFile& file,
+                    std::vector<float>& positions, std::vector<uint32_t>& indices)
+{
+    // Chunks start after the end of a line
+    const size_t count = (file.size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE;
+    std::vector<const char*> bounds(count + 1);
+    const char* end = file.data + file.size;
+    bounds[0] = file.data;
+    for (size_t c = 1; c < count; c++) {
+        const char* p = file.data + c * OBJ_CHUNK_SIZE;
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        bounds[c] = std::max(bounds[c - 1], (eol != nullptr)? eol + 1 : end);
+    }
+    bounds[count] = end;
+
+    std::vector<ObjChunk> chunks(count);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < count; c++) {
+        parseObjChunk(bounds[c], bounds[c + 1], chunks[c]);
+    }
+
+    std::vector<size_t> vertexOffsets(count + 1, 0), indexOffsets(count + 1, 0);
+    for (size_t c = 0; c < count; c++) {
+        if (chunks[c].error != nullptr) {
+            const size_t line = std::count(file.data, chunks[c].error, '\n') + 1;
+            Debug::Log::e(TAG, "%s:%zu: invalid line", filename, line);
+            return false;
+        }
+        vertexOffsets[c + 1] = vertexOffsets[c] + chunks[c].positions.size() / 3;
+        indexOffsets[c + 1] = indexOffsets[c] + chunks[c].indices.size();
+    }
+    if (vertexOffsets[count] > UINT32_MAX) {
+        Debug::Log::e(TAG, "%s: too many vertices", filename);
+        return false;
+    }
+
+    const uint32_t vertices = vertexOffsets[count];
+    positions.resize(3 * vertexOffsets[count]);
+    indices.resize(indexOffsets[count]);
+    bool valid = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:valid)
+    for (size_t c = 0; c < count; c++) {
+        ObjChunk& chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), &positions[3 * vertexOffsets[c]]);
+        for (uint32_t i : chunk.relative) {
+            chunk.indices[i] += vertexOffsets[c];
+        }
+        for (uint32_t index : chunk.indices) {
+            valid = valid && index < vertices;
+        }
+        std::copy(chunk.indices.begin(), chunk.indices.end(), &indices[indexOffsets[c]]);
+        chunk = ObjChunk();
+    }
+    if (!valid) {
+        Debug::Log::e(TAG, "%s: face with a vertex out of range", filename);
+        return false;
+    }
+    return true;
+}
+
+
+/* PLY */
+enum PlyType {
+    PLY_INVALID,
+    PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+    PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64,
+};
+
+struct PlyProperty {
+    std::string name;
+    /** Type of the value, or of the items of a list */
+    PlyType type;
+    bool list;
+    PlyType countType;
+};
+
+struct PlyElement {
+    std::string name;
+    uint64_t count;
+    std::vector<PlyProperty> properties;
+};
+
+static PlyType parsePlyType(const std::string& name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+static size_t plyTypeSize(PlyType type) {
+    static const size_t SIZES[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
+    return SIZES[type];
+}
+
+/** Read a little endian value of a type at p */
+static double readPly(PlyType type, const char* p) {
+    switch (type) {
+        case PLY_INT8: { int8_t v; memcpy(&v, p, 1); return v; }
+        case PLY_UINT8: { uint8_t v; memcpy(&v, p, 1); return v; }
+        case PLY_INT16: { int16_t v; memcpy(&v, p, 2); return v; }
+        case PLY_UINT16: { uint16_t v; memcpy(&v, p, 2); return v; }
+        case PLY_INT32: { int32_t v; memcpy(&v, p, 4); return v; }
+        case PLY_UINT32: { uint32_t v; memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT32: { float v; memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT64: { double v; memcpy(&v, p, 8); return v; }
+        default: return 0;
+    }
+}
+
+/**
+ * Read a list count or vertex index at p. Returns false if its type is
+ * not an integer or it is negative.
+*/
+static bool readPlyIndex(PlyType type, const char* p, uint32_t& value) {
+    if (type == PLY_FLOAT32 || type == PLY_FLOAT64) {
+        return false;
+    }
+    // Every integer type is exact in a double
+    const double v = readPly(type, p);
+    if (v < 0) {
+        return false;
+    }
+    value = static_cast<uint32_t>(v);
+    return true;
+}
+
+/** Size of every record of an element without lists, 0 if it has lists */
+static size_t plyRecordSize(const PlyElement& element) {
+    size_t size = 0;
+    for (const PlyProperty& property : element.properties) {
+        if (property.list) {
+            return 0;
+        }
+        size += plyTypeSize(property.type);
+    }
+    return size;
+}
+
+/** Read the header, leaving p at the data */
+static bool parsePlyHeader(const char*& p, const char* end, std::vector<PlyElement>& elements) {
+    bool first = true;
+    bool format = false;
+    while (p < end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == nullptr) {
+            return false;
+        }
+        std::string line(p, eol);
+        p = eol + 1;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        char word[4][64];
+        const int words = sscanf(line.c_str(), "%63s %63s %63s %63s", word[0], word[1], word[2], word[3]);
+        if (first) {
+            if (line != "ply") {
+                return false;
+            }
+            first = false;
+        } else if (words <= 0 || !strcmp(word[0], "comment") || !strcmp(word[0], "obj_info")) {
+            continue;
+        } else if (!strcmp(word[0], "format") && words >= 2) {
+            format = !strcmp(word[1], "binary_little_endian") &&
+                __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+        } else if (!strcmp(word[0], "element") && words == 3) {
+            elements.push_back(PlyElement {word[1], strtoull(word[2], nullptr, 10), {}});
+        } else if (!strcmp(word[0], "property") && !elements.empty() && words >= 3) {
+            PlyProperty property;
+            property.list = !strcmp(word[1], "list");
+            if (property.list && words == 4) {
+                property.countType = parsePlyType(word[2]);
+                property.type = parsePlyType(word[3]);
+                const char* name = strrchr(line.c_str(), ' ');
+                property.name = (name != nullptr)? name + 1 : "";
+            } else if (!property.list && words == 3) {
+                property.countType = PLY_INVALID;
+                property.type = parsePlyType(word[1]);
+                property.name = word[2];
+            } else {
+                return false;
+            }
+            if (property.type == PLY_INVALID || (property.list && property.countType == PLY_INVALID)) {
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        } else if (!strcmp(word[0], "end_header")) {
+            if (!format) {
+                Debug::Log::e(TAG, "Only binary little endian PLY files are supported");
+            }
+            return format;
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool readPlyVertices(const PlyElement& element, const char*& p, const char* end,
+                            std::vector<float>& positions)
+{
+    const size_t stride = plyRecordSize(element);
+    size_t offsets[3];
+    PlyType types[3] = {PLY_INVALID, PLY_INVALID, PLY_INVALID};
+    size_t offset = 0;
+    for (const PlyProperty& property : element.properties) {
+        for (unsigned int k = 0; k < 3; k++) {
+            if (property.name == std::string(1, 'x' + k)) {
+                offsets[k] = offset;
+                types[k] = property.type;
+            }
+        }
+        offset += plyTypeSize(property.type);
+    }
+    if (stride == 0 || types[0] == PLY_INVALID || types[1] == PLY_INVALID || types[2] == PLY_INVALID ||
+        element.count > UINT32_MAX || element.count > static_cast<size_t>(end - p) / stride) {
+        return false;
+    }
+
+    const size_t count = element.count;
+    positions.resize(3 * count);
+    const bool packed = stride == 3*sizeof(float) && offsets[0] == 0 && offsets[1] == 4 && offsets[2] == 8 &&
+        types[0] == PLY_FLOAT32 && types[1] == PLY_FLOAT32 && types[2] == PLY_FLOAT32;
+    const size_t blocks = (count + PLY_COPY_BLOCK - 1) / PLY_COPY_BLOCK;
+    const char* data = p;
+    #pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < blocks; b++) {
+        const size_t first = b * PLY_COPY_BLOCK;
+        const size_t last = std::min(first + PLY_COPY_BLOCK, count);
+        if (packed) {
+            memcpy(&positions[3 * first], data + first * stride, (last - first) * stride);
+        } else {
+            for (size_t v = first; v < last; v++) {
+                for (unsigned int k = 0; k < 3; k++) {
+                    positions[3*v + k] = readPly(types[k], data + v * stride + offsets[k]);
+                }
+            }
+        }
+    }
+    p += count * stride;
+    return true;
+}
+
+static bool readPlyFaces(const PlyElement& element, const char*& p, const char* end,
+                         std::vector<uint32_t>& indices)
+{
+    const PlyProperty* list = nullptr;
+    for (const PlyProperty& property : element.properties) {
+        if (property.list && (property.name == "vertex_indices" || property.name == "vertex_index")) {
+            list = &property;
+        }
+    }
+    if (list == nullptr) {
+        return false;
+    }
+
+    // Only triangles with 32 bit indices: copy the records
+    const size_t triangleRecord = 1 + 3*sizeof(uint32_t);
+    const size_t count = element.count;
+    if (element.properties.size() == 1 && list->countType == PLY_UINT8 &&
+        (list->type == PLY_INT32 || list->type == PLY_UINT32) &&
+        count <= static_cast<size_t>(end - p) / triangleRecord) {
+        const char* data = p;
+        bool triangles = true;
+        #pragma omp parallel for schedule(static) reduction(&&:triangles)
+        for (size_t f = 0; f < count; f++) {
+            triangles = triangles && data[f * triangleRecord] == 3;
+        }
+
+        if (triangles) {
+            indices.resize(3 * count);
+            const size_t blocks = (count + PLY_COPY_BLOCK - 1) / PLY_COPY_BLOCK;
+            #pragma omp parallel for schedule(static)
+            for (size_t b = 0; b < blocks; b++) {
+                const size_t last = std::min((b + 1) * PLY_COPY_BLOCK, count);
+                for (size_t f = b * PLY_COPY_BLOCK; f < last; f++) {
+                    memcpy(&indices[3*f], data + f * triangleRecord + 1, 3*sizeof(uint32_t));
+                }
+            }
+            p += count * triangleRecord;
+            return true;
+        }
+    }
+
+    // Any other layout: walk the records
+    indices.clear();
+    for (size_t f = 0; f < count; f++) {
+        for (const PlyProperty& property : element.properties) {
+            if (!property.list) {
+                if (static_cast<size_t>(end - p) < plyTypeSize(property.type)) {
+                    return false;
+                }
+                p += plyTypeSize(property.type);
+                continue;
+            }
+            const size_t countSize = plyTypeSize(property.countType);
+            const size_t itemSize = plyTypeSize(property.type);
+            if (static_cast<size_t>(end - p) < countSize) {
+                return false;
+            }
+            uint32_t items;
+            if (!readPlyIndex(property.countType, p, items)) {
+                return false;
+            }
+            p += countSize;
+            if (static_cast<size_t>(end - p) < items * itemSize) {
+                return false;
+            }
+            if (&property == list && items >= 3) {
+                uint32_t first, previous, next;
+                if (!readPlyIndex(property.type, p, first) ||
+                    !readPlyIndex(property.type, p + itemSize, previous)) {
+                    return false;
+                }
+                for (size_t k = 2; k < items; k++, previous = next) {
+                    if (!readPlyIndex(property.type, p + k * itemSize, next)) {
+                        return false;
+                    }
+                    indices.push_back(first);
+                    indices.push_back(previous);
+                    indices.push_back(next);
+                }
+            }
+            p += items * itemSize;
+        }
+    }
+    return true;
+}
+
+/** Move p past the records of an element */
+static bool skipPlyElement(const PlyElement& element, const char*& p, const char* end) {
+    const size_t size = plyRecordSize(element);
+    if (size > 0) {
+        if (element.count > static_cast<size_t>(end - p) / size) {
+            return false;
+        }
+        p += element.count * size;
+        return true;
+    }
+    for (size_t r = 0; r < element.count; r++) {
+        for (const PlyProperty& property : element.properties) {
+            size_t bytes = plyTypeSize(property.type);
+            if (property.list) {
+                if (static_cast<size_t>(end - p) < plyTypeSize(property.countType)) {
+                    return false;
+                }
+                uint32_t items;
+                if (!readPlyIndex(property.countType, p, items)) {
+                    return false;
+                }
+                p += plyTypeSize(property.countType);
+                bytes *= items;
+            }
+            if (static_cast<size_t>(end - p) < bytes) {
+                return false;
+            }
+            p += bytes;
+        }
+    }
+    return true;
+}
+
+static bool loadPly(const char* filename, MappedFile& file,
+                    std::vector<float>& positions, std::vector<uint32_t>& indices)
+{
+    const char* p = file.data;
+    const char* end = file.data + file.size;
+    std::vector<PlyElement> elements;
+    if (!parsePlyHeader(p, end, elements)) {
+        Debug::Log::e(TAG, "%s: invalid PLY header", filename);
+        return false;
+    }
+
+    bool vertices = false, faces = false;
+    for (const PlyElement& element : elements) {
+        bool ok;
+        if (element.name == "vertex") {
+            ok = vertices = readPlyVertices(element, p, end, positions);
+        } else if (element.name == "face") {
+            ok = faces = readPlyFaces(element, p, end, indices);
+        } else {
+            ok = skipPlyElement(element, p, end);
+        }
+        if (!ok) {
+            Debug::Log::e(TAG, "%s: invalid or truncated element %s", filename, element.name.c_str());
+            return false;
+        }
+        if (vertices && faces) {
+            break;
+        }
+    }
+    if (!vertices || !faces) {
+        Debug::Log::e(TAG, "%s: no vertices or faces", filename);
+        return false;
+    }
+
+    const uint32_t count = positions.size() / 3;
+    bool valid = true;
+    #pragma omp parallel for schedule(static) reduction(&&:valid)
+    for (size_t i = 0; i < indices.size(); i++) {
+        valid = valid && indices[i] < count;
+    }
+    if (!valid) {
+        Debug::Log::e(TAG, "%s: face with a vertex out of range", filename);
+    }
+    return valid;
+}
+
+
+TriangleMesh* loadMesh(const char* filename, struct Material material, Arena& arena) {
+    auto start = std::chrono::steady_clock::now();
+
+    const char* extension = strrchr(filename, '.');
+    const bool obj = extension != nullptr && !strcasecmp(extension, ".obj");
+    const bool ply = extension != nullptr && !strcasecmp(extension, ".ply");
+    if (!obj && !ply) {
+        Debug::Log::e(TAG, "%s: unknown mesh format", filename);
+        return nullptr;
+    }
+
+    MappedFile file;
+    if (!file.open(filename)) {
+        Debug::Log::e(TAG, "Could not open %s", filename);
+        return nullptr;
+    }
+
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    if (!(obj? loadObj(filename, file, positions, indices) : loadPly(filename, file, positions, indices))) {
+        return nullptr;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double megabytes = file.size / (1024.0 * 1024.0);
+    Debug::Log::i(TAG, "Loaded %s: %zu vertices, %zu triangles, %.1f MB in %.2f s, %.0f MB/s",
+        filename, positions.size() / 3, indices.size() / 3, megabytes, seconds,
+        (seconds > 0)? megabytes / seconds : 0.0);
+
+    return arena.create<TriangleMesh>(material, std::move(positions), std::move(indices));
+}
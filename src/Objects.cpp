@@ -39,6 +39,41 @@ struct Material& IObject3D::material() {
     return mMaterial;
 }
 
+Real IObject3D::getArea() {
+    return infinity<Real>();
+}
+
+Vec3D IObject3D::samplePoint(Real u1, Real u2) {
+    (void) u1;
+    (void) u2;
+
+    return Vec3D();
+}
+
+struct NormalCone IObject3D::getNormalCone() {
+    return NormalCone {Vec3D(0, 0, 1), static_cast<Real>(M_PI)};
+}
+
+size_t IObject3D::getStorageBytes() {
+    return 0;
+}
+
+
+/* Scene */
+void Scene::clear() {
+    objects.clear();
+    arena.release();
+    revision++;
+}
+
+size_t Scene::getSizeBytes() {
+    size_t bytes = arena.getSizeBytes();
+    for (IObject3D* object : objects) {
+        bytes += object->getStorageBytes();
+    }
+    return bytes;
+}
+
 
 /* Plane */
 Plane::Plane(struct Material material, Vec3D position_v, Vec3D normal_v)
@@ -79,6 +114,10 @@ struct Enclosure Plane::getEnclosure() {
     };
 }
 
+void Plane::translate(Vec3D& offset_v) {
+    mPosition_v += offset_v;
+}
+
 
 /* Triangle
  * Surface normal depends on the order of (A, B, C)
@@ -162,6 +201,30 @@ struct Enclosure Triangle::getEnclosure() {
     };
 }
 
+Real Triangle::getArea() {
+    Vec3D AB_v = mB_v - mA_v;
+    Vec3D AC_v = mC_v - mA_v;
+    return 0.5f * AB_v.cross(AC_v).dist();
+}
+
+Vec3D Triangle::samplePoint(Real u1, Real u2) {
+    // Uniform barycentric coordinates
+    Real su1 = sqrt(u1);
+    Real b0 = 1 - su1;
+    Real b1 = u2 * su1;
+    return b0*mA_v + b1*mB_v + (1 - b0 - b1)*mC_v;
+}
+
+struct NormalCone Triangle::getNormalCone() {
+    return NormalCone {mNormal_v, 0};
+}
+
+void Triangle::translate(Vec3D& offset_v) {
+    mA_v += offset_v;
+    mB_v += offset_v;
+    mC_v += offset_v;
+}
+
 
 /* Sphere */
 Sphere::Sphere(struct Material material, Vec3D center_V, Real radius)
@@ -223,6 +286,21 @@ struct Enclosure Sphere::getEnclosure() {
     };
 }
 
+Real Sphere::getArea() {
+    return 4 * M_PI * mRadius*mRadius;
+}
+
+Vec3D Sphere::samplePoint(Real u1, Real u2) {
+    Real z = 1 - 2*u1;
+    Real r = sqrt(std::max<Real>(0, 1 - z*z));
+    Real phi = 2 * M_PI * u2;
+    return mCenter_v + mRadius*Vec3D(r*cos(phi), r*sin(phi), z);
+}
+
+void Sphere::translate(Vec3D& offset_v) {
+    mCenter_v += offset_v;
+}
+
 /* CompositeObject3D */
 Real CompositeObject3D::intersect(Ray& ray) {
     return -infinity<Real>();
@@ -267,6 +345,13 @@ struct Enclosure CompositeObject3D::getEnclosure() {
     return mEnclosure;
 }
 
+void CompositeObject3D::translate(Vec3D& offset_v) {
+    for (IObject3D* object : mObjects) {
+        object->translate(offset_v);
+    }
+    updateBoundary();
+}
+
 /// \todo Update enclosure and boundary
 void CompositeObject3D::updateBoundary() {
 
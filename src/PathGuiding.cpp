@@ -0,0 +1,354 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "PathGuiding.hpp"
+
+#include "Common.hpp"
+#include "Objects.hpp"
+#include "Utils.hpp"
+#include "Vector3D.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "debug.hpp"
+
+static const char* TAG = "PathGuiding";
+
+static const Real INV_4PI = 1.0 / (4*M_PI);
+
+/** Cylindrical mapping from a unit direction to the unit square */
+static void directionToSquare(Vec3D& direction, Real& u, Real& v) {
+    Vec3D d = direction.normalize();
+    Real phi = atan2(d.y, d.x);
+    if (phi < 0) {
+        phi += 2*M_PI;
+    }
+    u = std::min<Real>(std::max<Real>((d.z + 1) / 2, 0), 1 - 1e-6);
+    v = std::min<Real>(phi / (2*M_PI), 1 - 1e-6);
+}
+
+static Vec3D squareToDirection(Real u, Real v) {
+    const Real cosTheta = 2*u - 1;
+    const Real sinTheta = sqrt(std::max<Real>(0, 1 - cosTheta*cosTheta));
+    const Real phi = 2*M_PI*v;
+    return Vec3D(sinTheta*cos(phi), sinTheta*sin(phi), cosTheta);
+}
+
+/** Quadrant of a point of the unit square, which is then mapped into the quadrant */
+static unsigned quadrant(Real& u, Real& v) {
+    unsigned q = 0;
+    if (u >= 0.5) {
+        q |= 1;
+        u = 2*u - 1;
+    } else {
+        u = 2*u;
+    }
+    if (v >= 0.5) {
+        q |= 2;
+        v = 2*v - 1;
+    } else {
+        v = 2*v;
+    }
+    return q;
+}
+
+
+/* DTree */
+DTree::Node::Node() {
+    for (unsigned int q = 0; q < 4; q++) {
+        sum[q].store(0, std::memory_order_relaxed);
+        child[q] = 0;
+    }
+}
+
+DTree::Node::Node(const Node& other) {
+    *this = other;
+}
+
+DTree::Node& DTree::Node::operator=(const Node& other) {
+    for (unsigned int q = 0; q < 4; q++) {
+        sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        child[q] = other.child[q];
+    }
+    return *this;
+}
+
+DTree::DTree() : mNodes(1), mSampleCount(0) { }
+
+DTree::DTree(const DTree& other) : mNodes(other.mNodes) {
+    mSampleCount.store(other.mSampleCount.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+DTree& DTree::operator=(const DTree& other) {
+    mNodes = other.mNodes;
+    mSampleCount.store(other.mSampleCount.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+}
+
+Real DTree::total() {
+    Node& root = mNodes[0];
+    Real total = 0;
+    for (unsigned int q = 0; q < 4; q++) {
+        total += root.sum[q].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint32_t DTree::sampleCount() {
+    return mSampleCount.load(std::memory_order_relaxed);
+}
+
+size_t DTree::getSizeBytes() {
+    return mNodes.capacity() * sizeof(Node);
+}
+
+void DTree::record(Vec3D& direction, Real radiance) {
+    mSampleCount.fetch_add(1, std::memory_order_relaxed);
+    if (!(radiance > 0) || radiance == infinity<Real>()) {
+        return;
+    }
+
+    Real u, v;
+    directionToSquare(direction, u, v);
+    unsigned node = 0;
+    while (true) {
+        const unsigned q = quadrant(u, v);
+        atomicAdd(mNodes[node].sum[q], radiance);
+        if (mNodes[node].child[q] == 0) {
+            break;
+        }
+        node = mNodes[node].child[q];
+    }
+}
+
+Vec3D DTree::sample(Real& pdf) {
+    Real originU = 0, originV = 0, size = 1;
+    Real squarePdf = 1;
+    unsigned node = 0;
+
+    while (true) {
+        Real sums[4];
+        Real nodeTotal = 0;
+        for (unsigned int q = 0; q < 4; q++) {
+            sums[q] = mNodes[node].sum[q].load(std::memory_order_relaxed);
+            nodeTotal += sums[q];
+        }
+        if (nodeTotal <= 0) {
+            // Nothing learnt here: uniform inside the node
+            break;
+        }
+
+        // Choose a quadrant proportionally to its energy, skipping empty ones
+        Real r = uniformRandom() * nodeTotal;
+        unsigned q = 0;
+        for (unsigned int k = 0; k < 4; k++) {
+            if (sums[k] <= 0) {
+                continue;
+            }
+            q = k;
+            if (r < sums[k]) {
+                break;
+            }
+            r -= sums[k];
+        }
+
+        squarePdf *= 4 * sums[q] / nodeTotal;
+        size /= 2;
+        originU += (q & 1)? size : 0;
+        originV += (q & 2)? size : 0;
+
+        if (mNodes[node].child[q] == 0) {
+            break;
+        }
+        node = mNodes[node].child[q];
+    }
+
+    pdf = squarePdf * INV_4PI;
+    return squareToDirection(originU + size*uniformRandom(), originV + size*uniformRandom());
+}
+
+Real DTree::pdf(Vec3D& direction) {
+    Real u, v;
+    directionToSquare(direction, u, v);
+
+    Real squarePdf = 1;
+    unsigned node = 0;
+    while (true) {
+        Real nodeTotal = 0;
+        for (unsigned int q = 0; q < 4; q++) {
+            nodeTotal += mNodes[node].sum[q].load(std::memory_order_relaxed);
+        }
+        if (nodeTotal <= 0) {
+            break;
+        }
+
+        const unsigned q = quadrant(u, v);
+        squarePdf *= 4 * mNodes[node].sum[q].load(std::memory_order_relaxed) / nodeTotal;
+        if (mNodes[node].child[q] == 0) {
+            break;
+        }
+        node = mNodes[node].child[q];
+    }
+
+    return squarePdf * INV_4PI;
+}
+
+DTree DTree::refined(Real threshold, unsigned maxDepth) {
+    DTree result;
+    const Real t = total();
+    if (t > 0) {
+        refineNode(result, 0, 0, t, t, threshold, 1, maxDepth);
+    }
+    return result;
+}
+
+void DTree::refineNode(DTree& result, unsigned node, int source, Real sourceSum,
+                       Real total, Real threshold, unsigned depth, unsigned maxDepth)
+{
+    if (depth >= maxDepth) {
+        return;
+    }
+
+    for (unsigned int q = 0; q < 4; q++) {
+        // Quadrants that were leaves spread their energy evenly
+        const Real qSum = (source >= 0)?
+            mNodes[source].sum[q].load(std::memory_order_relaxed) : sourceSum/4;
+        if (qSum / total <= threshold) {
+            continue;
+        }
+
+        const unsigned child = result.mNodes.size();
+        result.mNodes.emplace_back();
+        result.mNodes[node].child[q] = child;
+
+        const int childSource = (source >= 0 && mNodes[source].child[q] != 0)?
+            static_cast<int>(mNodes[source].child[q]) : -1;
+        refineNode(result, child, childSource, qSum, total, threshold, depth + 1, maxDepth);
+    }
+}
+
+
+/* SDTree */
+SDTree::SDTree() {
+    reset(Enclosure {0, 1, 0, 1, 0, 1});
+}
+
+void SDTree::reset(const struct Enclosure& bounds) {
+    mBounds = bounds;
+    mNodes.clear();
+    mNodes.push_back(SNode {{0, 0}, 0, 0});
+    mLeaves.clear();
+    mLeaves.emplace_back();
+    mReady = false;
+}
+
+bool SDTree::ready() {
+    return mReady;
+}
+
+unsigned SDTree::spatialLeafCount() {
+    return mLeaves.size();
+}
+
+size_t SDTree::getSizeBytes() {
+    size_t bytes = mNodes.capacity() * sizeof(SNode) + mLeaves.capacity() * sizeof(Leaf);
+    for (Leaf& leaf : mLeaves) {
+        bytes += leaf.sampling.getSizeBytes() + leaf.building.getSizeBytes();
+    }
+    return bytes;
+}
+
+SDTree::Leaf& SDTree::lookup(Vec3D& point) {
+    Real p[3] = {
+        (point.x - mBounds.x_min) / (mBounds.x_max - mBounds.x_min),
+        (point.y - mBounds.y_min) / (mBounds.y_max - mBounds.y_min),
+        (point.z - mBounds.z_min) / (mBounds.z_max - mBounds.z_min),
+    };
+    for (unsigned int a = 0; a < 3; a++) {
+        p[a] = std::min<Real>(std::max<Real>(p[a], 0), 1);
+    }
+
+    unsigned node = 0;
+    while (mNodes[node].child[0] != 0) {
+        const int a = mNodes[node].axis;
+        if (p[a] < 0.5) {
+            p[a] = 2*p[a];
+            node = mNodes[node].child[0];
+        } else {
+            p[a] = 2*p[a] - 1;
+            node = mNodes[node].child[1];
+        }
+    }
+    return mLeaves[mNodes[node].leaf];
+}
+
+Real SDTree::sample(Vec3D& point, Vec3D& direction) {
+    Real pdf;
+    direction = lookup(point).sampling.sample(pdf);
+    return pdf;
+}
+
+Real SDTree::pdf(Vec3D& point, Vec3D& direction) {
+    return lookup(point).sampling.pdf(direction);
+}
+
+void SDTree::record(Vec3D& point, Vec3D& direction, Real radiance) {
+    lookup(point).building.record(direction, radiance);
+}
+
+void SDTree::splitNode(unsigned node, unsigned threshold, unsigned depth) {
+    if (mNodes[node].child[0] != 0) {
+        const uint32_t first = mNodes[node].child[0];
+        const uint32_t second = mNodes[node].child[1];
+        splitNode(first, threshold, depth + 1);
+        splitNode(second, threshold, depth + 1);
+        return;
+    }
+
+    const uint32_t leaf = mNodes[node].leaf;
+    if (depth >= MAX_SPATIAL_DEPTH || mLeaves[leaf].building.sampleCount() <= threshold) {
+        return;
+    }
+
+    // Both halves start from the distribution learnt by the parent
+    const uint32_t newLeaf = mLeaves.size();
+    mLeaves.push_back(mLeaves[leaf]);
+
+    const int axis = (depth % 3);
+    const uint32_t first = mNodes.size();
+    mNodes.push_back(SNode {{0, 0}, 0, leaf});
+    mNodes.push_back(SNode {{0, 0}, 0, newLeaf});
+    mNodes[node].child[0] = first;
+    mNodes[node].child[1] = first + 1;
+    mNodes[node].axis = axis;
+}
+
+void SDTree::refine(unsigned spp) {
+    const unsigned threshold = SPATIAL_THRESHOLD * sqrt(static_cast<Real>(spp));
+    splitNode(0, threshold, 0);
+
+    for (Leaf& leaf : mLeaves) {
+        leaf.sampling = leaf.building;
+        leaf.building = leaf.building.refined(DIRECTIONAL_THRESHOLD, MAX_DIRECTIONAL_DEPTH);
+    }
+    mReady = true;
+
+    Debug::Log::i(TAG, "Refined guiding tree: %zu spatial leaves", mLeaves.size());
+}
@@ -20,6 +20,7 @@
 
 #include "Common.hpp"
 #include "Camera.hpp"
+#include "Environment.hpp"
 #include "Light.hpp"
 #include "Objects.hpp"
 #include "Surface.hpp"
@@ -28,6 +29,8 @@
 #include <algorithm>
 #include <chrono>
 #include <limits>
+#include <numeric>
+#include <mutex>
 #include <vector>
 
 #include "debug.hpp"
@@ -37,14 +40,44 @@ static const char* TAG = "PathTracer";
 /// \todo ACCURACY value is completely random
 Real ACCURACY = 0.0001;
 
-void PathTracer::calculateBlocks(std::vector<Block>& blocks, unsigned int width, unsigned int height) {
-    for (unsigned int i = 0; i < width; i += mBlockWidth) {
+/** Fraction of the bounces sampled from the guiding distribution */
+static const Real GUIDING_FRACTION = 0.5;
+
+/** Fraction of the cache terminations also traced to estimate the bias */
+static const Real CACHE_VALIDATION_RATE = 1.0/16;
+
+/** Strata of every pixel, the first hits of which are cached */
+static const unsigned STRATA = Camera::STRATA;
+
+/** Length of a pass relative to the checkpoint interval */
+static const double CHECKPOINT_PASS_FRACTION = 0.25;
+
+/** What a sample taught the guiding distribution or the radiance cache */
+struct LearningRecord {
+    enum Kind { GUIDING, CACHE, VALIDATION } kind;
+    Vec3D point;
+    /** Direction for GUIDING, normal for CACHE */
+    Vec3D direction;
+    /** Radiance for CACHE, cached radiance for VALIDATION */
+    Color radiance;
+    Color traced;
+    Real value;
+};
+
+/**
+ * Records of the block of a deferring thread, kept until it is known
+ * whether the block is merged or taken again
+*/
+static thread_local std::vector<LearningRecord> sLearning;
+
+void PathTracer::calculateBlocks(std::vector<Block>& blocks, const Block& region) {
+    for (unsigned int i = region.left; i < region.right; i += mBlockWidth) {
         unsigned int right = i + mBlockWidth;
-        if (right > width) right = width;
+        if (right > region.right) right = region.right;
 
-        for (unsigned int j = 0; j < height; j += mBlockWidth) {
-            unsigned int down = j + mBlockWidth;
-            if (down > height) down = height;
+        for (unsigned int j = region.up; j < region.down; j += mBlockHeight) {
+            unsigned int down = j + mBlockHeight;
+            if (down > region.down) down = region.down;
 
             Block block = {
                 .left = i,
@@ -57,9 +90,9 @@ void PathTracer::calculateBlocks(std::vector<Block>& blocks, unsigned int width,
     }
 }
 
-void PathTracer::reorderBlocks(std::vector<Block>& blocks, unsigned width, unsigned height) {
-    int cx = width / 2;
-    int cy = height / 2;
+void PathTracer::reorderBlocks(std::vector<Block>& blocks, const Block& region) {
+    int cx = (region.left + region.right) / 2;
+    int cy = (region.up + region.down) / 2;
     std::sort(blocks.begin(), blocks.end(),
         [&](const Block& lhs, const Block& rhs)-> bool {
             int lx = (lhs.left + lhs.right) / 2;
@@ -82,79 +115,960 @@ PathTracer::PathTracer(unsigned spp, unsigned depth)
 PathTracer::~PathTracer() { }
 
 void PathTracer::addCallback(IResultsListener* listener) {
-    mPartialResultListeners.push_back(listener);
+    mNotifier.addListener(listener);
+    mListeners.push_back(listener);
+}
+
+void PathTracer::setNotificationInterval(double seconds) {
+    mNotifier.setInterval(seconds);
 }
 
-void PathTracer::notifyPartialResult(struct Scene& scene, Camera& camera) {
-    for(IResultsListener* listener : mPartialResultListeners) {
-        listener->onPartialResult(scene, camera);
+uint64_t PathTracer::configurationHash(struct Scene& scene, Camera& camera) {
+    std::vector<Real> values;
+    auto add = [&values](Vec3D v) {
+        values.insert(values.end(), {v.x, v.y, v.z});
+    };
+    for (IObject3D* object : scene.objects) {
+        struct Enclosure e = object->getEnclosure();
+        values.insert(values.end(), {e.x_min, e.x_max, e.y_min, e.y_max, e.z_min, e.z_max, object->getArea()});
+        add(object->material().color);
+        add(object->material().emission);
+    }
+    add(scene.backgroundColor);
+    add(camera.getPosition());
+    add(camera.getFacing());
+    values.push_back(camera.getFov());
+    if (mRadianceCache != nullptr) {
+        values.insert(values.end(), {mRadianceCache->getCellSize(), mRadianceCache->getFootprintScale(),
+            static_cast<Real>(mRadianceCache->getMinBounces())});
+    }
+    uint64_t hash = hashBytes(values.data(), values.size() * sizeof(Real), 0);
+
+    if (scene.environment != nullptr) {
+        std::vector<Color>& pixels = scene.environment->getPixels();
+        hash = hashBytes(pixels.data(), pixels.size() * sizeof(Color), hash);
     }
+
+    const uint32_t settings[] = {
+        mSPP, mMaxDepth, mFirstHitCacheEnabled, mLightSamplingEnabled, mEnvironmentSamplingEnabled,
+        mPathGuidingEnabled, mRadianceCache != nullptr, scene.environment != nullptr
+    };
+    return hashBytes(settings, sizeof(settings), hash);
 }
 
 void PathTracer::notifyRenderFinished(struct Scene& scene, Camera& camera) {
-    for(IResultsListener* listener : mPartialResultListeners) {
+    // Partial results are all delivered before the final one
+    mNotifier.flush();
+    for(IResultsListener* listener : mListeners) {
         listener->onRenderFinished(scene, camera);
     }
 }
 
+void PathTracer::reportMemory(struct Scene& scene, unsigned viewCount) {
+    const double MB = 1024.0 * 1024.0;
+    size_t storage = 0;
+    for (IObject3D* object : scene.objects) {
+        storage += object->getStorageBytes();
+    }
+    size_t lights = 0;
+    size_t replicas = 0;
+    for (std::unique_ptr<SceneReplica>& replica : mReplicas) {
+        lights += replica->lightBVH.getSizeBytes();
+        replicas += replica->objects.capacity() * sizeof(IObject3D*) + replica->environment.getSizeBytes();
+    }
+    size_t film = 0;
+    size_t framebuffer = 0;
+    for (unsigned int v = 0; v < viewCount; v++) {
+        Camera& camera = *mViews[v]->camera;
+        film += mViews[v]->film.getSizeBytes();
+        framebuffer += camera.getSurface().getSizeBytes();
+        if (camera.getAOVs() != nullptr) {
+            AOVBuffers& aovs = *camera.getAOVs();
+            framebuffer += aovs.albedo.getSizeBytes() + aovs.normal.getSizeBytes() + aovs.depth.getSizeBytes();
+        }
+    }
+
+    Debug::Log::i(TAG, "Memory: primitives %.2f MB (%.2f MB reserved), mesh arrays %.2f MB, "
+        "light hierarchy %.2f MB, replicas %.2f MB, film %.2f MB, framebuffer %.2f MB, "
+        "guiding %.2f MB, radiance cache %.2f MB, geometry cache %.2f MB",
+        scene.arena.getSizeBytes() / MB, scene.arena.getReservedBytes() / MB, storage / MB,
+        lights / MB, replicas / MB, film / MB, framebuffer / MB,
+        mPathGuidingEnabled? mGuiding.getSizeBytes() / MB : 0.0,
+        (mRadianceCache != nullptr)? mRadianceCache->getSizeBytes() / MB : 0.0,
+        (scene.geometryCache != nullptr)? scene.geometryCache->getSizeBytes() / MB : 0.0);
+}
+
 void PathTracer::setBlockSize(unsigned int width, unsigned int height) {
     mBlockWidth = width;
     mBlockHeight = height;
 }
 
+void PathTracer::setRegion(unsigned left, unsigned up, unsigned right, unsigned down) {
+    mRegion = Block {left, up, right, down};
+}
+
+void PathTracer::setSeed(uint64_t seed) {
+    mSeed = seed;
+}
+
+void PathTracer::setSharedFramebuffer(SharedFramebuffer* framebuffer) {
+    mSharedFramebuffer = framebuffer;
+}
+
+void PathTracer::setFilter(FilterType type) {
+    mFilter = type;
+}
+
+void PathTracer::setCheckpoint(const char* filename, double intervalSeconds) {
+    mCheckpointFile = filename;
+    mCheckpointInterval = intervalSeconds;
+}
+
+void PathTracer::setThreadCount(unsigned threads) {
+    mScheduler.setThreadCount(threads);
+}
+
+void PathTracer::setNumaTopology(Topology* topology) {
+    mTopology = topology;
+    mScheduler.setTopology(topology);
+    mReplicaScene = nullptr;
+}
+
+void PathTracer::setFirstHitCacheEnabled(bool enabled) {
+    mFirstHitCacheEnabled = enabled;
+}
+
+void PathTracer::setDenoiser(Denoiser* denoiser) {
+    mDenoiser = denoiser;
+}
+
+void PathTracer::setLightSamplingEnabled(bool enabled) {
+    mLightSamplingEnabled = enabled;
+    mReplicaScene = nullptr;
+}
+
+void PathTracer::setPathGuidingEnabled(bool enabled) {
+    mPathGuidingEnabled = enabled;
+}
+
+void PathTracer::setRadianceCache(RadianceCache* cache) {
+    mRadianceCache = cache;
+}
+
 void PathTracer::render(struct Scene& scene, Camera& camera) {
+    renderViews(scene, {&camera});
+}
+
+void PathTracer::renderViews(struct Scene& scene, const std::vector<Camera*>& cameras) {
+    if (cameras.empty()) {
+        return;
+    }
+
+    buildReplicas(scene);
+    mEnvironmentSamplingEnabled = mLightSamplingEnabled && !mReplicas[0]->environment.isBlack();
+
+    // The blocks of all the views go through the scheduler together, so the
+    // workers share the replicas and the warm caches, and a view finishing
+    // early leaves its workers to the others
+    while (mViews.size() < cameras.size()) {
+        mViews.push_back(std::make_unique<View>());
+    }
+    std::vector<ViewBlock> blocks;
+    for (unsigned int v = 0; v < cameras.size(); v++) {
+        View& view = *mViews[v];
+        Camera& camera = *cameras[v];
+        view.camera = &camera;
+        // Partial results of the first view go to the listeners
+        view.preview = (v == 0);
+        if (mDenoiser != nullptr) {
+            camera.setAOVsEnabled(true);
+        }
+
+        Surface& surface = camera.getSurface();
+        const unsigned width = surface.getWidth();
+        const unsigned height = surface.getHeight();
+        surface.clear();
+        if (cameras.size() > 1) {
+            Debug::Log::i(TAG, "Render view %d: %dx%d", v, width, height);
+        } else {
+            Debug::Log::i(TAG, "Render scene: %dx%d", width, height);
+        }
+
+        view.film.setFilter(mFilter);
+        Block region = {0, 0, width, height};
+        if (mRegion.right > mRegion.left && mRegion.down > mRegion.up) {
+            region = mRegion;
+        }
+        addBlocks(view, region, blocks);
+    }
+
+    // Continue from the checkpoint if it belongs to this frame
+    unsigned samplesDone = 0;
+    View& first = *mViews[0];
+    Surface& firstSurface = first.camera->getSurface();
+    Accumulation& accumulation = first.film.getAccumulation();
+    const uint64_t configuration = configurationHash(scene, *first.camera);
+    bool resumed = false;
+    if (mCheckpointFile != nullptr && cameras.size() > 1) {
+        Debug::Log::w(TAG, "Checkpoints are only supported for a single view");
+    } else if (mCheckpointFile != nullptr && accumulation.load(mCheckpointFile)) {
+        if (accumulation.width == firstSurface.getWidth() && accumulation.height == firstSurface.getHeight() &&
+            accumulation.seed == mSeed && accumulation.filter == first.film.getFilter().getType() &&
+            accumulation.configuration == configuration) {
+            resumed = true;
+        } else {
+            Debug::Log::w(TAG, "Checkpoint %s belongs to another scene or settings, starting over",
+                mCheckpointFile);
+        }
+    }
+    if (resumed) {
+        samplesDone = std::min(accumulation.minCount(), mSPP);
+        first.film.resolve(firstSurface, 0, 0, firstSurface.getWidth(), firstSurface.getHeight());
+        Debug::Log::i(TAG, "Resuming from checkpoint %s with %d spp", mCheckpointFile, samplesDone);
+    } else {
+        first.film.reset(firstSurface.getWidth(), firstSurface.getHeight(), mSeed);
+        accumulation.configuration = configuration;
+    }
+    for (unsigned int v = 0; v < cameras.size(); v++) {
+        View& view = *mViews[v];
+        Surface& surface = view.camera->getSurface();
+        if (v > 0) {
+            view.film.reset(surface.getWidth(), surface.getHeight(), mSeed);
+        }
+        view.film.setWorkerCount(mScheduler.getThreadCount());
+        view.shared = view.preview? sharedFramebufferFor(surface) : nullptr;
+    }
+    mNotifier.begin(firstSurface.getWidth(), firstSurface.getHeight(), &first.camera->getToneMapper());
+    if (samplesDone > 0) {
+        mNotifier.publish(firstSurface, {0, 0, firstSurface.getWidth(), firstSurface.getHeight()});
+    }
+
+    SharedFramebuffer* shared = first.shared;
+    if (mSharedFramebuffer != nullptr && shared == nullptr) {
+        Debug::Log::w(TAG, "Shared framebuffer is %dx%d, not publishing a %dx%d frame",
+            mSharedFramebuffer->getHeader().width, mSharedFramebuffer->getHeader().height,
+            firstSurface.getWidth(), firstSurface.getHeight());
+    }
+    if (shared != nullptr) {
+        shared->beginFrame();
+        shared->publish(firstSurface, 0, 0, firstSurface.getWidth(), firstSurface.getHeight());
+    }
+
+    // Path guiding and the radiance cache learn from passes of 2, 4, 8...
+    // samples per pixel. Checkpoints are written between passes, which are
+    // sized to the interval. Otherwise all the samples are taken in one pass.
+    const bool learning = mPathGuidingEnabled || mRadianceCache != nullptr;
+    if (learning) {
+        resetLearning(scene, cameras);
+    }
+
+    mScheduler.resetStatistics();
+    if (scene.geometryCache != nullptr) {
+        scene.geometryCache->resetStatistics();
+    }
+    auto lastCheckpoint = std::chrono::steady_clock::now();
+    double secondsPerSample = 0;
+    double firstWork = 0;
+    unsigned learningPass = 2;
+    for (unsigned int pass = 0; samplesDone < mSPP; pass++) {
+        unsigned spp = mSPP - samplesDone;
+        if (learning) {
+            spp = std::min(spp, learningPass);
+            learningPass *= 2;
+        } else if (mCheckpointFile != nullptr && cameras.size() == 1) {
+            // Passes of about a quarter of the interval, once the cost is known
+            spp = (pass == 0)? 1 : std::min<double>(spp,
+                std::max(1.0, CHECKPOINT_PASS_FRACTION * mCheckpointInterval / secondsPerSample));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        const double variance = renderPass(scene, blocks, samplesDone + spp, pass == 0);
+        auto end = std::chrono::steady_clock::now();
+        samplesDone += spp;
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        secondsPerSample = seconds / spp;
+
+        if (mPathGuidingEnabled) {
+            // Variance times cost of a sample: lower is better at equal time
+            const double work = variance * seconds / spp;
+            if (pass == 0) {
+                firstWork = work;
+            }
+            Debug::Log::i(TAG, "Guiding pass %d: %d spp, %.2f s, sample variance %.4g, "
+                "variance reduction at equal time %.2fx",
+                pass, spp, seconds, variance, (work > 0)? firstWork/work : 0.0);
+
+            if (samplesDone < mSPP) {
+                mGuiding.refine(spp);
+            }
+        }
+
+        if (mRadianceCache != nullptr) {
+            Debug::Log::i(TAG, "Pass %d: %d spp in %.2f s", pass, spp, seconds);
+            mRadianceCache->report();
+        }
+
+        if (mCheckpointFile != nullptr && cameras.size() == 1 && (samplesDone >= mSPP ||
+            std::chrono::duration<double>(end - lastCheckpoint).count() >= mCheckpointInterval)) {
+            if (accumulation.save(mCheckpointFile)) {
+                Debug::Log::i(TAG, "Checkpoint written at %d spp", samplesDone);
+            }
+            lastCheckpoint = std::chrono::steady_clock::now();
+        }
+    }
+
+    mScheduler.report();
+    if (scene.geometryCache != nullptr) {
+        scene.geometryCache->report();
+    }
+    reportMemory(scene, cameras.size());
+
+    for (unsigned int v = 0; v < cameras.size(); v++) {
+        View& view = *mViews[v];
+        Surface& surface = view.camera->getSurface();
+        if (mDenoiser == nullptr) {
+            continue;
+        }
+        mDenoiser->denoise(surface, *view.camera->getAOVs());
+        if (view.shared != nullptr) {
+            view.shared->publish(surface, 0, 0, surface.getWidth(), surface.getHeight());
+        }
+        if (view.preview) {
+            mNotifier.publish(surface, {0, 0, surface.getWidth(), surface.getHeight()});
+        }
+    }
+    if (shared != nullptr) {
+        shared->endFrame();
+    }
+
+    // The listeners follow the preview view only
+    for (unsigned int v = 0; v < cameras.size(); v++) {
+        if (mViews[v]->preview) {
+            notifyRenderFinished(scene, *mViews[v]->camera);
+        }
+    }
+}
+
+void PathTracer::beginFrame(struct Scene& scene, Camera& camera) {
+    buildReplicas(scene);
+    mEnvironmentSamplingEnabled = mLightSamplingEnabled && !mReplicas[0]->environment.isBlack();
+
+    if (mViews.empty()) {
+        mViews.push_back(std::make_unique<View>());
+    }
+    View& view = *mViews[0];
+    view.camera = &camera;
+    view.preview = false;
+    view.shared = nullptr;
+    view.film.setFilter(mFilter);
+
     Surface& surface = camera.getSurface();
+    surface.clear();
+    view.film.reset(surface.getWidth(), surface.getHeight(), mSeed);
+    view.film.setWorkerCount(mScheduler.getThreadCount());
+    if (mPathGuidingEnabled || mRadianceCache != nullptr) {
+        resetLearning(scene, {&camera});
+    }
+    mRegionSamples = 0;
+    mRegionLearningPass = 2;
+}
+
+void PathTracer::renderRegion(struct Scene& scene, unsigned left, unsigned up, unsigned right, unsigned down) {
+    std::vector<ViewBlock> blocks;
+    addBlocks(*mViews[0], Block {left, up, right, down}, blocks);
+    renderPass(scene, blocks, mSPP, true);
+
+    // Path guiding is refined after 2, 4, 8... samples per pixel of the
+    // whole frame, as in a local render, so that the regions rendered later
+    // sample from what the ones before learnt
+    if (mPathGuidingEnabled) {
+        for (const ViewBlock& b : blocks) {
+            mRegionSamples += static_cast<uint64_t>(b.block.right - b.block.left) *
+                (b.block.down - b.block.up) * mSPP;
+        }
+        Surface& surface = mViews[0]->camera->getSurface();
+        const uint64_t pixels = static_cast<uint64_t>(surface.getWidth()) * surface.getHeight();
+        if (mRegionSamples >= pixels * mRegionLearningPass) {
+            mGuiding.refine(mRegionLearningPass);
+            mRegionSamples = 0;
+            mRegionLearningPass *= 2;
+        }
+    }
+}
+
+void PathTracer::addBlocks(View& view, Block region, std::vector<ViewBlock>& blocks) {
+    Surface& surface = view.camera->getSurface();
     const unsigned width = surface.getWidth();
     const unsigned height = surface.getHeight();
-    surface.clear();
-    Debug::Log::i(TAG, "Render scene: %dx%d", width, height);
+    region.left = std::min(region.left, width);
+    region.up = std::min(region.up, height);
+    region.right = std::min(region.right, width);
+    region.down = std::min(region.down, height);
+
+    // Samples around the region also reach its pixels through the filter
+    const unsigned padding = view.film.getFilter().getPadding();
+    region.left = (region.left > padding)? region.left - padding : 0;
+    region.up = (region.up > padding)? region.up - padding : 0;
+    region.right = std::min(region.right + padding, width);
+    region.down = std::min(region.down + padding, height);
+
+    view.blocks.clear();
+    calculateBlocks(view.blocks, region);
+    reorderBlocks(view.blocks, region);
+    for (const Block& block : view.blocks) {
+        blocks.push_back({&view, block});
+    }
+}
+
+void PathTracer::resetLearning(struct Scene& scene, const std::vector<Camera*>& cameras) {
+    seedRandom(0, mSeed);
+    struct Enclosure bounds = estimateSceneBounds(scene, *cameras[0]);
+    for (unsigned int v = 1; v < cameras.size(); v++) {
+        struct Enclosure e = estimateSceneBounds(scene, *cameras[v]);
+        bounds.x_min = std::min(bounds.x_min, e.x_min);
+        bounds.x_max = std::max(bounds.x_max, e.x_max);
+        bounds.y_min = std::min(bounds.y_min, e.y_min);
+        bounds.y_max = std::max(bounds.y_max, e.y_max);
+        bounds.z_min = std::min(bounds.z_min, e.z_min);
+        bounds.z_max = std::max(bounds.z_max, e.z_max);
+    }
+    if (mPathGuidingEnabled) {
+        mGuiding.reset(bounds);
+    }
+    if (mRadianceCache != nullptr) {
+        Vec3D diagonal(bounds.x_max - bounds.x_min,
+            bounds.y_max - bounds.y_min, bounds.z_max - bounds.z_min);
+        mRadianceCache->clear(diagonal.dist());
+    }
+}
+
+SharedFramebuffer* PathTracer::sharedFramebufferFor(Surface& surface) {
+    if (mSharedFramebuffer == nullptr || mSharedFramebuffer->getHeader().width != surface.getWidth() ||
+        mSharedFramebuffer->getHeader().height != surface.getHeight()) {
+        return nullptr;
+    }
+    return mSharedFramebuffer;
+}
+
+void PathTracer::buildReplicas(struct Scene& scene) {
+    if (mReplicaScene == &scene && mReplicaRevision == scene.revision &&
+        mReplicas.size() == mScheduler.getNodeCount()) {
+        return;
+    }
+    mReplicaScene = &scene;
+    mReplicaRevision = scene.revision;
+
+    mReplicas.clear();
+    mReplicas.resize(mScheduler.getNodeCount());
+
+    // Built by a worker of each node, so that the memory is first touched there
+    mScheduler.runOnEachNode([&](unsigned node) {
+        mReplicas[node].reset(new SceneReplica());
+        SceneReplica& data = *mReplicas[node];
+        data.objects = scene.objects;
 
-    std::vector<Block> blocks;
-    calculateBlocks(blocks, width, height);
-    reorderBlocks(blocks, width, height);
+        std::vector<IObject3D*> noLights;
+        data.lightBVH.build(mLightSamplingEnabled? data.objects : noLights);
 
-    for (unsigned int b = 0; b < blocks.size(); b++) {
-        #pragma omp parallel for
-        for (unsigned int i = blocks[b].left; i < blocks[b].right; i++) {
-            for (unsigned int j = blocks[b].up; j < blocks[b].down; j++) {
+        if (scene.environment != nullptr) {
+            data.environment = *scene.environment;
+        } else {
+            data.environment = Environment(scene.backgroundColor);
+        }
+    });
+}
+
+PathTracer::SceneReplica& PathTracer::replica() {
+    const int worker = TileScheduler::currentWorker();
+    return *mReplicas[(worker >= 0)? mScheduler.getWorkerNode(worker) : 0];
+}
+
+bool PathTracer::renderBlock(struct Scene& scene, View& view, const Block& block, unsigned target,
+                             bool withAOVs, unsigned worker, double& workerVariance)
+{
+    Camera& camera = *view.camera;
+    Film& film = view.film;
+    Surface& surface = camera.getSurface();
+    const unsigned width = surface.getWidth();
+    Accumulation& accumulation = film.getAccumulation();
+    AOVBuffers* aovs = withAOVs? camera.getAOVs() : nullptr;
+    const unsigned int blockWidth = block.right - block.left;
+    const unsigned int blockPixels = blockWidth * (block.down - block.up);
+    // Once a ray misses geometry that is not resident, the rest of the block
+    // only takes one sample per pixel, so that the clusters it needs are
+    // requested in one batch, and nothing is merged
+    bool deferred = false;
+
+    // Rays through the block, pixel k of which is at (left + k % blockWidth,
+    // up + k / blockWidth). Cached hits are at the centre of their stratum.
+    RayBuffer rays;
+    rays.seed = mSeed;
+    rays.jittered = !mFirstHitCacheEnabled;
+
+    // G-buffer of the block with the hits at the centre of every
+    // stratum of every pixel, row by row like the surface
+    std::vector<HitRecord> gBuffer;
+    if (mFirstHitCacheEnabled) {
+        gBuffer.resize(blockPixels * STRATA);
+
+        // The first STRATA samples of a pixel take every stratum once
+        for (unsigned int n = 0; n < STRATA; n++) {
+            camera.generateRays(block.left, block.up, block.right, block.down, n, rays);
+            for (unsigned int k = 0; k < blockPixels; k++) {
+                const unsigned p = (block.up + k / blockWidth)*width + block.left + k % blockWidth;
+                Ray ray = rays.ray(k);
+                resolveHit(ray, scene, gBuffer[k*STRATA + Camera::stratumOf(p, n)]);
+            }
+        }
+        deferred = GeometryCache::takeDeferred();
+    }
+
+    if (aovs != nullptr) {
+        for (unsigned int j = block.up; j < block.down; j++) {
+            for (unsigned int i = block.left; i < block.right; i++) {
                 Ray ray = camera.getRayToPixel(i, j);
-                for (unsigned int n = 0; n < mSPP; n++) {
-                    surface[i][j] += traceRay(0, ray, scene);
+                HitRecord hit;
+                resolveHit(ray, scene, hit);
+                if (hit.valid) {
+                    aovs->albedo.at(i, j) = hit.material.color;
+                    aovs->normal.at(i, j) = hit.normal.normalize();
+                    aovs->depth.at(i, j).set(hit.distance, hit.distance, hit.distance);
+                } else {
+                    aovs->albedo.at(i, j).set(0, 0, 0);
+                    aovs->normal.at(i, j).set(0, 0, 0);
+                    aovs->depth.at(i, j).set(0, 0, 0);
+                }
+            }
+        }
+        deferred = GeometryCache::takeDeferred() || deferred;
+    }
+
+    unsigned first = target;
+    for (unsigned int j = block.up; j < block.down; j++) {
+        for (unsigned int i = block.left; i < block.right; i++) {
+            first = std::min(first, accumulation.counts[j*width + i]);
+        }
+    }
+
+    // The block is sampled one sample index at a time, with the rays of all
+    // its pixels generated together. Every sample has its own random
+    // sequence, and the film sums are exact. A pixel is then the same
+    // however its samples are split in passes and threads.
+    FilmTile& tile = film.beginTile(worker, block.left, block.up, block.right, block.down);
+    std::vector<double> sumL(blockPixels, 0), sumL2(blockPixels, 0);
+    for (unsigned int n = first; n < target && !deferred; n++) {
+        camera.generateRays(block.left, block.up, block.right, block.down, n, rays);
+        for (unsigned int k = 0; k < blockPixels; k++) {
+            const unsigned p = (block.up + k / blockWidth)*width + block.left + k % blockWidth;
+            if (n < accumulation.counts[p]) {
+                continue;
+            }
+
+            setRandomState(rays.random[k]);
+            Color sample;
+            if (mFirstHitCacheEnabled) {
+                HitRecord& hit = gBuffer[k*STRATA + Camera::stratumOf(p, n)];
+                if (hit.valid && mMaxDepth > 0) {
+                    sample = shadeHit(0, hit, scene);
+                } else if (mMaxDepth > 0) {
+                    Vec3D direction = rays.direction(k);
+                    sample = replica().environment.radiance(direction);
                 }
-                surface[i][j] *= 1.0f/mSPP;
+            } else {
+                Ray ray = rays.ray(k);
+                sample = traceRay(0, ray, scene, 0);
             }
+            deferred = GeometryCache::takeDeferred() || deferred;
+            if (deferred) {
+                continue;
+            }
+
+            tile.add(rays.x[k], rays.y[k], sample);
+            const double l = (sample.x + sample.y + sample.z) / 3;
+            sumL[k] += l;
+            sumL2[k] += l*l;
         }
+    }
+    if (deferred) {
+        commitLearning(false);
+        return false;
+    }
+    commitLearning(true);
 
-        notifyPartialResult(scene, camera);
+    double varianceSum = 0;
+    for (unsigned int k = 0; k < blockPixels; k++) {
+        const unsigned p = (block.up + k / blockWidth)*width + block.left + k % blockWidth;
+        const unsigned taken = target - std::min(accumulation.counts[p], target);
+        if (taken > 1) {
+            varianceSum += (sumL2[k] - sumL[k]*sumL[k]/taken) / (taken - 1);
+        }
+        accumulation.counts[p] = std::max(accumulation.counts[p], target);
     }
+    workerVariance += varianceSum;
 
-    notifyRenderFinished(scene, camera);
+    // The neighbouring blocks may still add to the edges of this one
+    film.merge(tile);
+    film.resolve(surface, block.left, block.up, block.right, block.down);
+    if (view.shared != nullptr) {
+        view.shared->publish(surface, block.left, block.up, block.right, block.down);
+    }
+    if (view.preview) {
+        mNotifier.publish(surface, {block.left, block.up, block.right, block.down});
+    }
+    return true;
 }
 
-Color PathTracer::traceRay(unsigned depth, Ray& ray, struct Scene& scene) {
+double PathTracer::renderPass(struct Scene& scene, std::vector<ViewBlock>& blocks, unsigned target,
+                              bool withAOVs)
+{
+    std::vector<double> varianceSums(mScheduler.getThreadCount(), 0);
+
+    // Blocks whose rays reach clusters of out-of-core meshes that are not
+    // resident are put aside while the I/O thread reads the clusters, and
+    // run again once the batch is in. The last round waits for its misses.
+    std::vector<unsigned> pending(blocks.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    for (unsigned int round = 0; !pending.empty(); round++) {
+        const bool deferring = scene.geometryCache != nullptr && scene.geometryCache->hasFiles() &&
+            round < MAX_DEFERRED_ROUNDS;
+        std::vector<unsigned> deferred;
+        std::mutex deferredLock;
+        mScheduler.run(pending.size(), [&](unsigned index, unsigned worker) {
+            GeometryCache::setDeferring(deferring);
+            ViewBlock& item = blocks[pending[index]];
+            const bool done = renderBlock(scene, *item.view, item.block, target, withAOVs,
+                worker, varianceSums[worker]);
+            GeometryCache::setDeferring(false);
+            if (!done) {
+                std::lock_guard<std::mutex> lock(deferredLock);
+                deferred.push_back(pending[index]);
+            }
+        });
+
+        if (!deferred.empty()) {
+            Debug::Log::d(TAG, "Round %u: %zu blocks deferred", round, deferred.size());
+            scene.geometryCache->waitForLoads();
+            std::sort(deferred.begin(), deferred.end());
+        }
+        pending.swap(deferred);
+    }
+
+    // Now every sample has been merged
+    mScheduler.run(blocks.size(), [&](unsigned b, unsigned worker) {
+        View& view = *blocks[b].view;
+        const Block& block = blocks[b].block;
+        Surface& surface = view.camera->getSurface();
+        view.film.resolve(surface, block.left, block.up, block.right, block.down);
+        if (view.shared != nullptr) {
+            view.shared->publish(surface, block.left, block.up, block.right, block.down);
+        }
+        if (view.preview) {
+            mNotifier.publish(surface, {block.left, block.up, block.right, block.down});
+        }
+    });
+
+    double varianceSum = 0;
+    for (double sum : varianceSums) {
+        varianceSum += sum;
+    }
+    unsigned pixels = 0;
+    for (const ViewBlock& item : blocks) {
+        pixels += (item.block.right - item.block.left) * (item.block.down - item.block.up);
+    }
+    return varianceSum / std::max(pixels, 1u);
+}
+
+struct Enclosure PathTracer::estimateSceneBounds(struct Scene& scene, Camera& camera) {
+    static constexpr unsigned GRID = 32;
+
+    Vec3D eye = camera.getRayToPixel(0, 0).getOrigin();
+    struct Enclosure bounds = Enclosure {eye.x, eye.x, eye.y, eye.y, eye.z, eye.z};
+    auto merge = [&bounds](Vec3D& p) {
+        bounds.x_min = std::min(bounds.x_min, p.x);
+        bounds.x_max = std::max(bounds.x_max, p.x);
+        bounds.y_min = std::min(bounds.y_min, p.y);
+        bounds.y_max = std::max(bounds.y_max, p.y);
+        bounds.z_min = std::min(bounds.z_min, p.z);
+        bounds.z_max = std::max(bounds.z_max, p.z);
+    };
+
+    for (IObject3D* object : scene.objects) {
+        struct Enclosure e = object->getEnclosure();
+        if (e.x_min == -infinity<Real>() || e.x_max == infinity<Real>() ||
+            e.y_min == -infinity<Real>() || e.y_max == infinity<Real>() ||
+            e.z_min == -infinity<Real>() || e.z_max == infinity<Real>()) {
+            continue;
+        }
+        Vec3D lo(e.x_min, e.y_min, e.z_min);
+        Vec3D hi(e.x_max, e.y_max, e.z_max);
+        merge(lo);
+        merge(hi);
+    }
+
+    // Unbounded objects: use the points seen by the camera and one bounce
+    const unsigned width = camera.getSurface().getWidth();
+    const unsigned height = camera.getSurface().getHeight();
+    for (unsigned int gx = 0; gx < GRID; gx++) {
+        for (unsigned int gy = 0; gy < GRID; gy++) {
+            Ray ray = camera.getRayToPixel((2*gx + 1)*width/(2*GRID), (2*gy + 1)*height/(2*GRID));
+            HitRecord hit;
+            if (!resolveHit(ray, scene, hit)) {
+                continue;
+            }
+            merge(hit.point);
+
+            Ray bounce(hit.point, sampleHemisphere(hit.normal));
+            if (resolveHit(bounce, scene, hit)) {
+                merge(hit.point);
+            }
+        }
+    }
+
+    const Real margin = 0.01f * std::max({bounds.x_max - bounds.x_min,
+        bounds.y_max - bounds.y_min, bounds.z_max - bounds.z_min, 1.0f});
+    bounds.x_min -= margin; bounds.x_max += margin;
+    bounds.y_min -= margin; bounds.y_max += margin;
+    bounds.z_min -= margin; bounds.z_max += margin;
+    return bounds;
+}
+
+Color PathTracer::traceRay(unsigned depth, Ray& ray, struct Scene& scene, Real bsdfPdf) {
     if (depth >= mMaxDepth) {
         return Color();
     }
 
+    HitRecord hit;
+    if (!resolveHit(ray, scene, hit)) {
+        Environment& environment = replica().environment;
+        Vec3D direction = ray.getDirection();
+        Color radiance = environment.radiance(direction);
+        if (mEnvironmentSamplingEnabled && bsdfPdf > 0) {
+            // Power heuristic against the environment sample of the previous bounce
+            const Real envPdf = environment.pdf(direction);
+            radiance *= bsdfPdf*bsdfPdf / (bsdfPdf*bsdfPdf + envPdf*envPdf);
+        }
+        return radiance;
+    }
+
+    if (mRadianceCache == nullptr) {
+        return shadeHit(depth, hit, scene);
+    }
+
+    // Paths whose footprint covers several cache cells stop at the cache
+    if (depth >= mRadianceCache->getMinBounces() &&
+        hit.distance >= mRadianceCache->getFootprintScale() * mRadianceCache->getCellSize()) {
+        Color cached;
+        if (mRadianceCache->lookup(hit.point, hit.normal, cached)) {
+            if (uniformRandom() < CACHE_VALIDATION_RATE) {
+                Color traced = shadeHit(depth, hit, scene);
+                validateCache(cached, traced);
+            }
+            return cached;
+        }
+    }
+
+    Color radiance = shadeHit(depth, hit, scene);
+    if (depth > 0 && depth <= mRadianceCache->getMinBounces()) {
+        recordCache(hit.point, hit.normal, radiance);
+    }
+    return radiance;
+}
+
+void PathTracer::recordGuiding(Vec3D& point, Vec3D& direction, Real radiance) {
+    if (GeometryCache::isDeferring()) {
+        sLearning.push_back(LearningRecord {LearningRecord::GUIDING, point, direction, Color(), Color(), radiance});
+    } else {
+        mGuiding.record(point, direction, radiance);
+    }
+}
+
+void PathTracer::recordCache(Vec3D& point, Vec3D& normal, Color& radiance) {
+    if (GeometryCache::isDeferring()) {
+        sLearning.push_back(LearningRecord {LearningRecord::CACHE, point, normal, radiance, Color(), 0});
+    } else {
+        mRadianceCache->record(point, normal, radiance);
+    }
+}
+
+void PathTracer::validateCache(Color& cached, Color& traced) {
+    if (GeometryCache::isDeferring()) {
+        sLearning.push_back(LearningRecord {LearningRecord::VALIDATION, Vec3D(), Vec3D(), cached, traced, 0});
+    } else {
+        mRadianceCache->validate(cached, traced);
+    }
+}
+
+void PathTracer::commitLearning(bool apply) {
+    if (apply) {
+        for (LearningRecord& record : sLearning) {
+            switch (record.kind) {
+                case LearningRecord::GUIDING:
+                    mGuiding.record(record.point, record.direction, record.value);
+                    break;
+                case LearningRecord::CACHE:
+                    mRadianceCache->record(record.point, record.direction, record.radiance);
+                    break;
+                case LearningRecord::VALIDATION:
+                    mRadianceCache->validate(record.radiance, record.traced);
+                    break;
+            }
+        }
+    }
+    sLearning.clear();
+}
+
+bool PathTracer::resolveHit(Ray& ray, struct Scene& scene, HitRecord& hit) {
     Real t;
-    IObject3D* iObject = intersectObjects(ray, scene.objects, t);
+    IObject3D* iObject = intersectObjects(ray, replica().objects, t);
     if (iObject == nullptr) {
-            return Color();
+        hit.valid = false;
+        return false;
     }
 
     Vec3D iPoint_v = ray.point(t);
     Vec3D iDirection_v = ray.getDirection();
-    Vec3D iNormal_v = iObject->getHitNormal(iPoint_v, iDirection_v);
-    iPoint_v.set(iPoint_v + ACCURACY*iNormal_v);
+    hit.normal = iObject->getHitNormal(iPoint_v, iDirection_v);
+    hit.point = iPoint_v + ACCURACY*hit.normal;
+    hit.distance = t;
+    hit.material = iObject->material();
+    hit.object = iObject;
+    hit.valid = true;
+    return true;
+}
+
+Color PathTracer::shadeHit(unsigned depth, HitRecord& hit, struct Scene& scene) {
+    // Emission of the lights in the hierarchy was already added by the
+    // previous bounce through direct light sampling
+    Color emission;
+    if (depth == 0 || !replica().lightBVH.contains(hit.object)) {
+        emission = hit.material.emission;
+    }
+
+    Color direct;
+    if (depth+1 < mMaxDepth) {
+        direct = sampleDirectLight(hit, scene);
+        if (mEnvironmentSamplingEnabled) {
+            direct += sampleEnvironment(hit, scene);
+        }
+    }
+
+    if (!mPathGuidingEnabled || !mGuiding.ready()) {
+        Vec3D sample_v = sampleHemisphere(hit.normal);
+
+        const Real p = 1.0/(2*M_PI);
+        Ray sampleRay(hit.point, sample_v);
 
-    struct Material iMaterial = iObject->material();
-    Color emission = iMaterial.emission;
+        Vec3D normal_v = hit.normal.normalize();
+        const Real pdf = sampleRay.getDirection().dot(normal_v) / M_PI;
+        Color radiance = traceRay(depth+1, sampleRay, scene, pdf);
+        if (mPathGuidingEnabled) {
+            // Learn the incident radiance over the cosine density
+            recordGuiding(hit.point, sample_v, luminance(radiance) / pdf);
+        }
+
+        Color incoming = hit.material.color * radiance;
+        return emission + direct + p*incoming;
+    }
 
-    Vec3D sample_v = sampleHemisphere(iNormal_v);
+    // One-sample mixture of the guiding distribution and cosine sampling
+    Vec3D normal_v = hit.normal.normalize();
+    Vec3D sample_v;
+    if (uniformRandom() < GUIDING_FRACTION) {
+        mGuiding.sample(hit.point, sample_v);
+    } else {
+        sample_v = sampleHemisphere(normal_v);
+    }
+    sample_v = sample_v.normalize();
+
+    const Real cosTheta = sample_v.dot(normal_v);
+    const Real pdf = GUIDING_FRACTION * mGuiding.pdf(hit.point, sample_v) +
+        (1 - GUIDING_FRACTION) * std::max<Real>(cosTheta, 0) / M_PI;
+    if (cosTheta <= 0 || pdf <= 0) {
+        // Below the surface: the sample still counts, with zero contribution
+        return emission + direct;
+    }
+
+    Ray sampleRay(hit.point, sample_v);
+    Color radiance = traceRay(depth+1, sampleRay, scene, pdf);
+    recordGuiding(hit.point, sample_v, luminance(radiance) / pdf);
+
+    // Same BRDF as the cosine samples above: color/(2*pi^2)
+    const Real weight = cosTheta / (2*M_PI*M_PI * pdf);
+    Color incoming = hit.material.color * radiance;
+    return emission + direct + weight*incoming;
+}
+
+Color PathTracer::sampleDirectLight(HitRecord& hit, struct Scene& scene) {
+    SceneReplica& data = replica();
+    if (data.lightBVH.empty()) {
+        return Color();
+    }
+
+    Real pmf;
+    IObject3D* light = data.lightBVH.sample(hit.point, hit.normal, uniformRandom(), pmf);
+    if (light == nullptr) {
+        return Color();
+    }
+
+    Vec3D lightPoint_v = light->samplePoint(uniformRandom(), uniformRandom());
+    Vec3D toLight_v = lightPoint_v - hit.point;
+    const Real dist = toLight_v.dist();
+    Vec3D wi_v = (1/dist) * toLight_v;
+    Vec3D normal_v = hit.normal.normalize();
+    Vec3D lightNormal_v = light->getSurfaceNormal(lightPoint_v, wi_v).normalize();
+
+    const Real cosSurface = wi_v.dot(normal_v);
+    const Real cosLight = fabs(wi_v.dot(lightNormal_v));
+    if (cosSurface <= 0 || cosLight <= 0) {
+        return Color();
+    }
+
+    // The sampled point is visible if the light is the closest hit around it
+    Real t;
+    Ray shadowRay(hit.point, wi_v);
+    IObject3D* occluder = intersectObjects(shadowRay, data.objects, t);
+    if (occluder != light || t < dist*(1 - ACCURACY)) {
+        return Color();
+    }
+
+    // Same estimator as the hemisphere samples of shadeHit: cosine sampling
+    // weighted by 1/(2*pi) amounts to a BRDF of color/(2*pi^2)
+    const Real brdf = 1.0/(2*M_PI*M_PI);
+    const Real weight = brdf * cosSurface * cosLight * light->getArea() / (dist*dist * pmf);
+    return weight * (hit.material.color * light->material().emission);
+}
+
+Real PathTracer::bouncePdf(HitRecord& hit, Vec3D& direction) {
+    Vec3D normal_v = hit.normal.normalize();
+    const Real cosTheta = std::max<Real>(direction.dot(normal_v), 0);
+    if (!mPathGuidingEnabled || !mGuiding.ready()) {
+        return cosTheta / M_PI;
+    }
+    return GUIDING_FRACTION * mGuiding.pdf(hit.point, direction) +
+        (1 - GUIDING_FRACTION) * cosTheta / M_PI;
+}
+
+Color PathTracer::sampleEnvironment(HitRecord& hit, struct Scene& scene) {
+    SceneReplica& data = replica();
+    Real envPdf;
+    Vec3D wi_v = data.environment.sample(uniformRandom(), uniformRandom(), envPdf);
+    Vec3D normal_v = hit.normal.normalize();
+    const Real cosSurface = wi_v.dot(normal_v);
+    if (cosSurface <= 0 || envPdf <= 0) {
+        return Color();
+    }
+
+    // Only rays that leave the scene see the environment
+    Real t;
+    Ray shadowRay(hit.point, wi_v);
+    if (intersectObjects(shadowRay, data.objects, t) != nullptr) {
+        return Color();
+    }
 
-    const Real p = 1.0/(2*M_PI);
-    Ray sampleRay(iPoint_v, sample_v);
+    const Real bsdfPdf = bouncePdf(hit, wi_v);
+    const Real mis = envPdf*envPdf / (envPdf*envPdf + bsdfPdf*bsdfPdf);
 
-    Color incoming = iMaterial.color * traceRay(depth+1, sampleRay, scene);
-    return emission + p*incoming;
+    const Real brdf = 1.0/(2*M_PI*M_PI);
+    const Real weight = mis * brdf * cosSurface / envPdf;
+    return weight * (hit.material.color * data.environment.radiance(wi_v));
 }
@@ -0,0 +1,241 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "RadianceCache.hpp"
+
+#include "Common.hpp"
+#include "Utils.hpp"
+
+#include <cmath>
+#include <cstdint>
+
+#include "debug.hpp"
+
+static const char* TAG = "RadianceCache";
+
+/** Cells per scene size when the cell size is not set */
+static const Real DEFAULT_CELLS = 64;
+
+/** Bits of each grid coordinate in a key */
+static const unsigned COORD_BITS = 20;
+static const uint64_t COORD_MASK = (1ull << COORD_BITS) - 1;
+
+/** splitmix64 finaliser */
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+RadianceCache::RadianceCache(unsigned capacityLog2)
+:   mCapacityLog2(capacityLog2),
+    mEntries(new Entry[1u << capacityLog2])
+{
+    clear(1);
+}
+
+RadianceCache::~RadianceCache() { }
+
+void RadianceCache::setCellSize(Real size) {
+    mCellSize = size;
+}
+
+void RadianceCache::setMinBounces(unsigned bounces) {
+    mMinBounces = bounces;
+}
+
+void RadianceCache::setMinSamples(unsigned samples) {
+    mMinSamples = samples;
+}
+
+void RadianceCache::setFootprintScale(Real scale) {
+    mFootprintScale = scale;
+}
+
+Real RadianceCache::getCellSize() {
+    return mResolvedCellSize;
+}
+
+unsigned RadianceCache::getMinBounces() {
+    return mMinBounces;
+}
+
+Real RadianceCache::getFootprintScale() {
+    return mFootprintScale;
+}
+
+void RadianceCache::clear(Real sceneSize) {
+    mResolvedCellSize = (mCellSize > 0)? mCellSize : sceneSize / DEFAULT_CELLS;
+
+    const unsigned capacity = 1u << mCapacityLog2;
+    for (unsigned int e = 0; e < capacity; e++) {
+        mEntries[e].key.store(0, std::memory_order_relaxed);
+        mEntries[e].r.store(0, std::memory_order_relaxed);
+        mEntries[e].g.store(0, std::memory_order_relaxed);
+        mEntries[e].b.store(0, std::memory_order_relaxed);
+        mEntries[e].count.store(0, std::memory_order_relaxed);
+    }
+
+    mLookups.store(0);
+    mHits.store(0);
+    mDropped.store(0);
+    mValidations.store(0);
+    mBiasSum.store(0);
+    mTracedSum.store(0);
+    mDifferenceSquares.store(0);
+}
+
+uint64_t RadianceCache::cellKey(Vec3D& point, Vec3D& normal) {
+    const Real inv = 1 / mResolvedCellSize;
+    const uint64_t offset = 1ull << (COORD_BITS - 1);
+    const uint64_t x = (static_cast<int64_t>(floor(point.x * inv)) + offset) & COORD_MASK;
+    const uint64_t y = (static_cast<int64_t>(floor(point.y * inv)) + offset) & COORD_MASK;
+    const uint64_t z = (static_cast<int64_t>(floor(point.z * inv)) + offset) & COORD_MASK;
+
+    // Dominant axis and sign of the normal, so that both sides of a wall differ
+    const Real ax = fabs(normal.x), ay = fabs(normal.y), az = fabs(normal.z);
+    uint64_t side;
+    if (ax >= ay && ax >= az) {
+        side = (normal.x > 0)? 0 : 1;
+    } else if (ay >= az) {
+        side = (normal.y > 0)? 2 : 3;
+    } else {
+        side = (normal.z > 0)? 4 : 5;
+    }
+
+    // The top bit keeps keys from being 0, which marks empty entries
+    return (1ull << 63) | (side << (3*COORD_BITS)) |
+        (z << (2*COORD_BITS)) | (y << COORD_BITS) | x;
+}
+
+RadianceCache::Entry* RadianceCache::find(uint64_t key, bool insert) {
+    const uint64_t mask = (1ull << mCapacityLog2) - 1;
+    const uint64_t hash = mix(key);
+
+    for (unsigned int probe = 0; probe < MAX_PROBES; probe++) {
+        Entry& entry = mEntries[(hash + probe) & mask];
+        uint64_t current = entry.key.load(std::memory_order_acquire);
+        if (current == key) {
+            return &entry;
+        }
+        if (current != 0) {
+            continue;
+        }
+        if (!insert) {
+            return nullptr;
+        }
+
+        // Claim the empty entry. Another thread may claim it first
+        if (entry.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) ||
+            current == key) {
+            return &entry;
+        }
+    }
+
+    if (insert) {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return nullptr;
+}
+
+void RadianceCache::record(Vec3D& point, Vec3D& normal, Color& radiance) {
+    if (!std::isfinite(radiance.x) || !std::isfinite(radiance.y) || !std::isfinite(radiance.z)) {
+        return;
+    }
+
+    Entry* entry = find(cellKey(point, normal), true);
+    if (entry == nullptr) {
+        return;
+    }
+
+    atomicAdd(entry->r, radiance.x);
+    atomicAdd(entry->g, radiance.y);
+    atomicAdd(entry->b, radiance.z);
+    entry->count.fetch_add(1, std::memory_order_release);
+}
+
+bool RadianceCache::lookup(Vec3D& point, Vec3D& normal, Color& radiance) {
+    mLookups.fetch_add(1, std::memory_order_relaxed);
+
+    Entry* entry = find(cellKey(point, normal), false);
+    if (entry == nullptr) {
+        return false;
+    }
+
+    const uint32_t count = entry->count.load(std::memory_order_acquire);
+    if (count < mMinSamples) {
+        return false;
+    }
+
+    const Real inv = 1.0f / count;
+    radiance.set(
+        inv * entry->r.load(std::memory_order_relaxed),
+        inv * entry->g.load(std::memory_order_relaxed),
+        inv * entry->b.load(std::memory_order_relaxed));
+    mHits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void RadianceCache::validate(Color& cached, Color& traced) {
+    const double c = luminance(cached);
+    const double t = luminance(traced);
+    mValidations.fetch_add(1, std::memory_order_relaxed);
+    atomicAdd(mBiasSum, c - t);
+    atomicAdd(mTracedSum, t);
+    atomicAdd(mDifferenceSquares, (c - t)*(c - t));
+}
+
+void RadianceCache::report() {
+    const uint64_t lookups = mLookups.load();
+    const uint64_t hits = mHits.load();
+    const uint64_t validations = mValidations.load();
+
+    unsigned used = 0;
+    const unsigned capacity = 1u << mCapacityLog2;
+    for (unsigned int e = 0; e < capacity; e++) {
+        if (mEntries[e].key.load(std::memory_order_relaxed) != 0) {
+            used++;
+        }
+    }
+
+    Debug::Log::i(TAG, "%d/%d cells used (%llu dropped records), cell size %.3g, "
+        "%llu lookups, %.1f%% terminated into the cache",
+        used, capacity, static_cast<unsigned long long>(mDropped.load()), mResolvedCellSize,
+        static_cast<unsigned long long>(lookups), (lookups > 0)? 100.0 * hits / lookups : 0.0);
+
+    if (validations > 1) {
+        // Cached and traced radiance are estimated at the same vertices: the
+        // mean of their difference is the bias and its spread is the variance
+        // that a terminated path does not pay
+        const double n = validations;
+        const double tracedMean = mTracedSum.load() / n;
+        const double bias = mBiasSum.load() / n;
+        const double variance = mDifferenceSquares.load() / n - bias*bias;
+        Debug::Log::i(TAG, "Bias %.4g (%.2f%% of the traced radiance), variance avoided %.4g "
+            "per termination (%llu validated terminations)",
+            bias, (tracedMean != 0)? 100.0 * bias / tracedMean : 0.0,
+            variance, static_cast<unsigned long long>(validations));
+    }
+}
+
+size_t RadianceCache::getSizeBytes() {
+    return (static_cast<size_t>(1) << mCapacityLog2) * sizeof(Entry);
+}
@@ -0,0 +1,160 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "ResultNotifier.hpp"
+
+#include <algorithm>
+
+#include "debug.hpp"
+
+static const char* TAG = "ResultNotifier";
+
+/** Default shortest time between notifications: 20 per second */
+static const double DEFAULT_INTERVAL = 0.05;
+
+/** Part of a rectangle inside width x height, empty if it lies outside */
+static ResultRect clip(const ResultRect& rect, unsigned width, unsigned height) {
+    ResultRect clipped;
+    clipped.right = std::min(rect.right, width);
+    clipped.down = std::min(rect.down, height);
+    clipped.left = std::min(rect.left, clipped.right);
+    clipped.up = std::min(rect.up, clipped.down);
+    return clipped;
+}
+
+ResultNotifier::ResultNotifier()
+:   mBack(0, 0),
+    mFront(0, 0)
+{
+    setInterval(DEFAULT_INTERVAL);
+    mThread = std::thread(&ResultNotifier::notifierLoop, this);
+}
+
+ResultNotifier::~ResultNotifier() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    mChanged.notify_all();
+    mThread.join();
+}
+
+void ResultNotifier::addListener(IResultsListener* listener) {
+    mListeners.push_back(listener);
+}
+
+bool ResultNotifier::hasListeners() {
+    return !mListeners.empty();
+}
+
+void ResultNotifier::setInterval(double seconds) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mInterval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(std::max(seconds, 0.0)));
+}
+
+void ResultNotifier::begin(unsigned width, unsigned height, ToneMapper* toneMapper) {
+    std::unique_lock<std::mutex> lock(mLock);
+    mChanged.wait(lock, [this]() { return mDelivered == mPublished; });
+    if (mBack.getWidth() != width || mBack.getHeight() != height) {
+        mBack = Surface(width, height);
+        mFront = Surface(width, height);
+        mDisplay.resize(width, height);
+    }
+    mToneMapper = toneMapper;
+    mNotifications = 0;
+}
+
+void ResultNotifier::publish(Surface& surface, const ResultRect& rect) {
+    if (mListeners.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+    const ResultRect clipped = clip(rect, std::min(surface.getWidth(), mBack.getWidth()),
+                                    std::min(surface.getHeight(), mBack.getHeight()));
+    for (unsigned int j = clipped.up; j < clipped.down; j++) {
+        std::copy(surface.row(j) + clipped.left, surface.row(j) + clipped.right,
+                  mBack.row(j) + clipped.left);
+    }
+    mDirty.push_back(clipped);
+    mPublished++;
+    mChanged.notify_all();
+}
+
+void ResultNotifier::flush() {
+    std::unique_lock<std::mutex> lock(mLock);
+    if (mDelivered == mPublished) {
+        return;
+    }
+    mFlush = true;
+    mChanged.notify_all();
+    mChanged.wait(lock, [this]() { return mDelivered == mPublished; });
+    mFlush = false;
+    Debug::Log::i(TAG, "%u notifications for %llu rectangles", mNotifications,
+        static_cast<unsigned long long>(mPublished));
+}
+
+void ResultNotifier::notifierLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    Clock::time_point last = Clock::now() - mInterval;
+    while (true) {
+        if (mDirty.empty()) {
+            if (mExit) {
+                return;
+            }
+            mChanged.wait(lock);
+            continue;
+        }
+
+        // Rectangles published before the interval ends go in the same notification
+        const Clock::time_point deadline = last + mInterval;
+        if (!mFlush && !mExit && Clock::now() < deadline) {
+            mChanged.wait_until(lock, deadline);
+            continue;
+        }
+
+        std::vector<ResultRect> dirty;
+        dirty.swap(mDirty);
+        for (ResultRect& rect : dirty) {
+            rect = clip(rect, mFront.getWidth(), mFront.getHeight());
+            for (unsigned int j = rect.up; j < rect.down; j++) {
+                std::copy(mBack.row(j) + rect.left, mBack.row(j) + rect.right, mFront.row(j) + rect.left);
+            }
+        }
+        const uint64_t published = mPublished;
+        ToneMapper* toneMapper = mToneMapper;
+        lock.unlock();
+
+        // Only the rows that changed are tone mapped, outside of the lock
+        if (toneMapper != nullptr) {
+            for (const ResultRect& rect : dirty) {
+                toneMapper->map(mFront, mDisplay, rect.up, rect.down);
+            }
+        }
+        for (IResultsListener* listener : mListeners) {
+            listener->onPartialResult(mFront, mDisplay, dirty);
+        }
+
+        lock.lock();
+        last = Clock::now();
+        mNotifications++;
+        mDelivered = published;
+        mChanged.notify_all();
+    }
+}
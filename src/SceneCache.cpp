@@ -0,0 +1,418 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "SceneCache.hpp"
+
+#include "Mesh.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "SceneCache";
+
+static const char MAGIC[4] = {'P', 'T', 'S', 'C'};
+static const uint32_t VERSION = 1;
+static const size_t ALIGNMENT = 64;
+
+enum CacheObjectType : uint32_t {
+    CACHE_PLANE = 1,
+    CACHE_TRIANGLE = 2,
+    CACHE_SPHERE = 3,
+    CACHE_MESH = 4,
+};
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint64_t size;
+    float background[3];
+    uint32_t dependencyCount;
+    uint32_t materialCount;
+    uint32_t objectCount;
+    uint64_t dependencies;
+    uint64_t materials;
+    uint64_t objects;
+};
+
+/** Followed by the path, padded to 8 bytes */
+struct CacheDependency {
+    uint64_t size;
+    int64_t modified;
+    uint32_t pathLength;
+    uint32_t reserved;
+};
+
+struct CacheMaterial {
+    float color[3];
+    float emission[3];
+};
+
+/**
+ * Plane: position, normal. Triangle: a, b, c. Sphere: center, radius.
+ * Mesh: counts of vertices, triangles and nodes and the offsets of their
+ * arrays.
+*/
+struct CacheObject {
+    uint32_t type;
+    uint32_t material;
+    float values[9];
+    uint32_t counts[3];
+    uint64_t arrays[3];
+};
+
+static inline size_t align(size_t offset) {
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+/** Size and modification time in nanoseconds of a file */
+static bool fileStamp(const char* filename, uint64_t& size, int64_t& modified) {
+    struct stat info;
+    if (stat(filename, &info) != 0) {
+        return false;
+    }
+    size = info.st_size;
+    modified = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+SceneCache::SceneCache() { }
+
+SceneCache::~SceneCache() {
+    for (auto& mapping : mMappings) {
+        munmap(mapping.first, mapping.second);
+    }
+}
+
+bool SceneCache::hashFile(const char* filename, uint64_t& hash) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+
+    hash = hashBytes(nullptr, 0, VERSION);
+    if (info.st_size > 0) {
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+        hash = hashBytes(data, info.st_size, hash);
+        munmap(data, info.st_size);
+    }
+    close(fd);
+    return true;
+}
+
+ParserError SceneCache::loadScene(const char* filename, const char* directory, struct Scene& scene) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t hash;
+    if (!hashFile(filename, hash)) {
+        Debug::Log::e(TAG, "Could not open file %s", filename);
+        return PARSER_ERROR_NO_FILE;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.ptscene", static_cast<unsigned long long>(hash));
+    const std::string cacheFile = std::string(directory) + name;
+    if (load(cacheFile.c_str(), hash, scene)) {
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Debug::Log::i(TAG, "Loaded %s from %s in %.1f ms", filename, cacheFile.c_str(), 1000 * seconds);
+        return PARSER_OK;
+    }
+
+    std::vector<std::string> files;
+    ParserError error = parseSceneFromXml(filename, scene, &files);
+    if (error == PARSER_OK && save(cacheFile.c_str(), hash, scene, files)) {
+        Debug::Log::i(TAG, "Wrote %s", cacheFile.c_str());
+    }
+    return error;
+}
+
+bool SceneCache::save(const char* cacheFile, uint64_t hash, struct Scene& scene,
+                      const std::vector<std::string>& files)
+{
+    // Dependencies by absolute path, so that they are found from anywhere
+    std::vector<uint8_t> dependencies;
+    for (const std::string& file : files) {
+        char path[PATH_MAX];
+        CacheDependency dependency = {};
+        if (realpath(file.c_str(), path) == nullptr ||
+            !fileStamp(path, dependency.size, dependency.modified)) {
+            Debug::Log::w(TAG, "Not caching the scene: cannot find %s", file.c_str());
+            return false;
+        }
+        dependency.pathLength = strlen(path);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&dependency);
+        dependencies.insert(dependencies.end(), bytes, bytes + sizeof(dependency));
+        dependencies.insert(dependencies.end(), path, path + dependency.pathLength);
+        dependencies.resize((dependencies.size() + 7) / 8 * 8, 0);
+    }
+
+    std::vector<CacheMaterial> materials;
+    std::map<std::array<float, 6>, uint32_t> materialIndices;
+    std::vector<CacheObject> objects(scene.objects.size());
+    std::vector<TriangleMesh*> meshes;
+    size_t offset = align(sizeof(CacheHeader));
+    const size_t dependencyOffset = offset;
+    offset = align(offset + dependencies.size());
+    for (unsigned int o = 0; o < scene.objects.size(); o++) {
+        IObject3D* object = scene.objects[o];
+        CacheObject& record = objects[o];
+        memset(&record, 0, sizeof(record));
+        if (Plane* plane = dynamic_cast<Plane*>(object)) {
+            Vec3D position = plane->position(), normal = plane->normal();
+            record.type = CACHE_PLANE;
+            const float values[6] = {position.x, position.y, position.z, normal.x, normal.y, normal.z};
+            std::copy_n(values, 6, record.values);
+        } else if (Triangle* triangle = dynamic_cast<Triangle*>(object)) {
+            Vec3D a = triangle->a(), b = triangle->b(), c = triangle->c();
+            record.type = CACHE_TRIANGLE;
+            const float values[9] = {a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z};
+            std::copy_n(values, 9, record.values);
+        } else if (Sphere* sphere = dynamic_cast<Sphere*>(object)) {
+            Vec3D center = sphere->center();
+            record.type = CACHE_SPHERE;
+            const float values[4] = {center.x, center.y, center.z, sphere->radius()};
+            std::copy_n(values, 4, record.values);
+        } else if (TriangleMesh* mesh = dynamic_cast<TriangleMesh*>(object)) {
+            record.type = CACHE_MESH;
+            record.counts[0] = mesh->getVertexCount();
+            record.counts[1] = mesh->getTriangleCount();
+            record.counts[2] = mesh->getNodeCount();
+            meshes.push_back(mesh);
+        } else {
+            Debug::Log::w(TAG, "Not caching the scene: it has an object that cannot be cached");
+            return false;
+        }
+
+        Color& color = object->material().color;
+        Color& emission = object->material().emission;
+        const std::array<float, 6> key = {color.x, color.y, color.z, emission.x, emission.y, emission.z};
+        auto it = materialIndices.find(key);
+        if (it == materialIndices.end()) {
+            it = materialIndices.emplace(key, materials.size()).first;
+            materials.push_back(CacheMaterial {{key[0], key[1], key[2]}, {key[3], key[4], key[5]}});
+        }
+        record.material = it->second;
+    }
+
+    const size_t materialOffset = offset;
+    offset = align(offset + materials.size() * sizeof(CacheMaterial));
+    const size_t objectOffset = offset;
+    offset = align(offset + objects.size() * sizeof(CacheObject));
+    for (CacheObject& record : objects) {
+        if (record.type == CACHE_MESH) {
+            record.arrays[0] = offset;
+            offset = align(offset + 3 * sizeof(float) * static_cast<size_t>(record.counts[0]));
+            record.arrays[1] = offset;
+            offset = align(offset + 3 * sizeof(uint32_t) * static_cast<size_t>(record.counts[1]));
+            record.arrays[2] = offset;
+            offset = align(offset + sizeof(TriangleMesh::Node) * static_cast<size_t>(record.counts[2]));
+        }
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.hash = hash;
+    header.size = offset;
+    header.background[0] = scene.backgroundColor.x;
+    header.background[1] = scene.backgroundColor.y;
+    header.background[2] = scene.backgroundColor.z;
+    header.dependencyCount = files.size();
+    header.materialCount = materials.size();
+    header.objectCount = objects.size();
+    header.dependencies = dependencyOffset;
+    header.materials = materialOffset;
+    header.objects = objectOffset;
+
+    const std::string temporary = std::string(cacheFile) + ".tmp";
+    FILE* f = fopen(temporary.c_str(), "wb");
+    if (f == nullptr) {
+        Debug::Log::w(TAG, "Could not write %s", temporary.c_str());
+        return false;
+    }
+
+    size_t written = 0;
+    bool ok = true;
+    auto write = [&](const void* data, size_t size) {
+        ok = ok && fwrite(data, 1, size, f) == size;
+        written += size;
+    };
+    auto pad = [&]() {
+        static const uint8_t zeros[ALIGNMENT] = {0};
+        write(zeros, align(written) - written);
+    };
+
+    write(&header, sizeof(header));
+    pad();
+    write(dependencies.data(), dependencies.size());
+    pad();
+    write(materials.data(), materials.size() * sizeof(CacheMaterial));
+    pad();
+    write(objects.data(), objects.size() * sizeof(CacheObject));
+    pad();
+    for (TriangleMesh* mesh : meshes) {
+        write(mesh->getPositions(), 3 * sizeof(float) * static_cast<size_t>(mesh->getVertexCount()));
+        pad();
+        write(mesh->getIndices(), 3 * sizeof(uint32_t) * static_cast<size_t>(mesh->getTriangleCount()));
+        pad();
+        write(mesh->getNodes(), sizeof(TriangleMesh::Node) * static_cast<size_t>(mesh->getNodeCount()));
+        pad();
+    }
+    ok = (fclose(f) == 0) && ok && written == offset;
+
+    if (!ok || rename(temporary.c_str(), cacheFile) != 0) {
+        Debug::Log::w(TAG, "Could not write %s", cacheFile);
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SceneCache::load(const char* cacheFile, uint64_t hash, struct Scene& scene) {
+    const int fd = open(cacheFile, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // Private and writable, as meshes write their arrays when translated
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    uint8_t* base = static_cast<uint8_t*>(mapping);
+    const size_t size = info.st_size;
+
+    // Whether count records of recordSize bytes at offset are in the file
+    auto inside = [size](uint64_t offset, uint64_t count, size_t recordSize) {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / recordSize;
+    };
+
+    const CacheHeader* header = reinterpret_cast<const CacheHeader*>(base);
+    bool valid = !memcmp(header->magic, MAGIC, sizeof(MAGIC)) && header->version == VERSION &&
+        header->hash == hash && header->size == size &&
+        inside(header->materials, header->materialCount, sizeof(CacheMaterial)) &&
+        inside(header->objects, header->objectCount, sizeof(CacheObject)) &&
+        header->dependencies <= size;
+    if (!valid) {
+        Debug::Log::i(TAG, "%s is stale or invalid", cacheFile);
+        munmap(mapping, size);
+        return false;
+    }
+
+    // Stale if any mesh file changed
+    uint64_t offset = header->dependencies;
+    for (unsigned int d = 0; valid && d < header->dependencyCount; d++) {
+        valid = inside(offset, 1, sizeof(CacheDependency));
+        if (!valid) {
+            break;
+        }
+        const CacheDependency* dependency = reinterpret_cast<const CacheDependency*>(base + offset);
+        offset += sizeof(CacheDependency);
+        valid = dependency->pathLength < PATH_MAX && inside(offset, dependency->pathLength, 1);
+        if (valid) {
+            const std::string path(reinterpret_cast<const char*>(base + offset), dependency->pathLength);
+            uint64_t fileSize;
+            int64_t modified;
+            valid = fileStamp(path.c_str(), fileSize, modified) &&
+                fileSize == dependency->size && modified == dependency->modified;
+            if (!valid) {
+                Debug::Log::i(TAG, "%s is stale: %s changed", cacheFile, path.c_str());
+            }
+        }
+        offset += (dependency->pathLength + 7) / 8 * 8;
+    }
+
+    const CacheMaterial* materials = reinterpret_cast<const CacheMaterial*>(base + header->materials);
+    const CacheObject* objects = reinterpret_cast<const CacheObject*>(base + header->objects);
+    // Objects go to the arena of the scene, and only join it if all are valid
+    std::vector<IObject3D*> created;
+    for (unsigned int o = 0; valid && o < header->objectCount; o++) {
+        const CacheObject& record = objects[o];
+        if (record.material >= header->materialCount) {
+            valid = false;
+            break;
+        }
+        const CacheMaterial& m = materials[record.material];
+        struct Material material = {Color(m.color[0], m.color[1], m.color[2]),
+                                    Color(m.emission[0], m.emission[1], m.emission[2])};
+        const float* v = record.values;
+        Vec3D v1(v[0], v[1], v[2]), v2(v[3], v[4], v[5]), v3(v[6], v[7], v[8]);
+
+        IObject3D* object = nullptr;
+        if (record.type == CACHE_PLANE) {
+            object = scene.arena.create<Plane>(material, v1, v2);
+        } else if (record.type == CACHE_TRIANGLE) {
+            object = scene.arena.create<Triangle>(material, v1, v2, v3);
+        } else if (record.type == CACHE_SPHERE) {
+            object = scene.arena.create<Sphere>(material, v1, v[3]);
+        } else if (record.type == CACHE_MESH &&
+            inside(record.arrays[0], 3 * static_cast<uint64_t>(record.counts[0]), sizeof(float)) &&
+            inside(record.arrays[1], 3 * static_cast<uint64_t>(record.counts[1]), sizeof(uint32_t)) &&
+            inside(record.arrays[2], record.counts[2], sizeof(TriangleMesh::Node))) {
+            // Offsets become pointers into the mapping
+            object = scene.arena.create<TriangleMesh>(material,
+                reinterpret_cast<float*>(base + record.arrays[0]), record.counts[0],
+                reinterpret_cast<uint32_t*>(base + record.arrays[1]), record.counts[1],
+                reinterpret_cast<TriangleMesh::Node*>(base + record.arrays[2]), record.counts[2]);
+        } else {
+            valid = false;
+            break;
+        }
+        created.push_back(object);
+    }
+
+    if (!valid) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    mMappings.emplace_back(mapping, size);
+    scene.backgroundColor = Color(header->background[0], header->background[1], header->background[2]);
+    scene.objects.insert(scene.objects.end(), created.begin(), created.end());
+    return true;
+}
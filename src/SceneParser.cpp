@@ -19,36 +19,259 @@
 #include "SceneParser.hpp"
 #include "debug.hpp"
 
+#include "ClusteredMesh.hpp"
+#include "MeshLoader.hpp"
 #include "Objects.hpp"
 
-#ifndef SCENE_PARSER_TEMPORARY
-static const char* LOG_TAG = "SceneParser";
-
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <string>
+
+#include <strings.h>
+#include <sys/stat.h>
 
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <libxml/xmlreader.h>
+
+static const char* LOG_TAG = "SceneParser";
 
 #define ROOT_NODE "scene"
 #define ATTR_BACKGROUND "background"
 #define NODE_SPHERE "sphere"
 #define NODE_TRIANGLE "triangle"
 #define NODE_PLANE "plane"
-#endif
+#define NODE_MESH "mesh"
+
+/** Attributes of an object element. Values belong to the reader */
+struct ObjectAttributes {
+    const char* color = nullptr;
+    const char* emission = nullptr;
+    const char* center = nullptr;
+    const char* radius = nullptr;
+    const char* position = nullptr;
+    const char* normal = nullptr;
+    const char* a = nullptr;
+    const char* b = nullptr;
+    const char* c = nullptr;
+    const char* file = nullptr;
+};
+
+/** Parse "x y z". Returns false unless there are exactly three reals */
+static bool parseVector(const char* str, Vec3D& v) {
+    if (str == nullptr) {
+        return false;
+    }
+    char* end;
+    const Real x = std::strtof(str, &end);
+    if (end == str) {
+        return false;
+    }
+    const char* next = end;
+    const Real y = std::strtof(next, &end);
+    if (end == next) {
+        return false;
+    }
+    next = end;
+    const Real z = std::strtof(next, &end);
+    if (end == next) {
+        return false;
+    }
+    while (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r') {
+        end++;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    v.set(x, y, z);
+    return true;
+}
 
-#ifdef SCENE_PARSER_TEMPORARY
-Sphere* createSphere(struct Material material, Vec3D& center, Real radius) {
-    return new Sphere(material, center, radius);
+/** Parse a hexadecimal "rrggbb", optionally with a '#', or "r g b" */
+static bool parseColor(const char* str, Color& color) {
+    if (str == nullptr) {
+        return false;
+    }
+    if (strchr(str, ' ') != nullptr) {
+        return parseVector(str, color);
+    }
+    if (*str == '#') {
+        str++;
+    }
+    char* end;
+    const unsigned long value = std::strtoul(str, &end, 16);
+    if (end == str || *end != '\0') {
+        return false;
+    }
+    color.set(((value >> 16) & 0xFF)/255.0f, ((value >> 8) & 0xFF)/255.0f, (value & 0xFF)/255.0f);
+    return true;
 }
 
-Plane* createPlane(struct Material material, Vec3D& center, Vec3D& normal) {
-    return new Plane(material, center, normal);
+static bool parseReal(const char* str, Real& value) {
+    if (str == nullptr) {
+        return false;
+    }
+    char* end;
+    value = std::strtof(str, &end);
+    return end != str && *end == '\0';
 }
 
-Triangle* createTriangle(struct Material material, Vec3D& A, Vec3D& B, Vec3D& C) {
-    return new Triangle(material, A, B, C);
+/**
+ * Create the object of the element the reader is on in the arena of scene,
+ * or nullptr if its attributes are missing or invalid. Relative mesh files are found from
+ * directory, the one of the scene file, and added to files if given.
+*/
+static IObject3D* parseObject(xmlTextReaderPtr reader, const char* name, const std::string& directory,
+                              std::vector<std::string>* files, struct Scene& scene)
+{
+    // Constant names and values are interned or owned by the reader, so
+    // reading them does not allocate
+    ObjectAttributes attributes;
+    while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+        const char* attribute = (const char*) xmlTextReaderConstName(reader);
+        const char* value = (const char*) xmlTextReaderConstValue(reader);
+        if (!strcmp(attribute, "color")) {
+            attributes.color = value;
+        } else if (!strcmp(attribute, "emission")) {
+            attributes.emission = value;
+        } else if (!strcmp(attribute, "center")) {
+            attributes.center = value;
+        } else if (!strcmp(attribute, "radius")) {
+            attributes.radius = value;
+        } else if (!strcmp(attribute, "position")) {
+            attributes.position = value;
+        } else if (!strcmp(attribute, "normal")) {
+            attributes.normal = value;
+        } else if (!strcmp(attribute, "a")) {
+            attributes.a = value;
+        } else if (!strcmp(attribute, "b")) {
+            attributes.b = value;
+        } else if (!strcmp(attribute, "c")) {
+            attributes.c = value;
+        } else if (!strcmp(attribute, "file")) {
+            attributes.file = value;
+        }
+    }
+
+    struct Material material = {Color(0.75, 0.75, 0.75), Color()};
+    if ((attributes.color != nullptr && !parseColor(attributes.color, material.color)) ||
+        (attributes.emission != nullptr && !parseColor(attributes.emission, material.emission))) {
+        return nullptr;
+    }
+
+    Vec3D v1, v2, v3;
+    Real radius;
+    if (!strcmp(name, NODE_SPHERE)) {
+        if (parseVector(attributes.center, v1) && parseReal(attributes.radius, radius) && radius > 0) {
+            return scene.arena.create<Sphere>(material, v1, radius);
+        }
+    } else if (!strcmp(name, NODE_PLANE)) {
+        if (parseVector(attributes.position, v1) && parseVector(attributes.normal, v2)) {
+            return scene.arena.create<Plane>(material, v1, v2);
+        }
+    } else if (!strcmp(name, NODE_TRIANGLE)) {
+        if (parseVector(attributes.a, v1) && parseVector(attributes.b, v2) && parseVector(attributes.c, v3)) {
+            return scene.arena.create<Triangle>(material, v1, v2, v3);
+        }
+    } else if (!strcmp(name, NODE_MESH)) {
+        if (attributes.file != nullptr) {
+            const std::string path = (attributes.file[0] == '/')? attributes.file : directory + attributes.file;
+            if (files != nullptr) {
+                files->push_back(path);
+            }
+            const char* extension = strrchr(path.c_str(), '.');
+            if (extension != nullptr && !strcasecmp(extension, ".ptcl")) {
+                if (scene.geometryCache == nullptr) {
+                    Debug::Log::e(LOG_TAG, "%s: out-of-core meshes need a geometry cache", path.c_str());
+                    return nullptr;
+                }
+                return loadClusteredMesh(path.c_str(), material, *scene.geometryCache, scene.arena);
+            }
+            return loadMesh(path.c_str(), material, scene.arena);
+        }
+    }
+    return nullptr;
 }
 
+/** Read the attributes of the root element */
+static bool parseRoot(xmlTextReaderPtr reader, struct Scene& scene) {
+    while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+        const char* attribute = (const char*) xmlTextReaderConstName(reader);
+        if (!strcmp(attribute, ATTR_BACKGROUND) &&
+            !parseColor((const char*) xmlTextReaderConstValue(reader), scene.backgroundColor)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ParserError parseSceneFromXml(const char* filename, struct Scene& scene, std::vector<std::string>* files) {
+    auto start = std::chrono::steady_clock::now();
+
+    xmlTextReaderPtr reader = xmlReaderForFile(filename, nullptr, XML_PARSE_NONET | XML_PARSE_COMPACT |
+        XML_PARSE_BIG_LINES);
+    if (reader == nullptr) {
+        Debug::Log::e(LOG_TAG, "Could not open file %s", filename);
+        return PARSER_ERROR_NO_FILE;
+    }
+
+    const char* slash = strrchr(filename, '/');
+    const std::string directory(filename, (slash != nullptr)? slash + 1 - filename : 0);
+
+    const size_t firstObject = scene.objects.size();
+    ParserError error = PARSER_OK;
+    bool root = false;
+    int status;
+    while ((status = xmlTextReaderRead(reader)) == 1) {
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+            continue;
+        }
+
+        const char* name = (const char*) xmlTextReaderConstName(reader);
+        const int depth = xmlTextReaderDepth(reader);
+        // Line of the element itself, not of where the parser has read up to
+        const long line = xmlGetLineNo(xmlTextReaderCurrentNode(reader));
+        if (depth == 0) {
+            root = !strcmp(name, ROOT_NODE);
+            if (!root || !parseRoot(reader, scene)) {
+                Debug::Log::e(LOG_TAG, "%s:%ld: expected a <" ROOT_NODE "> element", filename, line);
+                error = PARSER_ERROR_INVALID_FORMAT;
+                break;
+            }
+        } else if (depth == 1) {
+            if (strcmp(name, NODE_SPHERE) && strcmp(name, NODE_PLANE) && strcmp(name, NODE_TRIANGLE) &&
+                strcmp(name, NODE_MESH)) {
+                Debug::Log::w(LOG_TAG, "%s:%ld: ignoring unknown element <%s>", filename, line, name);
+                continue;
+            }
+            IObject3D* object = parseObject(reader, name, directory, files, scene);
+            if (object == nullptr) {
+                Debug::Log::e(LOG_TAG, "%s:%ld: invalid <%s>", filename, line, name);
+                error = PARSER_ERROR_INVALID_FORMAT;
+                break;
+            }
+            scene.objects.push_back(object);
+        }
+    }
+    if (error == PARSER_OK && (status != 0 || !root)) {
+        Debug::Log::e(LOG_TAG, "Could not parse file %s", filename);
+        error = PARSER_ERROR_INVALID_FORMAT;
+    }
+    xmlFreeTextReader(reader);
+
+    if (error != PARSER_OK) {
+        // The arena keeps the memory of the objects until the scene is cleared
+        scene.objects.resize(firstObject);
+        return error;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    struct stat info;
+    const double megabytes = (stat(filename, &info) == 0)? info.st_size / (1024.0 * 1024.0) : 0;
+    Debug::Log::i(LOG_TAG, "Loaded %zu objects from %s: %.1f MB in %.2f s, %.1f MB/s",
+        scene.objects.size() - firstObject, filename, megabytes, seconds,
+        (seconds > 0)? megabytes / seconds : 0.0);
+    return PARSER_OK;
+}
 
 void buildScene(struct Scene& scene) {
     Color color;
@@ -58,124 +281,42 @@ void buildScene(struct Scene& scene) {
     color.set(0.75, 0.75, 0.75);
     v1.set(0, 0, 0);
     v2.set(0, 1, 0);
-    scene.objects.push_back(createPlane({color, Color()}, v1, v2));
+    scene.add<Plane>(Material {color, Color()}, v1, v2);
 
     Real ceiling = 8*sRad;
     v1.set(0, ceiling, 0);
     v2.set(0, -1, 0);
-    scene.objects.push_back(createPlane({color, 10.0f*Color(1.0, 1.0, 1.0)}, v1, v2));
+    scene.add<Plane>(Material {color, 10.0f*Color(1.0, 1.0, 1.0)}, v1, v2);
 
     color.set(0.75, 0.2, 0.2);
     v1.set(-5*sRad, 0, 0);
     v2.set(1, 0, 0);
-    scene.objects.push_back(createPlane({color, Color()}, v1, v2));
+    scene.add<Plane>(Material {color, Color()}, v1, v2);
 
     color.set(0.75, 0.2, 0.2);
     v1.set(5*sRad, 0, 0);
     v2.set(-1, 0, 0);
-    scene.objects.push_back(createPlane({color, Color()}, v1, v2));
+    scene.add<Plane>(Material {color, Color()}, v1, v2);
 
     color.set(0.75, 0.75, 0.75);
     v1.set(0, 0, -200);
     v2.set(0, 0, 1);
-    scene.objects.push_back(createPlane({color, Color()}, v1, v2));
+    scene.add<Plane>(Material {color, Color()}, v1, v2);
 
     color.set(0.75, 0.75, 0.75);
     v1.set(0, 0, 0);
     v2.set(0, 0, -1);
-    scene.objects.push_back(createPlane({color, Color()}, v1, v2));
+    scene.add<Plane>(Material {color, Color()}, v1, v2);
 
     color.set(0.707, 0, 0.707);
     v1.set(-2.5f*sRad, sRad, -200+sRad);
-    scene.objects.push_back(createSphere({color, Color()}, v1, sRad));
+    scene.add<Sphere>(Material {color, Color()}, v1, sRad);
 
     color.set(0.707, 0.707, 0);
     v1.set(0, 2*sRad, -200 + sRad+sRad);
-    Sphere* greenSphere = createSphere({color, Color()}, v1, sRad);
-    scene.objects.push_back(greenSphere);
+    scene.add<Sphere>(Material {color, Color()}, v1, sRad);
 
     color.set(0, 0.707, 0.707);
     v1.set(2.5f*sRad, 2*sRad, -190+sRad);
-    scene.objects.push_back(createSphere({color, Color()}, v1, sRad));
-}
-#endif
-
-#ifndef SCENE_PARSER_TEMPORARY
-/// \todo
-IObject3D* parseObject(xmlNode* node) {
-    /// \todo Return object
-    return nullptr;
-
-    const char* name = (char*)(node->name);
-    if (!strcmp(name, NODE_SPHERE)) {
-    } else if (!strcmp(name, NODE_TRIANGLE)) {
-    } else if (!strcmp(name, NODE_PLANE)) {
-    } else {
-        return nullptr;
-    }
-}
-
-Color parseColor(const char* hexstr) {
-    const unsigned long value = std::strtoul(hexstr, 0, 16);
-    const Real r = (value & 0xFF0000)/255.0f;
-    const Real g = (value & 0x00FF00)/255.0f;
-    const Real b = (value & 0x0000FF)/255.0f;
-    return Color(r, g, b);
-}
-
-ParserError parse(const char* filename, struct Scene& scene) {
-    /// \todo Remove PARSER_ERROR_UNFINISHED when finished
-    return PARSER_ERROR_UNFINISHED;
-
-    xmlDoc *doc = NULL;
-    xmlNode *root = NULL;
-
-    doc = xmlReadFile(filename, NULL, 0);
-    if (doc == NULL) {
-        Debug::Log::e(LOG_TAG, "Could not parse file %s", filename);
-        return PARSER_ERROR_NO_FILE;
-    }
-
-    root = xmlDocGetRootElement(doc);
-    if (strcmp((char*)root->name, ROOT_NODE) != 0) {
-        return PARSER_ERROR_INVALID_FORMAT;
-    }
-
-    /* Attributes of the scene */
-    xmlAttr* attribute = root->properties;
-    while(attribute && attribute->name && attribute->children) {
-        xmlChar* value = xmlNodeListGetString(root->doc, attribute->children, 1);
-
-        // BACKGROUND
-        if (!strcmp((char*)attribute->name, ATTR_BACKGROUND)) {
-            Color background = parseColor((char*)value);
-            Debug::Log::i(LOG_TAG, "Found background %d", (char*)value);
-            /// \todo Parse colour and add it to the scene
-        }
-
-        xmlFree(value);
-        attribute = attribute->next;
-    }
-
-    /* Scene contents */
-    for (xmlNode* cur_node = root->children; cur_node; cur_node = cur_node->next) {
-        IObject3D* object = parseObject(cur_node);
-        if (object != nullptr) {
-            scene.objects.push_back(object);
-        }
-    }
-
-    return PARSER_OK;
-}
-#endif
-
-/// \todo Empty scene
-ParserError parseSceneFromXml(const char* filename, struct Scene& scene) {
-#ifdef SCENE_PARSER_TEMPORARY
-    (void) filename;
-    buildScene(scene);
-    return PARSER_OK;
-#else
-    return parse(filename, scene);
-#endif
+    scene.add<Sphere>(Material {color, Color()}, v1, sRad);
 }
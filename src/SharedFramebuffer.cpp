@@ -0,0 +1,235 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "SharedFramebuffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "SharedFramebuffer";
+
+static const char MAGIC[4] = {'P', 'T', 'F', 'B'};
+static const uint32_t VERSION = 1;
+
+/** Sections of the segment start on a cache line */
+static const size_t SECTION_ALIGNMENT = 64;
+
+/** Attempts to read a tile that keeps being written */
+static const unsigned READ_ATTEMPTS = 64;
+
+// Atomics are shared between processes
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "64-bit atomics must be lock-free");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "32-bit atomics must be lock-free");
+
+static size_t alignSection(size_t offset) {
+    return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+std::unique_ptr<SharedFramebuffer> SharedFramebuffer::create(const char* name,
+    unsigned width, unsigned height, unsigned tileSize)
+{
+    tileSize = std::max(tileSize, 1u);
+    const unsigned tilesX = (width + tileSize - 1) / tileSize;
+    const unsigned tilesY = (height + tileSize - 1) / tileSize;
+    const unsigned tiles = tilesX * tilesY;
+
+    const size_t dirtyOffset = alignSection(sizeof(SharedFramebufferHeader));
+    const size_t tileStateOffset = alignSection(dirtyOffset + (tiles + 63) / 64 * sizeof(uint64_t));
+    const size_t pixelOffset = alignSection(tileStateOffset + 2 * tiles * sizeof(uint32_t));
+    const size_t size = pixelOffset + static_cast<size_t>(width) * height * sizeof(Color);
+
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        Debug::Log::e(TAG, "Could not create shared memory %s", name);
+        return nullptr;
+    }
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        Debug::Log::e(TAG, "Could not map %zu bytes of shared memory %s", size, name);
+        shm_unlink(name);
+        return nullptr;
+    }
+
+    // The segment starts zeroed. The magic goes last, so a reader that maps
+    // the segment early never sees a partial header.
+    SharedFramebufferHeader* header = new (memory) SharedFramebufferHeader();
+    header->version = VERSION;
+    header->width = width;
+    header->height = height;
+    header->tileSize = tileSize;
+    header->tilesX = tilesX;
+    header->tilesY = tilesY;
+    header->dirtyOffset = dirtyOffset;
+    header->tileStateOffset = tileStateOffset;
+    header->pixelOffset = pixelOffset;
+    header->size = size;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+
+    Debug::Log::i(TAG, "Publishing %dx%d frames in shared memory %s", width, height, name);
+    return std::unique_ptr<SharedFramebuffer>(new SharedFramebuffer(name, true, memory, size));
+}
+
+std::unique_ptr<SharedFramebuffer> SharedFramebuffer::open(const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat status;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) >= sizeof(SharedFramebufferHeader)) {
+        memory = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    SharedFramebufferHeader* header = static_cast<SharedFramebufferHeader*>(memory);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) || header->version != VERSION ||
+        header->size != static_cast<uint64_t>(status.st_size)) {
+        munmap(memory, status.st_size);
+        return nullptr;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return std::unique_ptr<SharedFramebuffer>(new SharedFramebuffer(name, false, memory, status.st_size));
+}
+
+SharedFramebuffer::SharedFramebuffer(const char* name, bool owner, void* memory, size_t size)
+:   mName(name),
+    mOwner(owner),
+    mMemory(memory),
+    mSize(size)
+{
+    char* base = static_cast<char*>(memory);
+    mHeader = static_cast<SharedFramebufferHeader*>(memory);
+    mDirty = reinterpret_cast<std::atomic<uint64_t>*>(base + mHeader->dirtyOffset);
+    mTileState = reinterpret_cast<std::atomic<uint32_t>*>(base + mHeader->tileStateOffset);
+    mPixels = reinterpret_cast<Color*>(base + mHeader->pixelOffset);
+}
+
+SharedFramebuffer::~SharedFramebuffer() {
+    munmap(mMemory, mSize);
+    if (mOwner) {
+        shm_unlink(mName.c_str());
+    }
+}
+
+SharedFramebufferHeader& SharedFramebuffer::getHeader() {
+    return *mHeader;
+}
+
+const Color* SharedFramebuffer::getPixels() {
+    return mPixels;
+}
+
+void SharedFramebuffer::beginFrame() {
+    mHeader->complete.store(0);
+    mHeader->frame.fetch_add(1);
+    mHeader->sequence.fetch_add(1);
+}
+
+void SharedFramebuffer::publish(Surface& surface, unsigned left, unsigned up, unsigned right, unsigned down) {
+    const unsigned width = mHeader->width;
+    const unsigned tileSize = mHeader->tileSize;
+    right = std::min(right, width);
+    down = std::min(down, mHeader->height);
+    if (left >= right || up >= down) {
+        return;
+    }
+
+    for (unsigned int ty = up / tileSize; ty <= (down - 1) / tileSize; ty++) {
+        for (unsigned int tx = left / tileSize; tx <= (right - 1) / tileSize; tx++) {
+            const unsigned t = ty * mHeader->tilesX + tx;
+            const unsigned x0 = std::max(left, tx * tileSize);
+            const unsigned x1 = std::min(right, (tx + 1) * tileSize);
+            const unsigned y0 = std::max(up, ty * tileSize);
+            const unsigned y1 = std::min(down, (ty + 1) * tileSize);
+
+            mTileState[2*t].fetch_add(1);
+            for (unsigned int j = y0; j < y1; j++) {
+                std::copy(surface.row(j) + x0, surface.row(j) + x1, mPixels + static_cast<size_t>(j) * width + x0);
+            }
+            mTileState[2*t + 1].fetch_add(1);
+            mTileState[2*t].fetch_sub(1);
+            markDirty(t);
+        }
+    }
+    mHeader->sequence.fetch_add(1);
+}
+
+void SharedFramebuffer::endFrame() {
+    mHeader->complete.store(1);
+    mHeader->sequence.fetch_add(1);
+}
+
+void SharedFramebuffer::takeDirtyTiles(std::vector<unsigned>& tiles) {
+    tiles.clear();
+    const unsigned count = mHeader->tilesX * mHeader->tilesY;
+    for (unsigned int w = 0; w < (count + 63) / 64; w++) {
+        uint64_t bits = mDirty[w].exchange(0);
+        while (bits != 0) {
+            tiles.push_back(64*w + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+}
+
+void SharedFramebuffer::markDirty(unsigned tile) {
+    mDirty[tile / 64].fetch_or(1ull << (tile % 64));
+}
+
+bool SharedFramebuffer::readTile(unsigned tile, std::vector<Color>& out) {
+    const unsigned tileSize = mHeader->tileSize;
+    const unsigned x0 = (tile % mHeader->tilesX) * tileSize;
+    const unsigned y0 = (tile / mHeader->tilesX) * tileSize;
+    const unsigned x1 = std::min(x0 + tileSize, mHeader->width);
+    const unsigned y1 = std::min(y0 + tileSize, mHeader->height);
+    out.resize((x1 - x0) * (y1 - y0));
+
+    for (unsigned int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        const uint32_t version = mTileState[2*tile + 1].load();
+        if (mTileState[2*tile].load() != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        Color* o = out.data();
+        for (unsigned int j = y0; j < y1; j++) {
+            const Color* row = mPixels + static_cast<size_t>(j) * mHeader->width;
+            o = std::copy(row + x0, row + x1, o);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (mTileState[2*tile].load() == 0 && mTileState[2*tile + 1].load() == version) {
+            return true;
+        }
+    }
+    return false;
+}
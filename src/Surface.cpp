@@ -25,61 +25,339 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
 
 static const char* TAG = "Surface";
 
+/** Alignment of the pixel buffer: a cache line, and wide enough for any SIMD register */
+static const size_t SURFACE_ALIGNMENT = 64;
+
+/** Longest text of a pixel in a P3 PPM: "255 255 255 " */
+static const unsigned PPM_PIXEL_CHARS = 12;
+
+// Streaming passes treat the buffer as an array of channels
+static_assert(sizeof(Color) == 3 * sizeof(Real), "Color must be three packed channels");
+
 Surface::Surface(unsigned width, unsigned height) : width(width), height(height) {
     Debug::Log::d(TAG, "Construct surface %dx%d", width, height);
-    color = new Color*[width];
-    for (unsigned int i = 0; i < width; i++) {
-        color[i] = new Color[height];
-    }
+    allocate();
+}
+
+Surface::Surface(const Surface& other) : width(other.width), height(other.height) {
+    allocate();
+    std::copy_n(other.color, static_cast<size_t>(width) * height, color);
+}
+
+Surface::Surface(Surface&& other) : width(other.width), height(other.height), color(other.color) {
+    other.width = 0;
+    other.height = 0;
+    other.color = nullptr;
 }
 
 Surface::~Surface() {
     Debug::Log::d(TAG, "Delete surface");
-    for (unsigned int i = 0; i < width; i++) {
-        delete[] color[i];
+    release();
+}
+
+Surface& Surface::operator=(const Surface& other) {
+    if (this != &other) {
+        if (width != other.width || height != other.height) {
+            release();
+            width = other.width;
+            height = other.height;
+            allocate();
+        }
+        std::copy_n(other.color, static_cast<size_t>(width) * height, color);
     }
-    delete[] color;
+    return *this;
 }
 
-unsigned Surface::getWidth() {
+Surface& Surface::operator=(Surface&& other) {
+    if (this != &other) {
+        release();
+        width = other.width;
+        height = other.height;
+        color = other.color;
+        other.width = 0;
+        other.height = 0;
+        other.color = nullptr;
+    }
+    return *this;
+}
+
+void Surface::allocate() {
+    // aligned_alloc needs a multiple of the alignment
+    const size_t bytes = std::max<size_t>(getSizeBytes(), 1);
+    void* memory = aligned_alloc(SURFACE_ALIGNMENT,
+        (bytes + SURFACE_ALIGNMENT - 1) / SURFACE_ALIGNMENT * SURFACE_ALIGNMENT);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    color = static_cast<Color*>(memory);
+    std::uninitialized_value_construct_n(color, static_cast<size_t>(width) * height);
+}
+
+void Surface::release() {
+    if (color != nullptr) {
+        std::destroy_n(color, static_cast<size_t>(width) * height);
+        free(color);
+        color = nullptr;
+    }
+}
+
+unsigned Surface::getWidth() const {
     return width;
 }
 
-unsigned Surface::getHeight() {
+unsigned Surface::getHeight() const {
     return height;
 }
 
-Color* Surface::operator[](unsigned i) {
-    return color[i];
+size_t Surface::getSizeBytes() {
+    return static_cast<size_t>(width) * height * sizeof(Color);
 }
 
-void Surface::toPPM(const char* filename) {
-    FILE *f = fopen(filename, "w");
-    fprintf(f, "P3\n%d %d\n%d\n", width, height, 255);
-    for (unsigned int j = 0; j < height; j++)  {
+bool Surface::save(const char* filename, ImageFormat format) {
+    switch (format) {
+    case IMAGE_PPM_ASCII:
+        return toPPM(filename);
+    case IMAGE_PPM:
+        return toBinaryPPM(filename);
+    case IMAGE_PFM:
+        return toPFM(filename);
+    case IMAGE_HALF_TILES:
+        return toTiledHalf(filename);
+    }
+    return false;
+}
+
+/** Write a header and a buffer to a new file */
+static bool writeFile(const char* filename, const std::string& header,
+                      const void* data, size_t bytes)
+{
+    FILE *f = fopen(filename, "wb");
+    if (f == nullptr) {
+        Debug::Log::e(TAG, "Could not open %s", filename);
+        return false;
+    }
+    bool ok = fwrite(header.data(), 1, header.size(), f) == header.size() &&
+        fwrite(data, 1, bytes, f) == bytes;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        Debug::Log::e(TAG, "Could not write %s", filename);
+    }
+    return ok;
+}
+
+bool Surface::toPPM(const char* filename) {
+    // Rows are formatted in parallel into their own slice of the buffer
+    std::vector<char> text(static_cast<size_t>(width) * height * PPM_PIXEL_CHARS);
+    std::vector<unsigned> lengths(height);
+    #pragma omp parallel for schedule(static)
+    for (unsigned int j = 0; j < height; j++) {
+        char* out = &text[static_cast<size_t>(j) * width * PPM_PIXEL_CHARS];
+        char* start = out;
+        const Color* pixels = row(j);
         for (unsigned int i = 0; i < width; i++) {
-            Color c = color[i][j];
-            fprintf(f,"%d %d %d ", toColorInt(c.x), toColorInt(c.y), toColorInt(c.z));
+            const uint8_t rgb[3] = {
+                toColorInt(pixels[i].x), toColorInt(pixels[i].y), toColorInt(pixels[i].z)};
+            for (unsigned int c = 0; c < 3; c++) {
+                out += formatColorInt(out, rgb[c]);
+                *out++ = ' ';
+            }
+        }
+        lengths[j] = out - start;
+    }
+
+    // Close the gaps between the rows
+    size_t size = 0;
+    for (unsigned int j = 0; j < height; j++) {
+        memmove(&text[size], &text[static_cast<size_t>(j) * width * PPM_PIXEL_CHARS], lengths[j]);
+        size += lengths[j];
+    }
+
+    char header[64];
+    snprintf(header, sizeof(header), "P3\n%d %d\n%d\n", width, height, 255);
+    return writeFile(filename, header, text.data(), size);
+}
+
+bool Surface::toBinaryPPM(const char* filename) {
+    std::vector<uint8_t> bytes(3 * static_cast<size_t>(width) * height);
+    const Real* values = reinterpret_cast<const Real*>(color);
+    #pragma omp parallel for schedule(static)
+    for (unsigned int j = 0; j < height; j++) {
+        const size_t start = 3 * static_cast<size_t>(j) * width;
+        for (size_t k = start; k < start + 3*width; k++) {
+            bytes[k] = toColorInt(values[k]);
         }
     }
-    fclose(f);
+
+    char header[64];
+    snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, 255);
+    return writeFile(filename, header, bytes.data(), bytes.size());
 }
 
-void Surface::applyGammaCorrection(Real gamma) {
-    for (unsigned int i = 0; i < width; i++)  {
-        for (unsigned int j = 0; j < height; j++) {
-            color[i][j] = gammaFunc(color[i][j], gamma);
+bool Surface::toPFM(const char* filename) {
+    // PFM rows go from bottom to top, in the byte order given by the sign of the scale
+    std::vector<float> values(3 * static_cast<size_t>(width) * height);
+    #pragma omp parallel for schedule(static)
+    for (unsigned int j = 0; j < height; j++) {
+        const Color* pixels = row(height - 1 - j);
+        float* out = &values[3 * static_cast<size_t>(j) * width];
+        for (unsigned int i = 0; i < width; i++) {
+            out[3*i] = pixels[i].x;
+            out[3*i + 1] = pixels[i].y;
+            out[3*i + 2] = pixels[i].z;
         }
     }
+
+    char header[64];
+    const bool littleEndian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+    snprintf(header, sizeof(header), "PF\n%d %d\n%s\n", width, height, littleEndian? "-1.0" : "1.0");
+    return writeFile(filename, header, values.data(), values.size() * sizeof(float));
+}
+
+/** IEEE 754 half of a float, rounded to nearest even */
+static uint16_t toHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const uint32_t magnitude = bits & 0x7fffffff;
+
+    if (magnitude >= 0x7f800000) {
+        // Infinity or NaN
+        return sign | 0x7c00 | ((magnitude > 0x7f800000)? 0x200 : 0);
+    }
+    if (magnitude >= 0x477ff000) {
+        // Rounds above the largest half
+        return sign | 0x7c00;
+    }
+    if (magnitude < 0x38800000) {
+        // Subnormal half, or zero
+        if (magnitude < 0x33000000) {
+            return sign;
+        }
+        const uint32_t exponent = magnitude >> 23;
+        const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        const uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t middle = 1u << (shift - 1);
+        if (rest > middle || (rest == middle && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+
+    uint32_t half = ((magnitude - 0x38000000) >> 13);
+    const uint32_t rest = magnitude & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return sign | half;
+}
+
+bool Surface::toTiledHalf(const char* filename, unsigned tileSize) {
+    tileSize = std::max(tileSize, 1u);
+    const unsigned tilesX = (width + tileSize - 1) / tileSize;
+    const unsigned tilesY = (height + tileSize - 1) / tileSize;
+
+    // Tiles are cropped, so a row of tiles holds tile rows of whole image rows
+    std::vector<uint16_t> halfs(3 * static_cast<size_t>(width) * height);
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int t = 0; t < tilesX * tilesY; t++) {
+        const unsigned left = (t % tilesX) * tileSize;
+        const unsigned up = (t / tilesX) * tileSize;
+        const unsigned right = std::min(left + tileSize, width);
+        const unsigned down = std::min(up + tileSize, height);
+
+        // Every tile before this one in its row of tiles is tileSize wide
+        uint16_t* out = &halfs[3 * (static_cast<size_t>(up) * width +
+            static_cast<size_t>(left) * (down - up))];
+        for (unsigned int j = up; j < down; j++) {
+            const Color* pixels = row(j);
+            for (unsigned int i = left; i < right; i++) {
+                *out++ = toHalf(pixels[i].x);
+                *out++ = toHalf(pixels[i].y);
+                *out++ = toHalf(pixels[i].z);
+            }
+        }
+    }
+
+    const uint32_t fields[4] = {1, width, height, tileSize};
+    std::string header("PTHT");
+    header.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+    return writeFile(filename, header, halfs.data(), halfs.size() * sizeof(uint16_t));
 }
 
 void Surface::clear() {
-    for (unsigned int i = 0; i < width; i++)  {
-        for (unsigned int j = 0; j < height; j++) {
-            color[i][j].set(0, 0, 0);
+    Real* values = reinterpret_cast<Real*>(color);
+    const size_t count = 3 * static_cast<size_t>(width) * height;
+    #pragma omp simd
+    for (size_t k = 0; k < count; k++) {
+        values[k] = 0;
+    }
+}
+
+AOVBuffers::AOVBuffers(unsigned width, unsigned height)
+:   albedo(width, height),
+    normal(width, height),
+    depth(width, height)
+{ }
+
+DisplayImage::DisplayImage(unsigned width, unsigned height) {
+    resize(width, height);
+}
+
+void DisplayImage::resize(unsigned w, unsigned h) {
+    width = w;
+    height = h;
+    pixels.resize(3 * static_cast<size_t>(w) * h);
+}
+
+unsigned DisplayImage::getWidth() {
+    return width;
+}
+
+unsigned DisplayImage::getHeight() {
+    return height;
+}
+
+bool DisplayImage::save(const char* filename, ImageFormat format) {
+    char header[64];
+    if (format == IMAGE_PPM) {
+        snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, 255);
+        return writeFile(filename, header, pixels.data(), pixels.size());
+    } else if (format != IMAGE_PPM_ASCII) {
+        Debug::Log::e(TAG, "Display images are only written as PPM");
+        return false;
+    }
+
+    std::vector<char> text(pixels.size() * PPM_PIXEL_CHARS / 3);
+    std::vector<unsigned> lengths(height);
+    #pragma omp parallel for schedule(static)
+    for (unsigned int j = 0; j < height; j++) {
+        char* out = &text[static_cast<size_t>(j) * width * PPM_PIXEL_CHARS];
+        char* start = out;
+        const uint8_t* values = row(j);
+        for (unsigned int k = 0; k < 3*width; k++) {
+            out += formatColorInt(out, values[k]);
+            *out++ = ' ';
         }
+        lengths[j] = out - start;
+    }
+
+    size_t size = 0;
+    for (unsigned int j = 0; j < height; j++) {
+        memmove(&text[size], &text[static_cast<size_t>(j) * width * PPM_PIXEL_CHARS], lengths[j]);
+        size += lengths[j];
     }
+
+    snprintf(header, sizeof(header), "P3\n%d %d\n%d\n", width, height, 255);
+    return writeFile(filename, header, text.data(), size);
 }
@@ -0,0 +1,262 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "TileScheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include "debug.hpp"
+
+static const char* TAG = "TileScheduler";
+
+static thread_local int tCurrentWorker = -1;
+
+TileScheduler::TileScheduler(unsigned threads) : mRequestedThreads(threads) {
+    start(threads);
+}
+
+TileScheduler::~TileScheduler() {
+    stop();
+}
+
+void TileScheduler::start(unsigned threads) {
+    mNodeCount = (mTopology != nullptr)? mTopology->getNodeCount() : 1;
+    if (threads == 0 && mTopology != nullptr) {
+        for (unsigned int node = 0; node < mNodeCount; node++) {
+            threads += mTopology->getCpus(node).size();
+        }
+    } else if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Every node needs a worker to place its data
+    threads = std::max(threads, mNodeCount);
+
+    mExit = false;
+    for (unsigned int w = 0; w < threads; w++) {
+        mWorkers.emplace_back(new Worker());
+        if (mTopology != nullptr) {
+            // Consecutive workers go to different nodes, then to the next CPU of each
+            Worker& worker = *mWorkers.back();
+            worker.node = w % mNodeCount;
+            const std::vector<unsigned>& cpus = mTopology->getCpus(worker.node);
+            worker.cpu = cpus[(w / mNodeCount) % cpus.size()];
+        }
+    }
+    for (unsigned int w = 0; w < threads; w++) {
+        mWorkers[w]->thread = std::thread(&TileScheduler::workerLoop, this, w, mBatch);
+    }
+}
+
+void TileScheduler::stop() {
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mExit = true;
+    }
+    mWake.notify_all();
+    for (auto& worker : mWorkers) {
+        worker->thread.join();
+    }
+    mWorkers.clear();
+}
+
+void TileScheduler::setThreadCount(unsigned threads) {
+    mRequestedThreads = threads;
+    stop();
+    start(threads);
+}
+
+unsigned TileScheduler::getThreadCount() {
+    return mWorkers.size();
+}
+
+void TileScheduler::setTopology(Topology* topology) {
+    mTopology = topology;
+    stop();
+    start(mRequestedThreads);
+}
+
+unsigned TileScheduler::getNodeCount() {
+    return mNodeCount;
+}
+
+unsigned TileScheduler::getWorkerNode(unsigned worker) {
+    return mWorkers[worker]->node;
+}
+
+unsigned TileScheduler::getTileNode(unsigned tile) {
+    return mWorkers[tile % mWorkers.size()]->node;
+}
+
+int TileScheduler::currentWorker() {
+    return tCurrentWorker;
+}
+
+void TileScheduler::run(unsigned count, const Task& task) {
+    if (count == 0) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    const unsigned workers = mWorkers.size();
+    for (unsigned int tile = 0; tile < count; tile++) {
+        Worker& worker = *mWorkers[tile % workers];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.tiles.push_back(tile);
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(mLock);
+        mTask = &task;
+        mActive = workers;
+        mBatch++;
+        mWake.notify_all();
+        mDone.wait(guard, [this] { return mActive == 0; });
+        mTask = nullptr;
+    }
+
+    mWallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void TileScheduler::runOnEachNode(const std::function<void(unsigned node)>& task) {
+    // The first worker of every node takes the tile of its node
+    for (unsigned int node = 0; node < mNodeCount; node++) {
+        std::lock_guard<std::mutex> guard(mWorkers[node]->lock);
+        mWorkers[node]->tiles.push_back(node);
+    }
+
+    Task nodeTask = [&task](unsigned node, unsigned) { task(node); };
+    {
+        std::unique_lock<std::mutex> guard(mLock);
+        mTask = &nodeTask;
+        mStealingEnabled = false;
+        mActive = mWorkers.size();
+        mBatch++;
+        mWake.notify_all();
+        mDone.wait(guard, [this] { return mActive == 0; });
+        mTask = nullptr;
+        mStealingEnabled = true;
+    }
+}
+
+bool TileScheduler::steal(unsigned index, unsigned victim, unsigned& tile) {
+    Worker& other = *mWorkers[victim];
+    std::lock_guard<std::mutex> guard(other.lock);
+    if (other.tiles.empty()) {
+        return false;
+    }
+    tile = other.tiles.back();
+    other.tiles.pop_back();
+    mWorkers[index]->tilesStolen++;
+    return true;
+}
+
+bool TileScheduler::nextTile(unsigned index, unsigned& tile) {
+    Worker& self = *mWorkers[index];
+    {
+        std::lock_guard<std::mutex> guard(self.lock);
+        if (!self.tiles.empty()) {
+            tile = self.tiles.front();
+            self.tiles.pop_front();
+            return true;
+        }
+    }
+
+    if (!mStealingEnabled) {
+        return false;
+    }
+
+    // Steal the last tile of the next worker that has any, from the same node first
+    const unsigned workers = mWorkers.size();
+    for (unsigned int offset = 1; offset < workers; offset++) {
+        const unsigned victim = (index + offset) % workers;
+        if (mWorkers[victim]->node == self.node && steal(index, victim, tile)) {
+            return true;
+        }
+    }
+    for (unsigned int offset = 1; offset < workers; offset++) {
+        const unsigned victim = (index + offset) % workers;
+        if (mWorkers[victim]->node != self.node && steal(index, victim, tile)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TileScheduler::workerLoop(unsigned index, uint64_t seenBatch) {
+    Worker& self = *mWorkers[index];
+    tCurrentWorker = index;
+    if (self.cpu >= 0 && !Topology::pinThread(self.cpu)) {
+        Debug::Log::w(TAG, "Could not pin worker %d to CPU %d", index, self.cpu);
+    }
+
+    while (true) {
+        const Task* task;
+        {
+            std::unique_lock<std::mutex> guard(mLock);
+            mWake.wait(guard, [&] { return mExit || mBatch != seenBatch; });
+            if (mExit) {
+                return;
+            }
+            seenBatch = mBatch;
+            task = mTask;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        unsigned tile;
+        while (nextTile(index, tile)) {
+            (*task)(tile, index);
+            self.tilesRun++;
+        }
+        self.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> guard(mLock);
+        if (--mActive == 0) {
+            mDone.notify_one();
+        }
+    }
+}
+
+void TileScheduler::resetStatistics() {
+    // Workers are idle between batches, so their counters can be written
+    for (auto& worker : mWorkers) {
+        worker->tilesRun = 0;
+        worker->tilesStolen = 0;
+        worker->busySeconds = 0;
+    }
+    mWallSeconds = 0;
+}
+
+void TileScheduler::report() {
+    double busy = 0;
+    for (unsigned int w = 0; w < mWorkers.size(); w++) {
+        Worker& worker = *mWorkers[w];
+        busy += worker.busySeconds;
+        Debug::Log::i(TAG, "Worker %d (node %d): %llu tiles (%llu stolen), %.1f%% utilization",
+            w, worker.node,
+            static_cast<unsigned long long>(worker.tilesRun),
+            static_cast<unsigned long long>(worker.tilesStolen),
+            (mWallSeconds > 0)? 100.0 * worker.busySeconds / mWallSeconds : 0.0);
+    }
+
+    // Share of the time that the workers were available that they spent on tiles
+    Debug::Log::i(TAG, "%zu workers, %.2f s wall, %.2f s busy, parallel efficiency %.1f%%",
+        mWorkers.size(), mWallSeconds, busy,
+        (mWallSeconds > 0)? 100.0 * busy / (mWallSeconds * mWorkers.size()) : 0.0);
+}
@@ -0,0 +1,112 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "ToneMapper.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+/** Entries of the transfer function table, fine enough for 8-bit output near black */
+static const unsigned LUT_SIZE = 8192;
+
+/** Table indices of count channels after exposure and the tone curve */
+template <ToneCurve curve>
+static void toIndices(const Real* in, uint32_t* out, unsigned count, Real exposure) {
+    #pragma omp simd
+    for (unsigned int k = 0; k < count; k++) {
+        // Also sends NaN to black
+        Real x = in[k] * exposure;
+        x = (x > 0)? x : 0;
+        if (curve == TONE_REINHARD) {
+            x = x / (1 + x);
+        } else if (curve == TONE_ACES) {
+            x = (x * (2.51f*x + 0.03f)) / (x * (2.43f*x + 0.59f) + 0.14f);
+        }
+        x = (x < 1)? x : 1;
+        out[k] = static_cast<uint32_t>(x * (LUT_SIZE - 1) + 0.5f);
+    }
+}
+
+ToneMapper::ToneMapper() {
+    buildLut();
+}
+
+void ToneMapper::setExposure(Real stops) {
+    mExposure = std::exp2(stops);
+}
+
+void ToneMapper::setCurve(ToneCurve curve) {
+    mCurve = curve;
+}
+
+void ToneMapper::setSRGBEnabled(bool enabled) {
+    if (enabled != mSRGBEnabled) {
+        mSRGBEnabled = enabled;
+        buildLut();
+    }
+}
+
+void ToneMapper::buildLut() {
+    mLut.resize(LUT_SIZE);
+    for (unsigned int k = 0; k < LUT_SIZE; k++) {
+        double x = static_cast<double>(k) / (LUT_SIZE - 1);
+        if (mSRGBEnabled) {
+            x = (x <= 0.0031308)? 12.92 * x : 1.055 * pow(x, 1/2.4) - 0.055;
+        }
+        mLut[k] = static_cast<uint8_t>(std::min(x, 1.0) * 255 + 0.5);
+    }
+}
+
+void ToneMapper::map(Surface& surface, DisplayImage& display) {
+    map(surface, display, 0, surface.getHeight());
+}
+
+void ToneMapper::map(Surface& surface, DisplayImage& display, unsigned up, unsigned down) {
+    // Rows are written at the width of the surface
+    if (display.getWidth() != surface.getWidth() || display.getHeight() != surface.getHeight()) {
+        display.resize(surface.getWidth(), surface.getHeight());
+    }
+    const unsigned count = 3 * surface.getWidth();
+    down = std::min(down, surface.getHeight());
+
+    #pragma omp parallel
+    {
+        std::vector<uint32_t> indices(count);
+
+        #pragma omp for schedule(static)
+        for (unsigned int j = up; j < down; j++) {
+            const Real* in = reinterpret_cast<const Real*>(surface.row(j));
+            switch (mCurve) {
+            case TONE_CLAMP:
+                toIndices<TONE_CLAMP>(in, indices.data(), count, mExposure);
+                break;
+            case TONE_REINHARD:
+                toIndices<TONE_REINHARD>(in, indices.data(), count, mExposure);
+                break;
+            case TONE_ACES:
+                toIndices<TONE_ACES>(in, indices.data(), count, mExposure);
+                break;
+            }
+
+            uint8_t* out = display.row(j);
+            for (unsigned int k = 0; k < count; k++) {
+                out[k] = mLut[indices[k]];
+            }
+        }
+    }
+}
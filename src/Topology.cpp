@@ -0,0 +1,162 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "Topology.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <sched.h>
+
+#include "debug.hpp"
+
+static const char* TAG = "Topology";
+
+/** Parse a sysfs CPU list such as "0-3,8-11" */
+static std::vector<unsigned> parseCpuList(const char* filename) {
+    std::vector<unsigned> cpus;
+    FILE* f = fopen(filename, "r");
+    if (f == nullptr) {
+        return cpus;
+    }
+
+    unsigned first, last;
+    while (fscanf(f, "%u", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (unsigned cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+
+    fclose(f);
+    return cpus;
+}
+
+Topology::Topology() { }
+
+std::vector<unsigned> Topology::availableCpus() {
+    std::vector<unsigned> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+    return cpus;
+}
+
+std::vector<unsigned> Topology::realNodes() {
+    return parseCpuList("/sys/devices/system/node/online");
+}
+
+Topology Topology::detect() {
+    Topology topology;
+    const std::vector<unsigned> available = availableCpus();
+    const std::vector<unsigned> nodes = realNodes();
+
+    char filename[64];
+    for (unsigned node : nodes) {
+        snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%u/cpulist", node);
+        std::vector<unsigned> cpus;
+        for (unsigned cpu : parseCpuList(filename)) {
+            if (std::find(available.begin(), available.end(), cpu) != available.end()) {
+                cpus.push_back(cpu);
+            }
+        }
+        // Nodes with memory only, or outside the affinity mask, run no workers
+        if (!cpus.empty()) {
+            topology.mCpus.push_back(cpus);
+            topology.mMemoryNodes.push_back(node);
+        }
+    }
+
+    if (topology.mCpus.empty()) {
+        topology.mCpus.push_back(available);
+        topology.mMemoryNodes.push_back(nodes.empty()? 0 : nodes[0]);
+    }
+
+    Debug::Log::i(TAG, "Detected %zu NUMA nodes with %zu CPUs",
+        topology.mCpus.size(), available.size());
+    return topology;
+}
+
+Topology Topology::simulate(unsigned nodes) {
+    Topology topology;
+    const std::vector<unsigned> available = availableCpus();
+    std::vector<unsigned> real = realNodes();
+    if (real.empty()) {
+        real.push_back(0);
+    }
+    nodes = std::max(1u, nodes);
+
+    // CPUs are dealt in turn. With fewer CPUs than nodes, nodes share them
+    topology.mCpus.resize(nodes);
+    for (unsigned int c = 0; c < std::max<size_t>(nodes, available.size()); c++) {
+        topology.mCpus[c % nodes].push_back(available[c % available.size()]);
+    }
+    // and the real nodes back them in turn
+    for (unsigned int node = 0; node < nodes; node++) {
+        topology.mMemoryNodes.push_back(real[node % real.size()]);
+    }
+    topology.mSimulated = true;
+
+    Debug::Log::i(TAG, "Simulated %u NUMA nodes over %zu CPUs and %zu real nodes",
+        nodes, available.size(), real.size());
+    return topology;
+}
+
+unsigned Topology::getNodeCount() {
+    return mCpus.size();
+}
+
+const std::vector<unsigned>& Topology::getCpus(unsigned node) {
+    return mCpus[node];
+}
+
+unsigned Topology::getMemoryNode(unsigned node) {
+    return mMemoryNodes[node];
+}
+
+bool Topology::isSimulated() {
+    return mSimulated;
+}
+
+bool Topology::pinThread(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
@@ -27,12 +27,13 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <limits>
 #include <vector>
 
-// Random seed for erand48
-static uint16_t Xi[3];
+// Random state for erand48, one sequence per thread
+static thread_local uint16_t Xi[3];
 
 /** Calculate discriminant b^2 - 4ac */
 inline Real discriminant(Real a, Real b, Real c) {
@@ -91,7 +92,7 @@ Vec3D sampleHemisphere(Vec3D& normal) {
     Vec3D rand_v = (w.cross(Vec3D(0, 0, 1)).dist() > 0)?
         Vec3D(0, 0, 1) : Vec3D(1, 0, 0);
 
-    Vec3D u = w.cross(rand_v);
+    Vec3D u = w.cross(rand_v).normalize();
     Vec3D v = w.cross(u);
     Vec3D sample_v =
         static_cast<Real>(cos(phi)*rs)*u +
@@ -101,6 +102,58 @@ Vec3D sampleHemisphere(Vec3D& normal) {
     return sample_v;
 }
 
+Real uniformRandom() {
+    return erand48(Xi);
+}
+
+void seedRandom(uint64_t stream, uint64_t seed) {
+    // splitmix64 of both values, so that nearby streams are unrelated
+    uint64_t x = seed + 0x9e3779b97f4a7c15ull * (stream + 1);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+
+    Xi[0] = x;
+    Xi[1] = x >> 16;
+    Xi[2] = x >> 32;
+}
+
+uint64_t getRandomState() {
+    return Xi[0] | (static_cast<uint64_t>(Xi[1]) << 16) | (static_cast<uint64_t>(Xi[2]) << 32);
+}
+
+void setRandomState(uint64_t state) {
+    Xi[0] = state;
+    Xi[1] = state >> 16;
+    Xi[2] = state >> 32;
+}
+
+/** splitmix64 finalizer */
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t h = mix64(seed + 0x9e3779b97f4a7c15ull * (size + 1));
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        h = (h ^ mix64(word)) * 0x9e3779b97f4a7c15ull;
+        h = (h << 29) | (h >> 35);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes, size);
+    return mix64(h ^ mix64(tail));
+}
+
 IObject3D* intersectObjects(Ray& ray, std::vector<IObject3D*>& objects, Real& t) {
     IObject3D* object_tmp = nullptr;
     t = infinity<Real>();
@@ -123,10 +176,26 @@ uint32_t colorGetARGB(Color& color) {
     return argb;
 }
 
+Real luminance(Color& c) {
+    return 0.2126f*c.x + 0.7152f*c.y + 0.0722f*c.z;
+}
+
 uint8_t toColorInt(Real component) {
     return static_cast<uint8_t>(colorClamp(component) * 0xFF);
 }
 
+unsigned formatColorInt(char* out, uint8_t value) {
+    unsigned n = 0;
+    if (value >= 100) {
+        out[n++] = '0' + value / 100;
+    }
+    if (value >= 10) {
+        out[n++] = '0' + value / 10 % 10;
+    }
+    out[n++] = '0' + value % 10;
+    return n;
+}
+
 
 Real colorClamp(Real x) {
     if (x < 0) return 0;
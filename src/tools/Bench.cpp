@@ -0,0 +1,303 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+/*
+ * Measures the renderer on canonical scenes built in code, so that runs on
+ * different trees and machines can be compared, and writes the results as
+ * JSON to the file given as argument or to the standard output.
+ *
+ * Scenes: the built-in box, the box with a large tessellated sphere, with a
+ * grid of many small spheres and lit by a grid of many small emitters.
+ * Ray rates are measured on one thread. Whole renders are timed with 1, 2,
+ * 4... worker threads up to the hardware threads.
+*/
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "Camera.hpp"
+#include "LightBVH.hpp"
+#include "Mesh.hpp"
+#include "Objects.hpp"
+#include "PathTracer.hpp"
+#include "SceneParser.hpp"
+#include "Utils.hpp"
+
+static const char* TAG = "Bench";
+
+/** Frame rendered in every scene */
+static const unsigned WIDTH = 128;
+static const unsigned HEIGHT = 96;
+static const float FOV = 60;
+static const unsigned SPP = 4;
+static const unsigned DEPTH = 4;
+static const uint64_t SEED = 1;
+
+/** Tessellation of the large mesh, 2 * rings * segments triangles */
+static const unsigned MESH_RINGS = 256;
+static const unsigned MESH_SEGMENTS = 512;
+/** Side of the grids of spheres and of lights */
+static const unsigned GRID = 16;
+
+/** Rays cycled through by the primitive tests, and number of tests */
+static const unsigned PRIMITIVE_RAYS = 4096;
+static const unsigned PRIMITIVE_TESTS = 1u << 20;
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/** Sphere of 2 * rings * segments triangles */
+static TriangleMesh* createMeshSphere(Arena& arena, struct Material material, Vec3D center,
+                                      Real radius, unsigned rings, unsigned segments)
+{
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    positions.reserve(3 * (rings + 1) * segments);
+    indices.reserve(6 * rings * segments);
+    for (unsigned int r = 0; r <= rings; r++) {
+        const double theta = M_PI * r / rings;
+        for (unsigned int s = 0; s < segments; s++) {
+            const double phi = 2 * M_PI * s / segments;
+            positions.push_back(center.x + radius * sin(theta) * cos(phi));
+            positions.push_back(center.y + radius * cos(theta));
+            positions.push_back(center.z + radius * sin(theta) * sin(phi));
+        }
+    }
+    for (unsigned int r = 0; r < rings; r++) {
+        for (unsigned int s = 0; s < segments; s++) {
+            const uint32_t a = r * segments + s;
+            const uint32_t b = r * segments + (s + 1) % segments;
+            const uint32_t c = a + segments;
+            const uint32_t d = b + segments;
+            indices.insert(indices.end(), {a, c, b, b, c, d});
+        }
+    }
+    return arena.create<TriangleMesh>(material, std::move(positions), std::move(indices));
+}
+
+static void buildMeshScene(struct Scene& scene) {
+    buildScene(scene);
+    TriangleMesh* mesh = createMeshSphere(scene.arena, Material {Color(0.75, 0.75, 0.75), Color()},
+        Vec3D(0, 45, -110), 40, MESH_RINGS, MESH_SEGMENTS);
+    scene.objects.push_back(mesh);
+}
+
+static void buildSpheresScene(struct Scene& scene) {
+    buildScene(scene);
+    for (unsigned int i = 0; i < GRID; i++) {
+        for (unsigned int k = 0; k < GRID; k++) {
+            Color color(0.2f + 0.5f * i / GRID, 0.5f, 0.2f + 0.5f * k / GRID);
+            Vec3D center(-120 + 240.0f * i / (GRID - 1), 5, -190 + 150.0f * k / (GRID - 1));
+            scene.add<Sphere>(Material {color, Color()}, center, 5);
+        }
+    }
+}
+
+static void buildLightsScene(struct Scene& scene) {
+    buildScene(scene);
+    for (unsigned int i = 0; i < GRID; i++) {
+        for (unsigned int k = 0; k < GRID; k++) {
+            Color emission(1 + 4.0f * i / GRID, 3, 1 + 4.0f * k / GRID);
+            Vec3D center(-120 + 240.0f * i / (GRID - 1), 200, -190 + 150.0f * k / (GRID - 1));
+            scene.add<Sphere>(Material {Color(), emission}, center, 2);
+        }
+    }
+}
+
+struct SceneBench {
+    const char* name;
+    void (*build)(struct Scene& scene);
+};
+
+/**
+ * Time intersect() on rays from around the unit sphere towards points in
+ * the unit cube. Writes the tests per second and the fraction that hit.
+*/
+static void benchPrimitive(FILE* out, const char* name, IObject3D& object, bool last) {
+    std::vector<Ray> rays;
+    rays.reserve(PRIMITIVE_RAYS);
+    seedRandom(0, SEED);
+    for (unsigned int r = 0; r < PRIMITIVE_RAYS; r++) {
+        Vec3D normal(uniformRandom() - 0.5f, uniformRandom() - 0.5f, uniformRandom() - 0.5f);
+        Vec3D origin = 4.0f * normal.normalize();
+        Vec3D target(2*uniformRandom() - 1, 2*uniformRandom() - 1, 2*uniformRandom() - 1);
+        rays.push_back(Ray(origin, target - origin));
+    }
+
+    unsigned hits = 0;
+    auto start = Clock::now();
+    for (unsigned int n = 0; n < PRIMITIVE_TESTS; n++) {
+        if (object.intersect(rays[n % PRIMITIVE_RAYS]) > 0) {
+            hits++;
+        }
+    }
+    const double seconds = secondsSince(start);
+    fprintf(out, "    \"%s\": {\"intersections_per_s\": %.0f, \"hit_rate\": %.4f}%s\n", name,
+        PRIMITIVE_TESTS / seconds, static_cast<double>(hits) / PRIMITIVE_TESTS, last? "" : ",");
+}
+
+static void benchPrimitives(FILE* out) {
+    struct Material material = {Color(0.5, 0.5, 0.5), Color()};
+    Plane plane(material, Vec3D(0, 0, 0), Vec3D(0, 1, 0));
+    Sphere sphere(material, Vec3D(0, 0, 0), 1);
+    Triangle triangle(material, Vec3D(-1, 0, -1), Vec3D(1, 0, -1), Vec3D(0, 0, 1));
+    Arena arena;
+    TriangleMesh* mesh = createMeshSphere(arena, material, Vec3D(0, 0, 0), 1, 64, 128);
+
+    fprintf(out, "  \"primitives\": {\n");
+    benchPrimitive(out, "plane", plane, false);
+    benchPrimitive(out, "sphere", sphere, false);
+    benchPrimitive(out, "triangle", triangle, false);
+    // Rays through the hierarchy of a mesh of 16k triangles
+    benchPrimitive(out, "triangle_mesh", *mesh, true);
+    fprintf(out, "  },\n");
+}
+
+static void benchScene(FILE* out, const SceneBench& bench, bool last) {
+    Debug::Log::i(TAG, "Scene %s", bench.name);
+    struct Scene scene;
+    auto start = Clock::now();
+    bench.build(scene);
+    const double buildSeconds = secondsSince(start);
+
+    LightBVH lights;
+    start = Clock::now();
+    lights.build(scene.objects);
+    const double lightSeconds = secondsSince(start);
+
+    Camera camera(WIDTH, HEIGHT, FOV, Vec3D(0, 80, 0), Vec3D(0, -0.1, -1));
+    RayBuffer rays;
+    rays.seed = SEED;
+    camera.generateRays(0, 0, WIDTH, HEIGHT, 0, rays);
+
+    // Camera rays alone, the hits kept in preallocated arrays
+    std::vector<IObject3D*> hits(rays.size());
+    std::vector<Real> distances(rays.size());
+    start = Clock::now();
+    for (unsigned int k = 0; k < rays.size(); k++) {
+        Ray ray = rays.ray(k);
+        hits[k] = intersectObjects(ray, scene.objects, distances[k]);
+    }
+    const double primarySeconds = secondsSince(start);
+
+    // One diffuse bounce from each of their hits, made outside of the timings
+    std::vector<Ray> bounces;
+    bounces.reserve(rays.size());
+    for (unsigned int k = 0; k < rays.size(); k++) {
+        if (hits[k] != nullptr) {
+            Ray ray = rays.ray(k);
+            Vec3D point = ray.point(distances[k]);
+            Vec3D direction = ray.getDirection();
+            Vec3D normal = hits[k]->getHitNormal(point, direction);
+            bounces.push_back(Ray(point + 0.001f*normal, sampleHemisphere(normal)));
+        }
+    }
+
+    Real t;
+    start = Clock::now();
+    for (Ray& ray : bounces) {
+        intersectObjects(ray, scene.objects, t);
+    }
+    const double incoherentSeconds = secondsSince(start);
+
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": \"%s\",\n", bench.name);
+    fprintf(out, "      \"objects\": %zu,\n", scene.objects.size());
+    fprintf(out, "      \"lights\": %u,\n", lights.size());
+    fprintf(out, "      \"build_seconds\": %.6f,\n", buildSeconds);
+    fprintf(out, "      \"light_build_seconds\": %.6f,\n", lightSeconds);
+    fprintf(out, "      \"primary_mrays_per_s\": %.4f,\n", rays.size() / primarySeconds * 1e-6);
+    fprintf(out, "      \"incoherent_mrays_per_s\": %.4f,\n", bounces.size() / incoherentSeconds * 1e-6);
+    fprintf(out, "      \"threads\": [\n");
+
+    const unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    double oneThread = 0;
+    for (unsigned int threads = 1; ; threads = std::min(2 * threads, hardwareThreads)) {
+        PathTracer renderer(SPP, DEPTH);
+        renderer.setThreadCount(threads);
+        renderer.setSeed(SEED);
+        start = Clock::now();
+        renderer.renderScene(scene, camera);
+        const double samplesPerSecond = WIDTH * HEIGHT * SPP / secondsSince(start);
+        if (threads == 1) {
+            oneThread = samplesPerSecond;
+        }
+        fprintf(out, "        {\"threads\": %u, \"samples_per_s\": %.0f, \"speedup\": %.3f}%s\n",
+            threads, samplesPerSecond, samplesPerSecond / oneThread,
+            (threads == hardwareThreads)? "" : ",");
+        if (threads == hardwareThreads) {
+            break;
+        }
+    }
+    fprintf(out, "      ]\n");
+    fprintf(out, "    }%s\n", last? "" : ",");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 2) {
+        Debug::Log::e(TAG, "Usage: Bench [output.json]");
+        return -1;
+    }
+    FILE* out = (argc == 2)? fopen(argv[1], "w") : stdout;
+    if (out == nullptr) {
+        Debug::Log::e(TAG, "Could not write %s", argv[1]);
+        return -1;
+    }
+
+    const SceneBench scenes[] = {
+        {"cornell", buildScene},
+        {"mesh", buildMeshScene},
+        {"spheres", buildSpheresScene},
+        {"lights", buildLightsScene},
+    };
+    const unsigned sceneCount = sizeof(scenes) / sizeof(scenes[0]);
+
+    fprintf(out, "{\n");
+#ifdef __OPTIMIZE__
+    const bool optimized = true;
+#else
+    const bool optimized = false;
+#endif
+    fprintf(out, "  \"build\": {\"compiler\": \"%s\", \"optimized\": %s},\n", __VERSION__,
+        optimized? "true" : "false");
+    fprintf(out, "  \"hardware_threads\": %u,\n", std::max(1u, std::thread::hardware_concurrency()));
+    fprintf(out, "  \"frame\": {\"width\": %u, \"height\": %u, \"spp\": %u, \"depth\": %u},\n",
+        WIDTH, HEIGHT, SPP, DEPTH);
+    benchPrimitives(out);
+    fprintf(out, "  \"scenes\": [\n");
+    for (unsigned int s = 0; s < sceneCount; s++) {
+        benchScene(out, scenes[s], s + 1 == sceneCount);
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout && fclose(out) != 0) {
+        Debug::Log::e(TAG, "Could not write %s", argv[1]);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Follows the shared framebuffer of a renderer, e.g. one started with
+ * "Visualizer ... --shm /pathtracer", and reports the tiles it receives.
+ * Once the frame is complete, it is written as a PFM file if one is given.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "SharedFramebuffer.hpp"
+
+static const char* TAG = "FramebufferReader";
+
+/** Time to wait for the renderer to create the segment */
+static const double OPEN_TIMEOUT = 10;
+/** Time between polls of the segment */
+static const std::chrono::milliseconds POLL_INTERVAL(20);
+
+static bool writePFM(const char* filename, unsigned width, unsigned height, std::vector<Color>& pixels) {
+    FILE* f = fopen(filename, "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    fprintf(f, "PF\n%d %d\n%s\n", width, height,
+        (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)? "-1.0" : "1.0");
+    bool ok = true;
+    for (unsigned int j = height; j-- > 0; ) {
+        for (unsigned int i = 0; i < width; i++) {
+            const Color& c = pixels[j*width + i];
+            const float rgb[3] = {c.x, c.y, c.z};
+            ok = ok && fwrite(rgb, sizeof(rgb), 1, f) == 1;
+        }
+    }
+    return (fclose(f) == 0) && ok;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        Debug::Log::e(TAG, "Usage: FramebufferReader NAME [output.pfm]");
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<SharedFramebuffer> framebuffer;
+    while ((framebuffer = SharedFramebuffer::open(argv[1])) == nullptr) {
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > OPEN_TIMEOUT) {
+            Debug::Log::e(TAG, "No shared framebuffer %s", argv[1]);
+            return -1;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+
+    SharedFramebufferHeader& header = framebuffer->getHeader();
+    const unsigned width = header.width;
+    const unsigned tileSize = header.tileSize;
+    printf("Following %s: %dx%d in %dx%d tiles of %d pixels\n", argv[1],
+        width, header.height, header.tilesX, header.tilesY, tileSize);
+
+    std::vector<Color> image(width * header.height);
+    std::vector<unsigned> tiles;
+    std::vector<Color> tile;
+    uint64_t updates = 0, torn = 0;
+    uint64_t lastSequence = 0;
+    while (true) {
+        // Read complete before the tiles, so the last tiles are not missed
+        const bool complete = header.complete.load() != 0;
+        const uint64_t sequence = header.sequence.load();
+
+        framebuffer->takeDirtyTiles(tiles);
+        for (unsigned t : tiles) {
+            if (!framebuffer->readTile(t, tile)) {
+                // Read again on the next poll, even if the writer is done with it
+                framebuffer->markDirty(t);
+                torn++;
+                continue;
+            }
+            const unsigned x0 = (t % header.tilesX) * tileSize;
+            const unsigned y0 = (t / header.tilesX) * tileSize;
+            const unsigned w = std::min(tileSize, width - x0);
+            for (unsigned int k = 0; k < tile.size(); k++) {
+                image[(y0 + k / w) * width + x0 + k % w] = tile[k];
+            }
+            updates++;
+        }
+
+        if (sequence != lastSequence) {
+            printf("Frame %d, sequence %" PRIu64 ": %zu tiles updated\n",
+                header.frame.load(), sequence, tiles.size());
+            lastSequence = sequence;
+        }
+        if (complete && tiles.empty()) {
+            break;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+
+    printf("Frame complete: %" PRIu64 " tile updates, %" PRIu64 " torn reads\n", updates, torn);
+    if (argc == 3 && !writePFM(argv[2], width, header.height, image)) {
+        Debug::Log::e(TAG, "Could not write %s", argv[2]);
+        return -1;
+    }
+    return 0;
+}
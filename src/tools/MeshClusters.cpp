@@ -0,0 +1,57 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+/*
+ * Converts an OBJ or PLY mesh into a cluster file, which scenes can then use
+ * as an out-of-core mesh: <mesh file="city.ptcl"/>.
+*/
+
+#include <cstdlib>
+
+#include "debug.hpp"
+
+#include "Arena.hpp"
+#include "ClusteredMesh.hpp"
+#include "MeshLoader.hpp"
+
+static const char* TAG = "MeshClusters";
+
+/** Default largest number of triangles of a cluster */
+static const unsigned DEFAULT_CLUSTER_TRIANGLES = 4096;
+/** Smallest cluster, so that leaves of the hierarchy are never split */
+static const unsigned MIN_CLUSTER_TRIANGLES = 16;
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        Debug::Log::e(TAG, "Usage: MeshClusters input.{obj,ply} output.ptcl [triangles per cluster]");
+        return -1;
+    }
+    const unsigned clusterTriangles = (argc == 4)? atoi(argv[3]) : DEFAULT_CLUSTER_TRIANGLES;
+    if (clusterTriangles < MIN_CLUSTER_TRIANGLES) {
+        Debug::Log::e(TAG, "Clusters need at least %d triangles", MIN_CLUSTER_TRIANGLES);
+        return -1;
+    }
+
+    Arena arena;
+    TriangleMesh* mesh = loadMesh(argv[1], Material(), arena);
+    if (mesh == nullptr || !writeClusteredMesh(argv[2], *mesh, clusterTriangles)) {
+        return -1;
+    }
+    return 0;
+}
@@ -16,34 +16,338 @@
  * limitations under the License.
 */
 
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "debug.hpp"
 
 #include "IRenderer.hpp"
 #include "PathTracer.hpp"
 
+#include "Animation.hpp"
 #include "Camera.hpp"
+#include "Denoiser.hpp"
+#include "Distributed.hpp"
+#include "Environment.hpp"
+#include "GeometryCache.hpp"
+#include "ImageWriter.hpp"
+#include "RadianceCache.hpp"
+#include "SharedFramebuffer.hpp"
 #include "Surface.hpp"
+#include "SceneCache.hpp"
 #include "SceneParser.hpp"
+#include "Topology.hpp"
 
-#define DEFAULT_FILENAME "scene.xml"
+#define DEFAULT_CHECKPOINT_INTERVAL 300.0
 
 const char* TAG = "Visualizer";
 
+static void printUsage() {
+    Debug::Log::e(TAG, "Usage: Visualizer [filename] width height fov spp depth [options]");
+    Debug::Log::e(TAG, "       Visualizer --worker ADDRESS [--threads N]");
+    Debug::Log::e(TAG, "Without a scene file, the built-in scene is rendered.");
+    Debug::Log::e(TAG, "Options:");
+    Debug::Log::e(TAG, "  --first-hit-cache    Resolve primary hits once per pixel");
+    Debug::Log::e(TAG, "  --denoise            Filter the result guided by albedo, normal and depth");
+    Debug::Log::e(TAG, "  --guiding            Learn the incident light to guide diffuse bounces");
+    Debug::Log::e(TAG, "  --radiance-cache     Terminate long paths into a world-space radiance cache");
+    Debug::Log::e(TAG, "  --environment FILE   Light the scene with a lat-long PFM environment map");
+    Debug::Log::e(TAG, "  --scene-cache DIR    Keep parsed scenes in DIR and map them on later runs");
+    Debug::Log::e(TAG, "  --geometry-cache MB  Memory for the clusters of out-of-core meshes (default 256)");
+    Debug::Log::e(TAG, "  --threads N          Render with N worker threads (default: all cores)");
+    Debug::Log::e(TAG, "  --numa               Pin workers and place data on the NUMA nodes");
+    Debug::Log::e(TAG, "  --simulate-numa N    NUMA mode on a simulated topology of N nodes");
+    Debug::Log::e(TAG, "  --coordinator ADDR   Render through worker processes connecting to ADDR,");
+    Debug::Log::e(TAG, "                       which is unix:PATH, HOST:PORT or PORT");
+    Debug::Log::e(TAG, "  --local-workers N    Start N worker processes for the coordinator");
+    Debug::Log::e(TAG, "  --worker ADDR        Render tiles for the coordinator at ADDR");
+    Debug::Log::e(TAG, "  --animation FILE     Render the frames of a keyframed animation");
+    Debug::Log::e(TAG, "  --output PATTERN     File name of the animation frames (default frame%%04d.EXT)");
+    Debug::Log::e(TAG, "                       or of the views (default view%%d.EXT)");
+    Debug::Log::e(TAG, "  --view X Y Z FX FY FZ  Add a view from (X, Y, Z) facing (FX, FY, FZ). All the");
+    Debug::Log::e(TAG, "                       views are rendered together in place of the default one");
+    Debug::Log::e(TAG, "  --sequential-views   Render the views one after another, e.g. to compare times;");
+    Debug::Log::e(TAG, "                       guiding and the radiance cache then learn from each view alone");
+    Debug::Log::e(TAG, "  --format FORMAT      ppm (binary, default), p3 (text), pfm (float) or");
+    Debug::Log::e(TAG, "                       half (tiled half float). Float formats are not tone mapped");
+    Debug::Log::e(TAG, "  --exposure STOPS     Scale the radiance by 2^STOPS before tone mapping");
+    Debug::Log::e(TAG, "  --tonemap CURVE      clamp (default), reinhard or aces");
+    Debug::Log::e(TAG, "  --filter FILTER      Pixel filter: box (default), gaussian or mitchell");
+    Debug::Log::e(TAG, "  --shm NAME           Publish the frame in shared memory NAME, e.g. /pathtracer");
+    Debug::Log::e(TAG, "  --checkpoint FILE    Save progress to FILE and resume from it");
+    Debug::Log::e(TAG, "  --checkpoint-interval S  Seconds between checkpoints (default %.0f)", DEFAULT_CHECKPOINT_INTERVAL);
+    Debug::Log::e(TAG, "  --seed N             Seed of the sampler (default 0)");
+}
+
+/** Format of an option value and the file extension it uses */
+static bool parseFormat(const char* name, ImageFormat& format, const char*& extension) {
+    if (!strcmp(name, "ppm")) {
+        format = IMAGE_PPM;
+        extension = "ppm";
+    } else if (!strcmp(name, "p3")) {
+        format = IMAGE_PPM_ASCII;
+        extension = "ppm";
+    } else if (!strcmp(name, "pfm")) {
+        format = IMAGE_PFM;
+        extension = "pfm";
+    } else if (!strcmp(name, "half")) {
+        format = IMAGE_HALF_TILES;
+        extension = "pth";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Whether an output pattern takes exactly one number: a single %d, which can
+ * have a width and zero padding as in %04d, and no other conversion but %%.
+ * The pattern is the format of snprintf, so any other conversion would read
+ * arguments that are not there.
+*/
+static bool isNumberPattern(const char* pattern) {
+    unsigned numbers = 0;
+    for (const char* c = pattern; *c != '\0'; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        c++;
+        if (*c == '%') {
+            continue;
+        }
+        while (*c >= '0' && *c <= '9') {
+            c++;
+        }
+        if (*c != 'd') {
+            return false;
+        }
+        numbers++;
+    }
+    return numbers == 1;
+}
+
+/**
+ * Render the frames of an animation with the same scene and renderer. The
+ * frames are written on a background thread while the next one renders.
+*/
+static int renderSequence(Animation& animation, struct Scene& scene, PathTracer& renderer,
+                          Camera& camera, const std::string& pattern, ImageFormat format,
+                          double setupSeconds)
+{
+    ImageWriter writer;
+    const unsigned frames = animation.getFrameCount();
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int frame = 0; frame < frames; frame++) {
+        animation.apply(frame, scene, camera);
+        renderer.renderScene(scene, camera);
+
+        char filename[256];
+        snprintf(filename, sizeof(filename), pattern.c_str(), frame);
+        if (format == IMAGE_PFM || format == IMAGE_HALF_TILES) {
+            writer.write(camera.getSurface(), filename, format);
+        } else {
+            writer.write(camera.getDisplay(), filename, format);
+        }
+        Debug::Log::i(TAG, "Frame %d/%d rendered", frame + 1, frames);
+    }
+    writer.flush();
+    const double writeSeconds = writer.getWriteSeconds();
+
+    // One invocation per frame would pay the setup and the writes on every frame
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double perFrame = (seconds + setupSeconds) / frames;
+    const double perInvocation = perFrame + setupSeconds + writeSeconds / frames;
+    Debug::Log::i(TAG, "%d frames in %.2f s: %.0f frames/hour (%.0f with one invocation per "
+        "frame: %.3f s setup and %.3f s write per frame)", frames, seconds + setupSeconds,
+        3600 / perFrame, 3600 / perInvocation, setupSeconds, writeSeconds / frames);
+    return (writer.getFailures() > 0)? -1 : 0;
+}
+
+/**
+ * Render several views of the same scene, all together through the
+ * scheduler of the renderer or one after another, and write an image of
+ * each view.
+*/
+static int renderViews(std::vector<std::unique_ptr<Camera>>& cameras, struct Scene& scene,
+                       PathTracer& renderer, const std::string& pattern, ImageFormat format,
+                       bool sequential)
+{
+    std::vector<Camera*> views;
+    for (std::unique_ptr<Camera>& camera : cameras) {
+        views.push_back(camera.get());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (sequential) {
+        for (Camera* camera : views) {
+            renderer.renderScene(scene, *camera);
+        }
+    } else {
+        renderer.renderScene(scene, views);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    Debug::Log::i(TAG, "%zu views rendered %s in %.2f s, %.2f s per view", views.size(),
+        sequential? "one after another" : "together", seconds, seconds / views.size());
+
+    ImageWriter writer;
+    for (unsigned int v = 0; v < views.size(); v++) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), pattern.c_str(), v);
+        if (format == IMAGE_PFM || format == IMAGE_HALF_TILES) {
+            writer.write(views[v]->getSurface(), filename, format);
+        } else {
+            writer.write(views[v]->getDisplay(), filename, format);
+        }
+    }
+    writer.flush();
+    return (writer.getFailures() > 0)? -1 : 0;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 6 || argc > 7) {
-        Debug::Log::e(TAG, "Usage: Visualizer [filename] width height fov spp depth");
+    auto programStart = std::chrono::steady_clock::now();
+
+    // Options start with "--" and can be given anywhere after the program name
+    std::vector<char*> args;
+    bool firstHitCache = false;
+    bool denoise = false;
+    bool guiding = false;
+    bool radianceCache = false;
+    const char* environmentFile = nullptr;
+    const char* sceneCacheDirectory = nullptr;
+    unsigned geometryCacheMegabytes = 0;
+    unsigned threads = 0;
+    bool numa = false;
+    unsigned simulatedNodes = 0;
+    const char* coordinatorAddress = nullptr;
+    const char* workerAddress = nullptr;
+    unsigned localWorkers = 0;
+    const char* animationFile = nullptr;
+    const char* outputPattern = nullptr;
+    std::vector<std::pair<Vec3D, Vec3D>> views;
+    bool sequentialViews = false;
+    ImageFormat format = IMAGE_PPM;
+    float exposure = 0;
+    ToneCurve toneCurve = TONE_CLAMP;
+    FilterType filter = FILTER_BOX;
+    const char* sharedName = nullptr;
+    const char* extension = "ppm";
+    const char* checkpointFile = nullptr;
+    double checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
+    uint64_t seed = 0;
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "--first-hit-cache")) {
+            firstHitCache = true;
+        } else if (!strcmp(argv[a], "--denoise")) {
+            denoise = true;
+        } else if (!strcmp(argv[a], "--guiding")) {
+            guiding = true;
+        } else if (!strcmp(argv[a], "--radiance-cache")) {
+            radianceCache = true;
+        } else if (!strcmp(argv[a], "--environment") && a+1 < argc) {
+            environmentFile = argv[++a];
+        } else if (!strcmp(argv[a], "--scene-cache") && a+1 < argc) {
+            sceneCacheDirectory = argv[++a];
+        } else if (!strcmp(argv[a], "--geometry-cache") && a+1 < argc) {
+            geometryCacheMegabytes = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--threads") && a+1 < argc) {
+            threads = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--numa")) {
+            numa = true;
+        } else if (!strcmp(argv[a], "--simulate-numa") && a+1 < argc) {
+            numa = true;
+            simulatedNodes = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--coordinator") && a+1 < argc) {
+            coordinatorAddress = argv[++a];
+        } else if (!strcmp(argv[a], "--local-workers") && a+1 < argc) {
+            localWorkers = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--worker") && a+1 < argc) {
+            workerAddress = argv[++a];
+        } else if (!strcmp(argv[a], "--animation") && a+1 < argc) {
+            animationFile = argv[++a];
+        } else if (!strcmp(argv[a], "--output") && a+1 < argc) {
+            outputPattern = argv[++a];
+        } else if (!strcmp(argv[a], "--view") && a+6 < argc) {
+            Vec3D position(atof(argv[a+1]), atof(argv[a+2]), atof(argv[a+3]));
+            Vec3D facing(atof(argv[a+4]), atof(argv[a+5]), atof(argv[a+6]));
+            views.push_back({position, facing});
+            a += 6;
+        } else if (!strcmp(argv[a], "--sequential-views")) {
+            sequentialViews = true;
+        } else if (!strcmp(argv[a], "--format") && a+1 < argc) {
+            if (!parseFormat(argv[++a], format, extension)) {
+                Debug::Log::e(TAG, "Unknown format %s", argv[a]);
+                printUsage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "--exposure") && a+1 < argc) {
+            exposure = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--tonemap") && a+1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "clamp")) {
+                toneCurve = TONE_CLAMP;
+            } else if (!strcmp(argv[a], "reinhard")) {
+                toneCurve = TONE_REINHARD;
+            } else if (!strcmp(argv[a], "aces")) {
+                toneCurve = TONE_ACES;
+            } else {
+                Debug::Log::e(TAG, "Unknown tone curve %s", argv[a]);
+                printUsage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "--filter") && a+1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "box")) {
+                filter = FILTER_BOX;
+            } else if (!strcmp(argv[a], "gaussian")) {
+                filter = FILTER_GAUSSIAN;
+            } else if (!strcmp(argv[a], "mitchell")) {
+                filter = FILTER_MITCHELL;
+            } else {
+                Debug::Log::e(TAG, "Unknown filter %s", argv[a]);
+                printUsage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "--shm") && a+1 < argc) {
+            sharedName = argv[++a];
+        } else if (!strcmp(argv[a], "--checkpoint") && a+1 < argc) {
+            checkpointFile = argv[++a];
+        } else if (!strcmp(argv[a], "--checkpoint-interval") && a+1 < argc) {
+            checkpointInterval = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--seed") && a+1 < argc) {
+            seed = strtoull(argv[++a], nullptr, 10);
+        } else if (!strncmp(argv[a], "--", 2)) {
+            Debug::Log::e(TAG, "Unknown option %s", argv[a]);
+            printUsage();
+            return -1;
+        } else {
+            args.push_back(argv[a]);
+        }
+    }
+
+    if (workerAddress != nullptr) {
+        RenderWorker worker(workerAddress, threads);
+        return worker.run();
+    }
+
+    const int nargs = args.size();
+    if (nargs < 5 || nargs > 6) {
+        printUsage();
         return -1;
     }
 
-    const char* filename = (argc == 7)? argv[1] : DEFAULT_FILENAME;
-    const int o = (argc == 7)? 1 : 0;
-    unsigned int width = atoi(argv[1+o]);
-    unsigned int height = atoi(argv[2+o]);
-    float fov = atof(argv[3+o]);
-    unsigned int spp = atoi(argv[4+o]);
-    unsigned int depth = atoi(argv[5+o]);
+    const char* filename = (nargs == 6)? args[0] : nullptr;
+    const int o = (nargs == 6)? 1 : 0;
+    unsigned int width = atoi(args[0+o]);
+    unsigned int height = atoi(args[1+o]);
+    float fov = atof(args[2+o]);
+    unsigned int spp = atoi(args[3+o]);
+    unsigned int depth = atoi(args[4+o]);
 
     if (width <= 0 || height <= 0) {
         Debug::Log::e(TAG, "ERROR: Surface cannot have null size");
@@ -59,22 +363,139 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    // Out-of-core meshes page their clusters through the cache while they live
+    GeometryCache geometryCache;
+    if (geometryCacheMegabytes > 0) {
+        geometryCache.setBudget(static_cast<size_t>(geometryCacheMegabytes) * 1024 * 1024);
+    }
     struct Scene scene;
-    ParserError ret = parseSceneFromXml(filename, scene);
-    if (ret != PARSER_OK) {
-        Debug::Log::e(TAG, "Error %d while parsing scene xml", ret);
-        return ret;
+    scene.geometryCache = &geometryCache;
+    SceneCache sceneCache;
+    if (filename != nullptr) {
+        ParserError ret = (sceneCacheDirectory != nullptr)?
+            sceneCache.loadScene(filename, sceneCacheDirectory, scene) : parseSceneFromXml(filename, scene);
+        if (ret != PARSER_OK) {
+            Debug::Log::e(TAG, "Error %d while parsing scene xml", ret);
+            return ret;
+        }
+    } else {
+        buildScene(scene);
     }
 
+    Environment environment;
+    if (environmentFile != nullptr) {
+        if (!environment.loadPFM(environmentFile)) {
+            return -1;
+        }
+        scene.environment = &environment;
+    }
 
+    auto setupCamera = [&](Camera& camera) {
+        camera.setGammaCorrectionEnabled(true);
+        camera.getToneMapper().setExposure(exposure);
+        camera.getToneMapper().setCurve(toneCurve);
+    };
     Vec3D camPos(0, 80, -0);
     Vec3D camFacing(0, -0.1, -1);
     Camera camera(width, height, fov, camPos, camFacing);
-    camera.setGammaCorrectionEnabled(true);
+    setupCamera(camera);
 
     PathTracer renderer(spp, depth);
-    renderer.renderScene(scene, camera);
-    camera.getSurface().toPPM("visualizer.ppm");
+    renderer.setThreadCount(threads);
+    std::unique_ptr<Topology> topology;
+    if (numa) {
+        topology.reset(new Topology((simulatedNodes > 0)?
+            Topology::simulate(simulatedNodes) : Topology::detect()));
+        renderer.setNumaTopology(topology.get());
+    }
+    renderer.setFirstHitCacheEnabled(firstHitCache);
+    renderer.setSeed(seed);
+    renderer.setFilter(filter);
+    std::unique_ptr<SharedFramebuffer> sharedFramebuffer;
+    if (sharedName != nullptr) {
+        sharedFramebuffer = SharedFramebuffer::create(sharedName, width, height);
+        if (sharedFramebuffer == nullptr) {
+            return -1;
+        }
+        renderer.setSharedFramebuffer(sharedFramebuffer.get());
+    }
+    renderer.setPathGuidingEnabled(guiding);
+    RadianceCache cache;
+    if (radianceCache) {
+        renderer.setRadianceCache(&cache);
+    }
+    Denoiser denoiser;
+    if (denoise) {
+        renderer.setDenoiser(&denoiser);
+    }
+
+    if (checkpointFile != nullptr) {
+        if (animationFile != nullptr || coordinatorAddress != nullptr) {
+            Debug::Log::w(TAG, "Checkpoints are only supported for single frames rendered locally");
+        } else {
+            renderer.setCheckpoint(checkpointFile, checkpointInterval);
+        }
+    }
 
-    return 0;
+    if (!views.empty()) {
+        if (animationFile != nullptr || coordinatorAddress != nullptr) {
+            Debug::Log::e(TAG, "Views are only supported for single frames rendered locally");
+            return -1;
+        }
+        if (outputPattern != nullptr && !isNumberPattern(outputPattern)) {
+            Debug::Log::e(TAG, "Output pattern %s needs one %%d or %%0Nd for the view number "
+                "and no other %% but %%%%", outputPattern);
+            return -1;
+        }
+        std::vector<std::unique_ptr<Camera>> cameras;
+        for (std::pair<Vec3D, Vec3D>& view : views) {
+            cameras.push_back(std::make_unique<Camera>(width, height, fov, view.first, view.second));
+            setupCamera(*cameras.back());
+        }
+        const std::string pattern = (outputPattern != nullptr)?
+            outputPattern : std::string("view%d.") + extension;
+        return renderViews(cameras, scene, renderer, pattern, format, sequentialViews);
+    }
+
+    if (animationFile != nullptr) {
+        if (outputPattern != nullptr && !isNumberPattern(outputPattern)) {
+            Debug::Log::e(TAG, "Output pattern %s needs one %%d or %%0Nd for the frame number "
+                "and no other %% but %%%%", outputPattern);
+            return -1;
+        }
+        Animation animation;
+        if (!animation.load(animationFile)) {
+            return -1;
+        }
+        const double setupSeconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - programStart).count();
+        const std::string pattern = (outputPattern != nullptr)?
+            outputPattern : std::string("frame%04d.") + extension;
+        return renderSequence(animation, scene, renderer, camera, pattern, format, setupSeconds);
+    }
+
+    if (coordinatorAddress != nullptr) {
+        if (denoise) {
+            Debug::Log::w(TAG, "Denoising is not supported with workers");
+        }
+        RenderCoordinator coordinator(coordinatorAddress);
+        if (!coordinator.listen() ||
+            !coordinator.spawnLocalWorkers(localWorkers, "/proc/self/exe", threads)) {
+            return -1;
+        }
+        struct RenderSettings settings = {spp, depth, firstHitCache, guiding, radianceCache, true,
+            static_cast<uint8_t>(filter), seed};
+        if (!coordinator.render(scene, camera, settings)) {
+            return -1;
+        }
+        camera.onRenderFinished();
+    } else {
+        renderer.renderScene(scene, camera);
+    }
+    // Float formats keep the linear values, the others are tone mapped
+    const std::string output = std::string("visualizer.") + extension;
+    const bool hdr = (format == IMAGE_PFM || format == IMAGE_HALF_TILES);
+    const bool saved = hdr? camera.getSurface().save(output.c_str(), format) :
+        camera.getDisplay().save(output.c_str(), format);
+    return saved? 0 : -1;
 }
@@ -0,0 +1,167 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+
+/*
+ * Round trip of meshes through cluster files: an out-of-core mesh paged
+ * through the geometry cache, even one too small for all its clusters,
+ * must intersect and render exactly like the mesh it was written from.
+*/
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "test/TestCommon.hpp"
+
+#include "Arena.hpp"
+#include "Camera.hpp"
+#include "ClusteredMesh.hpp"
+#include "GeometryCache.hpp"
+#include "Mesh.hpp"
+#include "Objects.hpp"
+#include "PathTracer.hpp"
+#include "SceneParser.hpp"
+
+static const struct Material MATERIAL = {Color(0.7, 0.3, 0.3), Color()};
+static const unsigned RINGS = 24;
+static const unsigned SEGMENTS = 48;
+static const unsigned CLUSTER_TRIANGLES = 64;
+
+/** A sphere of radius 30 at (0, 0, -150) */
+static std::unique_ptr<TriangleMesh> sphere() {
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    for (unsigned int r = 0; r <= RINGS; r++) {
+        const double theta = M_PI * r / RINGS;
+        for (unsigned int s = 0; s < SEGMENTS; s++) {
+            const double phi = 2 * M_PI * s / SEGMENTS;
+            positions.push_back(30 * sin(theta) * cos(phi));
+            positions.push_back(30 * cos(theta));
+            positions.push_back(-150 + 30 * sin(theta) * sin(phi));
+        }
+    }
+    for (unsigned int r = 0; r < RINGS; r++) {
+        for (unsigned int s = 0; s < SEGMENTS; s++) {
+            const uint32_t a = r * SEGMENTS + s;
+            const uint32_t b = r * SEGMENTS + (s + 1) % SEGMENTS;
+            indices.insert(indices.end(), {a, b + SEGMENTS, b, a, a + SEGMENTS, b + SEGMENTS});
+        }
+    }
+    return std::make_unique<TriangleMesh>(MATERIAL, std::move(positions), std::move(indices));
+}
+
+/** Distances of rays from the origin towards a grid around the sphere */
+static std::vector<Real> trace(IObject3D& object) {
+    std::vector<Real> distances;
+    for (int j = -20; j <= 20; j++) {
+        for (int i = -20; i <= 20; i++) {
+            Ray ray(Vec3D(0, 0, 0), Vec3D(1.75f * i, 1.75f * j, -150));
+            distances.push_back(object.intersect(ray));
+        }
+    }
+    return distances;
+}
+
+static std::unique_ptr<Camera> render(struct Scene& scene) {
+    std::unique_ptr<Camera> camera =
+        std::make_unique<Camera>(48, 36, 30, Vec3D(0, 0, 0), Vec3D(0, 0, -1));
+    PathTracer renderer(4, 3);
+    renderer.setSeed(5);
+    renderer.setThreadCount(2);
+    renderer.renderScene(scene, *camera);
+    return camera;
+}
+
+static void testRoundTrip() {
+    TestDirectory directory;
+    const std::string filename = directory.path("sphere.ptcl");
+    std::unique_ptr<TriangleMesh> mesh = sphere();
+    CHECK(writeClusteredMesh(filename.c_str(), *mesh, CLUSTER_TRIANGLES));
+
+    // Room for a few clusters only, so that they are evicted and read again
+    GeometryCache cache(16 << 10);
+    Arena arena;
+    ClusteredMesh* clustered = loadClusteredMesh(filename.c_str(), MATERIAL, cache, arena);
+    CHECK(clustered != nullptr);
+    if (clustered == nullptr) {
+        return;
+    }
+    CHECK(clustered->getTriangleCount() == mesh->getTriangleCount());
+    CHECK(clustered->getClusterCount() >= mesh->getTriangleCount() / CLUSTER_TRIANGLES);
+    CHECK(std::fabs(clustered->getArea() - mesh->getArea()) <= 1e-4 * mesh->getArea());
+    struct Enclosure a = mesh->getEnclosure();
+    struct Enclosure b = clustered->getEnclosure();
+    CHECK(a.x_min == b.x_min && a.x_max == b.x_max && a.y_min == b.y_min &&
+          a.y_max == b.y_max && a.z_min == b.z_min && a.z_max == b.z_max);
+
+    const std::vector<Real> expected = trace(*mesh);
+    CHECK(trace(*clustered) == expected);
+    unsigned hits = 0;
+    for (Real t : expected) {
+        hits += (t > 0);
+    }
+    CHECK(hits > 0 && hits < expected.size());
+    CHECK(cache.getSizeBytes() <= cache.getBudget());
+
+    // Renders defer the misses of their blocks and take them again. The
+    // meshes are not in the arenas of the scenes, which do not free them
+    struct Scene inCore;
+    buildScene(inCore);
+    inCore.objects.push_back(mesh.get());
+    struct Scene outOfCore;
+    buildScene(outOfCore);
+    outOfCore.objects.push_back(clustered);
+    outOfCore.geometryCache = &cache;
+    CHECK(sameSurface(render(inCore)->getSurface(), render(outOfCore)->getSurface()));
+}
+
+static void testInvalid() {
+    TestDirectory directory;
+    GeometryCache cache;
+    Arena arena;
+    const std::string filename = directory.path("sphere.ptcl");
+    CHECK(writeClusteredMesh(filename.c_str(), *sphere(), CLUSTER_TRIANGLES));
+
+    // Cut in the cluster table at the end
+    FILE* f = fopen(filename.c_str(), "rb");
+    std::string contents;
+    char buffer[4096];
+    size_t read;
+    while (f != nullptr && (read = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        contents.append(buffer, read);
+    }
+    if (f != nullptr) {
+        fclose(f);
+    }
+    const std::string truncated = directory.write("truncated.ptcl", contents.substr(0, contents.size() - 8));
+    CHECK(loadClusteredMesh(truncated.c_str(), MATERIAL, cache, arena) == nullptr);
+
+    std::string magic = contents;
+    magic[0] = 'X';
+    CHECK(loadClusteredMesh(directory.write("magic.ptcl", magic).c_str(), MATERIAL, cache, arena) == nullptr);
+    CHECK(loadClusteredMesh(directory.write("empty.ptcl", "").c_str(), MATERIAL, cache, arena) == nullptr);
+    CHECK(loadClusteredMesh(directory.path("missing.ptcl").c_str(), MATERIAL, cache, arena) == nullptr);
+}
+
+int main() {
+    testRoundTrip();
+    testInvalid();
+    return finish("ClusteredMesh");
+}
@@ -0,0 +1,155 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+
+/*
+ * The sampler draws every sample of every pixel from its own sequence of the
+ * seed: renders with the same seed must have the same bits whatever the
+ * threads, and a render resumed from a checkpoint must equal the one that
+ * was never interrupted.
+*/
+
+#include <memory>
+
+#include "test/TestCommon.hpp"
+
+#include "Accumulation.hpp"
+#include "Camera.hpp"
+#include "Objects.hpp"
+#include "PathTracer.hpp"
+#include "SceneParser.hpp"
+
+static const unsigned WIDTH = 96;
+static const unsigned HEIGHT = 72;
+static const float FOV = 60;
+static const unsigned SPP = 8;
+static const unsigned DEPTH = 3;
+
+static std::unique_ptr<Camera> newCamera() {
+    return std::make_unique<Camera>(WIDTH, HEIGHT, FOV, Vec3D(0, 0, 0), Vec3D(0, 0, 1));
+}
+
+static std::unique_ptr<Camera> render(struct Scene& scene, uint64_t seed, unsigned threads) {
+    std::unique_ptr<Camera> camera = newCamera();
+    PathTracer renderer(SPP, DEPTH);
+    renderer.setSeed(seed);
+    renderer.setThreadCount(threads);
+    renderer.renderScene(scene, *camera);
+    return camera;
+}
+
+/**
+ * Keeps the first checkpoint seen during a render that has some but not all
+ * the samples, as a render interrupted there would have left it. The
+ * checkpoint is replaced atomically after every pass, so it is always whole.
+*/
+class CheckpointCopier : public IResultsListener {
+public:
+    CheckpointCopier(const std::string& checkpoint, const std::string& copy)
+    :   mCheckpoint(checkpoint), mCopy(copy)
+    { }
+
+    void onPartialResult(const Surface&, const DisplayImage&, const std::vector<ResultRect>&) {
+        Accumulation accumulation;
+        if (!mCopied && accumulation.load(mCheckpoint.c_str()) &&
+            accumulation.minCount() > 0 && accumulation.minCount() < SPP) {
+            mCopied = accumulation.save(mCopy.c_str());
+        }
+    }
+
+    void onRenderFinished(struct Scene&, Camera&) { }
+
+    bool copied() {
+        return mCopied;
+    }
+
+private:
+    std::string mCheckpoint;
+    std::string mCopy;
+    bool mCopied = false;
+};
+
+static void testSeed(struct Scene& scene) {
+    std::unique_ptr<Camera> one = render(scene, 7, 1);
+    std::unique_ptr<Camera> two = render(scene, 7, 2);
+    std::unique_ptr<Camera> other = render(scene, 8, 2);
+    CHECK(sameSurface(one->getSurface(), two->getSurface()));
+    CHECK(!sameSurface(one->getSurface(), other->getSurface()));
+}
+
+static void testCheckpoint(struct Scene& scene) {
+    TestDirectory directory;
+    const std::string checkpoint = directory.path("render.ck");
+    const std::string partial = directory.path("partial.ck");
+    std::unique_ptr<Camera> reference = render(scene, 3, 1);
+
+    // Passes of one sample, each followed by a checkpoint. The listener runs
+    // on a thread of its own, so it may miss every partial checkpoint of a
+    // render; one of a few renders is enough
+    bool copied = false;
+    for (unsigned int attempt = 0; attempt < 8 && !copied; attempt++) {
+        std::unique_ptr<Camera> interrupted = newCamera();
+        PathTracer renderer(SPP, DEPTH);
+        CheckpointCopier copier(checkpoint, partial);
+        renderer.setSeed(3);
+        renderer.setThreadCount(1);
+        renderer.setNotificationInterval(0);
+        renderer.addCallback(&copier);
+        renderer.setCheckpoint(checkpoint.c_str(), 0);
+        unlink(checkpoint.c_str());
+        renderer.renderScene(scene, *interrupted);
+        CHECK(sameSurface(reference->getSurface(), interrupted->getSurface()));
+        copied = copier.copied();
+    }
+    CHECK(copied);
+
+    Accumulation accumulation;
+    CHECK(accumulation.load(partial.c_str()));
+    CHECK(accumulation.width == WIDTH && accumulation.height == HEIGHT);
+
+    std::unique_ptr<Camera> resumed = newCamera();
+    PathTracer renderer(SPP, DEPTH);
+    renderer.setSeed(3);
+    renderer.setThreadCount(2);
+    renderer.setCheckpoint(partial.c_str(), 0);
+    renderer.renderScene(scene, *resumed);
+    CHECK(sameSurface(reference->getSurface(), resumed->getSurface()));
+
+    // Samples of another seed are not resumed
+    std::unique_ptr<Camera> reseeded = newCamera();
+    PathTracer other(SPP, DEPTH);
+    other.setSeed(4);
+    other.setThreadCount(1);
+    other.setCheckpoint(partial.c_str(), 0);
+    other.renderScene(scene, *reseeded);
+    CHECK(sameSurface(render(scene, 4, 1)->getSurface(), reseeded->getSurface()));
+
+    // Neither are damaged checkpoints
+    CHECK(!accumulation.load(directory.write("empty.ck", "").c_str()));
+    CHECK(!accumulation.load(directory.write("magic.ck", "PTCK\x03").c_str()));
+}
+
+int main() {
+    struct Scene scene;
+    buildScene(scene);
+
+    testSeed(scene);
+    testCheckpoint(scene);
+    return finish("Determinism");
+}
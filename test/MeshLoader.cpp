@@ -0,0 +1,173 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+
+/*
+ * Loading of OBJ and PLY meshes: the vertex reference forms of OBJ faces,
+ * relative indices across the chunks parsed in parallel, polygons, the
+ * property types of PLY files, and invalid files.
+*/
+
+#include <cmath>
+#include <cstdint>
+
+#include "test/TestCommon.hpp"
+
+#include "Arena.hpp"
+#include "Mesh.hpp"
+#include "MeshLoader.hpp"
+
+static const struct Material MATERIAL = {Color(0.5, 0.5, 0.5), Color()};
+
+static TriangleMesh* load(const std::string& filename, Arena& arena) {
+    return loadMesh(filename.c_str(), MATERIAL, arena);
+}
+
+/** Check that a mesh has the given counts and the unit square as bounds */
+static void checkSquare(TriangleMesh* mesh, uint32_t vertices, uint32_t triangles, Real area) {
+    CHECK(mesh != nullptr);
+    if (mesh == nullptr) {
+        return;
+    }
+    CHECK(mesh->getVertexCount() == vertices);
+    CHECK(mesh->getTriangleCount() == triangles);
+    CHECK(std::fabs(mesh->getArea() - area) <= 1e-4 * area);
+    struct Enclosure bounds = mesh->getEnclosure();
+    CHECK(bounds.x_min == 0 && bounds.x_max == 1 && bounds.y_min == 0 && bounds.y_max == 1);
+}
+
+static void testObj() {
+    TestDirectory directory;
+    Arena arena;
+
+    // A quad split in a fan, with every form of vertex reference
+    checkSquare(load(directory.write("quad.obj",
+        "# unit square\n"
+        "mtllib square.mtl\n"
+        "o square\n"
+        "v 0 0 0\n"
+        "v 1 0 0\r\n"
+        "v 1 1 0\n"
+        "v 0 1 0\n"
+        "vt 0 0\n"
+        "vn 0 0 1\n"
+        "usemtl grey\n"
+        "f 1/1/1 2//1 3/1 -1\n"), arena), 4, 2, 1);
+
+    // Triangles referring to the vertices before them, across chunk bounds
+    const unsigned triangles = 60000;
+    std::string lines;
+    for (unsigned int t = 0; t < triangles; t++) {
+        lines += "v 0.000000 0.000000 0.000000\nv 1.000000 0.000000 0.000000\n"
+                 "v 0.000000 1.000000 0.000000\nf -3 -2 -1\n";
+    }
+    CHECK(lines.size() > (4u << 20));
+    checkSquare(load(directory.write("large.obj", lines), arena), 3 * triangles, triangles,
+        triangles / 2.0);
+
+    CHECK(load(directory.write("zero.obj", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 0 1 2\n"), arena) == nullptr);
+    CHECK(load(directory.write("range.obj", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\n"), arena) == nullptr);
+    CHECK(load(directory.write("before.obj", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf -4 -2 -1\n"), arena) == nullptr);
+    CHECK(load(directory.write("edge.obj", "v 0 0 0\nv 1 0 0\nf 1 2\n"), arena) == nullptr);
+    CHECK(load(directory.write("vertex.obj", "v 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n"), arena) == nullptr);
+    CHECK(load(directory.write("empty.obj", ""), arena) == nullptr);
+    CHECK(load(directory.path("missing.obj"), arena) == nullptr);
+}
+
+/** Append the bytes of a value to a PLY body */
+template<typename T>
+static void put(std::string& body, T value) {
+    body.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static std::string plyHeader(const char* vertexProperties, unsigned vertices,
+                             const char* faceProperties, unsigned faces)
+{
+    char header[512];
+    snprintf(header, sizeof(header), "ply\nformat binary_little_endian 1.0\ncomment test\n"
+        "element vertex %u\n%selement face %u\n%send_header\n",
+        vertices, vertexProperties, faces, faceProperties);
+    return header;
+}
+
+static void testPly() {
+    TestDirectory directory;
+    Arena arena;
+    const float square[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}};
+
+    // Float positions and a quad of int indices
+    std::string ply = plyHeader("property float x\nproperty float y\nproperty float z\n", 4,
+        "property list uchar int vertex_indices\n", 1);
+    for (const float* v : square) {
+        put(ply, v[0]); put(ply, v[1]); put(ply, v[2]);
+    }
+    put<uint8_t>(ply, 4);
+    for (int32_t i : {0, 1, 2, 3}) {
+        put(ply, i);
+    }
+    checkSquare(load(directory.write("quad.ply", ply), arena), 4, 2, 1);
+
+    // Double positions, properties that are skipped and unsigned indices
+    ply = plyHeader("property double x\nproperty double y\nproperty double z\nproperty uchar red\n", 4,
+        "property list uchar uint vertex_indices\nproperty uchar flags\n", 2);
+    for (const float* v : square) {
+        put<double>(ply, v[0]); put<double>(ply, v[1]); put<double>(ply, v[2]); put<uint8_t>(ply, 255);
+    }
+    const uint32_t faces[2][3] = {{0, 1, 2}, {0, 2, 3}};
+    for (const uint32_t* face : faces) {
+        put<uint8_t>(ply, 3);
+        put(ply, face[0]); put(ply, face[1]); put(ply, face[2]);
+        put<uint8_t>(ply, 0);
+    }
+    checkSquare(load(directory.write("double.ply", ply), arena), 4, 2, 1);
+
+    // Invalid faces: a negative count, a negative index and one out of range
+    const std::string triangle = plyHeader("property float x\nproperty float y\nproperty float z\n", 3,
+        "property list char int vertex_indices\n", 1);
+    std::string vertices;
+    for (unsigned int v = 0; v < 3; v++) {
+        put(vertices, square[v][0]); put(vertices, square[v][1]); put(vertices, square[v][2]);
+    }
+    for (int32_t index : {-1, 3}) {
+        std::string body = triangle + vertices;
+        put<int8_t>(body, 3);
+        for (int32_t i : {0, 1, index}) {
+            put(body, i);
+        }
+        CHECK(load(directory.write("index.ply", body), arena) == nullptr);
+    }
+    std::string negative = triangle + vertices;
+    put<int8_t>(negative, -3);
+    CHECK(load(directory.write("count.ply", negative), arena) == nullptr);
+
+    // Truncated body, ASCII and unknown formats
+    ply = triangle + vertices;
+    put<int8_t>(ply, 3);
+    put<int32_t>(ply, 0);
+    CHECK(load(directory.write("truncated.ply", ply), arena) == nullptr);
+    CHECK(load(directory.write("ascii.ply", "ply\nformat ascii 1.0\nelement vertex 0\nend_header\n"),
+        arena) == nullptr);
+    CHECK(load(directory.write("mesh.stl", "solid\n"), arena) == nullptr);
+}
+
+int main() {
+    testObj();
+    testPly();
+    return finish("MeshLoader");
+}
@@ -0,0 +1,140 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+
+/*
+ * Round trip of scenes through the scene cache: a mapped cache must render
+ * exactly like the parsed scene, and a cache must not be used once the
+ * scene, a mesh it depends on or the cache file itself changed.
+*/
+
+#include <algorithm>
+#include <memory>
+#include <typeinfo>
+
+#include "test/TestCommon.hpp"
+
+#include "Camera.hpp"
+#include "Mesh.hpp"
+#include "Objects.hpp"
+#include "PathTracer.hpp"
+#include "SceneCache.hpp"
+#include "SceneParser.hpp"
+
+static const char* SCENE =
+    "<scene background=\"202040\">\n"
+    "  <plane position=\"0 -40 0\" normal=\"0 1 0\" color=\"bfbfbf\"/>\n"
+    "  <sphere center=\"-30 0 -150\" radius=\"20\" color=\"b4b400\"/>\n"
+    "  <sphere center=\"0 200 -150\" radius=\"80\" emission=\"4 4 4\"/>\n"
+    "  <triangle a=\"0 -40 -180\" b=\"60 -40 -180\" c=\"30 20 -180\" color=\"00b4b4\"/>\n"
+    "  <mesh file=\"mesh.obj\" color=\"b40000\"/>\n"
+    "</scene>\n";
+
+/** A pyramid, with a second one if twice */
+static std::string pyramid(bool twice) {
+    std::string obj = "v 10 -40 -140\nv 50 -40 -140\nv 30 -40 -110\nv 30 0 -130\n"
+        "f 1 2 4\nf 2 3 4\nf 3 1 4\nf 1 3 2\n";
+    if (twice) {
+        obj += "v -50 -40 -120\nv -20 -40 -120\nv -35 -40 -100\nv -35 -20 -110\n"
+            "f -4 -3 -1\nf -3 -2 -1\nf -2 -4 -1\nf -4 -2 -3\n";
+    }
+    return obj;
+}
+
+static std::unique_ptr<Camera> render(struct Scene& scene) {
+    std::unique_ptr<Camera> camera =
+        std::make_unique<Camera>(48, 36, 60, Vec3D(0, 0, 0), Vec3D(0, 0, -1));
+    PathTracer renderer(4, 3);
+    renderer.setSeed(11);
+    renderer.renderScene(scene, *camera);
+    return camera;
+}
+
+/** Triangles of the meshes of a scene */
+static uint32_t meshTriangles(struct Scene& scene) {
+    uint32_t triangles = 0;
+    for (IObject3D* object : scene.objects) {
+        TriangleMesh* mesh = dynamic_cast<TriangleMesh*>(object);
+        if (mesh != nullptr) {
+            triangles += mesh->getTriangleCount();
+        }
+    }
+    return triangles;
+}
+
+static void testRoundTrip() {
+    TestDirectory directory;
+    directory.write("mesh.obj", pyramid(false));
+    const std::string filename = directory.write("scene.xml", SCENE);
+    const std::string cacheDirectory = directory.path("");
+
+    uint64_t hash;
+    CHECK(SceneCache::hashFile(filename.c_str(), hash));
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.ptscene", static_cast<unsigned long long>(hash));
+    const std::string cacheFile = directory.path(name);
+
+    // The cache maps the meshes, so it outlives the scenes
+    SceneCache cache;
+    struct Scene parsed;
+    CHECK(cache.loadScene(filename.c_str(), cacheDirectory.c_str(), parsed) == PARSER_OK);
+    CHECK(parsed.objects.size() == 5);
+    CHECK(access(cacheFile.c_str(), R_OK) == 0);
+
+    struct Scene mapped;
+    CHECK(cache.load(cacheFile.c_str(), hash, mapped));
+    CHECK(mapped.objects.size() == parsed.objects.size());
+    for (unsigned int o = 0; o < std::min(mapped.objects.size(), parsed.objects.size()); o++) {
+        CHECK(typeid(*mapped.objects[o]) == typeid(*parsed.objects[o]));
+        CHECK(mapped.objects[o]->material().color == parsed.objects[o]->material().color);
+        CHECK(mapped.objects[o]->material().emission == parsed.objects[o]->material().emission);
+    }
+    CHECK(mapped.backgroundColor == parsed.backgroundColor);
+    CHECK(meshTriangles(mapped) == 4);
+    CHECK(sameSurface(render(parsed)->getSurface(), render(mapped)->getSurface()));
+
+    // Another hash is another scene file
+    struct Scene other;
+    CHECK(!cache.load(cacheFile.c_str(), hash + 1, other));
+    CHECK(other.objects.empty());
+
+    // A mesh that changed makes the cache stale, and the scene is parsed again
+    directory.write("mesh.obj", pyramid(true));
+    struct Scene stale;
+    CHECK(!cache.load(cacheFile.c_str(), hash, stale));
+    CHECK(stale.objects.empty());
+    struct Scene reparsed;
+    CHECK(cache.loadScene(filename.c_str(), cacheDirectory.c_str(), reparsed) == PARSER_OK);
+    CHECK(meshTriangles(reparsed) == 8);
+    struct Scene remapped;
+    CHECK(cache.load(cacheFile.c_str(), hash, remapped));
+    CHECK(meshTriangles(remapped) == 8);
+
+    // Damaged caches are refused
+    struct Scene damaged;
+    CHECK(!cache.load(directory.write("empty.ptscene", "").c_str(), hash, damaged));
+    CHECK(!cache.load(directory.write("short.ptscene", "PTSC").c_str(), hash, damaged));
+    CHECK(!cache.load(directory.path("missing.ptscene").c_str(), hash, damaged));
+    CHECK(damaged.objects.empty());
+}
+
+int main() {
+    testRoundTrip();
+    return finish("SceneCache");
+}
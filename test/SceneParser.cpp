@@ -0,0 +1,109 @@
+/*
+ * This source file is part of PathTracer
+ *
+ * Copyright 2019 Javier Lancha Vázquez
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+
+/*
+ * Parsing of XML scene files: every kind of object and attribute, unknown
+ * elements, and invalid files, which must leave the scene as it was.
+*/
+
+#include "test/TestCommon.hpp"
+
+#include "Objects.hpp"
+#include "SceneParser.hpp"
+
+static void testObjects() {
+    TestDirectory directory;
+    const std::string filename = directory.write("scene.xml",
+        "<?xml version=\"1.0\"?>\n"
+        "<scene background=\"ff8000\">\n"
+        "  <sphere center=\"0 60 -170\" radius=\"30\" color=\"#b4b400\" emission=\"2 2 2\"/>\n"
+        "  <plane position=\"0 0 0\" normal=\"0 1 0\"/>\n"
+        "  <!-- Comments and unknown elements are skipped -->\n"
+        "  <cube size=\"1\"/>\n"
+        "  <triangle a=\"0 0 0\" b=\"1 0 0\" c=\"0 1 0\" color=\"0.5 0.25 1\"/>\n"
+        "</scene>\n");
+
+    struct Scene scene;
+    std::vector<std::string> files;
+    CHECK(parseSceneFromXml(filename.c_str(), scene, &files) == PARSER_OK);
+    CHECK(files.empty());
+    CHECK(scene.backgroundColor.x == 1 && scene.backgroundColor.y == 128/255.0f &&
+          scene.backgroundColor.z == 0);
+    if (scene.objects.size() != 3) {
+        CHECK(scene.objects.size() == 3);
+        return;
+    }
+
+    Sphere* sphere = dynamic_cast<Sphere*>(scene.objects[0]);
+    CHECK(sphere != nullptr);
+    if (sphere != nullptr) {
+        CHECK(sphere->center().x == 0 && sphere->center().y == 60 && sphere->center().z == -170);
+        CHECK(sphere->radius() == 30);
+        CHECK(sphere->material().color.x == 180/255.0f && sphere->material().color.z == 0);
+        CHECK(sphere->material().emission.x == 2);
+    }
+
+    Plane* plane = dynamic_cast<Plane*>(scene.objects[1]);
+    CHECK(plane != nullptr);
+    if (plane != nullptr) {
+        // Objects without color are light grey
+        CHECK(plane->normal().y == 1);
+        CHECK(plane->material().color.x == 0.75f);
+    }
+
+    CHECK(dynamic_cast<Triangle*>(scene.objects[2]) != nullptr);
+    CHECK(scene.objects[2]->material().color.y == 0.25f);
+}
+
+/** Parse a file that must be refused, and check that scene is left as it was */
+static void checkInvalid(TestDirectory& directory, const char* contents, ParserError expected) {
+    struct Scene scene;
+    buildScene(scene);
+    const size_t objects = scene.objects.size();
+
+    const std::string filename = directory.write("invalid.xml", contents);
+    CHECK(parseSceneFromXml(filename.c_str(), scene) == expected);
+    CHECK(scene.objects.size() == objects);
+}
+
+static void testInvalid() {
+    TestDirectory directory;
+    checkInvalid(directory, "<scene><sphere center=\"0 0 0\" radius=\"1\"/>"
+        "<sphere center=\"0 0 0\" radius=\"-1\"/></scene>", PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "<scene><sphere center=\"0 0\" radius=\"1\"/></scene>",
+        PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "<scene><plane position=\"0 0 0\" normal=\"0 1 0\" color=\"zz\"/></scene>",
+        PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "<scene><mesh file=\"missing.obj\"/></scene>", PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "<world><sphere center=\"0 0 0\" radius=\"1\"/></world>",
+        PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "<scene background=\"red\"></scene>", PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "<scene><sphere center=\"0 0 0\" radius=\"1\"/>", PARSER_ERROR_INVALID_FORMAT);
+    checkInvalid(directory, "", PARSER_ERROR_INVALID_FORMAT);
+
+    struct Scene scene;
+    CHECK(parseSceneFromXml(directory.path("missing.xml").c_str(), scene) == PARSER_ERROR_NO_FILE);
+}
+
+int main() {
+    testObjects();
+    testInvalid();
+    return finish("SceneParser");
+}